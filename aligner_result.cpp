@@ -1249,7 +1249,7 @@ bool AlnFlags::printYF(BTString& o, bool first) const {
 	else if(!nfilt_  ) flag = "NS";
 	else if(!scfilt_ ) flag = "SC";
 	else if(!qcfilt_ ) flag = "QC";
-	if(flag > 0) {
+	if(flag != NULL) {
 		if(!first) o.append('\t');
 		o.append("YF:Z:");
 		o.append(flag);
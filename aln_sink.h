@@ -29,6 +29,8 @@
 #include "outq.h"
 #include <utility>
 #include "splice_site.h"
+#include "read_out.h"
+#include "hisat_lib.h"
 
 // Forward decl
 template <typename index_t>
@@ -51,6 +53,7 @@ struct ReportingMetrics {
 
 	void reset() {
 		init(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		ncontam = 0;
 	}
 
 	void init(
@@ -159,9 +162,12 @@ struct ReportingMetrics {
 		sum_best1     += met.sum_best1;
 		sum_best2     += met.sum_best2;
 		sum_best      += met.sum_best;
+
+		ncontam       += met.ncontam;
 	}
 
 	uint64_t  nread;         // # reads
+	uint64_t  ncontam;       // # reads/pairs dropped by --filter-fa
 	uint64_t  npaired;       // # pairs
 	uint64_t  nunpaired;     // # unpaired reads
 	
@@ -606,7 +612,8 @@ public:
 		oq_(oq),
 		refnames_(refnames),
 		quiet_(quiet),
-        spliceSiteDB_(ssdb)
+        spliceSiteDB_(ssdb),
+		readOut_(NULL)
 	{ }
 
 	/**
@@ -768,7 +775,7 @@ public:
 	 * repetitively.  Write it to stderr.  Optionally write Hadoop counter
 	 * updates.
 	 */
-	void printAlSumm(
+	static void printAlSumm(
 		const ReportingMetrics& met,
 		size_t repThresh, // threshold for uniqueness, or max if no thresh
 		bool discord,     // looked for discordant alignments
@@ -860,6 +867,13 @@ public:
 		met_.merge(met, getLock);
 	}
 
+	/**
+	 * Return the metrics merged in so far.
+	 */
+	const ReportingMetrics& metrics() const {
+		return met_;
+	}
+
 	/**
 	 * Return mutable reference to the shared OutputQueue.
 	 */
@@ -867,6 +881,21 @@ public:
 		return oq_;
 	}
 
+	/**
+	 * Also write each read's original text to the --un/--al/--un-conc/
+	 * --al-conc files, according to how it aligned.
+	 */
+	void setReadOut(ReadOutFiles *ro) {
+		readOut_ = ro;
+	}
+
+	/**
+	 * Return the read-file writer, or NULL if none was requested.
+	 */
+	ReadOutFiles *readOut() {
+		return readOut_;
+	}
+
 protected:
 
 	OutputQueue&       oq_;           // output queue
@@ -875,6 +904,7 @@ protected:
 	bool               quiet_;        // true -> don't print alignment stats at the end
 	ReportingMetrics   met_;          // global repository of reporting metrics
     SpliceSiteDB*      spliceSiteDB_; //
+	ReadOutFiles*      readOut_;      // --un/--al/--un-conc/--al-conc files
 };
 
 /**
@@ -1328,6 +1358,46 @@ protected:
 	StackedAln staln_;
 };
 
+/**
+ * Return the SAM FLAG for alignment 'rs' of a read, or NULL if it failed
+ * to align, given the alignment 'rso' of the opposite mate, if any.
+ */
+static inline int samFlag(
+	const AlnFlags& flags,
+	const AlnRes* rs,
+	const AlnRes* rso)
+{
+	int fl = 0;
+	if(flags.partOfPair()) {
+		fl |= SAM_FLAG_PAIRED;
+		if(flags.alignedConcordant()) {
+			fl |= SAM_FLAG_MAPPED_PAIRED;
+ 		}
+		if(!flags.mateAligned()) {
+			// Other fragment is unmapped
+			fl |= SAM_FLAG_MATE_UNMAPPED;
+		}
+		fl |= (flags.readMate1() ?
+			   SAM_FLAG_FIRST_IN_PAIR : SAM_FLAG_SECOND_IN_PAIR);
+		if(flags.mateAligned() && rso != NULL) {
+			if(!rso->fw()) {
+				fl |= SAM_FLAG_MATE_STRAND;
+			}
+		}
+	}
+	if(!flags.isPrimary()) {
+		fl |= SAM_FLAG_NOT_PRIMARY;
+	}
+	if(rs != NULL && !rs->fw()) {
+		fl |= SAM_FLAG_QUERY_STRAND;
+	}
+	if(rs == NULL) {
+		// Failed to align
+		fl |= SAM_FLAG_UNMAPPED;
+	}
+	return fl;
+}
+
 /**
  * An AlnSink concrete subclass for printing SAM alignments.  The user might
  * want to customize SAM output in various ways.  We encapsulate all these
@@ -1429,6 +1499,117 @@ protected:
 	BTString         dqual_;   // buffer for decoded quality sequence
 };
 
+/**
+ * An AlnSink concrete subclass for the library interface (hisat_lib.h):
+ * rather than printing SAM records, it hands the fields of each one to a
+ * callback as a hisat_aln_t.  The strings in a record are built in the
+ * read's output buffer, so the OutputQueue must be set to discard.
+ */
+template <typename index_t>
+class AlnSinkCallback : public AlnSink<index_t> {
+
+	typedef EList<std::string> StrList;
+
+public:
+
+	AlnSinkCallback(
+		OutputQueue&     oq,           // output queue; must discard
+		const SamConfig& samc,         // settings for the optional fields
+		const StrList&   refnames,     // reference names
+        SpliceSiteDB*    ssdb = NULL) :
+		AlnSink<index_t>(
+			oq,
+			refnames,
+			true,
+            ssdb),
+		samc_(samc),
+		cb_(NULL),
+		user_(NULL),
+		first_(0)
+	{ }
+
+	virtual ~AlnSinkCallback() { }
+
+	/**
+	 * Set the callback for the next batch of reads, the first of which
+	 * has id 'first'.
+	 */
+	void setCallback(hisat_aln_cb cb, void *user, TReadId first) {
+		cb_ = cb;
+		user_ = user;
+		first_ = first;
+	}
+
+	/**
+	 * Hand a single alignment result, which might be paired or unpaired,
+	 * to the callback, mate 1 first.
+	 */
+	virtual void append(
+		BTString&     o,           // scratch space for the record's strings
+		StackedAln&   staln,       // StackedAln to write stacked alignment
+		size_t        threadId,    // which thread am I?
+		const Read*   rd1,         // mate #1
+		const Read*   rd2,         // mate #2
+		const TReadId rdid,        // read ID
+		AlnRes* rs1,               // alignments for mate #1
+		AlnRes* rs2,               // alignments for mate #2
+		const AlnSetSumm& summ,    // summary
+		const SeedAlSumm& ssm1,    // seed alignment summary
+		const SeedAlSumm& ssm2,    // seed alignment summary
+		const AlnFlags* flags1,    // flags for mate #1
+		const AlnFlags* flags2,    // flags for mate #2
+		const PerReadMetrics& prm, // per-read metrics
+		const Mapq& mapq,          // MAPQ calculator
+		const Scoring& sc,         // scoring scheme
+		bool report2)              // report alns for both mates
+	{
+		assert(rd1 != NULL || rd2 != NULL);
+		if(rd1 != NULL) {
+			assert(flags1 != NULL);
+			appendMate(o, staln, *rd1, rd2, rdid, rs1, rs2, summ, ssm1,
+			           *flags1, prm, mapq, sc);
+            if(rs1 != NULL && rs1->spliced() && this->spliceSiteDB_ != NULL) {
+                this->spliceSiteDB_->addSpliceSite(*rd1, *rs1);
+            }
+		}
+		if(rd2 != NULL && report2) {
+			assert(flags2 != NULL);
+			appendMate(o, staln, *rd2, rd1, rdid, rs2, rs1, summ, ssm2,
+			           *flags2, prm, mapq, sc);
+            if(rs2 != NULL && rs2->spliced() && this->spliceSiteDB_ != NULL) {
+                this->spliceSiteDB_->addSpliceSite(*rd2, *rs2);
+            }
+		}
+	}
+
+protected:
+
+	/**
+	 * Hand a single per-mate alignment result to the callback.  If the
+	 * alignment is part of a pair, information about the opposite mate
+	 * and its alignment are given in rdo/rso.
+	 */
+	void appendMate(
+		BTString&     o,
+		StackedAln&   staln,
+		const Read&   rd,
+		const Read*   rdo,
+		const TReadId rdid,
+		AlnRes* rs,
+		AlnRes* rso,
+		const AlnSetSumm& summ,
+		const SeedAlSumm& ssm,
+		const AlnFlags& flags,
+		const PerReadMetrics& prm, // per-read metrics
+		const Mapq& mapq,          // MAPQ calculator
+		const Scoring& sc);        // scoring scheme
+
+	const SamConfig& samc_;    // settings for the optional fields
+	hisat_aln_cb     cb_;      // where records go
+	void*            user_;    // passed to cb_
+	TReadId          first_;   // id of the batch's first read
+};
+
 static inline std::ostream& printPct(
 							  std::ostream& os,
 							  uint64_t num,
@@ -1467,6 +1648,9 @@ void AlnSink<index_t>::printAlSumm(
 	if(hadoopOut) {
 		cerr << "reporter:counter:Bowtie,Reads processed," << met.nread << endl;
 	}
+	if(met.ncontam > 0) {
+		cerr << met.ncontam << " reads/pairs matched the contaminant filter and were not aligned" << endl;
+	}
 	uint64_t totread = met.nread;
 	if(totread > 0) {
 		cerr << "" << met.nread << " reads; of these:" << endl;
@@ -1775,7 +1959,7 @@ void AlnSinkWrap<index_t>::finishRead(
 									  bool suppressAlignments)         // = false
 {
 	obuf_.clear();
-	OutputQueueMark qqm(g_.outq(), obuf_, rdid_, threadid_);
+	OutputQueueMark qqm(g_.outq(), obuf_, rdid_, threadid_, prm.stages);
 	assert(init_);
 	if(!suppressSeedSummary) {
 		if(sr1 != NULL) {
@@ -1808,6 +1992,14 @@ void AlnSinkWrap<index_t>::finishRead(
 					  pairMax,
 					  unpair1Max,
 					  unpair2Max);
+		// Route the read to the --un/--al/--un-conc/--al-conc files
+		if(g_.readOut() != NULL) {
+			g_.readOut()->add(
+				rd1_ != NULL ? rd1_ : rd2_,
+				readIsPair() ? rd2_ : NULL,
+				readIsPair() ? (nconcord > 0) : (nunpair1 > 0 || nunpair2 > 0),
+				threadid_);
+		}
 		assert_leq(nconcord, rs1_.size());
 		assert_leq(nunpair1, rs1u_.size());
 		assert_leq(nunpair2, rs2u_.size());
@@ -2827,34 +3019,7 @@ void AlnSinkSam<index_t>::appendMate(
 	samc_.printReadName(o, rd.name, flags.partOfPair());
 	o.append('\t');
 	// FLAG
-	int fl = 0;
-	if(flags.partOfPair()) {
-		fl |= SAM_FLAG_PAIRED;
-		if(flags.alignedConcordant()) {
-			fl |= SAM_FLAG_MAPPED_PAIRED;
- 		}
-		if(!flags.mateAligned()) {
-			// Other fragment is unmapped
-			fl |= SAM_FLAG_MATE_UNMAPPED;
-		}
-		fl |= (flags.readMate1() ?
-			   SAM_FLAG_FIRST_IN_PAIR : SAM_FLAG_SECOND_IN_PAIR);
-		if(flags.mateAligned() && rso != NULL) {
-			if(!rso->fw()) {
-				fl |= SAM_FLAG_MATE_STRAND;
-			}
-		}
-	}
-	if(!flags.isPrimary()) {
-		fl |= SAM_FLAG_NOT_PRIMARY;
-	}
-	if(rs != NULL && !rs->fw()) {
-		fl |= SAM_FLAG_QUERY_STRAND;
-	}
-	if(rs == NULL) {
-		// Failed to align
-		fl |= SAM_FLAG_UNMAPPED;
-	}
+	int fl = samFlag(flags, rs, rso);
 	itoa10<int>(fl, buf);
 	o.append(buf);
 	o.append('\t');
@@ -3023,4 +3188,112 @@ void AlnSinkSam<index_t>::appendMate(
 	o.append('\n');
 }
 
+/**
+ * Fill in a hisat_aln_t for one mate and hand it to the callback.
+ */
+template <typename index_t>
+void AlnSinkCallback<index_t>::appendMate(
+	BTString&     o,
+	StackedAln&   staln,
+	const Read&   rd,
+	const Read*   rdo,
+	const TReadId rdid,
+	AlnRes* rs,
+	AlnRes* rso,
+	const AlnSetSumm& summ,
+	const SeedAlSumm& ssm,
+	const AlnFlags& flags,
+	const PerReadMetrics& prm,
+	const Mapq& mapqCalc,
+	const Scoring& sc)
+{
+	if(rs == NULL && samc_.omitUnalignedReads()) {
+		return;
+	}
+	char mapqInps[1024];
+	mapqInps[0] = '\0';
+	hisat_aln_t aln;
+	aln.read = (size_t)(rdid - first_);
+	aln.mate = flags.partOfPair() ? (flags.readMate1() ? 1 : 2) : 0;
+	aln.flag = samFlag(flags, rs, rso);
+	aln.mapq = 0;
+	aln.tlen = 0;
+	aln.score = 0;
+	aln.nm = 0;
+	aln.nh = 0;
+	size_t cigarOff = o.length();
+	if(rs != NULL) {
+		staln.reset();
+		rs->initStacked(rd, staln);
+		staln.leftAlign(false /* not past MMs */);
+		aln.refid = (int32_t)rs->refid();
+		aln.pos = rs->refoff();
+		aln.mapq = mapqCalc.mapq(
+			summ, flags, rd.mate < 2, rd.length(),
+			rdo == NULL ? 0 : rdo->length(), mapqInps);
+		staln.buildCigar(false);
+		staln.writeCigar(&o, NULL);
+		if(flags.partOfPair() && rso != NULL) {
+			aln.mate_refid = (int32_t)rso->refid();
+			aln.mate_pos = rso->refoff();
+		} else if(flags.partOfPair()) {
+			// As in SAM, this mate's position if the opposite one didn't align
+			aln.mate_refid = aln.refid;
+			aln.mate_pos = aln.pos;
+		} else {
+			aln.mate_refid = -1;
+			aln.mate_pos = -1;
+		}
+		if(rs->isFraglenSet()) {
+			aln.tlen = rs->fragmentLength();
+		}
+		aln.score = rs->score().score();
+		for(size_t i = 0; i < rs->ned().size(); i++) {
+			if(rs->ned()[i].type != EDIT_TYPE_SPL) aln.nm++;
+		}
+		if(flags.alignedPaired()) {
+			aln.nh = (int)summ.numAlnsPaired();
+		} else if(flags.alignedUnpaired() || flags.alignedUnpairedMate()) {
+			aln.nh = (int)((flags.alignedUnpaired() || flags.readMate1()) ?
+			               summ.numAlns1() : summ.numAlns2());
+		}
+	} else {
+		// As in SAM, an unaligned mate is placed with its aligned mate
+		aln.refid = aln.mate_refid = (int32_t)summ.orefid();
+		aln.pos = aln.mate_pos = (summ.orefid() != -1) ? summ.orefoff() : -1;
+		o.append('*');
+	}
+	o.append('\0');
+	size_t tagsOff = o.length();
+	if(rs != NULL) {
+		samc_.printAlignedOptFlags(
+								   o,           // output buffer
+								   true,        // first opt flag printed is first overall?
+								   rd,          // read
+								   *rs,         // individual alignment result
+								   staln,       // stacked alignment
+								   flags,       // alignment flags
+								   summ,        // summary of alignments for this read
+								   ssm,         // seed alignment summary
+								   prm,         // per-read metrics
+								   sc,          // scoring scheme
+								   mapqInps);   // inputs to MAPQ calculation
+	} else {
+		samc_.printEmptyOptFlags(
+								 o,           // output buffer
+								 true,        // first opt flag printed is first overall?
+								 rd,          // read
+								 flags,       // alignment flags
+								 summ,        // summary of alignments for this read
+								 ssm,         // seed alignment summary
+								 prm,         // per-read metrics
+								 sc);         // scoring scheme
+	}
+	o.append('\0');
+	// The buffer may have moved while it grew
+	aln.cigar = o.buf() + cigarOff;
+	aln.tags = o.buf() + tagsOff;
+	cb_(&aln, user_);
+}
+
 #endif /*ndef ALN_SINK_H_*/
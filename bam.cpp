@@ -0,0 +1,654 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <iostream>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#include "bam.h"
+
+using namespace std;
+
+/**
+ * Little-endian helpers; BAM is little-endian regardless of host.
+ */
+static inline void putU16(uint8_t *p, uint16_t v) {
+	p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void putU32(uint8_t *p, uint32_t v) {
+	p[0] = (uint8_t)v;         p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint32_t getU32(const uint8_t *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void appendBytes(EList<char>& b, const void *p, size_t len) {
+	size_t off = b.size();
+	b.resize(off + len);
+	memcpy(b.ptr() + off, p, len);
+}
+
+static inline void appendU8(EList<char>& b, uint8_t v) {
+	b.push_back((char)v);
+}
+
+static inline void appendU16(EList<char>& b, uint16_t v) {
+	uint8_t t[2]; putU16(t, v); appendBytes(b, t, 2);
+}
+
+static inline void appendU32(EList<char>& b, uint32_t v) {
+	uint8_t t[4]; putU32(t, v); appendBytes(b, t, 4);
+}
+
+/**
+ * Compute the UCSC bin for the 0-based half-open interval [beg, end); see
+ * the SAM specification.
+ */
+static inline int reg2bin(int beg, int end) {
+	--end;
+	if(beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+	if(beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+	if(beg >> 20 == end >> 20) return ((1 <<  9) - 1) / 7 + (beg >> 20);
+	if(beg >> 23 == end >> 23) return ((1 <<  6) - 1) / 7 + (beg >> 23);
+	if(beg >> 26 == end >> 26) return ((1 <<  3) - 1) / 7 + (beg >> 26);
+	return 0;
+}
+
+/**
+ * Parse a signed decimal integer from [s, s+len).
+ */
+static inline int64_t parseI64(const char *s, size_t len) {
+	size_t i = 0;
+	bool neg = false;
+	if(i < len && (s[i] == '-' || s[i] == '+')) {
+		neg = (s[i] == '-');
+		i++;
+	}
+	int64_t v = 0;
+	for(; i < len; i++) {
+		v = v * 10 + (s[i] - '0');
+	}
+	return neg ? -v : v;
+}
+
+static const uint8_t bgzfEof[28] = {
+	0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+	0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00
+};
+
+/**
+ * Append len bytes to the stream, emitting blocks as they fill.
+ */
+void BgzfWriter::write(const void *p, size_t len) {
+	assert(!closed_);
+	const uint8_t *s = (const uint8_t *)p;
+	while(len > 0) {
+		size_t n = min(len, BLOCK_SZ - cur_);
+		memcpy(ubuf_ + cur_, s, n);
+		cur_ += n;
+		s += n;
+		len -= n;
+		if(cur_ == BLOCK_SZ) flushBlock();
+	}
+}
+
+/**
+ * Compress the buffered data into one BGZF block and write it.
+ */
+void BgzfWriter::flushBlock() {
+	if(cur_ == 0) return;
+#ifdef USE_ZLIB
+	const size_t HDR = 18, FTR = 8;
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if(deflateInit2(&zs, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		cerr << "Error: could not initialize BAM compression" << endl;
+		throw 1;
+	}
+	zs.next_in = ubuf_;
+	zs.avail_in = (uInt)cur_;
+	zs.next_out = cbuf_ + HDR;
+	zs.avail_out = (uInt)(MAX_BLOCK_SZ - HDR - FTR);
+	int ret = deflate(&zs, Z_FINISH);
+	size_t clen = zs.total_out;
+	deflateEnd(&zs);
+	if(ret != Z_STREAM_END) {
+		cerr << "Error: BAM block did not fit after compression" << endl;
+		throw 1;
+	}
+	size_t bsize = HDR + clen + FTR;
+	static const uint8_t hdr[16] = {
+		0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00
+	};
+	memcpy(cbuf_, hdr, 16);
+	putU16(cbuf_ + 16, (uint16_t)(bsize - 1));
+	uint32_t crc = crc32(crc32(0L, Z_NULL, 0), ubuf_, (uInt)cur_);
+	putU32(cbuf_ + HDR + clen, crc);
+	putU32(cbuf_ + HDR + clen + 4, (uint32_t)cur_);
+	obuf_.writeChars((const char *)cbuf_, bsize);
+	cur_ = 0;
+#else
+	cerr << "Error: BAM output needs HISAT built with zlib (USE_ZLIB=1)" << endl;
+	throw 1;
+#endif
+}
+
+/**
+ * Emit the final partial block, followed by the empty EOF block.
+ */
+void BgzfWriter::close() {
+	if(closed_) return;
+	flushBlock();
+	obuf_.writeChars((const char *)bgzfEof, sizeof(bgzfEof));
+	obuf_.flush();
+	closed_ = true;
+}
+
+BamSorter::BamSorter(
+	OutFileBuf& obuf,
+	const EList<string>& refnames,
+	const EList<size_t>& reflens,
+	size_t nthreads,
+	size_t memLimit,
+	const string& tmpPrefix,
+	int level) :
+	obuf_(obuf),
+	refnames_(MISC_CAT),
+	reflens_(reflens),
+	refidx_(MISC_CAT),
+	buckets_(NULL),
+	nbuckets_(nthreads + 1), // thread ids may start at 1
+	tmpPrefix_(tmpPrefix),
+	level_(level),
+	nspills_(0),
+	finished_(false)
+{
+	assert_eq(refnames.size(), reflens.size());
+	for(size_t i = 0; i < refnames.size(); i++) {
+		// Names as SamConfig::printRefName prints them
+		const string& nm = refnames[i];
+		size_t len = 0;
+		while(len < nm.length() && !isspace(nm[len])) len++;
+		refnames_.push_back(nm.substr(0, len));
+		refidx_.push_back(make_pair(refnames_.back(), (int)i));
+	}
+	refidx_.sort();
+	buckets_ = new Bucket[nbuckets_];
+	bucketLimit_ = max<size_t>(memLimit / max<size_t>(nthreads, 1), 1024 * 1024);
+}
+
+BamSorter::~BamSorter() {
+	for(size_t i = 0; i < nbuckets_; i++) {
+		for(size_t j = 0; j < buckets_[i].runs.size(); j++) {
+			fclose(buckets_[i].runs[j].fh);
+		}
+	}
+	delete[] buckets_;
+}
+
+/**
+ * Return the id of the reference with the given name, or -1 for "*".
+ */
+int BamSorter::refid(const char *name, size_t len, Bucket& b) {
+	if(len == 1 && name[0] == '*') return -1;
+	if(b.lastRef >= 0) {
+		const string& last = refnames_[b.lastRef];
+		if(last.length() == len && memcmp(last.c_str(), name, len) == 0) {
+			return b.lastRef;
+		}
+	}
+	string key(name, len);
+	size_t lo = 0, hi = refidx_.size();
+	while(lo < hi) {
+		size_t mid = (lo + hi) >> 1;
+		if(refidx_[mid].first < key) lo = mid + 1;
+		else hi = mid;
+	}
+	if(lo == refidx_.size() || refidx_[lo].first != key) {
+		cerr << "Error: reference '" << key << "' not found while writing BAM" << endl;
+		throw 1;
+	}
+	b.lastRef = refidx_[lo].second;
+	return b.lastRef;
+}
+
+/**
+ * Encode the SAM lines in rec, all belonging to read rdid, into the
+ * bucket for the given thread.  Only that thread may call add() with
+ * that threadId.
+ */
+void BamSorter::add(const BTString& rec, TReadId rdid, size_t threadId) {
+	assert_lt(threadId, nbuckets_);
+	assert(!finished_);
+	Bucket& b = buckets_[threadId];
+	if(b.keys.empty() || b.lastRdid != rdid) {
+		b.ord = 0;
+		b.lastRdid = rdid;
+	}
+	const char *s = rec.toZBuf();
+	size_t len = rec.length();
+	size_t beg = 0;
+	while(beg < len) {
+		size_t end = beg;
+		while(end < len && s[end] != '\n') end++;
+		if(end > beg) {
+			encode(s + beg, end - beg, b, rdid);
+		}
+		beg = end + 1;
+	}
+	if(b.buf.size() + b.keys.size() * sizeof(BamKey) >= bucketLimit_) {
+		spill(b);
+	}
+}
+
+/**
+ * Encode one SAM line as a BAM record at the end of b.buf.
+ */
+void BamSorter::encode(const char *line, size_t len, Bucket& b, TReadId rdid) {
+	// Split into fields
+	const char *f[11];
+	size_t flen[11];
+	size_t nf = 0, i = 0, fbeg = 0;
+	for(; i <= len && nf < 11; i++) {
+		if(i == len || line[i] == '\t') {
+			f[nf] = line + fbeg;
+			flen[nf] = i - fbeg;
+			nf++;
+			fbeg = i + 1;
+		}
+	}
+	if(nf < 11) {
+		cerr << "Error: malformed SAM record while writing BAM: "
+		     << string(line, len) << endl;
+		throw 1;
+	}
+	const char *tags = (fbeg < len) ? line + fbeg : NULL;
+	size_t tagslen = (fbeg < len) ? len - fbeg : 0;
+
+	int32_t rid = refid(f[2], flen[2], b);
+	int32_t pos = (int32_t)parseI64(f[3], flen[3]) - 1;
+	uint32_t flag = (uint32_t)parseI64(f[1], flen[1]);
+	uint32_t mapq = (uint32_t)parseI64(f[4], flen[4]);
+	int32_t nrid = (flen[6] == 1 && f[6][0] == '=') ? rid : refid(f[6], flen[6], b);
+	int32_t npos = (int32_t)parseI64(f[7], flen[7]) - 1;
+	int32_t tlen = (int32_t)parseI64(f[8], flen[8]);
+	size_t namelen = min<size_t>(flen[0], 254);
+	size_t lseq = (flen[9] == 1 && f[9][0] == '*') ? 0 : flen[9];
+
+	size_t off = b.buf.size();
+	appendU32(b.buf, 0); // block_size, filled in below
+	appendU32(b.buf, (uint32_t)rid);
+	appendU32(b.buf, (uint32_t)pos);
+	appendU8(b.buf, (uint8_t)(namelen + 1));
+	appendU8(b.buf, (uint8_t)mapq);
+	size_t binOff = b.buf.size();
+	appendU16(b.buf, 0); // bin, filled in below
+	size_t ncigOff = b.buf.size();
+	appendU16(b.buf, 0); // n_cigar_op, filled in below
+	appendU16(b.buf, (uint16_t)flag);
+	appendU32(b.buf, (uint32_t)lseq);
+	appendU32(b.buf, (uint32_t)nrid);
+	appendU32(b.buf, (uint32_t)npos);
+	appendU32(b.buf, (uint32_t)tlen);
+	appendBytes(b.buf, f[0], namelen);
+	appendU8(b.buf, 0);
+	// CIGAR
+	uint32_t ncig = 0;
+	int32_t reflen = 0;
+	if(!(flen[5] == 1 && f[5][0] == '*')) {
+		uint32_t n = 0;
+		for(size_t j = 0; j < flen[5]; j++) {
+			char c = f[5][j];
+			if(c >= '0' && c <= '9') {
+				n = n * 10 + (c - '0');
+				continue;
+			}
+			const char *ops = "MIDNSHP=X";
+			const char *op = strchr(ops, c);
+			if(op == NULL) {
+				cerr << "Error: bad CIGAR operation '" << c << "' while writing BAM" << endl;
+				throw 1;
+			}
+			uint32_t opi = (uint32_t)(op - ops);
+			if(opi == 0 || opi == 2 || opi == 3 || opi == 7 || opi == 8) {
+				reflen += n;
+			}
+			appendU32(b.buf, (n << 4) | opi);
+			ncig++;
+			n = 0;
+		}
+	}
+	if(ncig > 0xffff) {
+		cerr << "Error: too many CIGAR operations for BAM" << endl;
+		throw 1;
+	}
+	// SEQ, 4 bits per base
+	static const char *seqNt16 = "=ACMGRSVTWYHKDBN";
+	for(size_t j = 0; j < lseq; j += 2) {
+		uint8_t hi = 15, lo = 0;
+		const char *p = strchr(seqNt16, toupper(f[9][j]));
+		if(p != NULL && *p != '\0') hi = (uint8_t)(p - seqNt16);
+		if(j + 1 < lseq) {
+			lo = 15;
+			p = strchr(seqNt16, toupper(f[9][j+1]));
+			if(p != NULL && *p != '\0') lo = (uint8_t)(p - seqNt16);
+		}
+		appendU8(b.buf, (uint8_t)((hi << 4) | lo));
+	}
+	// QUAL
+	bool noQual = (flen[10] == 1 && f[10][0] == '*');
+	for(size_t j = 0; j < lseq; j++) {
+		appendU8(b.buf, (noQual || j >= flen[10]) ? 0xff : (uint8_t)(f[10][j] - 33));
+	}
+	// Optional fields
+	size_t t = 0;
+	while(t < tagslen) {
+		size_t te = t;
+		while(te < tagslen && tags[te] != '\t') te++;
+		const char *tg = tags + t;
+		size_t tl = te - t;
+		t = te + 1;
+		if(tl < 5 || tg[2] != ':' || tg[4] != ':') continue;
+		appendBytes(b.buf, tg, 2);
+		const char *v = tg + 5;
+		size_t vl = tl - 5;
+		switch(tg[3]) {
+			case 'i': {
+				int64_t x = parseI64(v, vl);
+				if(x < 0) {
+					if(x >= -128)        { appendU8(b.buf, 'c'); appendU8(b.buf, (uint8_t)(int8_t)x); }
+					else if(x >= -32768) { appendU8(b.buf, 's'); appendU16(b.buf, (uint16_t)(int16_t)x); }
+					else                 { appendU8(b.buf, 'i'); appendU32(b.buf, (uint32_t)(int32_t)x); }
+				} else {
+					if(x <= 255)         { appendU8(b.buf, 'C'); appendU8(b.buf, (uint8_t)x); }
+					else if(x <= 65535)  { appendU8(b.buf, 'S'); appendU16(b.buf, (uint16_t)x); }
+					else                 { appendU8(b.buf, 'I'); appendU32(b.buf, (uint32_t)x); }
+				}
+				break;
+			}
+			case 'f': {
+				float x = (float)strtod(string(v, vl).c_str(), NULL);
+				uint32_t u;
+				memcpy(&u, &x, 4);
+				appendU8(b.buf, 'f');
+				appendU32(b.buf, u);
+				break;
+			}
+			case 'A': {
+				appendU8(b.buf, 'A');
+				appendU8(b.buf, vl > 0 ? (uint8_t)v[0] : 0);
+				break;
+			}
+			default: {
+				// Z and H: NUL-terminated string; anything else is
+				// carried as a string too, rather than dropped
+				appendU8(b.buf, tg[3] == 'H' ? 'H' : 'Z');
+				appendBytes(b.buf, v, vl);
+				appendU8(b.buf, 0);
+				break;
+			}
+		}
+	}
+	// Fill in block_size, bin and n_cigar_op
+	int32_t end = pos + (reflen > 0 ? reflen : 1);
+	uint8_t *rp = (uint8_t *)b.buf.ptr();
+	putU32(rp + off, (uint32_t)(b.buf.size() - off - 4));
+	putU16(rp + binOff, (uint16_t)reg2bin(pos, end));
+	putU16(rp + ncigOff, (uint16_t)ncig);
+
+	BamKey k;
+	k.coord = ((uint64_t)(uint32_t)rid << 32) | (uint32_t)(pos + 1);
+	k.rdid = rdid;
+	k.ord = b.ord++;
+	k.len = (uint32_t)(b.buf.size() - off);
+	k.off = off;
+	b.keys.push_back(k);
+}
+
+/**
+ * Open an anonymous temporary file for a sorted run.  The file is
+ * unlinked immediately so it goes away however the process exits.
+ */
+BamSorter::Run BamSorter::openRun() {
+	string path = tmpPrefix_ + ".XXXXXX";
+	EList<char> tmpl(MISC_CAT);
+	appendBytes(tmpl, path.c_str(), path.length() + 1);
+	int fd = mkstemp(tmpl.ptr());
+	if(fd < 0) {
+		cerr << "Error: could not create temporary file " << path
+		     << " for sorting BAM output" << endl;
+		throw 1;
+	}
+	unlink(tmpl.ptr());
+	Run r;
+	r.fh = fdopen(fd, "w+b");
+	r.level = 0;
+	if(r.fh == NULL) {
+		cerr << "Error: could not open temporary file for sorting BAM output" << endl;
+		throw 1;
+	}
+	return r;
+}
+
+/**
+ * Write a record, preceded by its key, to a run.
+ */
+static inline void writeRunRecord(FILE *fh, const BamKey& k, const char *rec) {
+	if(fwrite(&k.coord, 8, 1, fh) != 1 ||
+	   fwrite(&k.rdid,  8, 1, fh) != 1 ||
+	   fwrite(&k.ord,   4, 1, fh) != 1 ||
+	   fwrite(rec, k.len, 1, fh) != 1)
+	{
+		cerr << "Error: could not write temporary file while sorting BAM output" << endl;
+		throw 1;
+	}
+}
+
+/**
+ * Sort the bucket and write it out as a new run; then, while this thread
+ * has MERGE_FANIN runs at the same level, merge them into one.
+ */
+void BamSorter::spill(Bucket& b) {
+	if(b.keys.empty()) return;
+	b.keys.sort();
+	Run r = openRun();
+	for(size_t i = 0; i < b.keys.size(); i++) {
+		writeRunRecord(r.fh, b.keys[i], b.buf.ptr() + b.keys[i].off);
+	}
+	b.runs.push_back(r);
+	b.buf.clear();
+	b.keys.clear();
+	{
+		ThreadSafe t(&mutex_m);
+		nspills_++;
+	}
+	while(true) {
+		int lev = b.runs.back().level;
+		size_t nlev = 0;
+		for(size_t i = 0; i < b.runs.size(); i++) {
+			if(b.runs[i].level == lev) nlev++;
+		}
+		if(nlev < MERGE_FANIN) break;
+		EList<Run> src(MISC_CAT), keep(MISC_CAT);
+		for(size_t i = 0; i < b.runs.size(); i++) {
+			if(b.runs[i].level == lev) src.push_back(b.runs[i]);
+			else keep.push_back(b.runs[i]);
+		}
+		Run dst = openRun();
+		dst.level = lev + 1;
+		EList<RunReader> rds(MISC_CAT);
+		rds.resize(src.size());
+		for(size_t i = 0; i < src.size(); i++) {
+			rds[i].fh = src[i].fh;
+			rds[i].mem = NULL;
+			rewind(src[i].fh);
+		}
+		merge(rds, &dst, NULL);
+		for(size_t i = 0; i < src.size(); i++) {
+			fclose(src[i].fh);
+		}
+		keep.push_back(dst);
+		b.runs = keep;
+	}
+}
+
+/**
+ * Advance to the next record; return false when the source is exhausted.
+ */
+bool BamSorter::RunReader::next() {
+	if(mem != NULL) {
+		if(memi == mem->keys.size()) return false;
+		key = mem->keys[memi++];
+		data = mem->buf.ptr() + key.off;
+		return true;
+	}
+	if(fread(&key.coord, 8, 1, fh) != 1) return false;
+	uint8_t bs[4];
+	if(fread(&key.rdid, 8, 1, fh) != 1 ||
+	   fread(&key.ord,  4, 1, fh) != 1 ||
+	   fread(bs, 4, 1, fh) != 1)
+	{
+		cerr << "Error: truncated temporary file while sorting BAM output" << endl;
+		throw 1;
+	}
+	key.len = getU32(bs) + 4;
+	rec.resizeNoCopy(key.len);
+	memcpy(rec.ptr(), bs, 4);
+	if(fread(rec.ptr() + 4, key.len - 4, 1, fh) != 1) {
+		cerr << "Error: truncated temporary file while sorting BAM output" << endl;
+		throw 1;
+	}
+	data = rec.ptr();
+	return true;
+}
+
+/**
+ * Entry in the merge heap: the current key of source i.
+ */
+struct BamMergeEnt {
+	bool operator<(const BamMergeEnt& o) const { return key < o.key; }
+	bool operator<=(const BamMergeEnt& o) const { return key <= o.key; }
+	BamKey key;
+	size_t i;
+};
+
+/**
+ * Print a merge entry; needed by EHeap's debug-mode checks.
+ */
+static inline ostream& operator<<(ostream& os, const BamMergeEnt& e) {
+	return os << e.key.coord << ':' << e.key.rdid << ':' << e.key.ord << '@' << e.i;
+}
+
+/**
+ * K-way merge the given sources, either into run dst or, if dst is NULL,
+ * into the BAM stream.
+ */
+void BamSorter::merge(EList<RunReader>& srcs, Run *dst, BgzfWriter *bgzf) {
+	assert((dst == NULL) != (bgzf == NULL));
+	EHeap<BamMergeEnt> heap;
+	for(size_t i = 0; i < srcs.size(); i++) {
+		if(srcs[i].next()) {
+			BamMergeEnt e;
+			e.key = srcs[i].key;
+			e.i = i;
+			heap.insert(e);
+		}
+	}
+	while(heap.size() > 0) {
+		BamMergeEnt e = heap.pop();
+		RunReader& r = srcs[e.i];
+		if(dst != NULL) {
+			writeRunRecord(dst->fh, r.key, r.data);
+		} else {
+			bgzf->write(r.data, r.key.len);
+		}
+		if(r.next()) {
+			e.key = r.key;
+			heap.insert(e);
+		}
+	}
+}
+
+/**
+ * Write the BAM magic, SAM header text and reference dictionary.
+ */
+void BamSorter::writeBamHeader(BgzfWriter& bgzf) {
+	uint8_t t[4];
+	bgzf.write("BAM\1", 4);
+	putU32(t, (uint32_t)header_.length());
+	bgzf.write(t, 4);
+	bgzf.write(header_.toZBuf(), header_.length());
+	putU32(t, (uint32_t)refnames_.size());
+	bgzf.write(t, 4);
+	for(size_t i = 0; i < refnames_.size(); i++) {
+		putU32(t, (uint32_t)(refnames_[i].length() + 1));
+		bgzf.write(t, 4);
+		bgzf.write(refnames_[i].c_str(), refnames_[i].length() + 1);
+		putU32(t, (uint32_t)reflens_[i]);
+		bgzf.write(t, 4);
+	}
+}
+
+/**
+ * Merge everything and write the BAM file.  Call once, after all threads
+ * are done calling add().
+ */
+void BamSorter::finish() {
+	assert(!finished_);
+	finished_ = true;
+	// Sort what's still in memory and merge it with the spilled runs
+	EList<RunReader> rds(MISC_CAT);
+	size_t nsrc = 0;
+	for(size_t i = 0; i < nbuckets_; i++) {
+		nsrc += buckets_[i].runs.size() + (buckets_[i].keys.empty() ? 0 : 1);
+	}
+	rds.resize(nsrc);
+	size_t ri = 0;
+	for(size_t i = 0; i < nbuckets_; i++) {
+		Bucket& b = buckets_[i];
+		for(size_t j = 0; j < b.runs.size(); j++) {
+			rewind(b.runs[j].fh);
+			rds[ri].fh = b.runs[j].fh;
+			rds[ri].mem = NULL;
+			ri++;
+		}
+		if(!b.keys.empty()) {
+			b.keys.sort();
+			rds[ri].fh = NULL;
+			rds[ri].mem = &b;
+			rds[ri].memi = 0;
+			ri++;
+		}
+	}
+	assert_eq(nsrc, ri);
+	BgzfWriter bgzf(obuf_, level_);
+	writeBamHeader(bgzf);
+	merge(rds, NULL, &bgzf);
+	bgzf.close();
+}
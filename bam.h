@@ -0,0 +1,234 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BAM_H_
+#define BAM_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include "assert_helpers.h"
+#include "ds.h"
+#include "sstring.h"
+#include "filebuf.h"
+#include "read.h"
+#include "threading.h"
+#include "mem_ids.h"
+
+/**
+ * Writes BGZF-compressed data (the block-gzip container used by BAM) to an
+ * OutFileBuf.  Each block holds at most 64K of uncompressed data and is an
+ * independent gzip member.
+ */
+class BgzfWriter {
+
+public:
+
+	/// Max uncompressed bytes per block; leaves headroom so that
+	/// incompressible data still fits in a 64K compressed block
+	static const size_t BLOCK_SZ = 0xff00;
+	static const size_t MAX_BLOCK_SZ = 0x10000;
+
+	BgzfWriter(OutFileBuf& obuf, int level) :
+		obuf_(obuf),
+		level_(level),
+		cur_(0),
+		closed_(false) { }
+
+	~BgzfWriter() { close(); }
+
+	/**
+	 * Append len bytes to the stream, emitting blocks as they fill.
+	 */
+	void write(const void *p, size_t len);
+
+	/**
+	 * Emit the final partial block, followed by the empty EOF block.
+	 */
+	void close();
+
+protected:
+
+	void flushBlock();
+
+	OutFileBuf& obuf_;
+	int         level_;
+	size_t      cur_;
+	bool        closed_;
+	uint8_t     ubuf_[BLOCK_SZ];
+	uint8_t     cbuf_[MAX_BLOCK_SZ];
+};
+
+/**
+ * Sort key for a BAM record: reference id (unaligned records last),
+ * 0-based leftmost position, then the read id and the record's ordinal
+ * within the read so that ties resolve the same way regardless of how
+ * many threads produced the records.
+ */
+struct BamKey {
+
+	bool operator<(const BamKey& o) const {
+		if(coord != o.coord) return coord < o.coord;
+		if(rdid != o.rdid) return rdid < o.rdid;
+		return ord < o.ord;
+	}
+
+	bool operator<=(const BamKey& o) const {
+		return !(o < *this);
+	}
+
+	uint64_t coord; // refid in upper 32 bits, pos+1 in lower 32 bits
+	uint64_t rdid;  // read id
+	uint32_t ord;   // ordinal of record among those for the same read
+	uint32_t len;   // length of the encoded record, incl. block_size
+	uint64_t off;   // offset of the encoded record in its bucket
+};
+
+/**
+ * Produces a coordinate-sorted BAM file from the SAM records that the
+ * output queue would otherwise write directly.
+ *
+ * Each thread encodes its records into its own bucket without locking.
+ * When a bucket exceeds its share of the memory budget it is sorted and
+ * spilled to an (already unlinked) temporary file as a sorted run, so
+ * spilling overlaps with alignment on the other threads.  Runs are merged
+ * in batches of MERGE_FANIN as they accumulate, which keeps the number of
+ * open files bounded.  finish() sorts what is still in memory and k-way
+ * merges it with all runs into the BGZF-compressed output, so a run that
+ * fits in the memory budget never touches a temporary file.
+ */
+class BamSorter {
+
+	static const size_t MERGE_FANIN = 16;
+
+public:
+
+	BamSorter(
+		OutFileBuf& obuf,                   // BAM output
+		const EList<std::string>& refnames, // reference names
+		const EList<size_t>& reflens,       // reference lengths
+		size_t nthreads,                    // # threads calling add()
+		size_t memLimit,                    // total bytes to buffer before spilling
+		const std::string& tmpPrefix,       // prefix for temporary run files
+		int level);                         // zlib compression level, -1 for default
+
+	~BamSorter();
+
+	/**
+	 * Set the SAM header text that will be embedded in the BAM header.
+	 */
+	void setHeader(const BTString& text) {
+		header_ = text;
+	}
+
+	/**
+	 * Encode the SAM lines in rec, all belonging to read rdid, into the
+	 * bucket for the given thread.  Only that thread may call add() with
+	 * that threadId.
+	 */
+	void add(const BTString& rec, TReadId rdid, size_t threadId);
+
+	/**
+	 * Merge everything and write the BAM file.  Call once, after all
+	 * threads are done calling add().
+	 */
+	void finish();
+
+	/**
+	 * Return the number of runs spilled to disk so far.
+	 */
+	size_t numSpills() const {
+		return nspills_;
+	}
+
+protected:
+
+	/**
+	 * A sorted run in a temporary file.  Each record is stored as its
+	 * BamKey's coord, rdid and ord, followed by the BAM record itself
+	 * (starting with block_size).
+	 */
+	struct Run {
+		FILE    *fh;
+		int      level; // # merges that went into this run
+	};
+
+	/**
+	 * Per-thread record buffer.
+	 */
+	struct Bucket {
+		Bucket() :
+			buf(MISC_CAT),
+			keys(MISC_CAT),
+			runs(MISC_CAT),
+			ord(0),
+			lastRdid(0),
+			lastRef(-1) { }
+		EList<char>   buf;      // encoded records, back to back
+		EList<BamKey> keys;     // one per record in buf
+		EList<Run>    runs;     // sorted runs spilled by this thread
+		uint32_t      ord;      // next ordinal for lastRdid
+		TReadId       lastRdid; // read id of the last record added
+		int           lastRef;  // refid of the last record; speeds lookups
+	};
+
+	/**
+	 * Source of sorted records for a merge: either a run file or the
+	 * sorted, still-in-memory contents of a bucket.
+	 */
+	struct RunReader {
+		RunReader() : fh(NULL), mem(NULL), memi(0), data(NULL), rec(MISC_CAT) { }
+		bool next();
+		FILE         *fh;
+		const Bucket *mem;
+		size_t        memi;
+		BamKey        key;  // key of current record
+		const char   *data; // current record, starting with block_size
+		EList<char>   rec;  // buffer for records read from fh
+	};
+
+	void encode(const char *line, size_t len, Bucket& b, TReadId rdid);
+
+	int refid(const char *name, size_t len, Bucket& b);
+
+	void spill(Bucket& b);
+
+	Run openRun();
+
+	void merge(EList<RunReader>& srcs, Run *dst, BgzfWriter *bgzf);
+
+	void writeBamHeader(BgzfWriter& bgzf);
+
+	OutFileBuf&  obuf_;
+	EList<std::string> refnames_; // as printed in SAM: up to 1st whitespace
+	EList<size_t> reflens_;
+	EList<std::pair<std::string, int> > refidx_; // refnames_ sorted, for lookup
+	Bucket      *buckets_;
+	size_t       nbuckets_;
+	size_t       bucketLimit_;
+	std::string  tmpPrefix_;
+	int          level_;
+	BTString     header_;
+	size_t       nspills_;
+	bool         finished_;
+	MUTEX_T      mutex_m; // guards nspills_
+};
+
+#endif /*ndef BAM_H_*/
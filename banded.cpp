@@ -20,8 +20,379 @@
 #include <iostream>
 #include "banded.h"
 
+using namespace std;
+
+// Low enough to never win, high enough that a few penalties can't wrap
+static const int16_t BANDED_NEG = -0x4000;
+
+/**
+ * Return a vector with v in the low n lanes and 0 elsewhere.
+ */
+static inline __m128i lowLanes(int16_t v, size_t n) {
+	int16_t a[BandedSseAligner::NLANES];
+	for(size_t i = 0; i < BandedSseAligner::NLANES; i++) {
+		a[i] = (i < n) ? v : 0;
+	}
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+}
+
+/**
+ * Fill the band.  Lane l of a row holds the cell on diagonal l - maxgap,
+ * i.e. row i, reference column i + l - maxgap.
+ */
+void BandedSseAligner::fill() {
+	const int k = (int)maxgap_;
+	const int16_t rdOpen = (int16_t)sc_->readGapOpen();
+	const int16_t rdExt  = (int16_t)sc_->readGapExtend();
+	const int16_t rfOpen = (int16_t)sc_->refGapOpen();
+	const int16_t rfExt  = (int16_t)sc_->refGapExtend();
+	const __m128i vneg    = _mm_set1_epi16(BANDED_NEG);
+	const __m128i vrdOpen = _mm_set1_epi16(rdOpen);
+	const __m128i vrfOpen = _mm_set1_epi16(rfOpen);
+	const __m128i vrfExt  = _mm_set1_epi16(rfExt);
+	const __m128i vrdExt1 = _mm_set1_epi16(rdExt);
+	const __m128i vrdExt2 = _mm_set1_epi16((int16_t)(rdExt * 2));
+	const __m128i vrdExt4 = _mm_set1_epi16((int16_t)(rdExt * 4));
+	// Fill for lanes shifted in from outside the register
+	const __m128i negLo1 = lowLanes(BANDED_NEG, 1);
+	const __m128i negLo2 = lowLanes(BANDED_NEG, 2);
+	const __m128i negLo4 = lowLanes(BANDED_NEG, 4);
+	const __m128i negHi1 = _mm_slli_si128(negLo1, 2 * (NLANES - 1));
+	int16_t a[NLANES];
+	int16_t valid[NLANES];
+
+	mat_.resize((qlen_ + 1) * TB_NUM);
+
+	// Row 0: nothing of the query consumed yet; lanes right of the start
+	// diagonal are reached by a read gap
+	for(int l = 0; l < (int)NLANES; l++) {
+		int d = l - k;
+		if(d == 0) {
+			a[l] = 0;
+		} else if(d > 0 && l <= 2 * k && d <= (int)rlen_) {
+			a[l] = (int16_t)(-(rdOpen + (d - 1) * rdExt));
+		} else {
+			a[l] = BANDED_NEG;
+		}
+	}
+	__m128i vh = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+	__m128i vf = vneg;
+	__m128i *tb = mat_.ptr();
+	tb[TB_DIAG]  = _mm_setzero_si128();
+	tb[TB_E]     = _mm_andnot_si128(lowLanes(-1, k + 1), _mm_set1_epi16(-1));
+	tb[TB_EOPEN] = _mm_andnot_si128(lowLanes(-1, k + 1), lowLanes(-1, k + 2));
+	tb[TB_FOPEN] = _mm_setzero_si128();
+
+	for(size_t i = 1; i <= qlen_; i++) {
+		int c = q_[i-1];
+		int qv = qual_[i-1] - 33;
+		for(int l = 0; l < (int)NLANES; l++) {
+			int j = (int)i + l - k; // reference column after this cell
+			bool ok = l <= 2 * k && j >= 0 && j <= (int)rlen_;
+			valid[l] = ok ? -1 : 0;
+			if(ok && j >= 1) {
+				int rc = r_[j-1];
+				a[l] = (int16_t)sc_->score(c, rc > 3 ? 16 : (1 << rc), qv);
+			} else {
+				a[l] = BANDED_NEG;
+			}
+		}
+		__m128i vs  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+		__m128i vok = _mm_loadu_si128(reinterpret_cast<const __m128i*>(valid));
+		tb = mat_.ptr() + i * TB_NUM;
+
+		// Match/mismatch: same lane, previous row
+		__m128i vdiag = _mm_adds_epi16(vh, vs);
+
+		// Reference gap: next lane, previous row
+		__m128i vfopen = _mm_subs_epi16(_mm_or_si128(_mm_srli_si128(vh, 2), negHi1), vrfOpen);
+		__m128i vfext  = _mm_subs_epi16(_mm_or_si128(_mm_srli_si128(vf, 2), negHi1), vrfExt);
+		vf = _mm_max_epi16(vfopen, vfext);
+		vf = _mm_or_si128(_mm_and_si128(vok, vf), _mm_andnot_si128(vok, vneg));
+		tb[TB_FOPEN] = _mm_cmpeq_epi16(vf, vfopen);
+
+		__m128i vh1 = _mm_max_epi16(vdiag, vf);
+		tb[TB_DIAG] = _mm_cmpeq_epi16(vh1, vdiag);
+
+		// Read gap: previous lane, same row.  Resolve the chain of
+		// extensions with a prefix scan over the lanes.
+		__m128i vt = _mm_subs_epi16(_mm_or_si128(_mm_slli_si128(vh1, 2), negLo1), vrdOpen);
+		__m128i ve = vt;
+		ve = _mm_max_epi16(ve, _mm_subs_epi16(_mm_or_si128(_mm_slli_si128(ve, 2), negLo1), vrdExt1));
+		ve = _mm_max_epi16(ve, _mm_subs_epi16(_mm_or_si128(_mm_slli_si128(ve, 4), negLo2), vrdExt2));
+		ve = _mm_max_epi16(ve, _mm_subs_epi16(_mm_or_si128(_mm_slli_si128(ve, 8), negLo4), vrdExt4));
+		ve = _mm_or_si128(_mm_and_si128(vok, ve), _mm_andnot_si128(vok, vneg));
+		tb[TB_EOPEN] = _mm_cmpeq_epi16(ve, vt);
+		tb[TB_E] = _mm_cmpgt_epi16(ve, vh1);
+
+		vh = _mm_max_epi16(vh1, ve);
+		vh = _mm_or_si128(_mm_and_si128(vok, vh), _mm_andnot_si128(vok, vneg));
+	}
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(last_), vh);
+}
+
+/**
+ * Fill the band, then backtrace from the best cell in the last row,
+ * preferring cells closer to the starting diagonal when scores tie.
+ */
+bool BandedSseAligner::nextAlignment(int& score, EList<char>& ops) {
+	assert(sc_ != NULL);
+	ops.clear();
+	if(qlen_ == 0) return false;
+	fill();
+	const int k = (int)maxgap_;
+	int best = -1;
+	for(int dist = 0; dist <= k; dist++) {
+		for(int sign = -1; sign <= 1; sign += 2) {
+			int l = k + sign * dist;
+			if(l < 0 || l > 2 * k) continue;
+			if(last_[l] <= BANDED_NEG / 2) continue;
+			if(best < 0 || last_[l] > last_[best]) best = l;
+			if(dist == 0) break;
+		}
+	}
+	if(best < 0) return false;
+	score = last_[best];
+
+	// Backtrace; state 0 = H, 1 = max(diagonal, F), 2 = E, 3 = F
+	int i = (int)qlen_, l = best, state = 0;
+	while(i > 0 || l != k) {
+		assert_range(0, 2 * k, l);
+		const int16_t *tb = reinterpret_cast<const int16_t*>(mat_.ptr() + i * TB_NUM);
+		if(state == 0) {
+			state = (tb[TB_E * NLANES + l] != 0) ? 2 : 1;
+			continue;
+		}
+		if(state == 1) {
+			assert_gt(i, 0);
+			if(tb[TB_DIAG * NLANES + l] != 0) {
+				int j = i + l - k;
+				assert_gt(j, 0);
+				int rc = r_[j-1];
+				ops.push_back((rc == q_[i-1] && rc < 4) ? (char)BANDED_MATCH : (char)BANDED_MM);
+				i--;
+				state = 0;
+			} else {
+				state = 3;
+			}
+		} else if(state == 2) {
+			ops.push_back((char)BANDED_DEL);
+			state = (tb[TB_EOPEN * NLANES + l] != 0) ? 1 : 2;
+			l--;
+		} else {
+			assert_eq(3, state);
+			ops.push_back((char)BANDED_INS);
+			state = (tb[TB_FOPEN * NLANES + l] != 0) ? 0 : 3;
+			i--;
+			l++;
+		}
+	}
+	ops.reverse();
+	return true;
+}
+
 #ifdef MAIN_BANDED
+
+#include <stdlib.h>
+#include <limits>
+#include "simple_func.h"
+
+/**
+ * Score the best alignment of all of q against a prefix of r, starting at
+ * (0,0), with plain scalar dynamic programming.  With band >= 0 only cells
+ * within 'band' diagonals of the start diagonal are used, as in
+ * BandedSseAligner; with band < 0 the whole matrix is.
+ */
+static int scalarScore(
+	const char *q, const char *qual, size_t qlen,
+	const char *r, size_t rlen,
+	int band,
+	const Scoring& sc)
+{
+	const int NEG = std::numeric_limits<int>::min() / 2;
+	const int rdOpen = sc.readGapOpen(), rdExt = sc.readGapExtend();
+	const int rfOpen = sc.refGapOpen(),  rfExt = sc.refGapExtend();
+	size_t w = rlen + 1;
+	EList<int> H, E, F;
+	H.resize((qlen + 1) * w); H.fill(NEG);
+	E.resize((qlen + 1) * w); E.fill(NEG);
+	F.resize((qlen + 1) * w); F.fill(NEG);
+	for(size_t i = 0; i <= qlen; i++) {
+		for(size_t j = 0; j <= rlen; j++) {
+			if(band >= 0 && abs((int)j - (int)i) > band) continue;
+			size_t c = i * w + j;
+			if(i == 0 && j == 0) {
+				H[c] = 0;
+				continue;
+			}
+			if(j > 0 && H[c-1] > NEG) E[c] = max(H[c-1] - rdOpen, E[c-1] - rdExt);
+			if(i > 0 && H[c-w] > NEG) F[c] = max(H[c-w] - rfOpen, F[c-w] - rfExt);
+			int h = max(E[c], F[c]);
+			if(i > 0 && j > 0 && H[c-w-1] > NEG) {
+				int rc = r[j-1];
+				h = max(h, H[c-w-1] + sc.score(q[i-1], rc > 3 ? 16 : (1 << rc), qual[i-1] - 33));
+			}
+			H[c] = h;
+		}
+	}
+	int best = NEG;
+	for(size_t j = 0; j <= rlen; j++) best = max(best, H[qlen * w + j]);
+	return best;
+}
+
+/**
+ * Score the alignment 'ops' of q against r, setting 'rused' to the number
+ * of reference characters it covers.  Return false if the operations
+ * don't cover exactly all of q or run past the end of r.
+ */
+static bool replay(
+	const EList<char>& ops,
+	const char *q, const char *qual, size_t qlen,
+	const char *r, size_t rlen,
+	const Scoring& sc,
+	int& score, size_t& rused)
+{
+	size_t i = 0, j = 0;
+	score = 0;
+	for(size_t o = 0; o < ops.size(); o++) {
+		char op = ops[o];
+		bool ext = o > 0 && ops[o-1] == op;
+		if(op == BandedSseAligner::BANDED_MATCH || op == BandedSseAligner::BANDED_MM) {
+			if(i >= qlen || j >= rlen) return false;
+			int rc = r[j];
+			bool match = q[i] == rc && rc < 4;
+			if(match != (op == BandedSseAligner::BANDED_MATCH)) return false;
+			score += sc.score(q[i], rc > 3 ? 16 : (1 << rc), qual[i] - 33);
+			i++; j++;
+		} else if(op == BandedSseAligner::BANDED_INS) {
+			if(i >= qlen) return false;
+			score -= ext ? sc.refGapExtend() : sc.refGapOpen();
+			i++;
+		} else if(op == BandedSseAligner::BANDED_DEL) {
+			if(j >= rlen) return false;
+			score -= ext ? sc.readGapExtend() : sc.readGapOpen();
+			j++;
+		} else {
+			return false;
+		}
+	}
+	rused = j;
+	return i == qlen;
+}
+
+/**
+ * Check BandedSseAligner against scalarScore() on random problems:
+ * reads copied from a random reference with an insertion or deletion
+ * planted near either end, plus the odd mismatch or N, and unrelated
+ * random reads.  Build with:
+ *
+ *   g++ -DMAIN_BANDED -DPOPCNT_CAPABILITY -msse2 -o banded-test banded.cpp ds.cpp qual.cpp
+ */
 int main(void) {
-	
+	const double DMAX = std::numeric_limits<double>::max();
+	SimpleFunc scoreMin(SIMPLE_FUNC_LINEAR, 0.0f, DMAX, 0.0f, -0.2f);
+	SimpleFunc nCeil(SIMPLE_FUNC_LINEAR, 0.0f, DMAX, 0.0f, 0.15f);
+	Scoring scs[2] = {
+		Scoring::base1(),
+		// hisat-align's defaults
+		Scoring(DEFAULT_MATCH_BONUS, DEFAULT_MM_PENALTY_TYPE, DEFAULT_MM_PENALTY_MAX,
+		        DEFAULT_MM_PENALTY_MIN, scoreMin, nCeil, DEFAULT_N_PENALTY_TYPE,
+		        DEFAULT_N_PENALTY, DEFAULT_N_CAT_PAIR, DEFAULT_READ_GAP_CONST, DEFAULT_REF_GAP_CONST,
+		        DEFAULT_READ_GAP_LINEAR, DEFAULT_REF_GAP_LINEAR, 4)
+	};
+	srand(1);
+	BandedSseAligner al;
+	EList<char> ops;
+	char r[200], q[200], qual[200];
+	for(int pass = 0; pass < 2; pass++) {
+		cerr << (pass == 0 ? "Test reads with an indel near either end, scoring "
+		                   : "Test unrelated reads, scoring ");
+		for(int s = 0; s < 2; s++) {
+			cerr << s << "...";
+			const Scoring& sc = scs[s];
+			size_t nplanted = 0, ninband = 0;
+			for(int t = 0; t < 5000; t++) {
+				size_t maxgap = 1 + rand() % BandedSseAligner::MAX_GAP;
+				size_t qlen = 10 + rand() % 90;
+				size_t rlen = qlen + maxgap - (rand() % 4 == 0 ? rand() % (2 * maxgap) : 0);
+				for(size_t j = 0; j < rlen; j++) {
+					r[j] = (rand() % 50 == 0) ? 4 : rand() % 4;
+				}
+				for(size_t i = 0; i < qlen; i++) {
+					qual[i] = (char)(33 + rand() % 41);
+				}
+				int planted = 0;
+				if(pass == 0) {
+					// Copy r with a gap of up to maxgap starting within 8
+					// characters of either end of the read
+					size_t glen = 1 + rand() % maxgap;
+					bool ins = rand() % 2 == 0;
+					size_t gpos = (rand() % 2 == 0) ? rand() % 8 : qlen - 1 - rand() % 8;
+					size_t i = 0, j = 0;
+					ops.clear();
+					while(i < qlen) {
+						if(i == gpos && glen > 0) {
+							for(; glen > 0 && i < qlen; glen--) {
+								if(ins) {
+									q[i++] = rand() % 4;
+									ops.push_back(BandedSseAligner::BANDED_INS);
+								} else {
+									ops.push_back(BandedSseAligner::BANDED_DEL);
+									j++;
+								}
+							}
+							glen = 0;
+							continue;
+						}
+						if(j >= rlen) break;
+						q[i] = (rand() % 40 == 0) ? (r[j] + 1) % 4 : r[j];
+						ops.push_back(q[i] == r[j] && r[j] < 4 ?
+							BandedSseAligner::BANDED_MATCH : BandedSseAligner::BANDED_MM);
+						i++; j++;
+					}
+					if(i < qlen) continue; // reference too short for the read
+					size_t rused;
+					if(!replay(ops, q, qual, qlen, r, rlen, sc, planted, rused)) throw 1;
+				} else {
+					for(size_t i = 0; i < qlen; i++) q[i] = rand() % 5;
+				}
+				al.init(q, qual, qlen, r, rlen, maxgap, sc);
+				int score = 0;
+				bool found = al.nextAlignment(score, ops);
+				int expect = scalarScore(q, qual, qlen, r, rlen, (int)maxgap, sc);
+				if(!found) {
+					// Only if no cell of the last row is in the band
+					if(qlen <= rlen + maxgap) throw 1;
+					continue;
+				}
+				if(score != expect) {
+					cerr << "banded score " << score << " != scalar " << expect << endl;
+					throw 1;
+				}
+				int rescore;
+				size_t rused;
+				if(!replay(ops, q, qual, qlen, r, rlen, sc, rescore, rused) || rescore != score) {
+					cerr << "alignment doesn't cover the read or doesn't give its score" << endl;
+					throw 1;
+				}
+				if(abs((int)rused - (int)qlen) > (int)maxgap) throw 1;
+				if(pass == 0) {
+					// At least as good as the planted alignment and, unless a
+					// better alignment needs more than the band, as good as
+					// any
+					if(score < planted) throw 1;
+					int unbanded = scalarScore(q, qual, qlen, r, rlen, -1, sc);
+					if(score > unbanded) throw 1;
+					nplanted++;
+					if(score == unbanded) ninband++;
+				}
+			}
+			// Nearly all planted alignments are the best there is
+			if(ninband * 100 < nplanted * 99) throw 1;
+		}
+		cerr << "PASSED" << endl;
+	}
+	return 0;
 }
+
 #endif
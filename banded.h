@@ -21,32 +21,102 @@
 #define BANDED_H_
 
 #include "sse_util.h"
+#include "ds.h"
+#include "scoring.h"
+#include "mem_ids.h"
 
 /**
- * Use SSE instructions to quickly find stretches with lots of matches, then
- * resolve alignments.
+ * Banded dynamic programming aligner used to extend a partial alignment
+ * through a few small gaps.
+ *
+ * The query is aligned in the direction of extension, starting right next
+ * to the existing partial alignment (cell 0,0) and ending with the last
+ * query character; the end column is free within the band.  The band holds
+ * the 2 * maxgap + 1 diagonals around the partial alignment's diagonal.
+ * Each row of the band is one SSE register of 16-bit lanes, lane l holding
+ * diagonal l - maxgap, so matches/mismatches come from the same lane of the
+ * previous row, reference gaps from the neighboring lane of the previous row,
+ * and read gaps are resolved with a log-step prefix scan across the lanes of
+ * the current row.  Per-row backtrace masks are kept so the best alignment
+ * can be recovered.
+ *
+ * Callers extending to the left pass the query and reference reversed.
  */
 class BandedSseAligner {
 
 public:
 
+	static const size_t NLANES = 8;
+	static const size_t MAX_GAP = (NLANES - 1) / 2; // widest band that fits
+
+	/**
+	 * Alignment operations produced by nextAlignment(), in query order.
+	 */
+	enum {
+		BANDED_MATCH = '=',
+		BANDED_MM    = 'X',
+		BANDED_INS   = 'I', // query char against a reference gap
+		BANDED_DEL   = 'D'  // reference char against a query gap
+	};
+
+	BandedSseAligner() : mat_(DP_CAT), q_(NULL), qual_(NULL), r_(NULL),
+		qlen_(0), rlen_(0), maxgap_(0), sc_(NULL) { }
+
+	/**
+	 * Set up a new problem.  Query characters and reference characters
+	 * are 0-4 (A, C, G, T, N); qualities are phred+33.  The reference
+	 * should normally have qlen + maxgap characters; a shorter reference
+	 * (e.g. near the end of a chromosome) just narrows the band.
+	 */
 	void init(
-		int    *q,      // query, maskized
-		size_t  qi,     // query start
-		size_t  qf,     // query end
-		int    *r,      // reference, maskized
-		size_t  ri,     // reference start
-		size_t  rf)     // reference end
+		const char    *q,      // query
+		const char    *qual,   // query qualities
+		size_t         qlen,   // query length
+		const char    *r,      // reference
+		size_t         rlen,   // reference length
+		size_t         maxgap, // max gap length; <= MAX_GAP
+		const Scoring& sc)     // scoring scheme
 	{
-		
-	}
-	
-	void nextAlignment() {
+		assert_leq(maxgap, MAX_GAP);
+		q_ = q; qual_ = qual; qlen_ = qlen;
+		r_ = r; rlen_ = rlen;
+		maxgap_ = maxgap;
+		sc_ = &sc;
 	}
 
+	/**
+	 * Fill the band and backtrace from the best cell in the last row.
+	 * Returns false if no alignment of the whole query fits in the band.
+	 * Otherwise sets score and fills ops with the alignment, from the
+	 * first query character to the last.
+	 */
+	bool nextAlignment(int& score, EList<char>& ops);
+
 protected:
 
-	EList_m128i mat_;
+	// Backtrace masks stored per row
+	enum {
+		TB_DIAG = 0, // max(diagonal, F) came from the diagonal
+		TB_E,        // H came from E (read gap)
+		TB_EOPEN,    // E was opened rather than extended
+		TB_FOPEN,    // F was opened rather than extended
+		TB_NUM
+	};
+
+	/**
+	 * Fill the band row by row, leaving the last row's scores in last_.
+	 */
+	void fill();
+
+	EList_m128i    mat_;   // TB_NUM vectors per row
+	const char    *q_;
+	const char    *qual_;
+	const char    *r_;
+	size_t         qlen_;
+	size_t         rlen_;
+	size_t         maxgap_;
+	const Scoring *sc_;
+	int16_t        last_[NLANES]; // H for the last row
 };
 
 #endif
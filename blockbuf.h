@@ -0,0 +1,281 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCKBUF_H_
+#define BLOCKBUF_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <iostream>
+#include <emmintrin.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef BOWTIE_MM
+#include <sys/mman.h>
+#endif
+#include "assert_helpers.h"
+
+/**
+ * Line-oriented reader for read files that works on large blocks rather
+ * than one character at a time.  Regular files are mapped into memory
+ * whole (when BOWTIE_MM is defined); pipes and stdin are read in large
+ * chunks.  Line ends are found 16 bytes at a time with SSE2.
+ *
+ * Lines handed out by nextLine() point into the block and stay valid until
+ * the next call to nextLine() or peek().  Text from the position given to
+ * mark() onward is kept across refills, so the caller can recover the
+ * original text of a whole record with markedText().
+ */
+class BlockBuf {
+
+public:
+
+	static const size_t CHUNK_SZ = 4 * 1024 * 1024;
+
+	BlockBuf() :
+		in_(NULL),
+		buf_(NULL),
+		cap_(0),
+		map_(NULL),
+		mapLen_(0),
+		cur_(NULL),
+		end_(NULL),
+		mark_(NULL),
+		nread_(0),
+		done_(true)
+	{ }
+
+	~BlockBuf() {
+		close();
+		delete[] buf_;
+	}
+
+	bool isOpen() const { return in_ != NULL; }
+
+	/**
+	 * Start reading from a new file.  Takes ownership of 'in' (but won't
+	 * close stdin).
+	 */
+	void newFile(FILE *in) {
+		close();
+		in_ = in;
+		done_ = false;
+		mark_ = NULL;
+		nread_ = 0;
+#ifdef BOWTIE_MM
+		struct stat st;
+		if(in != stdin && fstat(fileno(in), &st) == 0 &&
+		   S_ISREG(st.st_mode) && st.st_size > 0)
+		{
+			void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+			if(p != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+				madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+				map_ = (char *)p;
+				mapLen_ = (size_t)st.st_size;
+				cur_ = map_;
+				end_ = map_ + mapLen_;
+				done_ = true;
+				return;
+			}
+		}
+#endif
+		if(buf_ == NULL) {
+			cap_ = CHUNK_SZ;
+			buf_ = new char[cap_];
+		}
+		cur_ = end_ = buf_;
+	}
+
+	/**
+	 * Close the current file, if any.
+	 */
+	void close() {
+		unmap();
+		if(in_ != NULL && in_ != stdin) fclose(in_);
+		in_ = NULL;
+		cur_ = end_ = mark_ = NULL;
+		done_ = true;
+	}
+
+	/**
+	 * Return the first character of the next line without consuming
+	 * anything, or -1 at end of input.
+	 */
+	int peek() {
+		if(cur_ == end_ && !fill()) return -1;
+		return (unsigned char)*cur_;
+	}
+
+	/**
+	 * Set p and len to the next line, minus its line terminator ("\n" or
+	 * "\r\n"), and move past it.  Returns false at end of input.
+	 */
+	bool nextLine(const char*& p, size_t& len) {
+		if(cur_ == end_ && !fill()) return false;
+		size_t scanned = 0;
+		const char *nl;
+		while((nl = findNewline(cur_ + scanned, end_)) == NULL) {
+			scanned = (size_t)(end_ - cur_);
+			if(!fill()) break;
+		}
+		p = cur_;
+		if(nl == NULL) {
+			// Last line has no terminator
+			len = (size_t)(end_ - cur_);
+			cur_ = end_;
+		} else {
+			len = (size_t)(nl - cur_);
+			cur_ += len + 1;
+		}
+		if(len > 0 && p[len-1] == '\r') len--;
+		return true;
+	}
+
+	/**
+	 * Return true iff seek() can return to a position in this file in a
+	 * later run: it's a regular file, not stdin or a pipe.
+	 */
+	bool seekable() const {
+		return map_ != NULL || (in_ != NULL && in_ != stdin && ftello(in_) >= 0);
+	}
+
+	/**
+	 * Offset in the file of the next unconsumed character.
+	 */
+	uint64_t offset() const {
+		if(map_ != NULL) return (uint64_t)(cur_ - map_);
+		return nread_ - (uint64_t)(end_ - cur_);
+	}
+
+	/**
+	 * Size of the file, or -1 if it can't be determined.
+	 */
+	int64_t fileSize() const {
+		if(map_ != NULL) return (int64_t)mapLen_;
+		struct stat st;
+		if(in_ == NULL || fstat(fileno(in_), &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+		return (int64_t)st.st_size;
+	}
+
+	/**
+	 * Continue reading from offset 'off' of the file.  Returns false if
+	 * that isn't possible.
+	 */
+	bool seek(uint64_t off) {
+		mark_ = NULL;
+		if(map_ != NULL) {
+			if(off > mapLen_) return false;
+			cur_ = map_ + off;
+			return true;
+		}
+		if(in_ == NULL || in_ == stdin || fseeko(in_, (off_t)off, SEEK_SET) != 0) {
+			return false;
+		}
+		nread_ = off;
+		cur_ = end_ = buf_;
+		done_ = false;
+		return true;
+	}
+
+	/**
+	 * Start keeping text from the current position.
+	 */
+	void mark() { mark_ = cur_; }
+
+	/**
+	 * Text consumed since the last call to mark().
+	 */
+	const char *markedText() const { return mark_; }
+	size_t markedLen() const { return (mark_ == NULL) ? 0 : (size_t)(cur_ - mark_); }
+
+	/**
+	 * Return a pointer to the first '\n' in [p, e), or NULL if there is
+	 * none.
+	 */
+	static const char *findNewline(const char *p, const char *e) {
+		const __m128i vnl = _mm_set1_epi8('\n');
+		while(p + 16 <= e) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vnl));
+			if(m != 0) return p + __builtin_ctz(m);
+			p += 16;
+		}
+		for(; p < e; p++) {
+			if(*p == '\n') return p;
+		}
+		return NULL;
+	}
+
+protected:
+
+	void unmap() {
+#ifdef BOWTIE_MM
+		if(map_ != NULL) munmap(map_, mapLen_);
+#endif
+		map_ = NULL;
+		mapLen_ = 0;
+	}
+
+	/**
+	 * Read another chunk, keeping the unconsumed (and marked) text at the
+	 * front of the buffer.  Returns false if nothing more could be read.
+	 */
+	bool fill() {
+		if(done_) return false;
+		assert(buf_ != NULL);
+		const char *keep = (mark_ != NULL && mark_ < cur_) ? mark_ : cur_;
+		size_t nkeep = (size_t)(end_ - keep);
+		size_t off = (size_t)(cur_ - keep);
+		if(nkeep + CHUNK_SZ / 2 > cap_) {
+			// A single record is bigger than half the buffer; grow it
+			size_t ncap = cap_ * 2;
+			char *nbuf = new char[ncap];
+			memcpy(nbuf, keep, nkeep);
+			delete[] buf_;
+			buf_ = nbuf;
+			cap_ = ncap;
+		} else if(keep != buf_) {
+			memmove(buf_, keep, nkeep);
+		}
+		if(mark_ != NULL) mark_ = buf_;
+		cur_ = buf_ + off;
+		end_ = buf_ + nkeep;
+		size_t nread = fread(end_, 1, cap_ - nkeep, in_);
+		if(nread < cap_ - nkeep) done_ = true;
+		end_ += nread;
+		nread_ += nread;
+		return nread > 0;
+	}
+
+	FILE   *in_;
+	char   *buf_;    // chunk buffer when the file isn't mapped
+	size_t  cap_;
+	char   *map_;    // mapped file, if any
+	size_t  mapLen_;
+	char   *cur_;    // next unconsumed character
+	char   *end_;    // end of valid text
+	char   *mark_;   // start of text being kept, or NULL
+	uint64_t nread_; // bytes read into the chunk buffer so far
+	bool    done_;   // nothing more to read into the block
+};
+
+#endif /*ndef BLOCKBUF_H_*/
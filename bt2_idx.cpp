@@ -84,3 +84,55 @@ string adjustEbwtBase(const string& cmdline,
 }
 
 string gLastIOErrMsg;
+
+#ifdef MAIN_BT2_IDX
+
+/**
+ * Check pack40() and unpack40(), which hold the SA sample and ftab of a
+ * large index in memory.  Build with:
+ *
+ *   g++ -DMAIN_BT2_IDX -DBOWTIE_64BIT_INDEX -DPOPCNT_CAPABILITY -o bt2-idx-test \
+ *       bt2_idx.cpp multikey_qsort.cpp
+ */
+int main(void) {
+	cerr << "Test pack40/unpack40 round trips...";
+	{
+		const uint64_t B32 = (uint64_t)1 << 32;
+		const uint64_t vals[] = {
+			0, 1, 0xff, B32 - 1, B32, B32 + 1, B32 + 0xff,
+			((uint64_t)1 << 38), PACKED40_LIMIT - 2, PACKED40_LIMIT - 1,
+			// ftab pointers into eftab: OFF_MASK ^ index
+			~(uint64_t)0, ~(uint64_t)0 ^ 1, ~(uint64_t)0 ^ 0xfff,
+			~(uint64_t)0 ^ (PACKED40_LIMIT - 1)
+		};
+		uint8_t buf[6];
+		for(size_t i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+			buf[5] = 0xa5;
+			pack40(buf, vals[i]);
+			if(unpack40(buf) != vals[i]) {
+				cerr << "value " << vals[i] << " unpacked as " << unpack40(buf) << endl;
+				throw 1;
+			}
+			if(buf[5] != 0xa5) throw 1; // wrote past the 5 bytes
+		}
+		// Little-endian
+		pack40(buf, 0x0102030405ULL);
+		if(buf[0] != 5 || buf[1] != 4 || buf[2] != 3 || buf[3] != 2 || buf[4] != 1) throw 1;
+	}
+	cerr << "PASSED" << endl;
+
+	cerr << "Test values from 2^39 up don't survive packing...";
+	{
+		// Why packable() only allows BWTs shorter than PACKED40_LIMIT
+		uint8_t buf[5];
+		const uint64_t vals[] = { PACKED40_LIMIT, PACKED40_LIMIT + 1, ((uint64_t)1 << 40) - 1, (uint64_t)1 << 40 };
+		for(size_t i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+			pack40(buf, vals[i]);
+			if(unpack40(buf) == vals[i]) throw 1;
+		}
+	}
+	cerr << "PASSED" << endl;
+	return 0;
+}
+
+#endif
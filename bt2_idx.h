@@ -54,6 +54,7 @@
 #include "random_source.h"
 #include "mem_ids.h"
 #include "btypes.h"
+#include "build_checkpoint.h"
 
 #ifdef POPCNT_CAPABILITY
 #include "processor_support.h"
@@ -100,6 +101,36 @@ enum EBWT_FLAGS {
 						// each stretch reversed
 };
 
+/**
+ * Large (64-bit) indexes keep their SA sample and ftab in memory as 40-bit
+ * (5-byte) little-endian entries unless the index is memory-mapped or in
+ * shared memory; see Ebwt::offsAt() and Ebwt::ftabAt().  The files on disk
+ * are unchanged.  Bit 39 is sign-extended when unpacking so that ftab's
+ * pointers into eftab, which have all their high bits set, survive packing;
+ * an index is only packed if its BWT is shorter than 2^39.
+ */
+static const uint64_t PACKED40_LIMIT = ((uint64_t)1 << 39);
+
+static inline uint64_t unpack40(const uint8_t *p) {
+	uint64_t v = (uint64_t)p[0] |
+	            ((uint64_t)p[1] << 8) |
+	            ((uint64_t)p[2] << 16) |
+	            ((uint64_t)p[3] << 24) |
+	            ((uint64_t)p[4] << 32);
+	if(v & PACKED40_LIMIT) {
+		v |= ~(uint64_t)0 << 40;
+	}
+	return v;
+}
+
+static inline void pack40(uint8_t *p, uint64_t v) {
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16);
+	p[3] = (uint8_t)(v >> 24);
+	p[4] = (uint8_t)(v >> 32);
+}
+
 /**
  * Extended Burrows-Wheeler transform header.  This together with the
  * actual data arrays and other text-specific parameters defined in
@@ -548,12 +579,16 @@ public:
 	    _ftab(EBWT_CAT), \
 	    _eftab(EBWT_CAT), \
 	    _offs(EBWT_CAT), \
+	    _ftab40(EBWT_CAT), \
+	    _offs40(EBWT_CAT), \
 	    _ebwt(EBWT_CAT), \
 	    _useMm(false), \
 	    useShmem_(false), \
 	    _refnames(EBWT_CAT), \
 	    mmFile1_(NULL), \
-	    mmFile2_(NULL)
+	    mmFile2_(NULL), \
+	    shmFile1_(NULL), \
+	    shmFile2_(NULL)
 
 	/// Construct an Ebwt from the given input file
 	Ebwt(const string& in,
@@ -576,15 +611,21 @@ public:
 		 bool skipLoading = false) : 
 	     Ebwt_INITS
 	{
-		assert(!useMm || !useShmem);
-        
 #ifdef POPCNT_CAPABILITY
         ProcessorSupport ps;
         _usePOPCNTinstruction = ps.POPCNTenabled();
 #endif
         
 		packed_ = false;
-		_useMm = useMm;
+#ifndef BOWTIE_SHARED_MEM
+		if(useShmem) {
+			cerr << "Error: this binary was built without shared-memory support (BOWTIE_SHARED_MEM)" << endl;
+			throw 1;
+		}
+#endif
+		// Shared memory holds verbatim copies of the index files, which
+		// are used the same way as memory-mapped files
+		_useMm = useMm || useShmem;
 		useShmem_ = useShmem;
 		_in1Str = in + ".1." + gEbwt_ext;
 		_in2Str = in + ".2." + gEbwt_ext;
@@ -680,7 +721,8 @@ public:
 		int32_t overrideOffRate = -1,
 		bool verbose = false,
 		bool passMemExc = false,
-		bool sanityCheck = false) :
+		bool sanityCheck = false,
+		BuildCheckpoint* ckpt = NULL) :
 		Ebwt_INITS,
 		_eh(
 			joinedLen(szs),
@@ -697,6 +739,20 @@ public:
 		_in1Str = file + ".1." + gEbwt_ext;
 		_in2Str = file + ".2." + gEbwt_ext;
 		packed_ = packed;
+		// The .1/.2 files of a previous, interrupted run are complete;
+		// only the joined string is needed, for the local indexes
+		EList<string> files(MISC_CAT);
+		files.push_back(_in1Str);
+		files.push_back(_in2Str);
+		string key = fw ? "fw.global" : "rev.global";
+		if(ckpt != NULL && ckpt->done(key, files)) {
+			VMSG_NL("Reusing " << _in1Str.c_str() << " and " << _in2Str.c_str());
+			joinOnly(s, is, szs, sztot, refparams);
+			return;
+		}
+		if(ckpt != NULL) {
+			ckpt->clear(fw ? "fw.local" : "rev.local");
+		}
 		// Open output files
 		ofstream fout1(_in1Str.c_str(), ios::binary);
 		if(!fout1.good()) {
@@ -752,6 +808,9 @@ public:
 			cerr << "Please check if there is a problem with the disk or if disk is full." << endl;
 			throw 1;
 		}
+		if(ckpt != NULL) {
+			ckpt->finish(key, files);
+		}
 		// Reopen as input streams
 		VMSG_NL("Re-opening _in1 and _in2 as input streams");
 		if(_sanity) {
@@ -934,6 +993,26 @@ public:
 	 */
 	void szsToDisk(const EList<RefRecord>& szs, ostream& os, int reverse);
 	
+	/**
+	 * Join the text strings into 's' as initFromVector() does, without
+	 * writing anything or building the suffix array; for when the index
+	 * files are already on disk.
+	 */
+	template <typename TStr>
+	void joinOnly(TStr& s,
+	              EList<FileBuf*>& is,
+	              EList<RefRecord>& szs,
+	              index_t sztot,
+	              const RefReadInParams& refparams)
+	{
+		std::ostream devnull(NULL);
+		s.resize(joinedLen(szs));
+		joinToDisk(is, szs, sztot, refparams, s, devnull, devnull);
+		if(refparams.reverse == REF_READ_REVERSE) {
+			s.reverse();
+		}
+	}
+
 	/**
 	 * Helper for the constructors above.  Takes a vector of text
 	 * strings and joins them into a single string with a call to
@@ -1160,13 +1239,11 @@ public:
 		_plen.reset();
 		_rstarts.reset();
 		_offs.reset();
+		_ftab40.reset();
+		_offs40.reset();
 		_ebwt.reset();
-		if(offs() != NULL && useShmem_) {
-			FREE_SHARED(offs());
-		}
-		if(ebwt() != NULL && useShmem_) {
-			FREE_SHARED(ebwt());
-		}
+		DETACH_SHARED(shmFile1_);
+		DETACH_SHARED(shmFile2_);
 		if (_in1 != NULL) fclose(_in1);
 		if (_in2 != NULL) fclose(_in2);
 	}
@@ -1198,6 +1275,55 @@ public:
     inline const index_t* offs() const    { return _offs.get(); }
 #endif
 	inline const index_t* plen() const    { return _plen.get(); }
+
+	/**
+	 * Return true iff the SA sample is loaded, packed or not.
+	 */
+	inline bool offsLoaded() const {
+		return offs() != NULL || _offs40.get() != NULL;
+	}
+
+	/**
+	 * Return SA sample element i, whether or not the sample is packed.
+	 */
+	inline index_t offsAt(index_t i) const {
+		if(sizeof(index_t) == 8 && _offs40.get() != NULL) {
+			return (index_t)unpack40(_offs40.get() + (size_t)i * 5);
+		}
+		return offs()[i];
+	}
+
+	/**
+	 * Return ftab element i, whether or not the ftab is packed.
+	 */
+	inline index_t ftabAt(index_t i) const {
+		if(sizeof(index_t) == 8 && _ftab40.get() != NULL) {
+			return (index_t)unpack40(_ftab40.get() + (size_t)i * 5);
+		}
+		return ftab()[i];
+	}
+
+	/**
+	 * Return true iff an index of this length may be packed; see unpack40().
+	 */
+	bool packable(const EbwtParams<index_t>& eh) const {
+		return sizeof(index_t) == 8 && !_useMm && !useShmem_ &&
+		       (uint64_t)eh._bwtLen < PACKED40_LIMIT;
+	}
+
+	/**
+	 * Replace the ftab with a packed copy.
+	 */
+	void packFtab(const EbwtParams<index_t>& eh) {
+		assert(packable(eh));
+		assert(ftab() != NULL);
+		_ftab40.init(new uint8_t[eh._ftabLen * 5], eh._ftabLen * 5, true);
+		for(index_t i = 0; i < eh._ftabLen; i++) {
+			pack40(_ftab40.get() + (size_t)i * 5, (uint64_t)ftab()[i]);
+		}
+		_ftab.reset();
+		assert(ftab() == NULL);
+	}
 	inline const index_t* rstarts() const { return _rstarts.get(); }
 	inline const uint8_t*  ebwt() const    { return _ebwt.get(); }
 	bool        toBe() const         { return _toBigEndian; }
@@ -1301,6 +1427,8 @@ public:
 		_eftab.free();
 		_rstarts.free();
 		_offs.free(); // might not be under control of APtrWrap
+		_ftab40.free();
+		_offs40.free();
 		_ebwt.free(); // might not be under control of APtrWrap
 		// Keep plen; it's small and the client may want to seq it
 		// even when the others are evicted.
@@ -1344,6 +1472,14 @@ public:
 	 * Non-static facade for static function ftabHi.
 	 */
 	index_t ftabHi(index_t i) const {
+		if(_ftab40.get() != NULL) {
+			assert_lt(i, _eh._ftabLen);
+			index_t f = ftabAt(i);
+			if(f <= _eh._len) return f;
+			index_t efIdx = f ^ (index_t)OFF_MASK;
+			assert_lt(efIdx*2+1, _eh._eftabLen);
+			return eftab()[efIdx*2+1];
+		}
 		return Ebwt<index_t>::ftabHi(
 			ftab(),
 			eftab(),
@@ -1384,6 +1520,14 @@ public:
 	 * Non-static facade for static function ftabLo.
 	 */
 	index_t ftabLo(index_t i) const {
+		if(_ftab40.get() != NULL) {
+			assert_lt(i, _eh._ftabLen);
+			index_t f = ftabAt(i);
+			if(f <= _eh._len) return f;
+			index_t efIdx = f ^ (index_t)OFF_MASK;
+			assert_lt(efIdx*2+1, _eh._eftabLen);
+			return eftab()[efIdx*2];
+		}
 		return Ebwt<index_t>::ftabLo(
 			ftab(),
 			eftab(),
@@ -1465,12 +1609,12 @@ public:
 	 * it cannot be resolved immediately, return 0xffffffff.
 	 */
 	index_t tryOffset(index_t elt) const {
-		assert(offs() != NULL);
+		assert(offsLoaded());
 		if(elt == _zOff) return 0;
 		if((elt & _eh._offMask) == elt) {
 			index_t eltOff = elt >> _eh._offRate;
 			assert_lt(eltOff, _eh._offsLen);
-			index_t off = offs()[eltOff];
+			index_t off = offsAt(eltOff);
 			assert_neq((index_t)OFF_MASK, off);
 			return off;
 		} else {
@@ -1588,10 +1732,10 @@ public:
 			out << "non-NULL, [0] = " << fchr()[0] << endl;
 		}
 		out << "    ftab: ";
-		if(ftab() == NULL) {
+		if(ftab() == NULL && _ftab40.get() == NULL) {
 			out << "NULL" << endl;
 		} else {
-			out << "non-NULL, [0] = " << ftab()[0] << endl;
+			out << (ftab() == NULL ? "packed" : "non-NULL") << ", [0] = " << ftabAt(0) << endl;
 		}
 		out << "    eftab: ";
 		if(eftab() == NULL) {
@@ -1600,10 +1744,10 @@ public:
 			out << "non-NULL, [0] = " << eftab()[0] << endl;
 		}
 		out << "    offs: ";
-		if(offs() == NULL) {
+		if(!offsLoaded()) {
 			out << "NULL" << endl;
 		} else {
-			out << "non-NULL, [0] = " << offs()[0] << endl;
+			out << (offs() == NULL ? "packed" : "non-NULL") << ", [0] = " << offsAt(0) << endl;
 		}
 	}
 
@@ -2368,6 +2512,43 @@ public:
 		botsP[3] = topsP[3] + (bots[3] - tops[3]);
 	}
 
+	/**
+	 * Extend a pattern P by one character c to the left in this index while
+	 * keeping its range in the mirror index in sync.  [top, bot) is the range
+	 * of P here and [topP, botP) the range of P reversed in the mirror index;
+	 * on success both are replaced with the ranges for cP and true is
+	 * returned.  Calling this on the mirror index with the roles of the two
+	 * ranges swapped extends P to the right.
+	 *
+	 * Unlike mapBiLFEx, this accounts for the row whose BWT character is $:
+	 * the occurrence of P at the start of the text has nothing to its left,
+	 * and its reversal sorts first within [topP, botP).
+	 */
+	inline bool mapBiLF(
+		index_t& top,
+		index_t& bot,
+		index_t& topP,
+		index_t& botP,
+		int c) const
+	{
+		assert_gt(bot, top);
+		assert_eq(bot - top, botP - topP);
+		assert_range(0, 3, c);
+		SideLocus<index_t> ltop, lbot;
+		SideLocus<index_t>::initFromTopBot(top, bot, _eh, ebwt(), ltop, lbot);
+		index_t tops[4] = { 0, 0, 0, 0 }, bots[4] = { 0, 0, 0, 0 };
+		index_t topsP[4], botsP[4];
+		topsP[0] = topP + ((top <= _zOff && _zOff < bot) ? 1 : 0);
+		mapBiLFEx(ltop, lbot, tops, bots, topsP, botsP);
+		if(bots[c] <= tops[c]) {
+			return false;
+		}
+		top = tops[c];  bot = bots[c];
+		topP = topsP[c]; botP = botsP[c];
+		assert_eq(bot - top, botP - topP);
+		return true;
+	}
+
 	/**
 	 * Given row and its locus information, proceed on the given character
 	 * and return the next row, or all-fs if we can't proceed on that
@@ -2494,14 +2675,19 @@ public:
 #else
     APtrWrap<index_t> _offs;
 #endif
+	// _ftab and _offs packed to 40 bits, used instead of them when set
+	APtrWrap<uint8_t> _ftab40;
+	APtrWrap<uint8_t> _offs40;
 	// _ebwt is the Extended Burrows-Wheeler Transform itself, and thus
 	// is at least as large as the input sequence.
 	APtrWrap<uint8_t> _ebwt;
 	bool       _useMm;        /// use memory-mapped files to hold the index
-	bool       useShmem_;     /// use shared memory to hold large parts of the index
+	bool       useShmem_;     /// use shared memory to hold the index files
 	EList<string> _refnames; /// names of the reference sequences
 	char *mmFile1_;
 	char *mmFile2_;
+	char *shmFile1_;          /// shared copies of the files, to detach
+	char *shmFile2_;
 	EbwtParams<index_t> _eh;
 	bool packed_;
 
@@ -2624,6 +2810,13 @@ TStr Ebwt<index_t>::join(EList<FileBuf*>& l,
 	ret.resize(guessLen);
 	ASSERT_ONLY(index_t szsi = 0);
 	TIndexOffU dstoff = 0;
+	if(rpcp.ingest != NULL) {
+		size_t basei = 0;
+		for(index_t i = 0; i < rpcp.ingest->recs().size(); i++) {
+			rpcp.ingest->append(rpcp.ingest->recs()[i], basei, ret, dstoff, rpcp.reverse);
+		}
+		return ret;
+	}
 	for(index_t i = 0; i < l.size(); i++) {
 		// For each sequence we can pull out of istream l[i]...
 		assert(!l[i]->eof());
@@ -2666,7 +2859,7 @@ void Ebwt<index_t>::joinToDisk(
 {
 	RefReadInParams rpcp = refparams;
 	assert_gt(szs.size(), 0);
-	assert_gt(l.size(), 0);
+	assert(l.size() > 0 || rpcp.ingest != NULL);
 	assert_gt(sztot, 0);
 	// Not every fragment represents a distinct sequence - many
 	// fragments may correspond to a single sequence.  Count the
@@ -2711,8 +2904,33 @@ void Ebwt<index_t>::joinToDisk(
 	ASSERT_ONLY(index_t szsi = 0);
 	ASSERT_ONLY(index_t entsWritten = 0);
 	index_t dstoff = 0;
+	if(rpcp.ingest != NULL) {
+		// The input was parsed up front; replay its records
+		const RefIngest& ingest = *rpcp.ingest;
+		assert_eq(ingest.recs().size(), szs.size());
+		size_t basei = 0, namei = 0;
+		for(index_t i = 0; i < ingest.recs().size(); i++) {
+			const RefRecord& rec = ingest.recs()[i];
+			ingest.append(rec, basei, ret, dstoff, rpcp.reverse);
+			if(rec.first) {
+				const string& name = ingest.names()[namei++];
+				if(rec.len > 0) {
+					if(name.length() == 0) {
+						// If name was empty, replace with an index
+						ostringstream stm;
+						stm << seqsRead;
+						_refnames.push_back(stm.str());
+					} else {
+						_refnames.push_back(name);
+					}
+					seqsRead++;
+				}
+			}
+			ASSERT_ONLY(if(rec.len > 0) entsWritten++);
+		}
+	}
 	// For each filebuf
-	for(unsigned int i = 0; i < l.size(); i++) {
+	for(unsigned int i = 0; i < l.size() && rpcp.ingest == NULL; i++) {
 		assert(!l[i]->eof());
 		bool first = true;
 		index_t patoff = 0;
@@ -3258,7 +3476,7 @@ void Ebwt<index_t>::joinedToTextOff(
  */
 template <typename index_t>
 index_t Ebwt<index_t>::walkLeft(index_t row, index_t steps) const {
-	assert(offs() != NULL);
+	assert(offsLoaded());
 	assert_neq((index_t)OFF_MASK, row);
 	SideLocus<index_t> l;
 	if(steps > 0) l.initFromRow(row, _eh, ebwt());
@@ -3279,10 +3497,10 @@ index_t Ebwt<index_t>::walkLeft(index_t row, index_t steps) const {
  */
 template <typename index_t>
 index_t Ebwt<index_t>::getOffset(index_t row) const {
-	assert(offs() != NULL);
+	assert(offsLoaded());
 	assert_neq((index_t)OFF_MASK, row);
 	if(row == _zOff) return 0;
-	if((row & _eh._offMask) == row) return this->offs()[row >> _eh._offRate];
+	if((row & _eh._offMask) == row) return this->offsAt(row >> _eh._offRate);
 	index_t jumps = 0;
 	SideLocus<index_t> l;
 	l.initFromRow(row, _eh, ebwt());
@@ -3295,7 +3513,7 @@ index_t Ebwt<index_t>::getOffset(index_t row) const {
 		if(row == _zOff) {
 			return jumps;
 		} else if((row & _eh._offMask) == row) {
-			return jumps + this->offs()[row >> _eh._offRate];
+			return jumps + this->offsAt(row >> _eh._offRate);
 		}
 		l.initFromRow(row, _eh, ebwt());
 	}
@@ -82,7 +82,18 @@ void Ebwt<index_t>::readIntoMemory(
 		if(_useMm /*&& !justHeader*/) {
 			const char *names[] = {_in1Str.c_str(), _in2Str.c_str()};
 			int fds[] = { fileno(_in1), fileno(_in2) };
+			char **shmFiles[] = { &shmFile1_, &shmFile2_ };
 			for(int i = 0; i < (loadSASamp ? 2 : 1); i++) {
+				if(useShmem_) {
+					// The shared copy is laid out like the file; one
+					// reference per file for the life of the Ebwt
+					size_t len = 0;
+					if(*shmFiles[i] == NULL) {
+						*shmFiles[i] = ATTACH_SHARED(names[i], len, (_verbose || startVerbose));
+					}
+					mmFile[i] = *shmFiles[i];
+					continue;
+				}
 				if(_verbose || startVerbose) {
 					cerr << "  Memory-mapping input file " << (i+1) << ": ";
 					logTime(cerr);
@@ -277,8 +288,6 @@ void Ebwt<index_t>::readIntoMemory(
 		}
 	}
 	
-	bool shmemLeader;
-	
 	// TODO: I'm not consistent on what "header" means.  Here I'm using
 	// "header" to mean everything that would exist in memory if we
 	// started to build the Ebwt but stopped short of the build*() step
@@ -338,58 +347,34 @@ void Ebwt<index_t>::readIntoMemory(
 			cerr << "Reading ebwt (" << eh->_ebwtTotLen << "): ";
 			logTime(cerr);
 		}
-		bool shmemLeader = true;
-		if(useShmem_) {
-			uint8_t *tmp = NULL;
-			shmemLeader = ALLOC_SHARED_U8(
-				(_in1Str + "[ebwt]"), eh->_ebwtTotLen, &tmp,
-				"ebwt[]", (_verbose || startVerbose));
-			assert(tmp != NULL);
-			_ebwt.init(tmp, eh->_ebwtTotLen, false);
-			if(_verbose || startVerbose) {
-				cerr << "  shared-mem " << (shmemLeader ? "leader" : "follower") << endl;
-			}
-		} else {
-			try {
-				_ebwt.init(new uint8_t[eh->_ebwtTotLen], eh->_ebwtTotLen, true);
-			} catch(bad_alloc& e) {
-				cerr << "Out of memory allocating the ebwt[] array for the Bowtie index.  Please try" << endl
-				<< "again on a computer with more memory." << endl;
+		try {
+			_ebwt.init(new uint8_t[eh->_ebwtTotLen], eh->_ebwtTotLen, true);
+		} catch(bad_alloc& e) {
+			cerr << "Out of memory allocating the ebwt[] array for the Bowtie index.  Please try" << endl
+			<< "again on a computer with more memory." << endl;
+			throw 1;
+		}
+		// Read ebwt from primary stream
+		uint64_t bytesLeft = eh->_ebwtTotLen;
+		char *pebwt = (char*)this->ebwt();
+		while (bytesLeft>0){
+			size_t r = MM_READ(this->_in1, (void *)pebwt, bytesLeft);
+			if(MM_IS_IO_ERR(this->_in1, r, bytesLeft)) {
+				cerr << "Error reading _ebwt[] array: " << r << ", "
+				<< bytesLeft << endl;
 				throw 1;
 			}
+			pebwt += r;
+			bytesLeft -= r;
 		}
-		if(shmemLeader) {
-			// Read ebwt from primary stream
-			uint64_t bytesLeft = eh->_ebwtTotLen;
-			char *pebwt = (char*)this->ebwt();
-            while (bytesLeft>0){
-				size_t r = MM_READ(this->_in1, (void *)pebwt, bytesLeft);
-				if(MM_IS_IO_ERR(this->_in1, r, bytesLeft)) {
-					cerr << "Error reading _ebwt[] array: " << r << ", "
-                    << bytesLeft << endl;
-					throw 1;
-				}
-				pebwt += r;
-				bytesLeft -= r;
+		if(switchEndian) {
+			uint8_t *side = this->ebwt();
+			for(size_t i = 0; i < eh->_numSides; i++) {
+				index_t *cums = reinterpret_cast<index_t*>(side + eh->_sideSz - sizeof(index_t)*2);
+				cums[0] = endianSwapIndex(cums[0]);
+				cums[1] = endianSwapIndex(cums[1]);
+				side += this->_eh._sideSz;
 			}
-			if(switchEndian) {
-				uint8_t *side = this->ebwt();
-				for(size_t i = 0; i < eh->_numSides; i++) {
-					index_t *cums = reinterpret_cast<index_t*>(side + eh->_sideSz - sizeof(index_t)*2);
-					cums[0] = endianSwapIndex(cums[0]);
-					cums[1] = endianSwapIndex(cums[1]);
-					side += this->_eh._sideSz;
-				}
-			}
-#ifdef BOWTIE_SHARED_MEM
-			if(useShmem_) NOTIFY_SHARED(ebwt(), eh->_ebwtTotLen);
-#endif
-		} else {
-			// Seek past the data and wait until master is finished
-			fseek(_in1, eh->_ebwtTotLen, SEEK_CUR);
-#ifdef BOWTIE_SHARED_MEM
-			if(useShmem_) WAIT_SHARED(ebwt(), eh->_ebwtTotLen);
-#endif
 		}
 	}
 	
@@ -427,6 +412,7 @@ void Ebwt<index_t>::readIntoMemory(
 			}
 		}
 		_ftab.reset();
+		_ftab40.reset();
 		if(loadFtab) {
 			if(_useMm) {
 #ifdef BOWTIE_MM
@@ -446,6 +432,9 @@ void Ebwt<index_t>::readIntoMemory(
 						throw 1;
 					}
 				}
+				if(packable(*eh)) {
+					packFtab(*eh);
+				}
 			}
 			// Read etab from primary stream
 			if(_verbose || startVerbose) {
@@ -520,141 +509,130 @@ void Ebwt<index_t>::readIntoMemory(
 	}
 	
 	_offs.reset();
+	_offs40.reset();
 	if(loadSASamp) {
 		bytesRead = 4; // reset for secondary index file (already read 1-sentinel)
 		
-		shmemLeader = true;
+#ifdef HISAT_CLASS
+		const bool pack = false;
+#else
+		// Large indexes are packed to 40 bits as they're read
+		const bool pack = packable(*eh);
+#endif
 		if(_verbose || startVerbose) {
-			cerr << "Reading offs (" << offsLenSampled << " " << std::setw(2) << sizeof(index_t)*8 << "-bit words): ";
+			cerr << "Reading offs (" << offsLenSampled << " " << std::setw(2) << sizeof(index_t)*8 << "-bit words"
+			     << (pack ? ", packing to 40 bits" : "") << "): ";
 			logTime(cerr);
 		}
 		
 		if(!_useMm) {
-			if(!useShmem_) {
-				// Allocate offs_
-				try {
+			// Allocate offs_
+			try {
 #ifdef HISAT_CLASS
-					_offs.init(new uint16_t[offsLenSampled], offsLenSampled, true);
+				_offs.init(new uint16_t[offsLenSampled], offsLenSampled, true);
 #else
-                    _offs.init(new index_t[offsLenSampled], offsLenSampled, true);
-#endif
-				} catch(bad_alloc& e) {
-					cerr << "Out of memory allocating the offs[] array  for the Bowtie index." << endl
-					<< "Please try again on a computer with more memory." << endl;
-					throw 1;
+				if(pack) {
+					_offs40.init(new uint8_t[(size_t)offsLenSampled * 5], (size_t)offsLenSampled * 5, true);
+				} else {
+					_offs.init(new index_t[offsLenSampled], offsLenSampled, true);
 				}
-			} else {
-#ifdef HISAT_CLASS
-				uint16_t *tmp = NULL;
-				shmemLeader = ALLOC_SHARED_U32(
-					(_in2Str + "[offs]"), offsLenSampled*sizeof(uint16_t), &tmp,
-					"offs", (_verbose || startVerbose));
-				_offs.init((uint16_t*)tmp, offsLenSampled, false);
-#else
-                index_t *tmp = NULL;
-				shmemLeader = ALLOC_SHARED_U32(
-                                               (_in2Str + "[offs]"), offsLenSampled*sizeof(index_t), &tmp,
-                                               "offs", (_verbose || startVerbose));
-				_offs.init((index_t*)tmp, offsLenSampled, false);
 #endif
+			} catch(bad_alloc& e) {
+				cerr << "Out of memory allocating the offs[] array  for the Bowtie index." << endl
+				<< "Please try again on a computer with more memory." << endl;
+				throw 1;
 			}
 		}
 		
 		if(_overrideOffRate < 32) {
-			if(shmemLeader) {
-				// Allocate offs (big allocation)
-				if(switchEndian || offRateDiff > 0) {
-					assert(!_useMm);
-					const index_t blockMaxSz = (index_t)(2 * 1024 * 1024); // 2 MB block size
+			// Allocate offs (big allocation)
+			if(switchEndian || offRateDiff > 0 || pack) {
+				assert(!_useMm);
+				const index_t blockMaxSz = (index_t)(2 * 1024 * 1024); // 2 MB block size
 #ifdef HISAT_CLASS
-					const index_t blockMaxSzU = (blockMaxSz / sizeof(uint16_t)); // # U32s per block
+				const index_t blockMaxSzU = (blockMaxSz / sizeof(uint16_t)); // # U32s per block
 #else
-                    const index_t blockMaxSzU = (blockMaxSz / sizeof(index_t)); // # U32s per block
+                const index_t blockMaxSzU = (blockMaxSz / sizeof(index_t)); // # U32s per block
 #endif
-					char *buf;
-					try {
-						buf = new char[blockMaxSz];
-					} catch(std::bad_alloc& e) {
-						cerr << "Error: Out of memory allocating part of _offs array: '" << e.what() << "'" << endl;
-						throw e;
-					}
-					for(index_t i = 0; i < offsLen; i += blockMaxSzU) {
-					  index_t block = min<index_t>((index_t)blockMaxSzU, (index_t)(offsLen - i));
+				char *buf;
+				try {
+					buf = new char[blockMaxSz];
+				} catch(std::bad_alloc& e) {
+					cerr << "Error: Out of memory allocating part of _offs array: '" << e.what() << "'" << endl;
+					throw e;
+				}
+				for(index_t i = 0; i < offsLen; i += blockMaxSzU) {
+				  index_t block = min<index_t>((index_t)blockMaxSzU, (index_t)(offsLen - i));
 #ifdef HISAT_CLASS
-						size_t r = MM_READ(_in2, (void *)buf, block * sizeof(uint16_t));
-                        if(r != (size_t)(block * sizeof(uint16_t))) {
-							cerr << "Error reading block of _offs[] array: " << r << ", " << (block * sizeof(uint16_t)) << endl;
-							throw 1;
-						}
-                        index_t idx = i >> 1;
-						for(index_t j = 0; j < block; j += 2) {
-							assert_lt(idx, offsLenSampled);
-							this->offs()[idx] = ((uint16_t*)buf)[j];
-							if(switchEndian) {
-								this->offs()[idx] = endianSwapIndex((uint16_t)this->offs()[idx]);
-							}
-							idx++;
+					size_t r = MM_READ(_in2, (void *)buf, block * sizeof(uint16_t));
+                    if(r != (size_t)(block * sizeof(uint16_t))) {
+						cerr << "Error reading block of _offs[] array: " << r << ", " << (block * sizeof(uint16_t)) << endl;
+						throw 1;
+					}
+                    index_t idx = i >> 1;
+					for(index_t j = 0; j < block; j += 2) {
+						assert_lt(idx, offsLenSampled);
+						this->offs()[idx] = ((uint16_t*)buf)[j];
+						if(switchEndian) {
+							this->offs()[idx] = endianSwapIndex((uint16_t)this->offs()[idx]);
 						}
+						idx++;
+					}
 #else
-                        size_t r = MM_READ(_in2, (void *)buf, block * sizeof(index_t));
-                        if(r != (size_t)(block * sizeof(index_t))) {
-							cerr << "Error reading block of _offs[] array: " << r << ", " << (block * sizeof(index_t)) << endl;
-							throw 1;
+                    size_t r = MM_READ(_in2, (void *)buf, block * sizeof(index_t));
+                    if(r != (size_t)(block * sizeof(index_t))) {
+						cerr << "Error reading block of _offs[] array: " << r << ", " << (block * sizeof(index_t)) << endl;
+						throw 1;
+					}
+                    index_t idx = i >> offRateDiff;
+					for(index_t j = 0; j < block; j += (1 << offRateDiff)) {
+						assert_lt(idx, offsLenSampled);
+						index_t off = ((index_t*)buf)[j];
+						if(switchEndian) {
+							off = endianSwapIndex(off);
 						}
-                        index_t idx = i >> offRateDiff;
-						for(index_t j = 0; j < block; j += (1 << offRateDiff)) {
-							assert_lt(idx, offsLenSampled);
-							this->offs()[idx] = ((index_t*)buf)[j];
-							if(switchEndian) {
-								this->offs()[idx] = endianSwapIndex(this->offs()[idx]);
-							}
-							idx++;
+						if(pack) {
+							pack40(_offs40.get() + (size_t)idx * 5, (uint64_t)off);
+						} else {
+							this->offs()[idx] = off;
 						}
-#endif
+						idx++;
 					}
-					delete[] buf;
-				} else {
-					if(_useMm) {
+#endif
+				}
+				delete[] buf;
+			} else {
+				if(_useMm) {
 #ifdef BOWTIE_MM
 #  ifdef HISAT_CLASS
 #  else
-						_offs.init((index_t*)(mmFile[1] + bytesRead), offsLen, false);
-						bytesRead += (offsLen * sizeof(index_t));
-						fseek(_in2, (offsLen * sizeof(index_t)), SEEK_CUR);
+					_offs.init((index_t*)(mmFile[1] + bytesRead), offsLen, false);
+					bytesRead += (offsLen * sizeof(index_t));
+					fseek(_in2, (offsLen * sizeof(index_t)), SEEK_CUR);
 #  endif
 #endif
-					} else {
-                        // Workaround for small-index mode where MM_READ may
-                        // not be able to handle read amounts greater than 2^32
-                        // bytes.
+				} else {
+                    // Workaround for small-index mode where MM_READ may
+                    // not be able to handle read amounts greater than 2^32
+                    // bytes.
 #ifdef HISAT_CLASS
-                        uint64_t bytesLeft = (offsLen * sizeof(uint16_t));
+                    uint64_t bytesLeft = (offsLen * sizeof(uint16_t));
 #else
-                        uint64_t bytesLeft = (offsLen * sizeof(index_t));
+                    uint64_t bytesLeft = (offsLen * sizeof(index_t));
 #endif
-                        char *offs = (char *)this->offs();
-                        
-                        while(bytesLeft > 0) {
-                            size_t r = MM_READ(_in2, (void*)offs, bytesLeft);
-                            if(MM_IS_IO_ERR(_in2,r,bytesLeft)) {
-                                cerr << "Error reading block of _offs[] array: "
-                                << r << ", " << bytesLeft << gLastIOErrMsg << endl;
-                                throw 1;
-                            }
-                            offs += r;
-                            bytesLeft -= r;
+                    char *offs = (char *)this->offs();
+                    
+                    while(bytesLeft > 0) {
+                        size_t r = MM_READ(_in2, (void*)offs, bytesLeft);
+                        if(MM_IS_IO_ERR(_in2,r,bytesLeft)) {
+                            cerr << "Error reading block of _offs[] array: "
+                            << r << ", " << bytesLeft << gLastIOErrMsg << endl;
+                            throw 1;
                         }
-					}
+                        offs += r;
+                        bytesLeft -= r;
+                    }
 				}
-#ifdef BOWTIE_SHARED_MEM				
-				if(useShmem_) NOTIFY_SHARED(offs(), offsLenSampled*sizeof(index_t));
-#endif
-			} else {
-				// Not the shmem leader
-				fseek(_in2, offsLenSampled*sizeof(index_t), SEEK_CUR);
-#ifdef BOWTIE_SHARED_MEM				
-				if(useShmem_) WAIT_SHARED(offs(), offsLenSampled*sizeof(index_t));
-#endif
 			}
 		}
 	}
@@ -897,7 +875,7 @@ void Ebwt<index_t>::writeFromMemory(bool justHeader,
 		writeIndex<index_t>(out1, this->zOff(), be);
 		index_t offsLen = eh._offsLen;
 		for(index_t i = 0; i < offsLen; i++)
-			writeIndex<index_t>(out2, this->offs()[i], be);
+			writeIndex<index_t>(out2, this->offsAt(i), be);
 		
 		// 'fchr', 'ftab' and 'eftab' are not fully determined until the
 		// loop is finished, so they are written to the primary file after
@@ -906,7 +884,7 @@ void Ebwt<index_t>::writeFromMemory(bool justHeader,
 		for(int i = 0; i < 5; i++)
 			writeIndex<index_t>(out1, this->fchr()[i], be);
 		for(index_t i = 0; i < eh._ftabLen; i++)
-			writeIndex<index_t>(out1, this->ftab()[i], be);
+			writeIndex<index_t>(out1, this->ftabAt(i), be);
 		for(index_t i = 0; i < eh._eftabLen; i++)
 			writeIndex<index_t>(out1, this->eftab()[i], be);
 	}
@@ -107,9 +107,9 @@ void Ebwt<index_t>::sanityCheckAll(int reverse) const {
 	memset(seen, 0, 4 * seenLen);
 	index_t offsLen = eh._offsLen;
 	for(index_t i = 0; i < offsLen; i++) {
-		assert_lt(this->offs()[i], eh._bwtLen);
-		int w = this->offs()[i] >> 5;
-		int r = this->offs()[i] & 31;
+		assert_lt(this->offsAt(i), eh._bwtLen);
+		int w = this->offsAt(i) >> 5;
+		int r = this->offsAt(i) & 31;
 		assert_eq(0, (seen[w] >> r) & 1); // shouldn't have been seen before
 		seen[w] |= (1 << r);
 	}
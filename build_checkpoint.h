@@ -0,0 +1,243 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUILD_CHECKPOINT_H_
+#define BUILD_CHECKPOINT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <sys/stat.h>
+#include "ds.h"
+#include "mem_ids.h"
+
+/**
+ * Fold n bytes into a 64-bit FNV-1a hash; for fingerprints.
+ */
+static inline void fnvHash(uint64_t& h, const void* p, size_t n) {
+	const uint8_t* b = (const uint8_t*)p;
+	for(size_t i = 0; i < n; i++) {
+		h = (h ^ b[i]) * 0x100000001b3ULL;
+	}
+}
+
+/**
+ * Progress of a hisat-build run, kept in <bt2_base>.ckpt so that a run
+ * that was killed can be continued with --resume.  hisat uses the same
+ * file format for --checkpoint.  The file holds one
+ * "key value" line per entry and is rewritten, via a temporary file and
+ * a rename, every time an entry changes.  The "fingerprint" entry
+ * identifies the input and the options; a checkpoint whose fingerprint
+ * differs from the current run's is ignored.
+ *
+ * A completed phase is recorded with the sizes of the files it wrote, and
+ * only counts as done while the files still have those sizes.  Other
+ * entries (e.g. how far the local indexes got) are free-form.
+ */
+class BuildCheckpoint {
+
+public:
+
+	BuildCheckpoint() : ents_(MISC_CAT), enabled_(false) { }
+
+	/**
+	 * Start tracking progress in file 'fn'.  If 'resume' is set, pick up
+	 * the entries already there, provided they were written for the same
+	 * fingerprint.  Return true iff entries were picked up.
+	 */
+	bool init(const std::string& fn, uint64_t fingerprint, bool resume) {
+		fn_ = fn;
+		ents_.clear();
+		enabled_ = true;
+		std::ostringstream fp;
+		fp << std::hex << fingerprint;
+		bool picked = false;
+		if(resume) {
+			std::ifstream in(fn_.c_str());
+			std::string line;
+			while(std::getline(in, line)) {
+				size_t sp = line.find(' ');
+				if(sp == std::string::npos) continue;
+				ents_.push_back(std::make_pair(line.substr(0, sp), line.substr(sp + 1)));
+			}
+			std::string old;
+			if(get("fingerprint", old) && old == fp.str()) {
+				picked = true;
+			} else if(in.is_open() || !ents_.empty()) {
+				std::cerr << "Warning: \"" << fn_.c_str() << "\" was written for a different input "
+				          << "or different options; starting over" << std::endl;
+			} else {
+				std::cerr << "Warning: no checkpoint \"" << fn_.c_str() << "\"; starting over" << std::endl;
+			}
+			if(!picked) ents_.clear();
+		}
+		if(!picked) {
+			remove(fn_.c_str());
+			ents_.push_back(std::make_pair(std::string("fingerprint"), fp.str()));
+		}
+		return picked;
+	}
+
+	bool enabled() const { return enabled_; }
+
+	const std::string& file() const { return fn_; }
+
+	/**
+	 * Return true iff anything beyond the fingerprint was recorded.
+	 */
+	bool progress() const { return enabled_ && ents_.size() > 1; }
+
+	/**
+	 * Return true iff phase 'key' was completed and the files it wrote
+	 * still have the sizes they had then.
+	 */
+	bool done(const std::string& key, const EList<std::string>& files) const {
+		std::string val;
+		if(!enabled_ || !get(key, val)) return false;
+		std::istringstream is(val);
+		std::string tag;
+		if(!(is >> tag) || tag != "done") return false;
+		for(size_t i = 0; i < files.size(); i++) {
+			int64_t sz;
+			if(!(is >> sz) || sizeOf(files[i]) != sz) return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Record that phase 'key' is complete, having written 'files'.
+	 */
+	void finish(const std::string& key, const EList<std::string>& files) {
+		if(!enabled_) return;
+		std::ostringstream os;
+		os << "done";
+		for(size_t i = 0; i < files.size(); i++) {
+			os << " " << sizeOf(files[i]);
+		}
+		set(key, os.str());
+	}
+
+	bool get(const std::string& key, std::string& val) const {
+		for(size_t i = 0; i < ents_.size(); i++) {
+			if(ents_[i].first == key) {
+				val = ents_[i].second;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Set entry 'key' and save the checkpoint.
+	 */
+	void set(const std::string& key, const std::string& val) {
+		if(!enabled_) return;
+		size_t i = 0;
+		for(; i < ents_.size() && ents_[i].first != key; i++);
+		if(i == ents_.size()) {
+			ents_.push_back(std::make_pair(key, val));
+		} else {
+			ents_[i].second = val;
+		}
+		save();
+	}
+
+	/**
+	 * Set several entries and save the checkpoint once, so that they only
+	 * ever change together.
+	 */
+	void set(const EList<std::pair<std::string, std::string> >& kvs) {
+		if(!enabled_) return;
+		for(size_t j = 0; j < kvs.size(); j++) {
+			size_t i = 0;
+			for(; i < ents_.size() && ents_[i].first != kvs[j].first; i++);
+			if(i == ents_.size()) {
+				ents_.push_back(kvs[j]);
+			} else {
+				ents_[i].second = kvs[j].second;
+			}
+		}
+		save();
+	}
+
+	/**
+	 * Drop entry 'key', if there is one, and save the checkpoint.
+	 */
+	void clear(const std::string& key) {
+		if(!enabled_) return;
+		for(size_t i = 0; i < ents_.size(); i++) {
+			if(ents_[i].first == key) {
+				ents_.erase(i);
+				save();
+				return;
+			}
+		}
+	}
+
+	/**
+	 * Stop tracking and delete the checkpoint; for when the build is
+	 * complete.
+	 */
+	void discard() {
+		if(!enabled_) return;
+		remove(fn_.c_str());
+		ents_.clear();
+		enabled_ = false;
+	}
+
+	/**
+	 * Return the size of file 'fn', or -1 if there is no such file.
+	 */
+	static int64_t sizeOf(const std::string& fn) {
+		struct stat st;
+		if(stat(fn.c_str(), &st) != 0) return -1;
+		return (int64_t)st.st_size;
+	}
+
+protected:
+
+	void save() const {
+		std::string tmp = fn_ + ".tmp";
+		{
+			std::ofstream out(tmp.c_str());
+			for(size_t i = 0; i < ents_.size(); i++) {
+				out << ents_[i].first << ' ' << ents_[i].second << '\n';
+			}
+			out.flush();
+			if(!out.good()) {
+				std::cerr << "Could not write checkpoint \"" << tmp.c_str() << "\"" << std::endl;
+				throw 1;
+			}
+		}
+		if(rename(tmp.c_str(), fn_.c_str()) != 0) {
+			std::cerr << "Could not rename \"" << tmp.c_str() << "\" to \"" << fn_.c_str() << "\"" << std::endl;
+			throw 1;
+		}
+	}
+
+	std::string fn_;
+	EList<std::pair<std::string, std::string> > ents_;
+	bool enabled_;
+};
+
+#endif /*ndef BUILD_CHECKPOINT_H_*/
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <iostream>
+#include "alphabet.h"
+#include "contam_filter.h"
+
+using namespace std;
+
+/**
+ * Read all the sequences first so the filter can be sized to them, then
+ * add their k-mers.
+ */
+void ContamFilter::build(const EList<string>& fns) {
+	EList<string> seqs(MISC_CAT);
+	uint64_t nk = 0;
+	for(size_t i = 0; i < fns.size(); i++) {
+		FILE *fh = fopen(fns[i].c_str(), "rb");
+		if(fh == NULL) {
+			cerr << "Error: could not open --filter-fa file " << fns[i].c_str() << endl;
+			throw 1;
+		}
+		char buf[64 * 1024];
+		bool header = false, bol = true, sawHeader = false;
+		size_t n;
+		while((n = fread(buf, 1, sizeof(buf), fh)) > 0) {
+			for(size_t j = 0; j < n; j++) {
+				char c = buf[j];
+				if(bol && c == '>') {
+					header = sawHeader = true;
+					seqs.expand();
+				}
+				bol = (c == '\n');
+				if(header) {
+					if(bol) header = false;
+					continue;
+				}
+				if(c == '\n' || c == '\r' || isspace(c)) continue;
+				if(!sawHeader) {
+					cerr << "Error: --filter-fa file " << fns[i].c_str()
+					     << " is not in FASTA format" << endl;
+					fclose(fh);
+					throw 1;
+				}
+				seqs.back().push_back(c);
+			}
+		}
+		fclose(fh);
+	}
+	for(size_t i = 0; i < seqs.size(); i++) {
+		if(seqs[i].length() >= (size_t)k_) {
+			nk += seqs[i].length() - k_ + 1;
+		}
+	}
+	// Round up to a power of 2 blocks
+	uint64_t nbits = max<uint64_t>(nk * CONTAM_BITS_PER_KMER, 1 << 16);
+	nblocks_ = 1;
+	while((uint64_t)nblocks_ * CONTAM_BLOCK_WDS * 64 < nbits) {
+		nblocks_ <<= 1;
+	}
+	bits_.resizeExact(nblocks_ * CONTAM_BLOCK_WDS);
+	bits_.fillZero();
+	for(size_t i = 0; i < seqs.size(); i++) {
+		addSeq(seqs[i]);
+	}
+}
+
+/**
+ * Add the canonical k-mers of an ASCII sequence.  k-mers overlapping
+ * anything other than A, C, G or T are skipped.
+ */
+void ContamFilter::addSeq(const string& seq) {
+	uint64_t fw = 0, rc = 0;
+	int len = 0;
+	const int rcshift = 2 * (k_ - 1);
+	for(size_t i = 0; i < seq.length(); i++) {
+		int c = (unsigned char)seq[i];
+		if(asc2dnacat[c] != 1) {
+			len = 0;
+			continue;
+		}
+		uint64_t b = asc2dna[c];
+		fw = ((fw << 2) | b) & mask_;
+		rc = (rc >> 2) | ((3 - b) << rcshift);
+		if(++len >= k_) {
+			add(fw < rc ? fw : rc);
+		}
+	}
+}
+
+void ContamFilter::countHits(const Read& r, size_t& nk, size_t& nhit) const {
+	uint64_t fw = 0, rc = 0;
+	int len = 0;
+	const int rcshift = 2 * (k_ - 1);
+	const size_t rdlen = r.patFw.length();
+	for(size_t i = 0; i < rdlen; i++) {
+		int b = r.patFw[i];
+		if(b > 3) {
+			len = 0;
+			continue;
+		}
+		fw = ((fw << 2) | (uint64_t)b) & mask_;
+		rc = (rc >> 2) | ((uint64_t)(3 - b) << rcshift);
+		if(++len >= k_) {
+			nk++;
+			if(contains(fw < rc ? fw : rc)) {
+				nhit++;
+			}
+		}
+	}
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTAM_FILTER_H_
+#define CONTAM_FILTER_H_
+
+#include <stdint.h>
+#include <string>
+#include "assert_helpers.h"
+#include "ds.h"
+#include "mem_ids.h"
+#include "read.h"
+
+/**
+ * A Bloom filter over the canonical k-mers (k <= 32) of a set of
+ * contaminant sequences, e.g. rRNA, adapters and PhiX, given with
+ * --filter-fa.  A read or pair "matches" when at least a given fraction of
+ * its k-mers are in the filter; matching reads are set aside before any
+ * index work is done for them.
+ *
+ * The filter is blocked: each k-mer hashes to one 512-bit block, the size
+ * of a cache line, and sets CONTAM_NHASH bits within it, so a lookup
+ * touches memory in only one place.  The filter gets about 16 bits per
+ * contaminant k-mer, which keeps the per-k-mer false-positive rate well
+ * under 1%.
+ */
+class ContamFilter {
+
+	static const int    CONTAM_NHASH     = 5;
+	static const size_t CONTAM_BLOCK_WDS = 8;  // 64-bit words per block
+	static const size_t CONTAM_BITS_PER_KMER = 16;
+
+public:
+
+	ContamFilter(int k, float frac) :
+		k_(k),
+		frac_(frac),
+		mask_(k >= 32 ? ~(uint64_t)0 : (((uint64_t)1 << (2 * k)) - 1)),
+		nblocks_(0),
+		nkmers_(0),
+		bits_(MISC_CAT)
+	{
+		assert_range(1, 32, k);
+	}
+
+	/**
+	 * Read the given FASTA files and add all of their k-mers to the
+	 * filter.  Throws on error.
+	 */
+	void build(const EList<std::string>& fns);
+
+	/**
+	 * Return true iff at least the requested fraction of the k-mers of the
+	 * read (or of the pair, if rb != NULL) are in the filter.
+	 */
+	bool matches(const Read& ra, const Read* rb) const {
+		size_t nk = 0, nhit = 0;
+		countHits(ra, nk, nhit);
+		if(rb != NULL) {
+			countHits(*rb, nk, nhit);
+		}
+		return nk > 0 && (float)nhit >= frac_ * (float)nk;
+	}
+
+	/**
+	 * Return the number of contaminant k-mers added to the filter,
+	 * counting repeats.
+	 */
+	uint64_t numKmers() const { return nkmers_; }
+
+	/**
+	 * Return the size of the filter in bytes.
+	 */
+	size_t bytes() const { return bits_.size() * sizeof(uint64_t); }
+
+protected:
+
+	/**
+	 * Mix the bits of a k-mer; the finalizer from MurmurHash3.
+	 */
+	static inline uint64_t mix(uint64_t x) {
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return x;
+	}
+
+	void add(uint64_t kmer) {
+		uint64_t h = mix(kmer);
+		uint64_t *blk = bits_.ptr() + (size_t)((h >> 32) & (nblocks_ - 1)) * CONTAM_BLOCK_WDS;
+		uint64_t g = h * 0x9e3779b97f4a7c15ULL; // bit positions come from here
+		for(int i = 0; i < CONTAM_NHASH; i++) {
+			uint32_t b = (uint32_t)(g >> (55 - i * 9)) & 511;
+			blk[b >> 6] |= ((uint64_t)1 << (b & 63));
+		}
+		nkmers_++;
+	}
+
+	bool contains(uint64_t kmer) const {
+		uint64_t h = mix(kmer);
+		const uint64_t *blk = bits_.ptr() + (size_t)((h >> 32) & (nblocks_ - 1)) * CONTAM_BLOCK_WDS;
+		uint64_t g = h * 0x9e3779b97f4a7c15ULL; // bit positions come from here
+		for(int i = 0; i < CONTAM_NHASH; i++) {
+			uint32_t b = (uint32_t)(g >> (55 - i * 9)) & 511;
+			if((blk[b >> 6] & ((uint64_t)1 << (b & 63))) == 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Add the number of k-mers in r, and the number of those that are in
+	 * the filter, to nk and nhit.  k-mers overlapping an N are skipped.
+	 */
+	void countHits(const Read& r, size_t& nk, size_t& nhit) const;
+
+	/**
+	 * Add the k-mers of one contaminant sequence (ASCII) to the filter.
+	 */
+	void addSeq(const std::string& seq);
+
+	int             k_;
+	float           frac_;    // fraction of a read's k-mers that must hit
+	uint64_t        mask_;    // low 2k bits
+	size_t          nblocks_; // a power of 2
+	uint64_t        nkmers_;
+	EList<uint64_t> bits_;
+};
+
+#endif /*ndef CONTAM_FILTER_H_*/
@@ -129,6 +129,54 @@ bool DynProgFramer::frameSeedExtensionRect(
 	return !rect.entirelyTrimmed();
 }
 
+/**
+ * Set up the rectangle for extending a partial alignment (e.g. a GenomeHit)
+ * through small gaps.  The partial alignment's diagonal starts at the column
+ * next to it, 'off', and the rectangle leaves room for maxgap more read gaps
+ * beyond the extlen columns an ungapped extension would use:
+ *
+ *   rightward:  [off, off + extlen - 1 + maxgap]
+ *   leftward:   [off - (extlen - 1) - maxgap, off]
+ *
+ * Unlike seed extension, columns hanging off the reference are always
+ * trimmed, since there is no reference sequence to fill them with.  The core
+ * diagonals are the partial alignment's diagonal and the maxgap diagonals
+ * reached from it by read gaps.
+ */
+bool DynProgFramer::frameHitExtensionRect(
+	int64_t  off,      // ref offset of first column past partial alignment
+	bool     leftward, // true iff extending toward lower ref offsets
+	size_t   extlen,   // # read characters to extend over
+	int64_t  reflen,   // length of reference sequence aligned to
+	size_t   maxgap,   // max # of read or ref gaps permitted
+	DPRect&  rect)     // out: DP rectangle
+	const
+{
+	assert_gt(extlen, 0);
+	assert_gt(reflen, 0);
+	int64_t span = (int64_t)(extlen + maxgap);
+	int64_t refl = leftward ? off - span + 1 : off; // inclusive
+	int64_t refr = leftward ? off : off + span - 1; // inclusive
+	size_t triml = 0, trimr = 0;
+	if(refr >= reflen) {
+		trimr = (size_t)min<int64_t>(refr - reflen + 1, span);
+	}
+	if(refl < 0) {
+		triml = (size_t)min<int64_t>(-refl, span - (int64_t)trimr);
+	}
+	rect.refl_pretrim = refl;
+	rect.refr_pretrim = refr;
+	rect.refl  = refl + triml;
+	rect.refr  = refr - trimr;
+	rect.triml = triml;
+	rect.trimr = trimr;
+	rect.maxgap = maxgap;
+	rect.corel = leftward ? (size_t)(span - 1) - maxgap : 0;
+	rect.corer = rect.corel + maxgap; // inclusive
+	assert(rect.repOk());
+	return !rect.entirelyTrimmed();
+}
+
 /**
  * Set up variables that describe the shape of a dynamic programming matrix to
  * be filled in.  The matrix is built around the diagonals that terminate in
@@ -141,6 +141,21 @@ public:
 		size_t maxhalf,   // max width in either direction
 		DPRect& rect);    // out: DP rectangle
 
+	/**
+	 * Given a partial alignment and the reference offset of the column just
+	 * past its end (in the direction of extension), frame the rectangle for
+	 * extending it over the remaining extlen read characters with up to
+	 * maxgap gaps.
+	 */
+	bool frameHitExtensionRect(
+		int64_t off,      // ref offset of first column past partial alignment
+		bool    leftward, // true iff extending toward lower ref offsets
+		size_t  extlen,   // # read characters to extend over
+		int64_t reflen,   // length of reference sequence aligned to
+		size_t  maxgap,   // max # of read or ref gaps permitted
+		DPRect& rect)     // out: DP rectangle
+		const;
+
 	/**
 	 * Given information about an anchor mate hit, and information deduced by
 	 * PairedEndPolicy about where the opposite mate can begin and start given
@@ -28,6 +28,8 @@ void MemoryTally::add(int cat, uint64_t amt) {
 	ThreadSafe ts(&mutex_m);
 	tots_[cat] += amt;
 	tot_ += amt;
+	nallocs_[cat]++;
+	nalloc_++;
 	if(tots_[cat] > peaks_[cat]) {
 		peaks_[cat] = tots_[cat];
 	}
@@ -45,6 +47,8 @@ void MemoryTally::del(int cat, uint64_t amt) {
 	assert_geq(tot_, amt);
 	tots_[cat] -= amt;
 	tot_ -= amt;
+	nfrees_[cat]++;
+	nfree_++;
 }
 	
 #ifdef MAIN_DS
@@ -38,9 +38,11 @@ class MemoryTally {
 
 public:
 
-	MemoryTally() : tot_(0), peak_(0) {
+	MemoryTally() : tot_(0), peak_(0), nalloc_(0), nfree_(0) {
 		memset(tots_,  0, 256 * sizeof(uint64_t));
 		memset(peaks_, 0, 256 * sizeof(uint64_t));
+		memset(nallocs_, 0, 256 * sizeof(uint64_t));
+		memset(nfrees_,  0, 256 * sizeof(uint64_t));
 	}
 
 	/**
@@ -75,6 +77,29 @@ public:
 	 */
 	uint64_t peak(int cat) { return peaks_[cat]; }
 
+	/**
+	 * Return the number of allocations tallied so far.  Sampled before
+	 * and after a stretch of work, this shows how often the containers
+	 * involved had to grow.
+	 */
+	uint64_t allocs() { return nalloc_; }
+
+	/**
+	 * Return the number of allocations tallied so far in a particular
+	 * category.
+	 */
+	uint64_t allocs(int cat) { return nallocs_[cat]; }
+
+	/**
+	 * Return the number of frees tallied so far.
+	 */
+	uint64_t frees() { return nfree_; }
+
+	/**
+	 * Return the number of frees tallied so far in a particular category.
+	 */
+	uint64_t frees(int cat) { return nfrees_[cat]; }
+
 #ifndef NDEBUG
 	/**
 	 * Check that memory tallies are internally consistent;
@@ -97,6 +122,10 @@ protected:
 	uint64_t tot_;
 	uint64_t peaks_[256];
 	uint64_t peak_;
+	uint64_t nallocs_[256];
+	uint64_t nalloc_;
+	uint64_t nfrees_[256];
+	uint64_t nfree_;
 };
 
 extern MemoryTally gMemTally;
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
 #include <stdexcept>
 #include "assert_helpers.h"
 
@@ -495,6 +496,33 @@ public:
 		}
 	}
 
+	/**
+	 * Write 'nbases' bitpairs packed four to a byte, lowest bits first.
+	 */
+	void write(const uint8_t *bytes, size_t nbases) {
+		if(bpPtr_ != 0) {
+			for(size_t i = 0; i < nbases; i++) {
+				write((bytes[i >> 2] >> ((i & 3) << 1)) & 3);
+			}
+			return;
+		}
+		size_t nbytes = nbases >> 2;
+		if(nbytes > 0) {
+			// Flush the whole octets we have, then the new ones
+			if((cur_ > 0 && !fwrite((const void *)buf_, cur_, 1, out_)) ||
+			   !fwrite((const void *)bytes, nbytes, 1, out_))
+			{
+				std::cerr << "Error writing to the reference index file (.4.ebwt)" << std::endl;
+				throw 1;
+			}
+			cur_ = 0;
+			buf_[cur_] = 0;
+		}
+		for(size_t i = nbytes << 2; i < nbases; i++) {
+			write((bytes[i >> 2] >> ((i & 3) << 1)) & 3);
+		}
+	}
+
 	/**
 	 * Write any remaining bitpairs and then close the input
 	 */
@@ -541,13 +569,14 @@ public:
 	}
 
 	/**
-	 * Open a new output stream to a file with given name.
+	 * Open a new output stream to a file with given name.  With 'append',
+	 * add to the end of the file rather than replacing it.
 	 */
-	OutFileBuf(const char *out, bool binary = false) :
+	OutFileBuf(const char *out, bool binary = false, bool append = false) :
 		name_(out), cur_(0), closed_(false)
 	{
 		assert(out != NULL);
-		out_ = fopen(out, binary ? "wb" : "w");
+		out_ = fopen(out, append ? (binary ? "ab" : "a") : (binary ? "wb" : "w"));
 		if(out_ == NULL) {
 			std::cerr << "Error: Could not open alignment output file " << out << std::endl;
 			throw 1;
@@ -690,6 +719,21 @@ public:
 		cur_ = 0;
 	}
 
+	/**
+	 * Push everything written so far through to the file, and return the
+	 * file's size; for --checkpoint.  Throws on error.
+	 */
+	int64_t sync() {
+		assert(!closed_);
+		if(cur_ > 0) flush();
+		off_t off;
+		if(fflush(out_) != 0 || fsync(fileno(out_)) != 0 || (off = ftello(out_)) < 0) {
+			std::cerr << "Error while flushing output" << std::endl;
+			throw 1;
+		}
+		return (int64_t)off;
+	}
+
 	/**
 	 * Return true iff this stream is closed.
 	 */
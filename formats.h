@@ -36,7 +36,8 @@ enum file_format {
 	CMDLINE,
 	QSEQ,
     SRA_FASTA,
-    SRA_FASTQ
+    SRA_FASTQ,
+	HRB
 };
 
 static const std::string file_format_names[] = {
@@ -45,13 +46,13 @@ static const std::string file_format_names[] = {
 	"FASTA sampling",
 	"FASTQ",
 	"Tabbed mated",
+	"Tabbed mated",
 	"Raw",
 	"Command line",
-	"Chain file",
-	"Random",
 	"Qseq",
     "SRA_FASTA",
-    "SRA_FASTQ"
+    "SRA_FASTQ",
+	"HISAT binary reads"
 };
 
 #endif /*FORMATS_H_*/
@@ -38,9 +38,12 @@
 #include "scoring.h"
 #include "mem_ids.h"
 #include "simple_func.h"
+#include "dp_framer.h"
+#include "banded.h"
 #include "aligner_driver.h"
 #include "aligner_sw_driver.h"
 #include "group_walk.h"
+#include "splice_track.h"
 
 // Maximum insertion length
 static const uint32_t maxInsLen = 3;
@@ -122,6 +125,7 @@ struct BWTHit {
 		_fw = true;
 		_bwoff = (index_t)OFF_MASK;
 		_len = 0;
+		_rext = 0;
 		_coords.clear();
         _anchor_examined = false;
         _hit_type = CANDIDATE_HIT;
@@ -140,6 +144,7 @@ struct BWTHit {
 		_fw = fw;
 		_bwoff = bwoff;
 		_len = len;
+		_rext = 0;
         _coords.clear();
         _anchor_examined = false;
         _hit_type = hit_type;
@@ -191,6 +196,7 @@ struct BWTHit {
 	bool            _fw;                // whether read is forward or reverse complemented
 	index_t         _bwoff;             // current base of a read to search from the right end
 	index_t         _len;               // read length
+	index_t         _rext;              // # bases past the right end also matched at [_top, _bot)
 	
     EList<Coord>    _coords;            // genomic offsets corresponding to [_top, _bot)
     
@@ -387,6 +393,7 @@ struct SharedTempVars {
     SStringExpandable<char> raw_refbuf2;
     EList<int64_t> temp_scores;
     EList<int64_t> temp_scores2;
+    RefWindowCache refcache; // recently decoded reference windows
     ASSERT_ONLY(SStringExpandable<uint32_t> destU32);
     
     ASSERT_ONLY(BTDnaString editstr);
@@ -396,6 +403,16 @@ struct SharedTempVars {
     ASSERT_ONLY(EList<index_t> refoffs);
     
     LinkedEList<EList<Edit> > raw_edits;
+    
+    // for gapped extension (GenomeHit::bandedExtend)
+    BandedSseAligner        banded;
+    EList<char>             banded_ops;
+    SStringExpandable<char> banded_rd;
+    SStringExpandable<char> banded_qual;
+    SStringExpandable<char> banded_ref;
+    uint64_t                banded_cells; // DP cells filled so far, for the work budget
+    
+    SharedTempVars() : banded_cells(0) { }
 };
 
 /**
@@ -569,6 +586,34 @@ struct GenomeHit {
                 index_t&                rightext,
                 index_t                 mm = 0);
     
+    /**
+     * Return true iff extending the partial alignment to the left (or right)
+     * end of the read without gaps involves at most 'mm' mismatches and
+     * keeps the score at or above minsc, i.e. there is no point in trying
+     * bandedExtend.
+     */
+    bool ungappedExtendOk(
+                          const Read&             rd,
+                          const BitPairReference& ref,
+                          const Scoring&          sc,
+                          TAlScore                minsc,
+                          bool                    left,
+                          index_t                 mm);
+    
+    /**
+     * Extend the partial alignment all the way to the left (or right) end
+     * of the read using a banded DP that allows short gaps along with up
+     * to 'mm' mismatches.  Returns the number of read characters added,
+     * or 0 if no such gapped extension scores at least minsc.
+     */
+    index_t bandedExtend(
+                         const Read&             rd,
+                         const BitPairReference& ref,
+                         const Scoring&          sc,
+                         TAlScore                minsc,
+                         bool                    left,
+                         index_t                 mm);
+    
     /**
      * For alignment involving indel, move the indels
      * to the left most possible position
@@ -889,6 +934,23 @@ private:
                            index_t          maxIntronLen,
                            const            BitPairReference& ref);
     
+    /**
+     * Pack the donor and acceptor flanks of a breakpoint between refbuf[i]
+     * and refbuf2[i2] for SpliceSiteDB::probscore; both stay 0 if either
+     * flank runs off the reference buffers
+     */
+    static void spliceFlanks(
+                             const char*  refbuf,
+                             const char*  refbuf2,
+                             int          i,
+                             int          i2,
+                             int          len,
+                             int          this_ref_ext,
+                             int          other_ref_ext,
+                             uint32_t     spldir,
+                             int64_t&     donor_seq,
+                             int64_t&     acceptor_seq);
+    
 public:
 	bool            _fw;
 	index_t         _rdoff;
@@ -962,6 +1024,75 @@ bool GenomeHit<index_t>::compatibleWith(
     return true;
 }
 
+/**
+ * Pack the donor and acceptor flanks of a canonical splice site, as
+ * SpliceSiteDB::probscore takes them
+ */
+template <typename index_t>
+void GenomeHit<index_t>::spliceFlanks(
+                                      const char*  refbuf,
+                                      const char*  refbuf2,
+                                      int          i,
+                                      int          i2,
+                                      int          len,
+                                      int          this_ref_ext,
+                                      int          other_ref_ext,
+                                      uint32_t     spldir,
+                                      int64_t&     donor_seq,
+                                      int64_t&     acceptor_seq)
+{
+    donor_seq = acceptor_seq = 0;
+    if(spldir == EDIT_SPL_FW) {
+        if(i + 1 >= (int)donor_exonic_len &&
+           (int)(len + this_ref_ext) > i + (int)donor_intronic_len &&
+           i2 + (int)other_ref_ext >= (int)acceptor_intronic_len &&
+           (int)len > i2 + (int)acceptor_exonic_len - 1) {
+            int from = i + 1 - (int)donor_exonic_len;
+            int to = i + (int)donor_intronic_len;
+            for(int j = from; j <= to; j++) {
+                assert_geq(j, 0);
+                assert_lt(j, (int)(len + this_ref_ext));
+                int base = refbuf[j];
+                if(base > 3) base = 0;
+                donor_seq = donor_seq << 2 | base;
+            }
+            from = i2 - acceptor_intronic_len;
+            to = i2 + acceptor_exonic_len - 1;
+            for(int j = from; j <= to; j++) {
+                assert_geq(j, -(int)other_ref_ext);
+                assert_lt(j, (int)len);
+                int base = refbuf2[j];
+                if(base > 3) base = 0;
+                acceptor_seq = acceptor_seq << 2 | base;
+            }
+        }
+    } else if(spldir == EDIT_SPL_RC) {
+        if(i + 1 >= (int)acceptor_exonic_len &&
+           (int)(len + this_ref_ext) > i + (int)acceptor_intronic_len &&
+           i2 + (int)other_ref_ext >= (int)donor_intronic_len &&
+           (int)len > i2 + (int)donor_exonic_len - 1) {
+            int from = i + 1 - (int)acceptor_exonic_len;
+            int to = i + (int)acceptor_intronic_len;
+            for(int j = to; j >= from; j--) {
+                assert_geq(j, 0);
+                assert_lt(j, (int)(len + this_ref_ext));
+                int base = refbuf[j];
+                if(base > 3) base = 0;
+                acceptor_seq = acceptor_seq << 2 | (base ^ 0x3);
+            }
+            from = i2 - donor_intronic_len;
+            to = i2 + donor_exonic_len - 1;
+            for(int j = to; j >= from; j--) {
+                assert_geq(j, -(int)other_ref_ext);
+                assert_lt(j, (int)len);
+                int base = refbuf2[j];
+                if(base > 3) base = 0;
+                donor_seq = donor_seq << 2 | (base ^ 0x3);
+            }
+        }
+    }
+}
+
 /**
  * Combine itself with another GenomeHit
  * while allowing mismatches, an insertion, a deletion, or an intron
@@ -1096,7 +1227,8 @@ bool GenomeHit<index_t>::combineWith(
                              reinterpret_cast<uint32_t*>(raw_refbuf.wbuf()),
                              (size_t)this->_tidx,
                              (size_t)this_toff,
-                             len + this_ref_ext
+                             len + this_ref_ext,
+                             _sharedVars->refcache
                              ASSERT_ONLY(, destU32));
     assert_lt(off, 16);
     char *refbuf = raw_refbuf.wbuf() + off, *refbuf2 = NULL;
@@ -1118,7 +1250,8 @@ bool GenomeHit<index_t>::combineWith(
                                   reinterpret_cast<uint32_t*>(raw_refbuf2.wbuf()),
                                   (size_t)otherHit._tidx,
                                   (size_t)(other_toff + other_len - len - other_ref_ext),
-                                  len + other_ref_ext
+                                  len + other_ref_ext,
+                                  _sharedVars->refcache
                                   ASSERT_ONLY(, destU32));
         refbuf2 = raw_refbuf2.wbuf() + off2 + other_ref_ext;
         temp_scores.resize(len);
@@ -1170,8 +1303,56 @@ bool GenomeHit<index_t>::combineWith(
                     i_limit = i2_limit;
                 }
             }
+            // a canonical splice site always wins over a non-canonical one, so if the splice signal track
+            //    has motifs on both sides of any breakpoint, only those breakpoints are scored, and their
+            //    scores come from the track
+            bool tracked = false;
+#if !defined(NEW_PROB_MODEL)
+            const SpliceTrack* track = ssdb.track();
+            if(track != NULL) {
+                // reference offsets of refbuf[i + 1] and refbuf2[i2 - 2], less i
+                int64_t donor_base = (int64_t)this_toff + 1;
+                int64_t acceptor_base = (int64_t)(other_toff + other_len - len) - 1;
+                int start = max<int>(i2_limit, (int)max<int64_t>(-acceptor_base, 0));
+                int end = min<int>(i_limit, (int)len - 1);
+                for(int i0 = start; i0 < end; i0 += 64) {
+                    uint64_t m = track->motifs(this->_tidx, donor_base + i0) &
+                                 track->motifs(otherHit._tidx, acceptor_base + i0);
+                    if(end - i0 < 64) m &= ((uint64_t)1 << (end - i0)) - 1;
+                    while(m != 0) {
+                        i = i0 + __builtin_ctzll(m);
+                        i2 = i + 1;
+                        m &= m - 1;
+                        if((index_t)(i + 2) >= len + this_ref_ext || i2 - 2 < -other_ref_ext) continue;
+                        char donor = (refbuf[i + 1] << 4) | refbuf[i + 2];
+                        char acceptor = (refbuf2[i2 - 2] << 4) | refbuf2[i2 - 1];
+                        uint32_t spldir = EDIT_SPL_UNKNOWN;
+                        if(donor == GT && acceptor == AG) {
+                            spldir = EDIT_SPL_FW;
+                        } else if(donor == AGrc && acceptor == GTrc) {
+                            spldir = EDIT_SPL_RC;
+                        }
+                        if(spldir == EDIT_SPL_UNKNOWN) continue;
+                        int64_t tempscore = temp_scores[i] + temp_scores2[i2] - sc.canSpl();
+                        float splscore = SpliceSiteDB::combinescore(track->score(this->_tidx, donor_base + i),
+                                                                    track->score(otherHit._tidx, acceptor_base + i));
+                        if(!tracked || maxscore < tempscore || (maxscore == tempscore && maxsplscore < splscore)) {
+                            maxscore = tempscore;
+                            maxscorei = i;
+                            maxspldir = spldir;
+                            maxsplscore = splscore;
+                            tracked = true;
+                        }
+                    }
+                }
+                if(tracked) {
+                    spliceFlanks(refbuf, refbuf2, maxscorei, maxscorei + 1, len, this_ref_ext, other_ref_ext, maxspldir,
+                                 donor_seq, acceptor_seq);
+                }
+            }
+#endif
             for(i = i2_limit, i2 = i2_limit + 1;
-                i < i_limit && i2 < (int)len;
+                !tracked && i < i_limit && i2 < (int)len;
                 i++, i2++) {
                 int64_t tempscore = temp_scores[i] + temp_scores2[i2];
                 char donor = 0xff, acceptor = 0xff;
@@ -1197,56 +1378,8 @@ bool GenomeHit<index_t>::combineWith(
                 if(spldir != EDIT_SPL_UNKNOWN) {
                     // in case of canonical splice site, extract donor side sequence and acceptor side sequence
                     //    to calculate a score of the splicing event.
-                    if(spldir == EDIT_SPL_FW) {
-                        if(i + 1 >= (int)donor_exonic_len &&
-                           (int)(len + this_ref_ext) > i + (int)donor_intronic_len &&
-                           i2 + (int)other_ref_ext >= (int)acceptor_intronic_len &&
-                           (int)len > i2 + (int)acceptor_exonic_len - 1) {
-                            int from = i + 1 - (int)donor_exonic_len;
-                            int to = i + (int)donor_intronic_len;
-                            for(int j = from; j <= to; j++) {
-                                assert_geq(j, 0);
-                                assert_lt(j, (int)(len + this_ref_ext));
-                                int base = refbuf[j];
-                                if(base > 3) base = 0;
-                                temp_donor_seq = temp_donor_seq << 2 | base;
-                            }
-                            from = i2 - acceptor_intronic_len;
-                            to = i2 + acceptor_exonic_len - 1;
-                            for(int j = from; j <= to; j++) {
-                                assert_geq(j, -(int)other_ref_ext);
-                                assert_lt(j, (int)len);
-                                int base = refbuf2[j];
-                                if(base > 3) base = 0;
-                                temp_acceptor_seq = temp_acceptor_seq << 2 | base;
-                            }
-                        }
-                    } else if(spldir == EDIT_SPL_RC) {
-                        if(i + 1 >= (int)acceptor_exonic_len &&
-                           (int)(len + this_ref_ext) > i + (int)acceptor_intronic_len &&
-                           i2 + (int)other_ref_ext >= (int)donor_intronic_len &&
-                           (int)len > i2 + (int)donor_exonic_len - 1) {
-                            int from = i + 1 - (int)acceptor_exonic_len;
-                            int to = i + (int)acceptor_intronic_len;
-                            for(int j = to; j >= from; j--) {
-                                assert_geq(j, 0);
-                                assert_lt(j, (int)(len + this_ref_ext));
-                                int base = refbuf[j];
-                                if(base > 3) base = 0;
-                                temp_acceptor_seq = temp_acceptor_seq << 2 | (base ^ 0x3);
-                            }
-                            from = i2 - donor_intronic_len;
-                            to = i2 + donor_exonic_len - 1;
-                            for(int j = to; j >= from; j--) {
-                                assert_geq(j, -(int)other_ref_ext);
-                                assert_lt(j, (int)len);
-                                int base = refbuf2[j];
-                                if(base > 3) base = 0;
-                                temp_donor_seq = temp_donor_seq << 2 | (base ^ 0x3);
-                            }
-                        }
-                    }
-                    
+                    spliceFlanks(refbuf, refbuf2, i, i2, len, this_ref_ext, other_ref_ext, spldir,
+                                 temp_donor_seq, temp_acceptor_seq);
                     splscore = SpliceSiteDB::probscore(temp_donor_seq, temp_acceptor_seq);
                 }
                 // daehwan - for debugging purposes
@@ -1637,6 +1770,7 @@ bool GenomeHit<index_t>::extend(
                                 index_t&                rightext,
                                 index_t                 mm)
 {
+    StageTimer _st(prm.stages, STAGE_SW_EXTEND);
     assert_lt(this->_tidx, ref.numRefs());
     index_t max_leftext = leftext, max_rightext = rightext;
     assert(max_leftext > 0 || max_rightext > 0);
@@ -1652,6 +1786,14 @@ bool GenomeHit<index_t>::extend(
     // with 'mm' mismatches allowed
     const BTDnaString& seq = _fw ? rd.patFw : rd.patRc;
     const BTString& qual = _fw ? rd.qual  : rd.qualRev;
+    // when allowed to reach the end of the read but the ungapped scan can't
+    // get there, try to get there through small gaps in one pass
+    if(mm > 0 && _rdoff > 0 && max_leftext >= _rdoff) {
+        if(!ungappedExtendOk(rd, ref, sc, minsc, true, mm)) {
+            leftext = bandedExtend(rd, ref, sc, minsc, true, mm);
+        }
+        if(leftext > 0) doLeftAlign = true;
+    }
     if(max_leftext > 0 && _rdoff > 0) {
         assert_gt(_rdoff, 0);
         index_t left_rdoff, left_len, left_toff;
@@ -1684,7 +1826,8 @@ bool GenomeHit<index_t>::extend(
                                      reinterpret_cast<uint32_t*>(raw_refbuf.wbuf()),
                                      (size_t)_tidx,
                                      (size_t)rl,
-                                     _rdoff + read_gaps
+                                     _rdoff + read_gaps,
+                                     _sharedVars->refcache
                                      ASSERT_ONLY(, destU32));
             assert_lt(off, 16);
             char *refbuf = raw_refbuf.wbuf() + off;
@@ -1787,6 +1930,12 @@ bool GenomeHit<index_t>::extend(
     
     // extend the alignment further in the right direction
     // with 'mm' mismatches allowed
+    if(mm > 0 && _rdoff + _len < rdlen && max_rightext >= rdlen - (_rdoff + _len)) {
+        if(!ungappedExtendOk(rd, ref, sc, minsc, false, mm)) {
+            rightext = bandedExtend(rd, ref, sc, minsc, false, mm);
+        }
+        if(rightext > 0) doLeftAlign = true;
+    }
     if(max_rightext > 0 && _rdoff + _len < rdlen) {
         index_t right_rdoff, right_len, right_toff;
         this->getRight(right_rdoff, right_len, right_toff);
@@ -1814,7 +1963,8 @@ bool GenomeHit<index_t>::extend(
                                      reinterpret_cast<uint32_t*>(raw_refbuf.wbuf()),
                                      (size_t)_tidx,
                                      (size_t)rl,
-                                     rr
+                                     rr,
+                                     _sharedVars->refcache
                                      ASSERT_ONLY(, destU32));
             assert_lt(off, 16);
             char *refbuf = raw_refbuf.wbuf() + off;
@@ -1914,6 +2064,199 @@ bool GenomeHit<index_t>::extend(
     return leftext > 0 || rightext > 0;
 }
 
+/**
+ * Score the ungapped extension to one end of the read, stopping as soon as
+ * it has more than 'mm' mismatches.
+ */
+template <typename index_t>
+bool GenomeHit<index_t>::ungappedExtendOk(
+                                          const Read&             rd,
+                                          const BitPairReference& ref,
+                                          const Scoring&          sc,
+                                          TAlScore                minsc,
+                                          bool                    left,
+                                          index_t                 mm)
+{
+    assert(_sharedVars != NULL);
+    index_t rdlen = (index_t)rd.length();
+    index_t extlen = left ? _rdoff : rdlen - (_rdoff + _len);
+    if(extlen == 0) return true;
+    int64_t refoff;
+    if(left) {
+        if(_toff < extlen) return false;
+        refoff = (int64_t)_toff - extlen;
+    } else {
+        index_t right_rdoff, right_len, right_toff;
+        this->getRight(right_rdoff, right_len, right_toff);
+        refoff = (int64_t)right_toff + right_len;
+        if(refoff + extlen > (int64_t)ref.approxLen(_tidx)) return false;
+    }
+    SStringExpandable<char>& raw_refbuf = _sharedVars->raw_refbuf;
+    ASSERT_ONLY(SStringExpandable<uint32_t>& destU32 = _sharedVars->destU32);
+    raw_refbuf.resize(extlen + 16);
+    int off = ref.getStretch(
+                             reinterpret_cast<uint32_t*>(raw_refbuf.wbuf()),
+                             (size_t)_tidx,
+                             (size_t)refoff,
+                             extlen,
+                             _sharedVars->refcache
+                             ASSERT_ONLY(, destU32));
+    assert_lt(off, 16);
+    const char *refbuf = raw_refbuf.wbuf() + off;
+    const BTDnaString& seq = _fw ? rd.patFw : rd.patRc;
+    const BTString& qual = _fw ? rd.qual  : rd.qualRev;
+    index_t rdbase = left ? 0 : _rdoff + _len;
+    index_t num_mm = 0;
+    TAlScore score = _score;
+    for(index_t i = 0; i < extlen; i++) {
+        int rdc = seq[rdbase + i];
+        int rfc = refbuf[i];
+        if(rdc != rfc) {
+            if(++num_mm > mm) return false;
+            score += sc.score(rdc, 1 << rfc, qual[rdbase + i] - 33);
+        }
+    }
+    return score >= minsc;
+}
+
+/**
+ * Extend the partial alignment to one end of the read with BandedSseAligner.
+ * The band is framed around the partial alignment's diagonal by
+ * DynProgFramer and is at most maxInsLen/maxDelLen wide on either side.
+ * The result is only taken if it involves at least one gap; ungapped
+ * extensions are left to the simpler scan in extend().
+ */
+template <typename index_t>
+index_t GenomeHit<index_t>::bandedExtend(
+                                         const Read&             rd,
+                                         const BitPairReference& ref,
+                                         const Scoring&          sc,
+                                         TAlScore                minsc,
+                                         bool                    left,
+                                         index_t                 mm)
+{
+    assert(_sharedVars != NULL);
+    index_t rdlen = (index_t)rd.length();
+    index_t extlen = left ? _rdoff : rdlen - (_rdoff + _len);
+    if(extlen == 0) return 0;
+    if(left ? _trim5 > 0 : _trim3 > 0) return 0;
+    int maxgap = max<int>(sc.maxReadGaps(minsc - _score, rdlen),
+                          sc.maxRefGaps(minsc - _score, rdlen));
+    maxgap = min<int>(maxgap, (int)min<uint32_t>(maxInsLen, maxDelLen));
+    maxgap = min<int>(maxgap, (int)BandedSseAligner::MAX_GAP);
+    if(maxgap <= 0) return 0;
+    
+    // the column right next to the partial alignment
+    int64_t off;
+    if(left) {
+        off = (int64_t)_toff - 1;
+    } else {
+        index_t right_rdoff, right_len, right_toff;
+        this->getRight(right_rdoff, right_len, right_toff);
+        off = (int64_t)right_toff + right_len;
+    }
+    int64_t reflen = ref.approxLen(_tidx);
+    DynProgFramer dpframe(true);
+    DPRect rect;
+    if(!dpframe.frameHitExtensionRect(off, left, extlen, reflen, maxgap, rect)) return 0;
+    
+    SStringExpandable<char>& raw_refbuf = _sharedVars->raw_refbuf;
+    ASSERT_ONLY(SStringExpandable<uint32_t>& destU32 = _sharedVars->destU32);
+    size_t rflen = (size_t)(rect.refr - rect.refl + 1);
+    raw_refbuf.resize(rflen + 16);
+    int roff = ref.getStretch(
+                              reinterpret_cast<uint32_t*>(raw_refbuf.wbuf()),
+                              (size_t)_tidx,
+                              (size_t)rect.refl,
+                              rflen,
+                              _sharedVars->refcache
+                              ASSERT_ONLY(, destU32));
+    assert_lt(roff, 16);
+    const char *refbuf = raw_refbuf.wbuf() + roff;
+    
+    // lay out query and reference in the direction of extension
+    const BTDnaString& seq = _fw ? rd.patFw : rd.patRc;
+    const BTString& qual = _fw ? rd.qual  : rd.qualRev;
+    SStringExpandable<char>& ext_rd = _sharedVars->banded_rd;
+    SStringExpandable<char>& ext_qual = _sharedVars->banded_qual;
+    SStringExpandable<char>& ext_ref = _sharedVars->banded_ref;
+    ext_rd.resize(extlen);
+    ext_qual.resize(extlen);
+    ext_ref.resize(rflen);
+    for(index_t i = 0; i < extlen; i++) {
+        index_t rdc_off = left ? _rdoff - 1 - i : _rdoff + _len + i;
+        ext_rd.set((char)seq[rdc_off], i);
+        ext_qual.set((char)qual[rdc_off], i);
+    }
+    for(size_t i = 0; i < rflen; i++) {
+        ext_ref.set(refbuf[left ? rflen - 1 - i : i], i);
+    }
+    
+    BandedSseAligner& banded = _sharedVars->banded;
+    EList<char>& ops = _sharedVars->banded_ops;
+    banded.init(ext_rd.buf(), ext_qual.buf(), extlen, ext_ref.buf(), rflen, maxgap, sc);
+    _sharedVars->banded_cells += (uint64_t)extlen * BandedSseAligner::NLANES;
+    int ext_score = 0;
+    if(!banded.nextAlignment(ext_score, ops)) return 0;
+    index_t num_mm = 0, num_gap = 0, num_refc = 0;
+    for(index_t i = 0; i < ops.size(); i++) {
+        if(ops[i] == BandedSseAligner::BANDED_MM) num_mm++;
+        else if(ops[i] != BandedSseAligner::BANDED_MATCH) num_gap++;
+        if(ops[i] != BandedSseAligner::BANDED_INS) num_refc++;
+    }
+    if(num_gap == 0 || num_mm > mm) return 0;
+    // partial alignments can't start or end with a gap
+    if(ops.back() != BandedSseAligner::BANDED_MATCH &&
+       ops.back() != BandedSseAligner::BANDED_MM) return 0;
+    if(_score + ext_score < minsc) return 0;
+    
+    // convert to edits, walking the read from left to right
+    if(left) {
+        ops.reverse();
+        for(index_t i = 0; i < _edits->size(); i++) {
+            (*_edits)[i].pos += extlen;
+        }
+    }
+    index_t ri = 0, fi = 0; // read chars and ref chars used so far
+    index_t pos_base = left ? 0 : _len, added_edit = 0;
+    for(index_t i = 0; i < ops.size(); i++) {
+        // characters in extension order
+        int rdc = (ri < extlen) ? ext_rd[left ? extlen - 1 - ri : ri] : 4;
+        int rfc = (fi < num_refc) ? ext_ref[left ? num_refc - 1 - fi : fi] : 4;
+        Edit e;
+        switch(ops[i]) {
+            case BandedSseAligner::BANDED_MATCH:
+                ri++; fi++;
+                continue;
+            case BandedSseAligner::BANDED_MM:
+                e = Edit(pos_base + ri, rfc, rdc, EDIT_TYPE_MM, false);
+                ri++; fi++;
+                break;
+            case BandedSseAligner::BANDED_INS:
+                e = Edit(pos_base + ri, '-', "ACGTN"[rdc], EDIT_TYPE_REF_GAP);
+                ri++;
+                break;
+            default:
+                assert_eq(BandedSseAligner::BANDED_DEL, ops[i]);
+                e = Edit(pos_base + ri, "ACGTN"[rfc], '-', EDIT_TYPE_READ_GAP);
+                fi++;
+                break;
+        }
+        if(left) _edits->insert(e, added_edit++);
+        else     _edits->push_back(e);
+    }
+    assert_eq(ri, extlen);
+    assert_eq(fi, num_refc);
+    if(left) {
+        assert_geq(_toff, num_refc);
+        _toff -= num_refc;
+        _rdoff -= extlen;
+    }
+    _len += extlen;
+    _score += ext_score;
+    return extlen;
+}
+
 /**
  * For alignment involving indel, move the indels
  * to the left most possible position
@@ -2245,6 +2588,9 @@ struct HIMetrics {
         localsearchrecur = 0;
         globalgenomecoords = 0;
         localgenomecoords = 0;
+        budgetlf = 0;
+        budgetcells = 0;
+        budgettime = 0;
 	}
 	
 	void init(
@@ -2279,6 +2625,9 @@ struct HIMetrics {
         localsearchrecur += r.localsearchrecur;
         globalgenomecoords += r.globalgenomecoords;
         localgenomecoords += r.localgenomecoords;
+        budgetlf += r.budgetlf;
+        budgetcells += r.budgetcells;
+        budgettime += r.budgettime;
     }
 	   
     uint64_t localatts;      // # attempts of local search
@@ -2288,6 +2637,9 @@ struct HIMetrics {
     uint64_t localsearchrecur;
     uint64_t globalgenomecoords;
     uint64_t localgenomecoords;
+    uint64_t budgetlf;       // # reads cut short by --budget-lf
+    uint64_t budgetcells;    // # reads cut short by --budget-cells
+    uint64_t budgettime;     // # reads cut short by --budget-ms
 	
 	MUTEX_T mutex_m;
 };
@@ -2319,7 +2671,15 @@ public:
     _gwstate(GW_CAT),
     _gwstate_local(GW_CAT),
     _thread_rids_mindist(threads_rids_mindist),
-    _no_spliced_alignment(no_spliced_alignment)
+    _no_spliced_alignment(no_spliced_alignment),
+    _stages(NULL),
+    _bidir(false),
+    _budgetLF(0),
+    _budgetCells(0),
+    _budgetNs(0),
+    _lf0(0),
+    _cells0(0),
+    _ns0(0)
     {
         index_t genomeLen = ebwt.eh().len();
         _minK = 0;
@@ -2330,7 +2690,37 @@ public:
         _minK_local = 8;
     }
     
-    HI_Aligner() {
+    HI_Aligner() :
+    _stages(NULL),
+    _bidir(false),
+    _budgetLF(0),
+    _budgetCells(0),
+    _budgetNs(0),
+    _lf0(0),
+    _cells0(0),
+    _ns0(0)
+    {
+    }
+    
+    /**
+     * Limit the work done on each read or pair to the given number of LF
+     * operations (index search and SA resolution), banded DP cells and
+     * milliseconds.  0 means no limit.  go() checks the limits between
+     * search and extension steps; once one is exceeded it stops, and the
+     * read is reported with whatever was found so far.
+     */
+    void setWorkBudget(uint64_t lf, uint64_t cells, uint64_t ms) {
+        _budgetLF = lf;
+        _budgetCells = cells;
+        _budgetNs = ms * 1000000;
+    }
+    
+    /**
+     * Tell the aligner that the mirror index passed to go() is loaded, so
+     * that partial hits can be extended in both directions.
+     */
+    void setBidirectional(bool bidir) {
+        _bidir = bidir;
     }
     
     /**
@@ -2405,10 +2795,17 @@ public:
         index_t rdi;
         bool fw;
         bool found[2] = {true, this->_paired};
+        _stages = prm.stages;
+        startBudget(wlm);
         // given read and its reverse complement
         //  (and mate and the reverse complement of mate in case of pair alignment),
         // pick up one with best partial alignment
-        while(nextBWT(sc, ebwtFw, ebwtBw, ref, rdi, fw, wlm, prm, him, rnd, sink)) {
+        while(true) {
+            if(overBudget(wlm, prm, him)) break;
+            {
+                StageTimer _st(prm.stages, STAGE_GLOBAL_SEARCH);
+                if(!nextBWT(sc, ebwtFw, ebwtBw, ref, rdi, fw, wlm, prm, him, rnd, sink)) break;
+            }
             // given the partial alignment, try to extend it to full alignments
         	found[rdi] = align(sc, ebwtFw, ebwtBw, ref, swa, ssdb, rdi, fw, wlm, prm, swm, him, rnd, sink);
             if(!found[0] && !found[1]) {
@@ -2425,7 +2822,7 @@ public:
         
         // if no concordant pair is found, try to use alignment of one-end
         // as an anchor to align the other-end
-        if(this->_paired) {
+        if(this->_paired && !overBudget(wlm, prm, him)) {
             if(_concordantPairs.size() == 0 &&
                (sink.bestUnp1() >= _minsc[0] || sink.bestUnp2() >= _minsc[1])) {
                 bool mate_found = false;
@@ -2435,6 +2832,7 @@ public:
                 index_t rs_size[2] = {rs[0]->size(), rs[1]->size()};
                 for(index_t i = 0; i < 2; i++) {
                     for(index_t j = 0; j < rs_size[i]; j++) {
+                        if(overBudget(wlm, prm, him)) break;
                         const AlnRes& res = (*rs[i])[j];
                         bool fw = (res.orient() == 1);
                         mate_found |= alignMate(
@@ -2466,6 +2864,35 @@ public:
         return EXTEND_POLICY_FULFILLED;
     }
     
+    /**
+     * Note where the work counters stand at the start of a read.
+     */
+    void startBudget(const WalkMetrics& wlm) {
+        _lf0 = bwops_ + wlm.bwops;
+        _cells0 = _sharedVars.banded_cells;
+        _ns0 = (_budgetNs > 0) ? stageNanos() : 0;
+    }
+    
+    /**
+     * Return true iff the current read has used up one of its work
+     * budgets, noting which one in prm and counting it in him the first
+     * time.
+     */
+    bool overBudget(const WalkMetrics& wlm, PerReadMetrics& prm, HIMetrics& him) {
+        if(prm.budgetHit != WORK_BUDGET_NONE) return true;
+        if(_budgetLF > 0 && bwops_ + wlm.bwops - _lf0 > _budgetLF) {
+            prm.budgetHit = WORK_BUDGET_LF;
+            him.budgetlf++;
+        } else if(_budgetCells > 0 && _sharedVars.banded_cells - _cells0 > _budgetCells) {
+            prm.budgetHit = WORK_BUDGET_CELLS;
+            him.budgetcells++;
+        } else if(_budgetNs > 0 && stageNanos() - _ns0 > _budgetNs) {
+            prm.budgetHit = WORK_BUDGET_TIME;
+            him.budgettime++;
+        }
+        return prm.budgetHit != WORK_BUDGET_NONE;
+    }
+    
     /**
      * Given a read or its reverse complement (or mate),
      * align the unmapped portion using the global FM index
@@ -2556,7 +2983,8 @@ public:
                           hit,
                           rnd,
                           pseudogeneStop,
-                          anchorStop);
+                          anchorStop,
+                          _bidir ? &ebwtBw : NULL);
 
             assert(hit.repOk());
             if(hit.done()) return true;
@@ -2713,7 +3141,8 @@ public:
                          ReadBWTHit<index_t>&    hit,     // holds all the seed hits (and exact hit)
                          RandomSource&           rnd,
                          bool&                   pseudogeneStop,  // stop if mapped to multiple locations due to processed pseudogenes
-                         bool&                   anchorStop);
+                         bool&                   anchorStop,
+                         const Ebwt<index_t>*    ebwtBw = NULL);  // mirror index, to extend hits to the right
     
     /**
      * Global FM index search
@@ -2876,7 +3305,7 @@ public:
                             fw,
                             partialHit._bot - partialHit._top,
                             hit._len - partialHit._bwoff - partialHit._len,
-                            partialHit._len,
+                            partialHit._len + partialHit._rext,
                             partialHit._coords,
                             wlm,
                             prm,
@@ -2892,8 +3321,8 @@ public:
             }
             for(index_t k = 0; k < coords.size(); k++) {
                 const Coord& coord = coords[k];
-                index_t len = partialHit._len;
-                index_t rdoff = hit._len - partialHit._bwoff - len;
+                index_t rdoff = hit._len - partialHit._bwoff - partialHit._len;
+                index_t len = partialHit._len + partialHit._rext;
                 bool overlapped = false;
                 for(index_t l = 0; l < genomeHit_size; l++) {
                     GenomeHit<index_t>& genomeHit = genomeHits[l];
@@ -3041,6 +3470,20 @@ protected:
     
     uint64_t   _thread_rids_mindist;
     bool _no_spliced_alignment;
+    
+    // stage latency histograms of the current read (prm.stages), if timing
+    StageMetrics* _stages;
+    
+    // whether ebwtBw passed to go() is loaded; see setBidirectional
+    bool _bidir;
+    
+    // per-read work budget (0 = no limit) and the counters at read start
+    uint64_t _budgetLF;
+    uint64_t _budgetCells;
+    uint64_t _budgetNs;
+    uint64_t _lf0;
+    uint64_t _cells0;
+    uint64_t _ns0;
 
     // For AlnRes::matchesRef
 	ASSERT_ONLY(EList<bool> raw_matches_);
@@ -3344,6 +3787,7 @@ bool HI_Aligner<index_t, local_index_t>::getGenomeCoords(
                                                          bool                       rejectStraddle,
                                                          bool&                      straddled)
 {
+    StageTimer _st(prm.stages, STAGE_GENOME_COORDS);
     straddled = false;
     assert_gt(bot, top);
     index_t nelt = bot - top;
@@ -3416,6 +3860,7 @@ bool HI_Aligner<index_t, local_index_t>::getGenomeCoords_local(
                                                                bool                         rejectStraddle,
                                                                bool&                        straddled)
 {
+    StageTimer _st(prm.stages, STAGE_GENOME_COORDS);
     straddled = false;
     assert_gt(bot, top);
     index_t nelt = bot - top;
@@ -3485,6 +3930,7 @@ bool HI_Aligner<index_t, local_index_t>::pairReads(
                                                    RandomSource&           rnd,
                                                    AlnSinkWrap<index_t>&   sink)
 {
+    StageTimer _st(prm.stages, STAGE_PAIR);
     assert(_paired);
     const EList<AlnRes> *rs1 = NULL, *rs2 = NULL;
     sink.getUnp1(rs1); assert(rs1 != NULL);
@@ -3814,7 +4260,8 @@ size_t HI_Aligner<index_t, local_index_t>::partialSearch(
                                                          ReadBWTHit<index_t>&      hit,     // holds all the seed hits (and exact hit)
                                                          RandomSource&             rnd,     // pseudo-random source
                                                          bool&                     pseudogeneStop,
-                                                         bool&                     anchorStop)
+                                                         bool&                     anchorStop,
+                                                         const Ebwt<index_t>*      ebwtBw)  // mirror index
 {
     bool pseudogeneStop_ = pseudogeneStop, anchorStop_ = anchorStop;
     pseudogeneStop = anchorStop = false;
@@ -3835,6 +4282,8 @@ size_t HI_Aligner<index_t, local_index_t>::partialSearch(
     index_t dep = offset;
     index_t top = 0, bot = 0;
     index_t topTemp = 0, botTemp = 0;
+    index_t topb = 0, botb = 0;           // range in the mirror index
+    index_t topbTemp = 0, botbTemp = 0;
     index_t left = len - dep;
     assert_gt(left, 0);
     if(left < ftabLen) {
@@ -3868,6 +4317,10 @@ size_t HI_Aligner<index_t, local_index_t>::partialSearch(
     
     // Use ftab
     ebwt.ftabLoHi(seq, len - dep - ftabLen, false, top, bot);
+    if(ebwtBw != NULL) {
+        ebwtBw->ftabLoHi(seq, len - dep - ftabLen, false, topb, botb);
+        assert_eq(bot - top, botb - topb);
+    }
     dep += ftabLen;
     if(bot <= top) {
         cur = dep;
@@ -3890,7 +4343,15 @@ size_t HI_Aligner<index_t, local_index_t>::partialSearch(
         if(c > 3) {
             topTemp = botTemp = 0;
         } else {
-            if(bloc.valid()) {
+            if(ebwtBw != NULL) {
+                // also keeps the range in the mirror index when down to one row
+                bwops_ += 2;
+                topTemp = top; botTemp = bot;
+                topbTemp = topb; botbTemp = botb;
+                if(!ebwt.mapBiLF(topTemp, botTemp, topbTemp, botbTemp, c)) {
+                    topTemp = botTemp = 0;
+                }
+            } else if(bloc.valid()) {
                 bwops_ += 2;
                 topTemp = ebwt.mapLF(tloc, c);
                 botTemp = ebwt.mapLF(bloc, c);
@@ -3942,6 +4403,8 @@ size_t HI_Aligner<index_t, local_index_t>::partialSearch(
         
         top = topTemp;
         bot = botTemp;
+        topb = topbTemp;
+        botb = botbTemp;
         dep++;
 
         if(anchorStop_) {
@@ -3964,12 +4427,44 @@ size_t HI_Aligner<index_t, local_index_t>::partialSearch(
         index_t hit_type = CANDIDATE_HIT;
         if(anchorStop) hit_type = ANCHOR_HIT;
         else if(pseudogeneStop) hit_type = PSEUDOGENE_HIT;
+        // The search started where the previous hit stopped, so a repetitive
+        // hit may match further to the right at some of its locations.
+        // Extend it over the bases already searched using the mirror index,
+        // narrowing its range, instead of resolving every location and
+        // comparing against the reference.
+        index_t rext = 0;
+        if(ebwtBw != NULL && hit_type == CANDIDATE_HIT) {
+            while(rext < offset && bot - top > 1) {
+                int c = seq[len - offset + rext];
+                if(c > 3) break;
+                bwops_ += 2;
+                if(!ebwtBw->mapBiLF(topb, botb, top, bot, c)) break;
+                rext++;
+            }
+#ifndef NDEBUG
+            // Both ranges should match a search from scratch
+            BTDnaString ext, extrev;
+            for(index_t i = len - dep; i < len - offset + rext; i++) {
+                ext.append(seq[i]);
+            }
+            extrev = ext;
+            extrev.reverse();
+            index_t t2 = 0, b2 = 0;
+            ebwt.contains(ext, &t2, &b2);
+            assert_eq(top, t2);
+            assert_eq(bot, b2);
+            ebwtBw->contains(extrev, &t2, &b2);
+            assert_eq(topb, t2);
+            assert_eq(botb, b2);
+#endif
+        }
         partialHits.back().init(top,
                                 bot,
                                 fw,
                                 (index_t)offset,
                                 (index_t)(dep - offset),
                                 hit_type);
+        partialHits.back()._rext = rext;
         
         nelt += (bot - top);
         cur = dep;
@@ -4119,6 +4614,7 @@ size_t HI_Aligner<index_t, local_index_t>::localEbwtSearch(
                                                            local_index_t                    minUniqueLen,
                                                            local_index_t                    maxHitLen)
 {
+    StageTimer _st(_stages, STAGE_LOCAL_SEARCH);
 #ifndef NDEBUG
     if(searchfw) {
         assert(ebwtBw != NULL);
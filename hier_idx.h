@@ -20,6 +20,7 @@
 #ifndef HIEREBWT_H_
 #define HIEREBWT_H_
 
+#include <unistd.h>
 #include "hier_idx_common.h"
 #include "bt2_idx.h"
 #include "bt2_io.h"
@@ -733,8 +734,6 @@ void LocalEbwt<index_t, full_index_t>::readIntoMemory(
 		}
 	}
 
-	bool shmemLeader;
-	
 	// TODO: I'm not consistent on what "header" means.  Here I'm using
 	// "header" to mean everything that would exist in memory if we
 	// started to build the Ebwt but stopped short of the build*() step
@@ -794,59 +793,35 @@ void LocalEbwt<index_t, full_index_t>::readIntoMemory(
 			cerr << "Reading ebwt (" << this->_eh._ebwtTotLen << "): ";
 			logTime(cerr);
 		}
-		bool shmemLeader = true;
-		if(this->useShmem_) {
-			uint8_t *tmp = NULL;
-			shmemLeader = ALLOC_SHARED_U8(
-										  (this->_in1Str + "[ebwt]"), this->_eh._ebwtTotLen, &tmp,
-										  "ebwt[]", (this->_verbose || startVerbose));
-			assert(tmp != NULL);
-			this->_ebwt.init(tmp, this->_eh._ebwtTotLen, false);
-			if(this->_verbose || startVerbose) {
-				cerr << "  shared-mem " << (shmemLeader ? "leader" : "follower") << endl;
-			}
-		} else {
-			try {
-				this->_ebwt.init(new uint8_t[this->_eh._ebwtTotLen], this->_eh._ebwtTotLen, true);
-			} catch(bad_alloc& e) {
-				cerr << "Out of memory allocating the ebwt[] array for the Bowtie index.  Please try" << endl
-				<< "again on a computer with more memory." << endl;
+		try {
+			this->_ebwt.init(new uint8_t[this->_eh._ebwtTotLen], this->_eh._ebwtTotLen, true);
+		} catch(bad_alloc& e) {
+			cerr << "Out of memory allocating the ebwt[] array for the Bowtie index.  Please try" << endl
+			<< "again on a computer with more memory." << endl;
+			throw 1;
+		}
+		// Read ebwt from primary stream
+		uint64_t bytesLeft = this->_eh._ebwtTotLen;
+		char *pebwt = (char*)this->ebwt();
+		
+		while (bytesLeft>0){
+			size_t r = MM_READ(in5, (void *)pebwt, bytesLeft);
+			if(MM_IS_IO_ERR(in5, r, bytesLeft)) {
+				cerr << "Error reading _ebwt[] array: " << r << ", "
+				<< bytesLeft << endl;
 				throw 1;
 			}
+			pebwt += r;
+			bytesLeft -= r;
 		}
-		if(shmemLeader) {
-			// Read ebwt from primary stream
-			uint64_t bytesLeft = this->_eh._ebwtTotLen;
-			char *pebwt = (char*)this->ebwt();
-            
-			while (bytesLeft>0){
-				size_t r = MM_READ(in5, (void *)pebwt, bytesLeft);
-				if(MM_IS_IO_ERR(in5, r, bytesLeft)) {
-					cerr << "Error reading _ebwt[] array: " << r << ", "
-                    << bytesLeft << endl;
-					throw 1;
-				}
-				pebwt += r;
-				bytesLeft -= r;
-			}
-			if(switchEndian) {
-				uint8_t *side = this->ebwt();
-				for(size_t i = 0; i < this->_eh._numSides; i++) {
-					index_t *cums = reinterpret_cast<index_t*>(side + this->_eh._sideSz - sizeof(index_t)*2);
-					cums[0] = endianSwapIndex(cums[0]);
-					cums[1] = endianSwapIndex(cums[1]);
-					side += this->_eh._sideSz;
-				}
+		if(switchEndian) {
+			uint8_t *side = this->ebwt();
+			for(size_t i = 0; i < this->_eh._numSides; i++) {
+				index_t *cums = reinterpret_cast<index_t*>(side + this->_eh._sideSz - sizeof(index_t)*2);
+				cums[0] = endianSwapIndex(cums[0]);
+				cums[1] = endianSwapIndex(cums[1]);
+				side += this->_eh._sideSz;
 			}
-#ifdef BOWTIE_SHARED_MEM
-			if(useShmem_) NOTIFY_SHARED(this->ebwt(), this->_eh._ebwtTotLen);
-#endif
-		} else {
-			// Seek past the data and wait until master is finished
-			fseek(in5, this->_eh._ebwtTotLen, SEEK_CUR);
-#ifdef BOWTIE_SHARED_MEM
-			if(useShmem_) WAIT_SHARED(this->ebwt(), this->_eh._ebwtTotLen);
-#endif
 		}
 	}
 	
@@ -959,106 +934,86 @@ void LocalEbwt<index_t, full_index_t>::readIntoMemory(
 	
 	this->_offs.reset();
 	if(loadSASamp) {
-		shmemLeader = true;
 		if(this->_verbose || startVerbose) {
 			cerr << "Reading offs (" << offsLenSampled << " " << std::setw(2) << sizeof(index_t)*8 << "-bit words): ";
 			logTime(cerr);
 		}
 		
 		if(!this->_useMm) {
-			if(!this->useShmem_) {
-				// Allocate offs_
-				try {
-					this->_offs.init(new index_t[offsLenSampled], offsLenSampled, true);
-				} catch(bad_alloc& e) {
-					cerr << "Out of memory allocating the offs[] array  for the Bowtie index." << endl
-					<< "Please try again on a computer with more memory." << endl;
-					throw 1;
-				}
-			} else {
-				index_t *tmp = NULL;
-				shmemLeader = ALLOC_SHARED_U32(
-											   (this->_in2Str + "[offs]"), offsLenSampled*2, &tmp,
-											   "offs", (this->_verbose || startVerbose));
-				this->_offs.init((index_t*)tmp, offsLenSampled, false);
+			// Allocate offs_
+			try {
+				this->_offs.init(new index_t[offsLenSampled], offsLenSampled, true);
+			} catch(bad_alloc& e) {
+				cerr << "Out of memory allocating the offs[] array  for the Bowtie index." << endl
+				<< "Please try again on a computer with more memory." << endl;
+				throw 1;
 			}
 		}
 		
 		if(this->_overrideOffRate < 32) {
-			if(shmemLeader) {
-				// Allocate offs (big allocation)
-				if(switchEndian || offRateDiff > 0) {
-					assert(!this->_useMm);
-					const uint32_t blockMaxSz = (2 * 1024 * 1024); // 2 MB block size
-					const uint32_t blockMaxSzUIndex = (blockMaxSz / sizeof(index_t)); // # UIndexs per block
-					char *buf;
-					try {
-						buf = new char[blockMaxSz];
-					} catch(std::bad_alloc& e) {
-						cerr << "Error: Out of memory allocating part of _offs array: '" << e.what() << "'" << endl;
-						throw e;
+			// Allocate offs (big allocation)
+			if(switchEndian || offRateDiff > 0) {
+				assert(!this->_useMm);
+				const uint32_t blockMaxSz = (2 * 1024 * 1024); // 2 MB block size
+				const uint32_t blockMaxSzUIndex = (blockMaxSz / sizeof(index_t)); // # UIndexs per block
+				char *buf;
+				try {
+					buf = new char[blockMaxSz];
+				} catch(std::bad_alloc& e) {
+					cerr << "Error: Out of memory allocating part of _offs array: '" << e.what() << "'" << endl;
+					throw e;
+				}
+				for(index_t i = 0; i < offsLen; i += blockMaxSzUIndex) {
+				  index_t block = min<index_t>((index_t)blockMaxSzUIndex, (index_t)(offsLen - i));
+					size_t r = MM_READ(in6, (void *)buf, block * sizeof(index_t));
+					if(r != (size_t)(block * sizeof(index_t))) {
+						cerr << "Error reading block of _offs[] array: " << r << ", " << (block * sizeof(index_t)) << endl;
+						throw 1;
 					}
-					for(index_t i = 0; i < offsLen; i += blockMaxSzUIndex) {
-					  index_t block = min<index_t>((index_t)blockMaxSzUIndex, (index_t)(offsLen - i));
-						size_t r = MM_READ(in6, (void *)buf, block * sizeof(index_t));
-						if(r != (size_t)(block * sizeof(index_t))) {
-							cerr << "Error reading block of _offs[] array: " << r << ", " << (block * sizeof(index_t)) << endl;
-							throw 1;
-						}
-						index_t idx = i >> offRateDiff;
-						for(index_t j = 0; j < block; j += (1 << offRateDiff)) {
-							assert_lt(idx, offsLenSampled);
-							this->offs()[idx] = ((index_t*)buf)[j];
-							if(switchEndian) {
-								this->offs()[idx] = endianSwapIndex(this->offs()[idx]);
-							}
-							idx++;
+					index_t idx = i >> offRateDiff;
+					for(index_t j = 0; j < block; j += (1 << offRateDiff)) {
+						assert_lt(idx, offsLenSampled);
+						this->offs()[idx] = ((index_t*)buf)[j];
+						if(switchEndian) {
+							this->offs()[idx] = endianSwapIndex(this->offs()[idx]);
 						}
+						idx++;
 					}
-					delete[] buf;
-				} else {
-					if(this->_useMm) {
+				}
+				delete[] buf;
+			} else {
+				if(this->_useMm) {
 #ifdef BOWTIE_MM
-						this->_offs.init((index_t*)(mmFile[1] + bytesRead2), offsLen, false);
-						bytesRead2 += (offsLen * sizeof(index_t));
-						fseek(in6, (offsLen * sizeof(index_t)), SEEK_CUR);
+					this->_offs.init((index_t*)(mmFile[1] + bytesRead2), offsLen, false);
+					bytesRead2 += (offsLen * sizeof(index_t));
+					fseek(in6, (offsLen * sizeof(index_t)), SEEK_CUR);
 #endif
-					} else {
-						// If any of the high two bits are set
-						if((offsLen & 0xc0000000) != 0) {
-							if(sizeof(char *) <= 4) {
-								cerr << "Sanity error: sizeof(char *) <= 4 but offsLen is " << hex << offsLen << endl;
-								throw 1;
-							}
-							// offsLen << 2 overflows, so do it in four reads
-							char *offs = (char *)this->offs();
-							for(size_t i = 0; i < sizeof(index_t); i++) {
-								size_t r = MM_READ(in6, (void*)offs, offsLen);
-								if(r != (size_t)(offsLen)) {
-									cerr << "Error reading block of _offs[] array: " << r << ", " << offsLen << endl;
-									throw 1;
-								}
-								offs += offsLen;
-							}
-						} else {
-							// Do it all in one read
-							size_t r = MM_READ(in6, (void*)this->offs(), offsLen * sizeof(index_t));
-							if(r != (size_t)(offsLen * sizeof(index_t))) {
-								cerr << "Error reading _offs[] array: " << r << ", " << (offsLen * sizeof(index_t)) << endl;
+				} else {
+					// If any of the high two bits are set
+					if((offsLen & 0xc0000000) != 0) {
+						if(sizeof(char *) <= 4) {
+							cerr << "Sanity error: sizeof(char *) <= 4 but offsLen is " << hex << offsLen << endl;
+							throw 1;
+						}
+						// offsLen << 2 overflows, so do it in four reads
+						char *offs = (char *)this->offs();
+						for(size_t i = 0; i < sizeof(index_t); i++) {
+							size_t r = MM_READ(in6, (void*)offs, offsLen);
+							if(r != (size_t)(offsLen)) {
+								cerr << "Error reading block of _offs[] array: " << r << ", " << offsLen << endl;
 								throw 1;
 							}
+							offs += offsLen;
+						}
+					} else {
+						// Do it all in one read
+						size_t r = MM_READ(in6, (void*)this->offs(), offsLen * sizeof(index_t));
+						if(r != (size_t)(offsLen * sizeof(index_t))) {
+							cerr << "Error reading _offs[] array: " << r << ", " << (offsLen * sizeof(index_t)) << endl;
+							throw 1;
 						}
 					}
 				}
-#ifdef BOWTIE_SHARED_MEM				
-				if(this->useShmem_) NOTIFY_SHARED(this->offs(), offsLenSampled*sizeof(index_t));
-#endif
-			} else {
-				// Not the shmem leader
-				fseek(in6, offsLenSampled*sizeof(index_t), SEEK_CUR);
-#ifdef BOWTIE_SHARED_MEM				
-				if(this->useShmem_) WAIT_SHARED(this->offs(), offsLenSampled*sizeof(index_t));
-#endif
 			}
 		}
 	}
@@ -1114,7 +1069,11 @@ public:
 						   sanityCheck,
 						   skipLoading),
 	         _in5(NULL),
-	         _in6(NULL)
+	         _in6(NULL),
+	         mmFile5_(NULL),
+	         mmFile6_(NULL),
+	         shmFile5_(NULL),
+	         shmFile6_(NULL)
 	{
 		_in5Str = in + ".5." + gEbwt_ext;
 		_in6Str = in + ".6." + gEbwt_ext;
@@ -1174,10 +1133,14 @@ public:
 			 int32_t overrideOffRate = -1,
 			 bool verbose = false,
 			 bool passMemExc = false,
-			 bool sanityCheck = false);
+			 bool sanityCheck = false,
+			 const string& prevFile = string(), // reuse local indexes of this index
+			 BuildCheckpoint* ckpt = NULL);     // record progress here (--resume)
 	        	
 	~HierEbwt() {
 		clearLocalEbwts();
+		DETACH_SHARED(shmFile5_);
+		DETACH_SHARED(shmFile6_);
 	}
     
     /**
@@ -1298,6 +1261,8 @@ public:
 	
 	char                                     *mmFile5_;
 	char                                     *mmFile6_;
+	char                                     *shmFile5_; // shared copies of the files, to detach
+	char                                     *shmFile6_;
 };
     
 /// Construct an Ebwt from the given header parameters and string
@@ -1331,7 +1296,9 @@ HierEbwt<index_t, local_index_t>::HierEbwt(
                                            int32_t overrideOffRate,
                                            bool verbose,
                                            bool passMemExc,
-                                           bool sanityCheck) :
+                                           bool sanityCheck,
+                                           const string& prevFile,
+                                           BuildCheckpoint* ckpt) :
     Ebwt<index_t>(s,
                   packed,
                   color,
@@ -1354,28 +1321,62 @@ HierEbwt<index_t, local_index_t>::HierEbwt(
                   overrideOffRate,
                   verbose,
                   passMemExc,
-                  sanityCheck),
+                  sanityCheck,
+                  ckpt),
     _in5(NULL),
-    _in6(NULL)
+    _in6(NULL),
+    mmFile5_(NULL),
+    mmFile6_(NULL),
+    shmFile5_(NULL),
+    shmFile6_(NULL)
 {
     _in5Str = file + ".5." + gEbwt_ext;
     _in6Str = file + ".6." + gEbwt_ext;
     
+    // A previous, interrupted run may have written the local indexes of
+    // the sequences before (resume_tidx, resume_offset); cut off anything
+    // it wrote after its last checkpoint and carry on from there
+    string ckptKey = fw ? "fw.local" : "rev.local";
+    bool resumed = false;
+    index_t resume_tidx = 0, resume_offset = 0;
+    if(ckpt != NULL) {
+        string val;
+        int64_t sz5 = 0, sz6 = 0;
+        if(ckpt->get(ckptKey, val)) {
+            istringstream is(val);
+            resumed = (is >> resume_tidx >> resume_offset >> sz5 >> sz6) &&
+                      BuildCheckpoint::sizeOf(_in5Str) >= sz5 &&
+                      BuildCheckpoint::sizeOf(_in6Str) >= sz6 &&
+                      truncate(_in5Str.c_str(), (off_t)sz5) == 0 &&
+                      truncate(_in6Str.c_str(), (off_t)sz6) == 0;
+        }
+        if(resumed) {
+            VMSG_NL("Resuming local indexes at sequence " << resume_tidx << ", offset " << resume_offset);
+        } else {
+            resume_tidx = resume_offset = 0;
+        }
+    }
+    
     // Open output files
-    ofstream fout5(_in5Str.c_str(), ios::binary);
+    ios_base::openmode mode = resumed ? (ios::binary | ios::in) : ios::binary;
+    ofstream fout5(_in5Str.c_str(), mode);
     if(!fout5.good()) {
         cerr << "Could not open index file for writing: \"" << _in5Str.c_str() << "\"" << endl
         << "Please make sure the directory exists and that permissions allow writing by" << endl
         << "Bowtie." << endl;
         throw 1;
     }
-    ofstream fout6(_in6Str.c_str(), ios::binary);
+    ofstream fout6(_in6Str.c_str(), mode);
     if(!fout6.good()) {
         cerr << "Could not open index file for writing: \"" << _in6Str.c_str() << "\"" << endl
         << "Please make sure the directory exists and that permissions allow writing by" << endl
         << "Bowtie." << endl;
         throw 1;
     }
+    if(resumed) {
+        fout5.seekp(0, ios::end);
+        fout6.seekp(0, ios::end);
+    }
     
     // split the whole genome into a set of local indexes
     _nrefs = 0;
@@ -1533,21 +1534,88 @@ HierEbwt<index_t, local_index_t>::HierEbwt(
     // When building an Ebwt, these header parameters are known
     // "up-front", i.e., they can be written to disk immediately,
     // before we join() or buildToDisk()
-    writeI32(fout5, 1, be); // endian hint for priamry stream
-    writeI32(fout6, 1, be); // endian hint for secondary stream
-    writeIndex<index_t>(fout5, _nlocalEbwts, be); // number of local Ebwts
-    writeI32(fout5, local_lineRate,  be); // 2^lineRate = size in bytes of 1 line
-    writeI32(fout5, 2, be); // not used
-    writeI32(fout5, (int32_t)localOffRate,   be); // every 2^offRate chars is "marked"
-    writeI32(fout5, (int32_t)localFtabChars, be); // number of 2-bit chars used to address ftab
     int32_t flags = 1;
     if(this->_eh._color) flags |= EBWT_COLOR;
     if(this->_eh._entireReverse) flags |= EBWT_ENTIRE_REV;
-    writeI32(fout5, -flags, be); // BTL: chunkRate is now deprecated
-    
+    if(!resumed) {
+        writeI32(fout5, 1, be); // endian hint for priamry stream
+        writeI32(fout6, 1, be); // endian hint for secondary stream
+        writeIndex<index_t>(fout5, _nlocalEbwts, be); // number of local Ebwts
+        writeI32(fout5, local_lineRate,  be); // 2^lineRate = size in bytes of 1 line
+        writeI32(fout5, 2, be); // not used
+        writeI32(fout5, (int32_t)localOffRate,   be); // every 2^offRate chars is "marked"
+        writeI32(fout5, (int32_t)localFtabChars, be); // number of 2-bit chars used to address ftab
+        writeI32(fout5, -flags, be); // BTL: chunkRate is now deprecated
+    }
+
+    // When extending an existing index with new reference sequences
+    // appended after its own, the local indexes of the leading sequences
+    // are identical to the ones already on disk, so copy them verbatim
+    index_t nPrevRefs = 0;
+    if(!prevFile.empty()) {
+        string prev5Str = prevFile + ".5." + gEbwt_ext;
+        string prev6Str = prevFile + ".6." + gEbwt_ext;
+        ifstream prev5(prev5Str.c_str(), ios::binary);
+        ifstream prev6(prev6Str.c_str(), ios::binary);
+        if(!prev5.good() || !prev6.good()) {
+            cerr << "Could not open index files \"" << prev5Str.c_str() << "\" and \""
+                 << prev6Str.c_str() << "\" for reading." << endl;
+            throw 1;
+        }
+        bool switchEndian = (be != currentlyBigEndian());
+        if(readI32(prev5, switchEndian) != 1 || readI32(prev6, switchEndian) != 1) {
+            cerr << "Error: " << prev5Str.c_str() << " has different endianness than the index being built." << endl;
+            throw 1;
+        }
+        index_t prev_nlocalEbwts = readIndex<index_t>(prev5, switchEndian);
+        int32_t prev_lineRate = readI32(prev5, switchEndian);
+        readI32(prev5, switchEndian); // not used
+        int32_t prev_offRate = readI32(prev5, switchEndian);
+        int32_t prev_ftabChars = readI32(prev5, switchEndian);
+        int32_t prev_flags = readI32(prev5, switchEndian);
+        if(prev_lineRate != local_lineRate ||
+           prev_offRate != localOffRate ||
+           prev_ftabChars != localFtabChars ||
+           prev_flags != -flags) {
+            cerr << "Error: local index parameters of " << prev5Str.c_str()
+                 << " (offrate " << prev_offRate << ", ftabchars " << prev_ftabChars
+                 << ") differ from the ones requested (offrate " << localOffRate
+                 << ", ftabchars " << localFtabChars << ")." << endl;
+            throw 1;
+        }
+        index_t nPrevLocalEbwts = 0;
+        while(nPrevRefs < all_local_recs.size() && nPrevLocalEbwts < prev_nlocalEbwts) {
+            nPrevLocalEbwts += (index_t)all_local_recs[nPrevRefs++].size();
+        }
+        if(nPrevLocalEbwts != prev_nlocalEbwts) {
+            cerr << "Error: the " << prev_nlocalEbwts << " local indexes in " << prev5Str.c_str()
+                 << " do not cover the leading reference sequences." << endl;
+            throw 1;
+        }
+        // Everything but the trailing '\0' of the .5 file; a resumed run
+        // copied it already
+        int64_t prev5Sz = resumed ? 0 : fileSize(prev5Str.c_str()) - (int64_t)prev5.tellg() - 1;
+        char buf[1 << 16];
+        while(prev5Sz > 0) {
+            std::streamsize n = (std::streamsize)std::min<int64_t>(prev5Sz, sizeof(buf));
+            if(!prev5.read(buf, n)) {
+                cerr << "Error reading " << prev5Str.c_str() << endl;
+                throw 1;
+            }
+            fout5.write(buf, n);
+            prev5Sz -= n;
+        }
+        while(!resumed && (prev6.read(buf, sizeof(buf)) || prev6.gcount() > 0)) {
+            fout6.write(buf, prev6.gcount());
+        }
+        VMSG_NL("Reused " << nPrevLocalEbwts << " local indexes of " << nPrevRefs
+                << " reference sequences from " << prevFile.c_str());
+    }
+
     // build local FM indexes
     index_t curr_sztot = 0;
     bool firstIndex = true;
+    index_t nbuilt = 0;
     for(size_t tidx = 0; tidx < _refLens.size(); tidx++) {
         index_t refLen = _refLens[tidx];
         index_t local_offset = 0;
@@ -1576,6 +1644,15 @@ HierEbwt<index_t, local_index_t>::HierEbwt(
                 local_sztot += local_szs[i].len;
                 local_len += local_szs[i].len;
             }
+            if(tidx < nPrevRefs ||
+               tidx < resume_tidx ||
+               (tidx == resume_tidx && local_offset < resume_offset)) {
+                // Already copied from the previous index, or written
+                // before the run was interrupted
+                curr_sztot += local_sztot_interval;
+                local_offset += local_index_interval;
+                continue;
+            }
             TStr local_s;
             local_s.resize(local_sztot);
             if(refparams.reverse == REF_READ_REVERSE) {
@@ -1611,6 +1688,17 @@ HierEbwt<index_t, local_index_t>::HierEbwt(
             _localEbwts[tidx].push_back(localEbwt);
             curr_sztot += local_sztot_interval;
             local_offset += local_index_interval;
+            if(ckpt != NULL && ++nbuilt % local_ckpt_batch == 0) {
+                fout5.flush(); fout6.flush();
+                if(fout5.fail() || fout6.fail()) {
+                    cerr << "An error occurred writing the index to disk.  Please check if the disk is full." << endl;
+                    throw 1;
+                }
+                ostringstream os;
+                os << tidx << " " << local_offset << " "
+                   << (int64_t)fout5.tellp() << " " << (int64_t)fout6.tellp();
+                ckpt->set(ckptKey, os.str());
+            }
         }
     }
     assert_eq(curr_sztot, sztot);
@@ -1730,7 +1818,16 @@ void HierEbwt<index_t, local_index_t>::readIntoMemory(
 		if(this->_useMm /*&& !justHeader*/) {
 			const char *names[] = {_in5Str.c_str(), _in6Str.c_str()};
             int fds[] = { fileno(_in5), fileno(_in6) };
+			char **shmFiles[] = { &shmFile5_, &shmFile6_ };
 			for(int i = 0; i < (loadSASamp ? 2 : 1); i++) {
+				if(this->useShmem_) {
+					size_t len = 0;
+					if(*shmFiles[i] == NULL) {
+						*shmFiles[i] = ATTACH_SHARED(names[i], len, (this->_verbose || startVerbose));
+					}
+					mmFile[i] = *shmFiles[i];
+					continue;
+				}
 				if(this->_verbose || startVerbose) {
 					cerr << "  ¯ " << (i+1) << ": ";
 					logTime(cerr);
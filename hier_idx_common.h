@@ -38,4 +38,7 @@ static const int32_t  local_offRate        = 3;
 // the look table in a local index 4^<int> entries
 static const int32_t  local_ftabChars      = 6;
 
+// number of local indexes written between two checkpoints (hisat-build --resume)
+static const uint32_t local_ckpt_batch     = 1024;
+
 #endif /*HIEREBWT_COMMON_H_*/
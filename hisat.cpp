@@ -45,6 +45,7 @@
 #include "sam.h"
 #include "aligner_seed.h"
 #include "splice_site.h"
+#include "splice_track.h"
 #include "spliced_aligner.h"
 #include "aligner_seed_policy.h"
 #include "aligner_driver.h"
@@ -58,6 +59,9 @@
 #include "opts.h"
 #include "outq.h"
 #include "aligner_seed2.h"
+#include "contam_filter.h"
+#include "shard.h"
+#include "build_checkpoint.h"
 
 using namespace std;
 
@@ -77,11 +81,17 @@ static int timing;        // whether to report basic timing data
 static int metricsIval;   // interval between alignment metrics messages (0 = no messages)
 static string metricsFile;// output file to put alignment metrics in
 static bool metricsStderr;// output file to put alignment metrics in
+static string stageTimesFile; // output file to put per-stage latency histograms in
+static string traceFile;  // output file to put the timeline trace in
+static int traceStart;    // seconds into the search at which tracing starts
+static int traceSecs;     // seconds of the search to trace
+static bool hwCounters;   // charge hardware event counts to the pipeline stages
 static bool metricsPerRead; // report a metrics tuple for every read
 static bool allHits;      // for multihits, report just one
 static bool showVersion;  // just print version and quit?
 static int ipause;        // pause before maching?
-static uint32_t qUpto;    // max # of queries to read
+static TReadId qUpto;     // max # of queries to read
+static const TReadId QUPTO_NONE = std::numeric_limits<TReadId>::max(); // no -u
 int gTrim5;               // amount to trim from 5' end
 int gTrim3;               // amount to trim from 3' end
 static int offRate;       // keep default offRate
@@ -112,7 +122,7 @@ bool gReportDiscordant;   // find and report discordant paired-end alignments
 bool gReportMixed;        // find and report unpaired alignments for paired reads
 static uint32_t cacheLimit;      // ranges w/ size > limit will be cached
 static uint32_t cacheSize;       // # words per range cache
-static uint32_t skipReads;       // # reads/read pairs to skip
+static TReadId skipReads;        // # reads/read pairs to skip
 bool gNofw; // don't align fw orientation of read
 bool gNorc; // don't align rc orientation of read
 static uint32_t fastaContLen;
@@ -237,6 +247,29 @@ static size_t do1mmMinLen;    // length below which we disable 1mm e2e search
 static int seedBoostThresh;   // if average non-zero position has more than this many elements
 static size_t nSeedRounds;    // # seed rounds
 static bool reorder;          // true -> reorder SAM recs in -p mode
+static bool sortedBam;        // true -> write coordinate-sorted BAM instead of SAM
+static size_t sortMemMB;      // MB of encoded records to buffer before spilling sorted runs
+static string readOutFns[READ_OUT_NUM]; // --un, --al, --un-conc, --al-conc, --filtered(-conc) paths
+static int readOutCompress[READ_OUT_NUM]; // READ_OUT_PLAIN/GZIP/BZIP2 for each
+static string hrbOutfile;     // encode the input reads to this binary read file and exit
+static bool hrbBinQuals;      // bin qualities in --hrb-out files
+static uint32_t shardIdx;     // with --shard, align only the reads of this shard
+static uint32_t nShards;      // # shards the input is divided into (1 = no sharding)
+static string summaryFile;    // write the alignment summary counters to this file
+static EList<string> mergeSamFns;     // --merge-shards: SAM outputs of the shards
+static EList<string> mergeSummFns;    // --merge-summaries: their --summary-file outputs
+static EList<string> mergeSsFns;      // --merge-splicesites: their splice site lists
+static string ckptFile;       // --checkpoint: keep the progress of the run here
+static uint32_t ckptIval;     // reads/pairs between checkpoints
+static bool resume;           // continue from the checkpoint in ckptFile
+static EList<string> filterFastas; // contaminant sequences for the k-mer pre-filter
+static int filterK;           // k-mer length for --filter-fa
+static float filterFrac;      // fraction of a read's k-mers that must match --filter-fa
+static ContamFilter* contamFilter; // built from filterFastas; NULL if none
+static uint64_t budgetLF;     // max LF operations per read/pair; 0 = no limit
+static uint64_t budgetCells;  // max DP cells per read/pair; 0 = no limit
+static uint64_t budgetMs;     // max milliseconds per read/pair; 0 = no limit
+static bool bidirSearch;      // load the mirror index and extend hits in both directions
 static float sampleFrac;      // only align random fraction of input reads
 static bool arbitraryRandom;  // pseudo-randoms no longer a function of read properties
 static bool bowtie2p5;
@@ -250,8 +283,11 @@ static size_t maxIntronLen;
 static string knownSpliceSiteInfile;  //
 static string novelSpliceSiteInfile;  //
 static string novelSpliceSiteOutfile; //
+static bool twoPass;          // align once to collect splice sites, then again using them
+static uint32_t twoPassReads; // # reads to align in the first pass (0 = all)
 static bool secondary;
 static bool no_spliced_alignment;
+static bool noSsTrack;        // don't use the index's splice signal track (.ss.bt2)
 static int rna_strandness; //
 static bool splicesite_db_only; //
 
@@ -286,11 +322,16 @@ static void resetOptions() {
 	metricsIval				= 1; // interval between alignment metrics messages (0 = no messages)
 	metricsFile             = ""; // output file to put alignment metrics in
 	metricsStderr           = false; // print metrics to stderr (in addition to --metrics-file if it's specified
+	stageTimesFile          = ""; // output file to put per-stage latency histograms in
+	traceFile               = ""; // output file to put the timeline trace in
+	traceStart              = 0;  // seconds into the search at which tracing starts
+	traceSecs               = 1;  // seconds of the search to trace
+	hwCounters              = false; // charge hardware event counts to the pipeline stages
 	metricsPerRead          = false; // report a metrics tuple for every read?
 	allHits					= false; // for multihits, report just one
 	showVersion				= false; // just print version and quit?
 	ipause					= 0; // pause before maching?
-	qUpto					= 0xffffffff; // max # of queries to read
+	qUpto					= QUPTO_NONE; // max # of queries to read
 	gTrim5					= 0; // amount to trim from 5' end
 	gTrim3					= 0; // amount to trim from 3' end
 	offRate					= -1; // keep default offRate
@@ -450,6 +491,12 @@ static void resetOptions() {
 	nSeedRounds = 2;         // # rounds of seed searches to do for repetitive reads
 	do1mmMinLen = 60;        // length below which we disable 1mm search
 	reorder = false;         // reorder SAM records with -p > 1
+	sortedBam = false;       // write SAM
+	sortMemMB = 768;         // buffer this many MB of BAM records before spilling
+	for(int i = 0; i < READ_OUT_NUM; i++) {
+		readOutFns[i].clear();          // don't write reads to files
+		readOutCompress[i] = READ_OUT_PLAIN;
+	}
 	sampleFrac = 1.1f;       // align all reads
 	arbitraryRandom = false; // let pseudo-random seeds be a function of read properties
 	bowtie2p5 = false;
@@ -463,8 +510,29 @@ static void resetOptions() {
     knownSpliceSiteInfile = "";
     novelSpliceSiteInfile = "";
     novelSpliceSiteOutfile = "";
+    twoPass = false;
+    twoPassReads = 0;
+	hrbOutfile.clear();
+	hrbBinQuals = false;
+	shardIdx = 0;
+	nShards = 1;
+	summaryFile.clear();
+	mergeSamFns.clear();
+	mergeSummFns.clear();
+	mergeSsFns.clear();
+	ckptFile.clear();
+	ckptIval = 1000000;
+	resume = false;
+	filterFastas.clear();
+	filterK = 25;
+	filterFrac = 0.5f;
+	budgetLF = 0;
+	budgetCells = 0;
+	budgetMs = 0;
+	bidirSearch = false;
     secondary = false;       // allow secondary alignments
     no_spliced_alignment = false;
+    noSsTrack = false;
     rna_strandness = RNA_STRANDNESS_UNKNOWN;
     splicesite_db_only = false;
     
@@ -494,6 +562,11 @@ static struct option long_options[] = {
 	{(char*)"met",          required_argument, 0,            ARG_METRIC_IVAL},
 	{(char*)"met-file",     required_argument, 0,            ARG_METRIC_FILE},
 	{(char*)"met-stderr",   no_argument,       0,            ARG_METRIC_STDERR},
+	{(char*)"stage-times-file", required_argument, 0,        ARG_STAGE_TIMES_FILE},
+	{(char*)"trace-file",   required_argument, 0,            ARG_TRACE_FILE},
+	{(char*)"trace-start",  required_argument, 0,            ARG_TRACE_START},
+	{(char*)"trace-secs",   required_argument, 0,            ARG_TRACE_SECS},
+	{(char*)"hw-counters",  no_argument,       0,            ARG_HW_COUNTERS},
 	{(char*)"time",         no_argument,       0,            't'},
 	{(char*)"trim3",        required_argument, 0,            '3'},
 	{(char*)"trim5",        required_argument, 0,            '5'},
@@ -523,6 +596,17 @@ static struct option long_options[] = {
 	{(char*)"12",           required_argument, 0,            ARG_ONETWO},
 	{(char*)"tab5",         required_argument, 0,            ARG_TAB5},
 	{(char*)"tab6",         required_argument, 0,            ARG_TAB6},
+	{(char*)"hrb",          required_argument, 0,            ARG_HRB},
+	{(char*)"hrb-out",      required_argument, 0,            ARG_HRB_OUT},
+	{(char*)"hrb-bin-quals", no_argument,      0,            ARG_HRB_BIN_QUALS},
+	{(char*)"shard",        required_argument, 0,            ARG_SHARD},
+	{(char*)"summary-file", required_argument, 0,            ARG_SUMMARY_FILE},
+	{(char*)"merge-shards", required_argument, 0,            ARG_MERGE_SHARDS},
+	{(char*)"merge-summaries", required_argument, 0,         ARG_MERGE_SUMMARIES},
+	{(char*)"merge-splicesites", required_argument, 0,       ARG_MERGE_SPLICESITES},
+	{(char*)"checkpoint",   required_argument, 0,            ARG_CHECKPOINT},
+	{(char*)"checkpoint-ival", required_argument, 0,         ARG_CHECKPOINT_IVAL},
+	{(char*)"resume",       no_argument,       0,            ARG_RESUME},
 	{(char*)"phred33-quals", no_argument,      0,            ARG_PHRED33},
 	{(char*)"phred64-quals", no_argument,      0,            ARG_PHRED64},
 	{(char*)"phred33",       no_argument,      0,            ARG_PHRED33},
@@ -639,6 +723,29 @@ static struct option long_options[] = {
 	{(char*)"mapq-extra",       no_argument,       0,        ARG_MAPQ_EX},
 	{(char*)"seed-rounds",      required_argument, 0,        'R'},
 	{(char*)"reorder",          no_argument,       0,        ARG_REORDER},
+	{(char*)"sorted-bam",       no_argument,       0,        ARG_SORTED_BAM},
+	{(char*)"sort-mem",         required_argument, 0,        ARG_SORT_MEM},
+	{(char*)"un",               required_argument, 0,        ARG_UN},
+	{(char*)"un-gz",            required_argument, 0,        ARG_UN_GZ},
+	{(char*)"un-bz2",           required_argument, 0,        ARG_UN_BZ2},
+	{(char*)"al",               required_argument, 0,        ARG_AL},
+	{(char*)"al-gz",            required_argument, 0,        ARG_AL_GZ},
+	{(char*)"al-bz2",           required_argument, 0,        ARG_AL_BZ2},
+	{(char*)"un-conc",          required_argument, 0,        ARG_UN_CONC},
+	{(char*)"un-conc-gz",       required_argument, 0,        ARG_UN_CONC_GZ},
+	{(char*)"un-conc-bz2",      required_argument, 0,        ARG_UN_CONC_BZ2},
+	{(char*)"al-conc",          required_argument, 0,        ARG_AL_CONC},
+	{(char*)"al-conc-gz",       required_argument, 0,        ARG_AL_CONC_GZ},
+	{(char*)"al-conc-bz2",      required_argument, 0,        ARG_AL_CONC_BZ2},
+	{(char*)"filtered",         required_argument, 0,        ARG_FILTERED},
+	{(char*)"filtered-conc",    required_argument, 0,        ARG_FILTERED_CONC},
+	{(char*)"filter-fa",        required_argument, 0,        ARG_FILTER_FA},
+	{(char*)"filter-k",         required_argument, 0,        ARG_FILTER_K},
+	{(char*)"filter-frac",      required_argument, 0,        ARG_FILTER_FRAC},
+	{(char*)"budget-lf",        required_argument, 0,        ARG_BUDGET_LF},
+	{(char*)"budget-cells",     required_argument, 0,        ARG_BUDGET_CELLS},
+	{(char*)"budget-ms",        required_argument, 0,        ARG_BUDGET_MS},
+	{(char*)"bidir",            no_argument,       0,        ARG_BIDIR},
 	{(char*)"passthrough",      no_argument,       0,        ARG_READ_PASSTHRU},
 	{(char*)"sample",           required_argument, 0,        ARG_SAMPLE},
 	{(char*)"cp-min",           required_argument, 0,        ARG_CP_MIN},
@@ -665,8 +772,11 @@ static struct option long_options[] = {
     {(char*)"known-splicesite-infile",       required_argument, 0,        ARG_KNOWN_SPLICESITE_INFILE},
     {(char*)"novel-splicesite-infile",       required_argument, 0,        ARG_NOVEL_SPLICESITE_INFILE},
     {(char*)"novel-splicesite-outfile",      required_argument, 0,        ARG_NOVEL_SPLICESITE_OUTFILE},
+    {(char*)"two-pass",      no_argument, 0,        ARG_TWO_PASS},
+    {(char*)"two-pass-reads",      required_argument, 0,        ARG_TWO_PASS_READS},
     {(char*)"secondary",   no_argument, 0,        ARG_SECONDARY},
     {(char*)"no-spliced-alignment",   no_argument, 0,        ARG_NO_SPLICED_ALIGNMENT},
+    {(char*)"no-ss-track",   no_argument, 0,        ARG_NO_SS_TRACK},
     {(char*)"rna-strandness",   required_argument, 0,        ARG_RNA_STRANDNESS},
     {(char*)"splicesite-db-only",   no_argument, 0,        ARG_SPLICESITE_DB_ONLY},
 #ifdef USE_SRA
@@ -760,11 +870,18 @@ static void printUsage(ostream& out) {
 	    << "  -c                 <m1>, <m2>, <r> are sequences themselves, not files" << endl
 	    << "  -s/--skip <int>    skip the first <int> reads/pairs in the input (none)" << endl
 	    << "  -u/--upto <int>    stop after first <int> reads/pairs (no limit)" << endl
+	    << "  --shard <i>/<N>    align only reads/pairs i, i+N, i+2N, ... (0-based)" << endl
 	    << "  -5/--trim5 <int>   trim <int> bases from 5'/left end of reads (0)" << endl
 	    << "  -3/--trim3 <int>   trim <int> bases from 3'/right end of reads (0)" << endl
 	    << "  --phred33          qualities are Phred+33 (default)" << endl
 	    << "  --phred64          qualities are Phred+64" << endl
 	    << "  --int-quals        qualities encoded as space-delimited integers" << endl
+	    << "  --hrb <hrb>        reads/pairs are in HISAT binary read files written by --hrb-out" << endl
+	    << "  --hrb-out <hrb>    write the input reads to binary read file <hrb> and exit" << endl
+	    << "  --hrb-bin-quals    with --hrb-out, store qualities in 8 bins" << endl
+	    << "  --filter-fa <fa>   don't align reads whose k-mers match contaminant seqs in <fa>" << endl
+	    << "  --filter-k <int>   k-mer length for --filter-fa, at most 32 (25)" << endl
+	    << "  --filter-frac <float> fraction of a read's k-mers that must match (0.5)" << endl
 #ifdef USE_SRA
         << "  --sra-acc          SRA accession ID" << endl
 #endif
@@ -806,7 +923,10 @@ static void printUsage(ostream& out) {
         << "  --novel-splicesite-outfile <path>  report a list of splice sites" << endl
         << "  --novel-splicesite-infile <path>   provide a list of novel splice sites" << endl
         << "  --no-temp-splicesite               disable the use of splice sites found" << endl
+        << "  --two-pass                         align once to find splice sites, then again using them" << endl
+        << "  --two-pass-reads <int>             align only the first <int> reads in the first pass (all)" << endl
         << "  --no-spliced-alignment             disable spliced alignment" << endl
+        << "  --no-ss-track                      don't use the index's splice signal track" << endl
         << "  --rna-strandness <string>          Specify strand-specific information (unstranded)" << endl
         << endl
 		<< " Scoring:" << endl
@@ -828,6 +948,10 @@ static void printUsage(ostream& out) {
 	    << " Effort:" << endl
 	    << "  -D <int>           give up extending after <int> failed extends in a row (15)" << endl
 	    << "  -R <int>           for reads w/ repetitive seeds, try <int> sets of seeds (2)" << endl
+	    << "  --budget-lf <int>  stop searching for a read after <int> LF operations (no limit)" << endl
+	    << "  --budget-cells <int> stop searching for a read after <int> DP cells (no limit)" << endl
+	    << "  --budget-ms <int>  stop searching for a read after <int> milliseconds (no limit)" << endl
+	    << "  --bidir            also load mirror index; extend repetitive hits to the right" << endl
 		<< endl
 		<< " Paired-end:" << endl
 	    << "  -I/--minins <int>  minimum fragment length (0)" << endl
@@ -844,21 +968,29 @@ static void printUsage(ostream& out) {
 	//	out << "  --bam              output directly to BAM (by piping through 'samtools view')" << endl;
 	//}
 	out << "  -t/--time          print wall-clock time taken by search phases" << endl;
-	if(wrapper == "basic-0") {
 	out << "  --un <path>           write unpaired reads that didn't align to <path>" << endl
 	    << "  --al <path>           write unpaired reads that aligned at least once to <path>" << endl
 	    << "  --un-conc <path>      write pairs that didn't align concordantly to <path>" << endl
 	    << "  --al-conc <path>      write pairs that aligned concordantly at least once to <path>" << endl
 	    << "  (Note: for --un, --al, --un-conc, or --al-conc, add '-gz' to the option name, e.g." << endl
-		<< "  --un-gz <path>, to gzip compress output, or add '-bz2' to bzip2 compress output.)" << endl;
-	}
+		<< "  --un-gz <path>, to gzip compress output, or add '-bz2' to bzip2 compress output.)" << endl
+	    << "  --filtered <path>     write unpaired reads that matched --filter-fa to <path>" << endl
+	    << "  --filtered-conc <path> write pairs that matched --filter-fa to <path>" << endl;
 	out << "  --quiet            print nothing to stderr except serious errors" << endl
 	//  << "  --refidx           refer to ref. seqs by 0-based index rather than name" << endl
+		<< "  --summary-file <path>  write alignment summary counters to <path> (off)" << endl
+		<< "  --checkpoint <path>  save progress to <path> so a killed run can --resume (off)" << endl
+		<< "  --checkpoint-ival <int>  reads/pairs between checkpoints (1000000)" << endl
+		<< "  --resume           continue from the --checkpoint of an interrupted run" << endl
 		<< "  --met-file <path>  send metrics to file at <path> (off)" << endl
 		<< "  --met-stderr       send metrics to stderr (off)" << endl
 		<< "  --met <int>        report internal counters & metrics every <int> secs (1)" << endl
-	// Following is supported in the wrapper instead
-	//  << "  --no-unal          supppress SAM records for unaligned reads" << endl
+		<< "  --stage-times-file <path>  write per-stage latency histograms (JSON) to <path> (off)" << endl
+		<< "  --trace-file <path>  write a timeline of thread activity (Chrome trace JSON) to <path> (off)" << endl
+		<< "  --trace-start <int>  start the --trace-file timeline <int> secs into the search (0)" << endl
+		<< "  --trace-secs <int>   length of the --trace-file timeline in secs (1)" << endl
+		<< "  --hw-counters      add CPU cycles, instructions, cache/TLB/branch misses per stage to metrics" << endl
+	    << "  --no-unal          supppress SAM records for unaligned reads" << endl
 	    << "  --no-head          supppress header lines, i.e. lines starting with @" << endl
 	    << "  --no-sq            supppress @SQ header lines" << endl
 	    << "  --rg-id <text>     set read group id, reflected in @RG line and RG:Z: opt field" << endl
@@ -870,17 +1002,22 @@ static void printUsage(ostream& out) {
 	    << "  -o/--offrate <int> override offrate of index; must be >= index's offrate" << endl
 	    << "  -p/--threads <int> number of alignment threads to launch (1)" << endl
 	    << "  --reorder          force SAM output order to match order of input reads" << endl
+	    << "  --sorted-bam       write coordinate-sorted BAM instead of SAM" << endl
+	    << "  --sort-mem <int>   MB of records buffered before spilling to temp files (768)" << endl
 #ifdef BOWTIE_MM
 	    << "  --mm               use memory-mapped I/O for index; many 'bowtie's can share" << endl
 #endif
 #ifdef BOWTIE_SHARED_MEM
-		//<< "  --shmem            use shared mem for index; many 'bowtie's can share" << endl
+	    << "  --shmem            use shared mem for index; many 'hisat's can share" << endl
 #endif
 		<< endl
 	    << " Other:" << endl
 		<< "  --qc-filter        filter out reads that are bad according to QSEQ filter" << endl
 	    << "  --seed <int>       seed for random number generator (0)" << endl
 	    << "  --non-deterministic seed rand. gen. arbitrarily instead of using read attributes" << endl
+	    << "  --merge-shards <sam1,sam2,...>  concatenate the SAM outputs of --shard runs to -S <sam>" << endl
+	    << "  --merge-summaries <f1,f2,...>   add up their --summary-file outputs" << endl
+	    << "  --merge-splicesites <f1,f2,...> merge their --novel-splicesite-outfile lists" << endl
 	//  << "  --verbose          verbose output for debugging" << endl
 	    << "  --version          print version information and quit" << endl
 	    << "  -h/--help          print this usage message" << endl
@@ -1007,6 +1144,31 @@ static void parseOption(int next_option, const char *arg) {
 		case ARG_ONETWO: tokenize(arg, ",", mates12); format = TAB_MATE5; break;
 		case ARG_TAB5:   tokenize(arg, ",", mates12); format = TAB_MATE5; break;
 		case ARG_TAB6:   tokenize(arg, ",", mates12); format = TAB_MATE6; break;
+		case ARG_HRB:    tokenize(arg, ",", mates12); format = HRB; break;
+		case ARG_HRB_OUT: hrbOutfile = arg; break;
+		case ARG_HRB_BIN_QUALS: hrbBinQuals = true; break;
+		case ARG_SHARD: {
+			pair<uint32_t, uint32_t> p(0, 0);
+			if(strchr(arg, '/') != NULL) {
+				p = parsePair<uint32_t>(arg, '/');
+			}
+			if(p.second < 1 || p.first >= p.second) {
+				cerr << "Error: --shard arg must be <i>/<N> with 0 <= <i> < <N>; was " << arg << endl;
+				throw 1;
+			}
+			shardIdx = p.first;
+			nShards = p.second;
+			break;
+		}
+		case ARG_SUMMARY_FILE: summaryFile = arg; break;
+		case ARG_MERGE_SHARDS: tokenize(arg, ",", mergeSamFns); break;
+		case ARG_MERGE_SUMMARIES: tokenize(arg, ",", mergeSummFns); break;
+		case ARG_MERGE_SPLICESITES: tokenize(arg, ",", mergeSsFns); break;
+		case ARG_CHECKPOINT: ckptFile = arg; break;
+		case ARG_CHECKPOINT_IVAL:
+			ckptIval = (uint32_t)parseInt(1, "--checkpoint-ival arg must be at least 1", arg);
+			break;
+		case ARG_RESUME: resume = true; break;
 		case 'f': format = FASTA; break;
 		case 'F': {
 			format = FASTA_CONT;
@@ -1046,7 +1208,7 @@ static void parseOption(int next_option, const char *arg) {
 		case ARG_NO_DISCORDANT: gReportDiscordant = false; break;
 		case ARG_NO_MIXED: gReportMixed = false; break;
 		case 's':
-			skipReads = (uint32_t)parseInt(0, "-s arg must be positive", arg);
+			skipReads = (TReadId)parseInt(0, "-s arg must be positive", arg);
 			break;
 		case ARG_FF: gMate1fw = true;  gMate2fw = true;  break;
 		case ARG_RF: gMate1fw = false; gMate2fw = true;  break;
@@ -1093,7 +1255,7 @@ static void parseOption(int next_option, const char *arg) {
 			arbitraryRandom = true;
 			break;
 		case 'u':
-			qUpto = (uint32_t)parseInt(1, "-u/--qupto arg must be at least 1", arg);
+			qUpto = (TReadId)parseInt(1, "-u/--qupto arg must be at least 1", arg);
 			break;
 		case 'Q':
 			tokenize(arg, ",", qualities);
@@ -1215,6 +1377,15 @@ static void parseOption(int next_option, const char *arg) {
 		case ARG_METRIC_FILE: metricsFile = arg; break;
 		case ARG_METRIC_STDERR: metricsStderr = true; break;
 		case ARG_METRIC_PER_READ: metricsPerRead = true; break;
+		case ARG_STAGE_TIMES_FILE: stageTimesFile = arg; break;
+		case ARG_TRACE_FILE: traceFile = arg; break;
+		case ARG_TRACE_START:
+			traceStart = parseInt(0, "--trace-start arg must be at least 0", arg);
+			break;
+		case ARG_TRACE_SECS:
+			traceSecs = parseInt(1, "--trace-secs arg must be at least 1", arg);
+			break;
+		case ARG_HW_COUNTERS: hwCounters = true; break;
 		case ARG_NO_FW: gNofw = true; break;
 		case ARG_NO_RC: gNorc = true; break;
 		case ARG_SAM_NO_QNAME_TRUNC: samTruncQname = false; break;
@@ -1224,6 +1395,35 @@ static void parseOption(int next_option, const char *arg) {
 		case ARG_SAM_NOSQ: samNoSQ = true; break;
 		case ARG_SAM_PRINT_YI: sam_print_yi = true; break;
 		case ARG_REORDER: reorder = true; break;
+		case ARG_SORTED_BAM:
+#ifndef USE_ZLIB
+			cerr << "Error: --sorted-bam needs HISAT built with zlib (USE_ZLIB=1)" << endl;
+			throw 1;
+#endif
+			sortedBam = true;
+			break;
+		case ARG_SORT_MEM: {
+			sortMemMB = (size_t)parseInt(1, "--sort-mem arg must be at least 1", arg);
+			break;
+		}
+		case ARG_UN:
+		case ARG_UN_GZ:
+		case ARG_UN_BZ2:
+		case ARG_AL:
+		case ARG_AL_GZ:
+		case ARG_AL_BZ2:
+		case ARG_UN_CONC:
+		case ARG_UN_CONC_GZ:
+		case ARG_UN_CONC_BZ2:
+		case ARG_AL_CONC:
+		case ARG_AL_CONC_GZ:
+		case ARG_AL_CONC_BZ2: {
+			// Options come in groups of three: plain, -gz, -bz2
+			int kind = READ_OUT_UN + (next_option - ARG_UN) / 3;
+			readOutFns[kind] = arg;
+			readOutCompress[kind] = READ_OUT_PLAIN + (next_option - ARG_UN) % 3;
+			break;
+		}
 		case ARG_MAPQ_EX: {
 			sam_print_zp = true;
 			sam_print_zu = true;
@@ -1239,6 +1439,31 @@ static void parseOption(int next_option, const char *arg) {
 		case ARG_SAMPLE:
 			sampleFrac = parse<float>(arg);
 			break;
+		case ARG_FILTERED:
+			readOutFns[READ_OUT_FILT] = arg;
+			break;
+		case ARG_FILTERED_CONC:
+			readOutFns[READ_OUT_FILT_CONC] = arg;
+			break;
+		case ARG_FILTER_FA: tokenize(arg, ",", filterFastas); break;
+		case ARG_FILTER_K:
+			filterK = parseInt(1, "--filter-k arg must be at least 1", arg);
+			if(filterK > 32) {
+				cerr << "Error: --filter-k arg must be at most 32" << endl;
+				throw 1;
+			}
+			break;
+		case ARG_BUDGET_LF: budgetLF = parse<uint64_t>(arg); break;
+		case ARG_BUDGET_CELLS: budgetCells = parse<uint64_t>(arg); break;
+		case ARG_BUDGET_MS: budgetMs = parse<uint64_t>(arg); break;
+		case ARG_BIDIR: bidirSearch = true; break;
+		case ARG_FILTER_FRAC:
+			filterFrac = parse<float>(arg);
+			if(filterFrac <= 0.0f || filterFrac > 1.0f) {
+				cerr << "Error: --filter-frac arg must be greater than 0 and at most 1" << endl;
+				throw 1;
+			}
+			break;
 		case ARG_CP_MIN:
 			cminlen = parse<size_t>(arg);
 			break;
@@ -1521,8 +1746,14 @@ static void parseOption(int next_option, const char *arg) {
         case ARG_KNOWN_SPLICESITE_INFILE: knownSpliceSiteInfile = arg; break;
         case ARG_NOVEL_SPLICESITE_INFILE: novelSpliceSiteInfile = arg; break;
         case ARG_NOVEL_SPLICESITE_OUTFILE: novelSpliceSiteOutfile = arg; break;
+        case ARG_TWO_PASS: twoPass = true; break;
+        case ARG_TWO_PASS_READS: {
+            twoPassReads = (uint32_t)parseInt(1, "--two-pass-reads arg must be at least 1", arg);
+            break;
+        }
         case ARG_SECONDARY: secondary = true; break;
         case ARG_NO_SPLICED_ALIGNMENT: no_spliced_alignment = true; break;
+        case ARG_NO_SS_TRACK: noSsTrack = true; break;
         case ARG_RNA_STRANDNESS: {
             string strandness = arg;
             if(strandness == "F")       rna_strandness = RNA_STRANDNESS_F;
@@ -1673,6 +1904,15 @@ static void parseOptions(int argc, const char **argv) {
 		     << "files must sequences must be specified with -2 and --Q2." << endl;
 		throw 1;
 	}
+	if(filterFastas.empty() &&
+	   (!readOutFns[READ_OUT_FILT].empty() || !readOutFns[READ_OUT_FILT_CONC].empty()))
+	{
+		cerr << "Warning: --filtered and --filtered-conc have no effect without --filter-fa" << endl;
+	}
+	if(format == HRB && (!mates1.empty() || !queries.empty())) {
+		cerr << "Error: reads given with --hrb can't be combined with -1/-2/-U reads" << endl;
+		throw 1;
+	}
 	if(!rgs.empty() && rgid.empty()) {
 		cerr << "Warning: --rg was specified without --rg-id also "
 		     << "being specified.  @RG line is not printed unless --rg-id "
@@ -1691,9 +1931,21 @@ static void parseOptions(int argc, const char **argv) {
 	// If both -s and -u are used, we need to adjust qUpto accordingly
 	// since it uses rdid to know if we've reached the -u limit (and
 	// rdids are all shifted up by skipReads characters)
-	if(qUpto + skipReads > qUpto) {
+	if(qUpto != QUPTO_NONE) {
 		qUpto += skipReads;
 	}
+	// With --shard, reads are numbered within the shard, so turn -s/-u
+	// into the number of this shard's reads among the first -s/-u reads
+	if(nShards > 1) {
+		if(skipReads > shardIdx) {
+			skipReads = (skipReads - 1 - shardIdx) / nShards + 1;
+		} else {
+			skipReads = 0;
+		}
+		if(qUpto != QUPTO_NONE) {
+			qUpto = (qUpto > shardIdx) ? ((qUpto - 1 - shardIdx) / nShards + 1) : 0;
+		}
+	}
 	if(useShmem && useMm && !gQuiet) {
 		cerr << "Warning: --shmem overrides --mm..." << endl;
 		useMm = false;
@@ -1739,12 +1991,15 @@ typedef TIndexOffU index_t;
 typedef uint16_t local_index_t;
 static PairedPatternSource*              multiseed_patsrc;
 static HierEbwt<index_t>*                multiseed_ebwtFw;
-static HierEbwt<index_t>*                multiseed_ebwtBw;
+static Ebwt<index_t>*                    multiseed_ebwtBw;
 static Scoring*                          multiseed_sc;
 static BitPairReference*                 multiseed_refs;
 static AlignmentCache<index_t>*          multiseed_ca; // seed cache
 static AlnSink<index_t>*                 multiseed_msink;
 static OutFileBuf*                       multiseed_metricsOfb;
+static OutFileBuf*                       multiseed_stageOfb;
+static StageTrace*                       multiseed_traces; // one per thread, if --trace-file
+static const size_t TRACE_EVENTS_PER_THREAD = 1 << 19;    // 8 MB per thread
 static SpliceSiteDB*                     ssdb;
 
 /**
@@ -1837,6 +2092,54 @@ struct PerfMetrics {
 		nbtfiltdo_u = 0;
         
         him.reset();
+        stm.reset();
+	}
+
+	/**
+	 * Merge a thread's per-stage latency histograms into this object.
+	 */
+	void mergeStages(const StageMetrics& st, bool getLock) {
+		ThreadSafe ts(&mutex_m, getLock);
+		stm.merge(st);
+	}
+
+	/**
+	 * Merge everything a worker has accumulated in o since o was last
+	 * reset (its incremental counters and stage histograms) into this
+	 * object.
+	 */
+	void mergeUpdates(const PerfMetrics& o, bool getLock) {
+		merge(
+			&o.olmu,
+			&o.sdmu,
+			&o.wlmu,
+			&o.swmuSeed,
+			&o.swmuMate,
+			&o.rpmu,
+			&o.dpSse8uSeed,
+			&o.dpSse8uMate,
+			&o.dpSse16uSeed,
+			&o.dpSse16uMate,
+			o.nbtfiltst_u,
+			o.nbtfiltsc_u,
+			o.nbtfiltdo_u,
+			&o.him,
+			getLock);
+		mergeStages(o.stm, getLock);
+	}
+
+	/**
+	 * Write the per-stage latency histograms accumulated so far as one
+	 * line of JSON.  Histograms are cumulative, so each line summarizes
+	 * the run up to that point.
+	 */
+	void reportStages(OutFileBuf* o, bool sync) {
+		ThreadSafe ts(&mutex_m, sync);
+		ostringstream os;
+		stm.printJson(os, time(0), olm.reads + olmu.reads, hwCounters);
+		os << endl;
+		o->writeString(os.str());
+		o->flush();
 	}
 
 	/**
@@ -2065,6 +2368,44 @@ struct PerfMetrics {
                 /* 134 */ "LocalSearchRecur"    "\t"
                 /* 135 */ "GlobalGenomeCoords"  "\t"
                 /* 136 */ "LocalGenomeCoords"   "\t"
+
+				/* 137 */ "MemAllocs"      "\t"
+				/* 138 */ "MemFrees"       "\t"
+
+				/* 139 */ "BudgetLF"       "\t"
+				/* 140 */ "BudgetCells"    "\t"
+				/* 141 */ "BudgetTime"     "\t"
+
+				/* 142 */ "GlobalFMCycles"     "\t"
+				/* 143 */ "GlobalFMInstrs"     "\t"
+				/* 144 */ "GlobalFMLLCMiss"    "\t"
+				/* 145 */ "GlobalFMDTLBMiss"   "\t"
+				/* 146 */ "GlobalFMBrMiss"     "\t"
+				/* 147 */ "LocalFMCycles"      "\t"
+				/* 148 */ "LocalFMInstrs"      "\t"
+				/* 149 */ "LocalFMLLCMiss"     "\t"
+				/* 150 */ "LocalFMDTLBMiss"    "\t"
+				/* 151 */ "LocalFMBrMiss"      "\t"
+				/* 152 */ "SAWalkCycles"       "\t"
+				/* 153 */ "SAWalkInstrs"       "\t"
+				/* 154 */ "SAWalkLLCMiss"      "\t"
+				/* 155 */ "SAWalkDTLBMiss"     "\t"
+				/* 156 */ "SAWalkBrMiss"       "\t"
+				/* 157 */ "SWCycles"           "\t"
+				/* 158 */ "SWInstrs"           "\t"
+				/* 159 */ "SWLLCMiss"          "\t"
+				/* 160 */ "SWDTLBMiss"         "\t"
+				/* 161 */ "SWBrMiss"           "\t"
+				/* 162 */ "SpliceScanCycles"   "\t"
+				/* 163 */ "SpliceScanInstrs"   "\t"
+				/* 164 */ "SpliceScanLLCMiss"  "\t"
+				/* 165 */ "SpliceScanDTLBMiss" "\t"
+				/* 166 */ "SpliceScanBrMiss"   "\t"
+				/* 167 */ "OutputCycles"       "\t"
+				/* 168 */ "OutputInstrs"       "\t"
+				/* 169 */ "OutputLLCMiss"      "\t"
+				/* 170 */ "OutputDTLBMiss"     "\t"
+				/* 171 */ "OutputBrMiss"       "\t"
             
             
 				"\n";
@@ -2660,8 +3001,54 @@ struct PerfMetrics {
 		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
         // 136
         itoa10<size_t>(him.localgenomecoords, buf);
-        if(metricsStderr) stderrSs << buf;
-		if(o != NULL) { o->writeChars(buf); }
+        if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+
+		// 137. Container allocations so far; once the per-thread aligner
+		// state has warmed up this should hardly move between intervals
+		itoa10<size_t>(gMemTally.allocs(), buf);
+		if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+		// 138. Container frees so far
+		itoa10<size_t>(gMemTally.frees(), buf);
+		if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+
+		// 139. Reads cut short by --budget-lf
+		itoa10<size_t>(him.budgetlf, buf);
+		if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+		// 140. Reads cut short by --budget-cells
+		itoa10<size_t>(him.budgetcells, buf);
+		if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+		// 141. Reads cut short by --budget-ms
+		itoa10<size_t>(him.budgettime, buf);
+		if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+
+		// 142-171. Hardware events charged to the global FM search, local
+		// FM search, SA walk, SW extension, splice scan and output stages
+		// so far; 0 unless --hw-counters
+		static const int hwStages[] = {
+			STAGE_GLOBAL_SEARCH, STAGE_LOCAL_SEARCH, STAGE_GENOME_COORDS,
+			STAGE_SW_EXTEND, STAGE_SPLICE_SCAN, STAGE_SINK
+		};
+		const size_t nhwStages = sizeof(hwStages) / sizeof(hwStages[0]);
+		for(size_t i = 0; i < nhwStages; i++) {
+			for(int j = 0; j < HWC_NUM; j++) {
+				bool last = (i + 1 == nhwStages && j + 1 == HWC_NUM);
+				itoa10<uint64_t>(stm.hwc[hwStages[i]][j], buf);
+				if(metricsStderr) {
+					stderrSs << buf;
+					if(!last) stderrSs << '\t';
+				}
+				if(o != NULL) {
+					o->writeChars(buf);
+					if(!last) o->write('\t');
+				}
+			}
+		}
 
 		if(o != NULL) { o->write('\n'); }
 		if(metricsStderr) cerr << stderrSs.str().c_str() << endl;
@@ -2729,6 +3116,9 @@ struct PerfMetrics {
     
     //
     HIMetrics         him;
+    
+    // Cumulative per-stage latency histograms (--stage-times-file)
+    StageMetrics      stm;
 
 	MUTEX_T           mutex_m;  // lock for when one ob
 	bool              first; // yet to print first line?
@@ -2737,6 +3127,182 @@ struct PerfMetrics {
 
 static PerfMetrics metrics;
 
+/**
+ * Where a worker thread leaves its metrics for the metrics thread, so that
+ * workers never take a lock to report them.  The worker fills the mailbox
+ * only when it is empty and the metrics thread only empties it when it is
+ * full.  Padded so neighboring workers' mailboxes don't share cache lines.
+ */
+struct MetricsMailbox {
+
+	MetricsMailbox() : full(false) { }
+
+	volatile bool    full;  // set by the worker, cleared by the metrics thread
+	char             pad1[64];
+	PerfMetrics      m;     // counters deposited by the worker
+	ReportingMetrics sink;  // for the AlnSink summary; handed over at the end
+	ReportingMetrics ckpt;  // summary counters up to the worker's last read (--checkpoint)
+	char             pad2[64];
+};
+
+static MetricsMailbox* metricsBoxes;  // one per worker thread
+static bool metricsThreadOn;          // metrics thread writes interval reports
+static volatile bool metricsThreadDone;
+
+/**
+ * The library interface (hisat_lib.h) keeps the worker threads, and all
+ * they allocate, from one batch of reads to the next: with poolOn, a
+ * worker that runs out of reads waits for the next batch instead of
+ * returning.
+ */
+static bool                        poolOn;
+static tthread::mutex              poolMutex;
+static tthread::condition_variable poolCond;
+static uint64_t                    poolBatch; // # batches handed out
+static int                         poolIdle;  // # workers done with the current batch
+static bool                        poolQuit;  // workers should return
+static bool                        poolError; // a worker threw during the current batch
+
+/**
+ * Called by a worker that is done with batch 'batch' to wait for the
+ * next one.  Returns false if the worker should return instead.
+ */
+static bool waitForBatch(uint64_t& batch) {
+	tthread::lock_guard<tthread::mutex> guard(poolMutex);
+	poolIdle++;
+	poolCond.notify_all();
+	while(poolBatch == batch && !poolQuit) {
+		poolCond.wait(poolMutex);
+	}
+	batch = poolBatch;
+	return !poolQuit;
+}
+
+/**
+ * --checkpoint.  Every ckptIval reads/pairs, before the next read is
+ * handed out, the workers are brought to a stop and what a later run
+ * needs to carry on from there with --resume is saved: the rdid of the
+ * next read, the size of the SAM output, where the input continues, the
+ * summary counters and a snapshot of the splice site DB.  Workers take
+ * reads one at a time under ckptMutex, and the worker that finds a
+ * checkpoint due waits, holding it, for the reads already handed out to
+ * be finished; the output and the counters then cover exactly the reads
+ * before the checkpoint.
+ */
+static BuildCheckpoint   alnCkpt;
+static uint64_t          ckptFingerprint;
+static MUTEX_T           ckptMutex;
+static TReadId           ckptNext;  // rdid of the next read to be handed out
+static TReadId           ckptDue;   // save a checkpoint before handing out this rdid
+static volatile int      ckptBusy;  // # reads handed out but not finished
+static OutputQueue*      ckptOq;
+static OutFileBuf*       ckptOut;
+static ReportingMetrics  ckptMet;   // counters picked up from the checkpoint
+static string            ckptSites; // splice site snapshot the checkpoint refers to
+
+/**
+ * Save a checkpoint.  All the reads before ckptNext are finished and no
+ * others are handed out.
+ */
+static void saveAlnCheckpoint() {
+	ckptOq->flush(true);
+	ostringstream out;
+	out << ckptOut->sync();
+	ostringstream in;
+	bool seekable = multiseed_patsrc->tell(in);
+	ReportingMetrics met;
+	met.merge(ckptMet);
+	for(int i = 0; i < nthreads; i++) {
+		met.merge(metricsBoxes[i].ckpt);
+	}
+	string sites;
+	if(ssdb != NULL && ssdb->write()) {
+		ostringstream fn;
+		fn << ckptFile << ".ss." << ckptNext;
+		sites = fn.str();
+		ofstream os(sites.c_str());
+		ssdb->save(os);
+		os.close();
+		if(os.fail()) {
+			cerr << "Error: could not write splice site snapshot \"" << sites.c_str() << "\"" << endl;
+			throw 1;
+		}
+	}
+	ostringstream rdid;
+	rdid << ckptNext;
+	EList<pair<string, string> > ents;
+	ents.push_back(make_pair(string("rdid"), rdid.str()));
+	ents.push_back(make_pair(string("output"), out.str()));
+	ents.push_back(make_pair(string("input"), seekable ? in.str() : string("-")));
+	ents.push_back(make_pair(string("counters"), alnCountersToString(met)));
+	ents.push_back(make_pair(string("splicesites"), sites.empty() ? string("-") : sites));
+	alnCkpt.set(ents);
+	if(!ckptSites.empty() && ckptSites != sites) {
+		remove(ckptSites.c_str());
+	}
+	ckptSites = sites;
+}
+
+/**
+ * Tell the checkpointing that this worker is done with the read it was
+ * last handed, if any.  'rpm' holds its counters not yet merged into
+ * mbox.sink.
+ */
+static inline void finishCheckpointedRead(
+	MetricsMailbox& mbox,
+	const ReportingMetrics& rpm,
+	bool& busy)
+{
+	if(!busy) return;
+	mbox.ckpt.reset();
+	mbox.ckpt.merge(mbox.sink);
+	mbox.ckpt.merge(rpm);
+	__sync_fetch_and_sub(&ckptBusy, 1); // also publishes mbox.ckpt
+	busy = false;
+}
+
+/**
+ * Get the next read/pair like PatternSourcePerThread::nextReadPair(), but
+ * save a checkpoint first if one is due.  'busy' is true iff this worker
+ * was handed a read last time, which it has now finished.
+ */
+static void nextReadCheckpointed(
+	PatternSourcePerThread& ps,
+	MetricsMailbox& mbox,
+	const ReportingMetrics& rpm,
+	int tid,
+	bool& busy,
+	bool& success,
+	bool& done,
+	bool& paired)
+{
+	finishCheckpointedRead(mbox, rpm, busy);
+	if(nthreads > 1 && useTempSpliceSite) {
+		// Between reads, don't hold back the workers that have one;
+		// the checkpoint waits for them
+		thread_rids[tid - 1] = std::numeric_limits<uint64_t>::max();
+	}
+	ThreadSafe t(&ckptMutex);
+	if(ckptNext >= ckptDue) {
+		while(ckptBusy > 0) {
+#if defined(_TTHREAD_WIN32_)
+			Sleep(0);
+#elif defined(_TTHREAD_POSIX_)
+			sched_yield();
+#endif
+		}
+		__sync_synchronize();
+		saveAlnCheckpoint();
+		ckptDue = ckptNext + ckptIval;
+	}
+	ps.nextReadPair(success, done, paired, outType != OUTPUT_SAM);
+	if(success) {
+		ckptNext = ps.rdid() + 1;
+		__sync_fetch_and_add(&ckptBusy, 1);
+		busy = true;
+	}
+}
+
 // Cyclic rotations
 #define ROTL(n, x) (((x) << (n)) | ((x) >> (32-n)))
 #define ROTR(n, x) (((x) >> (n)) | ((x) << (32-n)))
@@ -2818,7 +3384,7 @@ static inline void printEEScoreMsg(
 
 
 #define MERGE_METRICS(met, sync) { \
-	msink.mergeMetrics(rpm); \
+	mbox.sink.merge(rpm, false); \
 	met.merge( \
 		&olm, \
 		&sdm, \
@@ -2848,6 +3414,39 @@ static inline void printEEScoreMsg(
     him.reset(); \
 }
 
+#define MERGE_STAGES(met, sync) { \
+	if(prm.stages != NULL) { \
+		met.mergeStages(*prm.stages, sync); \
+		prm.stages->reset(); \
+	} \
+}
+
+/**
+ * Give up the CPU while spinning.
+ */
+static inline void yieldThread() {
+#if defined(_TTHREAD_WIN32_)
+	Sleep(0);
+#elif defined(_TTHREAD_POSIX_)
+	sched_yield();
+#endif
+}
+
+/**
+ * Hand the worker's counters over in its mailbox, first waiting for it to
+ * be emptied; at the end of the input or of a batch.
+ */
+#define HAND_OVER_METRICS() { \
+	while(mbox.full) { \
+		yieldThread(); \
+	} \
+	__sync_synchronize(); \
+	MERGE_METRICS(mbox.m, false); \
+	MERGE_STAGES(mbox.m, false); \
+	__sync_synchronize(); \
+	mbox.full = true; \
+}
+
 #define MERGE_SW(x) { \
 	x.merge( \
 		sseU8ExtendMet, \
@@ -2888,15 +3487,16 @@ void get_cpu_and_node(int& cpu, int& node) {
 static void multiseedSearchWorker_hisat(void *vp) {
 	int tid = *((int*)vp);
 	assert(multiseed_ebwtFw != NULL);
-	assert(multiseedMms == 0 || multiseed_ebwtBw != NULL);
+	assert(!bidirSearch || multiseed_ebwtBw != NULL);
 	PairedPatternSource&             patsrc   = *multiseed_patsrc;
 	const HierEbwt<index_t>&         ebwtFw   = *multiseed_ebwtFw;
-	const HierEbwt<index_t>&         ebwtBw   = *multiseed_ebwtBw;
+	const Ebwt<index_t>&             ebwtBw   = *multiseed_ebwtBw;
 	const Scoring&                   sc       = *multiseed_sc;
 	const BitPairReference&          ref      = *multiseed_refs;
 	AlignmentCache<index_t>&         scShared = *multiseed_ca;
 	AlnSink<index_t>&                msink    = *multiseed_msink;
 	OutFileBuf*                      metricsOfb = multiseed_metricsOfb;
+	OutFileBuf*                      stageOfb   = multiseed_stageOfb;
 
 #ifdef PER_THREAD_TIMING
 	uint64_t ncpu_changeovers = 0;
@@ -2963,6 +3563,8 @@ static void multiseedSearchWorker_hisat(void *vp) {
                                                           localAlign,
                                                           thread_rids_mindist,
                                                           no_spliced_alignment);
+    splicedAligner.setWorkBudget(budgetLF, budgetCells, budgetMs);
+    splicedAligner.setBidirectional(bidirSearch);
 	SwAligner sw;
 	OuterLoopMetrics olm;
 	SeedSearchMetrics sdm;
@@ -3007,11 +3609,24 @@ static void multiseedSearchWorker_hisat(void *vp) {
     
   	PerfMetrics metricsPt; // per-thread metrics object; for read-level metrics
 	BTString nametmp;
+	BTString contamRec;    // empty output for reads dropped by --filter-fa
 	
 	PerReadMetrics prm;
+	// Per-thread stage latencies; only collected if --stage-times-file,
+	// --trace-file or --hw-counters
+	StageMetrics stagesPt;
+	StageTrace* trace = (multiseed_traces != NULL) ? &multiseed_traces[tid - 1] : NULL;
+	curStageTrace() = trace;
+	HwCounters hwcPt;
+	auto_ptr<StageCounters> stageHwc;
+	if(hwCounters && hwcPt.open() > 0) {
+		stageHwc.reset(new StageCounters(hwcPt));
+	}
+	curStageCounters() = stageHwc.get();
+	prm.stages = (stageOfb != NULL || trace != NULL || stageHwc.get() != NULL) ? &stagesPt : NULL;
     
-	// Used by thread with threadid == 1 to measure time elapsed
-	time_t iTime = time(0);
+	// Periodic merges go to our mailbox rather than to the global metrics
+	MetricsMailbox& mbox = metricsBoxes[tid - 1];
     
 	// Keep track of whether last search was exhaustive for mates 1 and 2
 	bool exhaustive[2] = { false, false };
@@ -3031,17 +3646,43 @@ static void multiseedSearchWorker_hisat(void *vp) {
 	rndArb.init((uint32_t)time(0));
 	int mergei = 0;
 	int mergeival = 16;
+	bool ckptRead = false; // --checkpoint: was handed a read last time
+	uint64_t batch = 0;    // library interface: batch being aligned
+	if(poolOn) {
+		// Restarted after an exception: carry on with the same batch
+		tthread::lock_guard<tthread::mutex> guard(poolMutex);
+		batch = poolBatch;
+	}
 	while(true) {
 		bool success = false, done = false, paired = false;
-		ps->nextReadPair(success, done, paired, outType != OUTPUT_SAM);
+		{
+			StageTimer _st(prm.stages, STAGE_PARSE);
+			if(!ckptFile.empty()) {
+				nextReadCheckpointed(*ps, mbox, rpm, tid, ckptRead, success, done, paired);
+			} else {
+				ps->nextReadPair(success, done, paired, outType != OUTPUT_SAM);
+			}
+		}
 		if(!success && done) {
-			break;
+			if(!poolOn) break;
+			// Library interface: this batch is done; hand over its
+			// metrics, which are collected before the next one starts
+			HAND_OVER_METRICS();
+			if(!waitForBatch(batch)) return;
+			continue;
 		} else if(!success) {
 			continue;
 		}
 		TReadId rdid = ps->rdid();
         
         if(nthreads > 1 && useTempSpliceSite) {
+            // Publish the read we're on before waiting; otherwise a thread
+            // can end up waiting on its own stale entry (e.g. 0 when it
+            // starts after the others have raced ahead) and stall them all
+            assert_gt(tid, 0);
+            assert_leq(tid, thread_rids.size());
+            thread_rids[tid - 1] = rdid;
+            uint64_t waitBeg = 0;
             while(true) {
                 uint64_t min_rdid = 0;
                 {
@@ -3056,6 +3697,7 @@ static void multiseedSearchWorker_hisat(void *vp) {
                 }
                 
                 if(min_rdid + thread_rids_mindist < rdid) {
+                    if(waitBeg == 0 && trace != NULL) waitBeg = stageNanos();
 #if defined(_TTHREAD_WIN32_)
                     Sleep(0);
 #elif defined(_TTHREAD_POSIX_)
@@ -3063,6 +3705,7 @@ static void multiseedSearchWorker_hisat(void *vp) {
 #endif
                 } else break;
             }
+            if(waitBeg != 0) trace->add(TRACE_THROTTLE_WAIT, waitBeg, stageNanos());
         }
         
 		bool sample = true;
@@ -3080,24 +3723,15 @@ static void multiseedSearchWorker_hisat(void *vp) {
 			//
 			// Check if there is metrics reporting for us to do.
 			//
-			if(metricsIval > 0 &&
-			   (metricsOfb != NULL || metricsStderr) &&
-			   !metricsPerRead &&
-			   ++mergei == mergeival)
-			{
-				// Do a periodic merge.  Update global metrics, in a
-				// synchronized manner if needed.
-				MERGE_METRICS(metrics, nthreads > 1);
+			if(metricsThreadOn && ++mergei >= mergeival && !mbox.full) {
+				// Hand our counters to the metrics thread.  If it hasn't
+				// picked up the last batch yet, keep accumulating.
+				__sync_synchronize();
+				MERGE_METRICS(mbox.m, false);
+				MERGE_STAGES(mbox.m, false);
+				__sync_synchronize();
+				mbox.full = true;
 				mergei = 0;
-				// Check if a progress message should be printed
-				if(tid == 0) {
-					// Only thread 1 prints progress messages
-					time_t curTime = time(0);
-					if(curTime - iTime >= metricsIval) {
-						metrics.reportInterval(metricsOfb, metricsStderr, false, true, NULL);
-						iTime = curTime;
-					}
-				}
 			}
 			prm.reset(); // per-read metrics
 			prm.doFmString = false;
@@ -3116,6 +3750,19 @@ static void multiseedSearchWorker_hisat(void *vp) {
 				current_node = node;
 			}
 #endif
+			if(contamFilter != NULL &&
+			   contamFilter->matches(ps->bufa(), paired ? &ps->bufb() : NULL))
+			{
+				// Matches the --filter-fa contaminants; set it aside without
+				// aligning it, but keep its (empty) place in the output queue
+				rpm.ncontam++;
+				if(msink.readOut() != NULL) {
+					msink.readOut()->addFiltered(&ps->bufa(), paired ? &ps->bufb() : NULL, (size_t)tid);
+				}
+				contamRec.clear();
+				OutputQueueMark qqm(msink.outq(), contamRec, rdid, (size_t)tid, prm.stages);
+				retry = false;
+			}
 			// Try to align this read
 			while(retry) {
 				retry = false;
@@ -3358,6 +4005,7 @@ static void multiseedSearchWorker_hisat(void *vp) {
                 }
                 
 				// Commit and report paired-end/unpaired alignments
+				StageTimer _stSink(prm.stages, STAGE_SINK);
 				msinkwrap.finishRead(
                                      NULL,
                                      NULL,
@@ -3378,13 +4026,14 @@ static void multiseedSearchWorker_hisat(void *vp) {
                                      sc,                   // scoring scheme
                                      !seedSumm,            // suppress seed summaries?
                                      seedSumm);            // suppress alignments?
+				_stSink.stop();
 				assert(!retry || msinkwrap.empty());
                 
                 if(nthreads > 1 && useTempSpliceSite) {
                     // ThreadSafe t(&thread_rids_mutex, nthreads > 1);
                     assert_gt(tid, 0);
                     assert_leq(tid, thread_rids.size());
-                    assert(thread_rids[tid - 1] == 0 || rdid > thread_rids[tid - 1]);
+                    assert_eq(rdid, thread_rids[tid - 1]);
                     thread_rids[tid - 1] = rdid;
                 }
 			} // while(retry)
@@ -3393,16 +4042,20 @@ static void multiseedSearchWorker_hisat(void *vp) {
 			break;
 		}
 		if(metricsPerRead) {
-			MERGE_METRICS(metricsPt, nthreads > 1);
+			MERGE_METRICS(metricsPt, false);
 			nametmp = ps->bufa().name;
 			metricsPt.reportInterval(
                                      metricsOfb, metricsStderr, true, true, &nametmp);
 			metricsPt.reset();
 		}
 	} // while(true)
+	if(!ckptFile.empty()) {
+		finishCheckpointedRead(mbox, rpm, ckptRead);
+	}
 	
-	// One last metrics merge
-	MERGE_METRICS(metrics, nthreads > 1);
+	// One last metrics merge; the mailbox is emptied for the last time
+	// after all workers have finished
+	HAND_OVER_METRICS();
     
 #ifdef PER_THREAD_TIMING
 	ss.str("");
@@ -3416,31 +4069,78 @@ static void multiseedSearchWorker_hisat(void *vp) {
 }
 
 /**
- * Called once per alignment job.  Sets up global pointers to the
- * shared global data structures, creates per-thread structures, then
- * enters the search loop.
+ * Library interface: run multiseedSearchWorker_hisat, and if it throws,
+ * record the error for hisat_align() to return and start it over on the
+ * rest of the batch.  The read being aligned gets no records.
  */
-static void multiseedSearch(
-	Scoring& sc,
-	PairedPatternSource& patsrc,  // pattern source
-	AlnSink<index_t>& msink,             // hit sink
-	HierEbwt<index_t>& ebwtFw,                 // index of original text
-	HierEbwt<index_t>& ebwtBw,                 // index of mirror text
-    BitPairReference* refs,
-	OutFileBuf *metricsOfb)
-{
-    multiseed_patsrc = &patsrc;
-	multiseed_msink  = &msink;
-	multiseed_ebwtFw = &ebwtFw;
-	multiseed_ebwtBw = &ebwtBw;
-	multiseed_sc     = &sc;
-	multiseed_metricsOfb      = metricsOfb;
-	multiseed_refs = refs;
-	AutoArray<tthread::thread*> threads(nthreads);
-	AutoArray<int> tids(nthreads);
-	{
+static void multiseedSearchPoolWorker_hisat(void *vp) {
+	while(true) {
+		try {
+			multiseedSearchWorker_hisat(vp);
+			return;
+		} catch(std::exception& e) {
+			cerr << "Error: Encountered exception: '" << e.what() << "'" << endl;
+		} catch(int e) {
+			cerr << "Error: Encountered internal HISAT exception (#" << e << ")" << endl;
+		}
+		tthread::lock_guard<tthread::mutex> guard(poolMutex);
+		poolError = true;
+	}
+}
+
+/**
+ * Merge the metrics workers have deposited in their mailboxes into the
+ * global metrics and empty the mailboxes.  With all == true, every mailbox
+ * is emptied and its reporting metrics are handed to the AlnSink; only do
+ * that once the workers are done.
+ */
+static void drainMetricsMailboxes(bool all) {
+	for(int i = 0; i < nthreads; i++) {
+		MetricsMailbox& mb = metricsBoxes[i];
+		if(!all && !mb.full) continue;
+		__sync_synchronize();
+		metrics.mergeUpdates(mb.m, false);
+		mb.m.reset();
+		if(all) {
+			multiseed_msink->mergeMetrics(mb.sink, false);
+			mb.sink.reset();
+		}
+		__sync_synchronize();
+		mb.full = false;
+	}
+}
+
+/**
+ * Metrics thread.  Collects what the workers deposit in their mailboxes
+ * and writes an interval report every metricsIval seconds.
+ */
+static void metricsThread(void *vp) {
+	OutFileBuf* metricsOfb = multiseed_metricsOfb;
+	OutFileBuf* stageOfb   = multiseed_stageOfb;
+	time_t iTime = time(0);
+	while(!metricsThreadDone) {
+		tthread::this_thread::sleep_for(tthread::chrono::milliseconds(100));
+		drainMetricsMailboxes(false);
+		time_t curTime = time(0);
+		if(curTime - iTime >= metricsIval) {
+			if(metricsOfb != NULL || metricsStderr) {
+				metrics.reportInterval(metricsOfb, metricsStderr, false, false, NULL);
+			}
+			if(stageOfb != NULL) {
+				metrics.reportStages(stageOfb, false);
+			}
+			iTime = curTime;
+		}
+	}
+}
+
+/**
+ * Load the parts of the indexes the search needs that aren't loaded yet;
+ * with --two-pass they're still resident from the first pass.
+ */
+static void loadIndexes(HierEbwt<index_t>& ebwtFw, Ebwt<index_t>& ebwtBw) {
+	if(!ebwtFw.isInMemory()) {
 		// Load the other half of the index into memory
-		assert(!ebwtFw.isInMemory());
 		Timer _t(cerr, "Time loading forward index: ", timing);
 		ebwtFw.loadIntoMemory(
 			0,  // colorspace?
@@ -3451,24 +4151,121 @@ static void multiseedSearch(
 			!noRefNames,  // load names?
 			startVerbose);
 	}
-#if 0
-	if(multiseedMms > 0 || do1mmUpFront) {
+	if(bidirSearch && !ebwtBw.isInMemory()) {
 		// Load the other half of the index into memory
-		assert(!ebwtBw.isInMemory());
 		Timer _t(cerr, "Time loading mirror index: ", timing);
 		ebwtBw.loadIntoMemory(
 			0, // colorspace?
 			// It's bidirectional search, so we need the reverse to be
 			// constructed as the reverse of the concatenated strings.
 			1,
-			true,        // load SA samp in reverse index
+			false,        // don't need SA samp in reverse index
 			true,         // yes, need ftab in reverse index
-			true,        // load rstarts in reverse index
-			!noRefNames,  // load names?
+			false,        // don't need rstarts in reverse index
+			false,        // don't need names
 			startVerbose);
 	}
-#endif
+}
+
+/**
+ * Write the per-thread timelines collected for --trace-file as a Chrome
+ * trace (JSON object format), readable by chrome://tracing and Perfetto.
+ * Timestamps are relative to 'origin', the start of the search.
+ */
+static void writeTrace(const string& fn, const StageTrace* traces, uint64_t origin) {
+	ofstream out(fn.c_str());
+	if(!out.is_open()) {
+		cerr << "Error: could not open trace file \"" << fn.c_str() << "\" for writing" << endl;
+		throw 1;
+	}
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+	    << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"hisat-align\"}}";
+	uint64_t dropped = 0;
+	for(int i = 0; i < nthreads; i++) {
+		out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << (i+1)
+		    << ",\"args\":{\"name\":\"worker " << (i+1) << "\"}}";
+		traces[i].printJson(out, i+1, origin);
+		dropped += traces[i].dropped();
+	}
+	out << "\n]}\n";
+	out.close();
+	if(out.fail()) {
+		cerr << "Error: could not write trace file \"" << fn.c_str() << "\"" << endl;
+		throw 1;
+	}
+	if(dropped > 0) {
+		cerr << "Warning: " << dropped << " trace events didn't fit in the per-thread buffers; "
+		     << "only the latest were kept.  Use a shorter --trace-secs to see the whole window." << endl;
+	}
+}
+
+/**
+ * Called once per alignment job.  Sets up global pointers to the
+ * shared global data structures, creates per-thread structures, then
+ * enters the search loop.
+ */
+static void multiseedSearch(
+	Scoring& sc,
+	PairedPatternSource& patsrc,  // pattern source
+	AlnSink<index_t>& msink,             // hit sink
+	HierEbwt<index_t>& ebwtFw,                 // index of original text
+	Ebwt<index_t>& ebwtBw,                     // index of mirror text
+    BitPairReference* refs,
+	OutFileBuf *metricsOfb,
+	OutFileBuf *stageOfb,
+	bool trace)                  // record the --trace-file timeline?
+{
+    multiseed_patsrc = &patsrc;
+	multiseed_msink  = &msink;
+	multiseed_ebwtFw = &ebwtFw;
+	multiseed_ebwtBw = &ebwtBw;
+	multiseed_sc     = &sc;
+	multiseed_metricsOfb      = metricsOfb;
+	multiseed_stageOfb        = stageOfb;
+	multiseed_refs = refs;
+	AutoArray<tthread::thread*> threads(nthreads);
+	AutoArray<int> tids(nthreads);
+	loadIndexes(ebwtFw, ebwtBw);
+	metricsBoxes = new MetricsMailbox[nthreads];
 	// Start the metrics thread
+	metricsThreadOn = metricsIval > 0 &&
+	                  (metricsOfb != NULL || metricsStderr || stageOfb != NULL) &&
+	                  !metricsPerRead;
+	metricsThreadDone = false;
+	tthread::thread* mthread = NULL;
+	if(metricsThreadOn) {
+		mthread = new tthread::thread(metricsThread, NULL);
+	}
+	if(hwCounters) {
+		// Find out up front which events can be counted, so that the
+		// workers don't each complain
+		HwCounters probe;
+		if(probe.open() == 0) {
+			cerr << "Warning: --hw-counters: hardware events can't be counted ("
+			     << strerror(probe.error()) << "); ignoring" << endl;
+			hwCounters = false;
+		} else {
+			for(int i = 0; i < HWC_NUM; i++) {
+				if(!probe.has(i)) {
+					cerr << "Warning: --hw-counters: " << hwc_names[i]
+					     << " can't be counted on this machine; reporting 0" << endl;
+				}
+			}
+		}
+		if(hwCounters && metricsOfb == NULL && !metricsStderr && stageOfb == NULL) {
+			cerr << "Warning: --hw-counters has no effect without --met-file, --met-stderr "
+			     << "or --stage-times-file" << endl;
+		}
+	}
+	// Timelines for --trace-file; events outside the window are ignored
+	uint64_t traceOrigin = stageNanos();
+	if(trace && !traceFile.empty()) {
+		uint64_t beg = traceOrigin + (uint64_t)traceStart * 1000000000ull;
+		multiseed_traces = new StageTrace[nthreads];
+		for(int i = 0; i < nthreads; i++) {
+			multiseed_traces[i].init(TRACE_EVENTS_PER_THREAD, beg, beg + (uint64_t)traceSecs * 1000000000ull);
+		}
+	}
 	{
 		Timer _t(cerr, "Multiseed full-index search: ", timing);
         
@@ -3486,38 +4283,148 @@ static void multiseedSearch(
             threads[i]->join();
 
 	}
+	if(mthread != NULL) {
+		metricsThreadDone = true;
+		mthread->join();
+		delete mthread;
+	}
+	drainMetricsMailboxes(true);
+	delete[] metricsBoxes;
+	metricsBoxes = NULL;
 	if(!metricsPerRead && (metricsOfb != NULL || metricsStderr)) {
 		metrics.reportInterval(metricsOfb, metricsStderr, true, false, NULL);
 	}
+	if(stageOfb != NULL) {
+		metrics.reportStages(stageOfb, false);
+	}
+	if(hwCounters && metrics.stm.hwMultiplexed) {
+		cerr << "Warning: --hw-counters: the kernel had to share the counters with other "
+		     << "users at times, so some counts are too low" << endl;
+	}
+	if(multiseed_traces != NULL) {
+		writeTrace(traceFile, multiseed_traces, traceOrigin);
+		delete[] multiseed_traces;
+		multiseed_traces = NULL;
+	}
 }
 
 static string argstr;
 
 extern void initializeCntLut();
 
-template<typename TStr>
-static void driver(
-	const char * type,
-	const string& bt2indexBase,
-	const string& outfile)
-{
-	if(gVerbose || startVerbose)  {
-		cerr << "Entered driver(): "; logTime(cerr, true);
+/**
+ * Identify the options of a run for --checkpoint, so that --resume only
+ * picks up a checkpoint saved by the same command.  The read file names
+ * are left out, as the wrapper feeds compressed reads through named pipes
+ * whose names change from run to run, and so are the thread count and
+ * the checkpoint interval, which can change between runs.
+ */
+static uint64_t alignFingerprint(int argc, const char **argv) {
+	static const char *skipArg[] = { "-1", "-2", "-U", "--12", "-p", "--threads", "--checkpoint-ival" };
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(int i = 1; i < argc; i++) {
+		string a = argv[i];
+		if(a == "--resume") continue;
+		bool skip = false;
+		for(size_t j = 0; j < sizeof(skipArg) / sizeof(skipArg[0]); j++) {
+			string opt = skipArg[j];
+			if(a == opt) {
+				i++; // and its argument
+				skip = true;
+			} else if(a.compare(0, opt.length() + 1, opt + "=") == 0 ||
+			          (opt.length() == 2 && a.length() > 2 && a.compare(0, 2, opt) == 0))
+			{
+				skip = true;
+			}
+		}
+		if(!skip) fnvHash(h, a.c_str(), a.length() + 1);
 	}
-    
-    initializeCntLut();   
-    
-	// Vector of the reference sequences; used for sanity-checking
-	EList<SString<char> > names, os;
-	EList<size_t> nameLens, seqLens;
-	// Read reference sequences from the command-line or from a FASTA file
-	if(!origString.empty()) {
-		// Read fasta file(s)
-		EList<string> origFiles;
-		tokenize(origString, ",", origFiles);
-		parseFastas(origFiles, names, nameLens, os, seqLens);
+	return h;
+}
+
+/**
+ * Start keeping a checkpoint in ckptFile.  With --resume, pick up the one
+ * an interrupted run left there: truncate the output to what it had
+ * written, move the input past the reads it had finished and restore its
+ * counters; the splice site snapshot is loaded later, into the DB.  Where
+ * the input can't seek (stdin, pipes, formats not parsed in whole blocks),
+ * the finished reads are parsed again but not aligned.  Returns true iff
+ * the run is a continuation.
+ */
+static bool resumeAlignment(PairedPatternSource& patsrc) {
+	ckptMet.reset();
+	ckptSites.clear();
+	string rdidStr;
+	if(!alnCkpt.init(ckptFile, ckptFingerprint, resume) || !alnCkpt.get("rdid", rdidStr)) {
+		// Nothing saved yet
+		return false;
 	}
-	PatternParams pp(
+	string outStr, in, counters, sites;
+	TReadId rdid = 0;
+	int64_t outSize = -1;
+	if(!alnCkpt.get("output", outStr) || !alnCkpt.get("input", in) ||
+	   !alnCkpt.get("counters", counters) || !alnCkpt.get("splicesites", sites) ||
+	   (istringstream(rdidStr) >> rdid).fail() || (istringstream(outStr) >> outSize).fail() ||
+	   !alnCountersFromString(counters, ckptMet))
+	{
+		cerr << "Error: checkpoint \"" << ckptFile.c_str() << "\" is malformed" << endl;
+		throw 1;
+	}
+	if(BuildCheckpoint::sizeOf(outfile) < outSize ||
+	   truncate(outfile.c_str(), (off_t)outSize) != 0)
+	{
+		cerr << "Error: could not restore \"" << outfile.c_str() << "\" to the " << outSize
+		     << " bytes it had at the checkpoint" << endl;
+		throw 1;
+	}
+	istringstream is(in);
+	bool seeked = in != "-" && patsrc.seek(is);
+	if(!seeked) {
+		patsrc.reset();
+	}
+	if(sites != "-") {
+		ckptSites = sites;
+	}
+	// With the input moved on, reads keep the rdids they had; otherwise
+	// the finished ones are skipped like -s skips
+	if(rdid > skipReads) {
+		skipReads = rdid;
+	}
+	if(!gQuiet) {
+		cerr << "Resuming from read " << rdid << " of \"" << ckptFile.c_str() << "\""
+		     << (seeked ? "" : "; re-reading the input up to there") << endl;
+	}
+	return true;
+}
+
+/**
+ * Load the splice sites given with --known-splicesite-infile and
+ * --novel-splicesite-infile into the given DB.
+ */
+static void loadSpliceSites(SpliceSiteDB& db) {
+    if(knownSpliceSiteInfile != "") {
+        ifstream ssdb_file(knownSpliceSiteInfile.c_str(), ios::in);
+        if(ssdb_file.is_open()) {
+            db.read(ssdb_file,
+                    true); // known splice sites
+            ssdb_file.close();
+        }
+    }
+    if(novelSpliceSiteInfile != "") {
+        ifstream ssdb_file(novelSpliceSiteInfile.c_str(), ios::in);
+        if(ssdb_file.is_open()) {
+            db.read(ssdb_file,
+                    false); // novel splice sites
+            ssdb_file.close();
+        }
+    }
+}
+
+/**
+ * Return the read-in parameters given by the options.
+ */
+static PatternParams patternParams() {
+	return PatternParams(
 		format,        // file format
 		fileParallel,  // true -> wrap files with separate PairedPatternSources
 		seed,          // pseudo-random seed
@@ -3528,8 +4435,233 @@ static void driver(
 		fuzzy,         // true -> try to parse fuzzy fastq
 		fastaContLen,  // length of sampled reads for FastaContinuous...
 		fastaContFreq, // frequency of sampled reads for FastaContinuous...
-		skipReads      // skip the first 'skip' patterns
+		skipReads,     // skip the first 'skip' patterns
+		shardIdx,      // dispense only this shard's reads/pairs...
+		nShards        // ...out of this many
 	);
+}
+
+/**
+ * Return a new scoring scheme set up from the options.
+ */
+static Scoring* newScoring() {
+	if(bonusMatch > 0 && !localAlign) {
+		cerr << "Warning: Match bonus always = 0 in --end-to-end mode; ignoring user setting" << endl;
+		bonusMatch = 0;
+	}
+	return new Scoring(
+		bonusMatch,     // constant reward for match
+		penMmcType,     // how to penalize mismatches
+		penMmcMax,      // max mm pelanty
+		penMmcMin,      // min mm pelanty
+		scoreMin,       // min score as function of read len
+		nCeil,          // max # Ns as function of read len
+		penNType,       // how to penalize Ns in the read
+		penN,           // constant if N pelanty is a constant
+		penNCatPair,    // whether to concat mates before N filtering
+		penRdGapConst,  // constant coeff for read gap cost
+		penRfGapConst,  // constant coeff for ref gap cost
+		penRdGapLinear, // linear coeff for read gap cost
+		penRfGapLinear, // linear coeff for ref gap cost
+		gGapBarrier,    // # rows at top/bot only entered diagonally
+        penCanSplice,   // canonical splicing penalty
+        penNoncanSplice,// non-canonical splicing penalty
+        penConflictSplice, // conflicting splice site penalty
+        &penIntronLen);  // penalty as to intron length
+}
+
+/**
+ * Return new SAM settings from the options, for the given references.
+ */
+static SamConfig* newSamConfig(
+	const EList<string>& refnames,
+	const EList<size_t>& reflens)
+{
+	return new SamConfig(
+		refnames,               // reference sequence names
+		reflens,                // reference sequence lengths
+		samTruncQname,          // whether to truncate QNAME to 255 chars
+		samOmitSecSeqQual,      // omit SEQ/QUAL for 2ndary alignments?
+		samNoUnal,              // omit unaligned-read records?
+		string("hisat"),      // program id
+		string("hisat"),      // program name
+		string(HISAT_VERSION), // program version
+		argstr,                 // command-line
+		rgs_optflag,            // read-group string
+        rna_strandness,
+		sam_print_as,
+		sam_print_xs,
+		sam_print_xss,
+		sam_print_yn,
+		sam_print_xn,
+		sam_print_cs,
+		sam_print_cq,
+		sam_print_x0,
+		sam_print_x1,
+		sam_print_xm,
+		sam_print_xo,
+		sam_print_xg,
+		sam_print_nm,
+		sam_print_md,
+		sam_print_yf,
+		sam_print_yi,
+		sam_print_ym,
+		sam_print_yp,
+		sam_print_yt,
+		sam_print_ys,
+		sam_print_zs,
+		sam_print_xr,
+		sam_print_xt,
+		sam_print_xd,
+		sam_print_xu,
+		sam_print_yl,
+		sam_print_ye,
+		sam_print_yu,
+		sam_print_xp,
+		sam_print_yr,
+		sam_print_zb,
+		sam_print_zr,
+		sam_print_zf,
+		sam_print_zm,
+		sam_print_zi,
+		sam_print_zp,
+		sam_print_zu,
+        sam_print_xs_a,
+        sam_print_nh);
+}
+
+/**
+ * Return the global index, with just its header read in; adjIdxBase must
+ * have been set.
+ */
+static HierEbwt<index_t, local_index_t>* newIndex() {
+	return new HierEbwt<index_t, local_index_t>(
+		adjIdxBase,
+	    0,        // index is colorspace
+		-1,       // fw index
+	    true,     // index is for the forward direction
+	    /* overriding: */ offRate,
+		0, // amount to add to index offrate or <= 0 to do nothing
+	    useMm,    // whether to use memory-mapped files
+	    useShmem, // whether to use shared memory
+	    mmSweep,  // sweep memory-mapped files
+	    !noRefNames, // load names?
+		true,        // load SA sample?
+		true,        // load ftab?
+		true,        // load rstarts?
+	    gVerbose, // whether to be talkative
+	    startVerbose, // talkative during initialization
+	    false /*passMemExc*/,
+	    sanityCheck);
+}
+
+/**
+ * Return the global mirror index, with just its header read in, or NULL
+ * without --bidir.  Only the global one is needed: partial hits are found
+ * in the global index before any local index is consulted.
+ */
+static Ebwt<index_t>* newMirrorIndex() {
+	if(!bidirSearch) return NULL;
+	if(gVerbose || startVerbose) {
+		cerr << "About to initialize rev Ebwt: "; logTime(cerr, true);
+	}
+	return new Ebwt<index_t>(
+		adjIdxBase + ".rev",
+		0,       // index is colorspace
+		1,       // need the reverse of the concatenated reference
+	    false, // index is for the reverse direction
+	    /* overriding: */ offRate,
+		0, // amount to add to index offrate or <= 0 to do nothing
+	    useMm,    // whether to use memory-mapped files
+	    useShmem, // whether to use shared memory
+	    mmSweep,  // sweep memory-mapped files
+	    false,       // load names?
+		false,       // load SA sample?
+		true,        // load ftab?
+		false,       // load rstarts?
+	    gVerbose,    // whether to be talkative
+	    startVerbose, // talkative during initialization
+	    false /*passMemExc*/,
+	    sanityCheck);
+}
+
+/**
+ * Return the reference sequences, for dynamic programming.  Throws if
+ * they can't be loaded.
+ */
+static BitPairReference* newReference() {
+	Timer _t(cerr, "Time loading reference: ", timing);
+	auto_ptr<BitPairReference> refs(
+		new BitPairReference(
+			adjIdxBase,
+			false,
+			sanityCheck,
+			NULL,
+			NULL,
+			false,
+			useMm,
+			useShmem,
+			mmSweep,
+			gVerbose,
+			startVerbose));
+	if(!refs->loaded()) throw 1;
+	return refs.release();
+}
+
+/**
+ * Return the contaminant pre-filter built from --filter-fa, or NULL if
+ * there is none.
+ */
+static ContamFilter* newContamFilter() {
+	if(filterFastas.empty()) return NULL;
+	Timer _t(cerr, "Time building contaminant filter: ", timing);
+	ContamFilter* contam = new ContamFilter(filterK, filterFrac);
+	contam->build(filterFastas);
+	if(gVerbose || startVerbose) {
+		cerr << "Contaminant filter: " << contam->numKmers() << " " << filterK
+		     << "-mers in " << contam->bytes() << " bytes" << endl;
+	}
+	return contam;
+}
+
+/**
+ * Return the splice signal track written by hisat-build --ss-track, or
+ * NULL if there is none or it isn't wanted.
+ */
+static SpliceTrack* newSpliceTrack(const BitPairReference& refs) {
+	if(noSsTrack || no_spliced_alignment) return NULL;
+	Timer _t(cerr, "Time loading splice signal track: ", timing);
+	SpliceTrack* ssTrack = new SpliceTrack();
+	if(!ssTrack->read(adjIdxBase + ".ss." + gEbwt_ext, refs, gVerbose || startVerbose)) {
+		delete ssTrack;
+		return NULL;
+	}
+	return ssTrack;
+}
+
+template<typename TStr>
+static void driver(
+	const char * type,
+	const string& bt2indexBase,
+	const string& outfile)
+{
+	if(gVerbose || startVerbose)  {
+		cerr << "Entered driver(): "; logTime(cerr, true);
+	}
+    
+    initializeCntLut();   
+    
+	// Vector of the reference sequences; used for sanity-checking
+	EList<SString<char> > names, os;
+	EList<size_t> nameLens, seqLens;
+	// Read reference sequences from the command-line or from a FASTA file
+	if(!origString.empty()) {
+		// Read fasta file(s)
+		EList<string> origFiles;
+		tokenize(origString, ",", origFiles);
+		parseFastas(origFiles, names, nameLens, os, seqLens);
+	}
+	PatternParams pp = patternParams();
 	if(gVerbose || startVerbose) {
 		cerr << "Creating PatternSource: "; logTime(cerr, true);
 	}
@@ -3551,9 +4683,13 @@ static void driver(
 	if(gVerbose || startVerbose) {
 		cerr << "Opening hit output file: "; logTime(cerr, true);
 	}
+	bool resumed = false;
+	if(!ckptFile.empty()) {
+		resumed = resumeAlignment(*patsrc);
+	}
 	OutFileBuf *fout;
 	if(!outfile.empty()) {
-		fout = new OutFileBuf(outfile.c_str(), false);
+		fout = new OutFileBuf(outfile.c_str(), false, resumed);
 	} else {
 		fout = new OutFileBuf();
 	}
@@ -3562,51 +4698,9 @@ static void driver(
 		cerr << "About to initialize fw Ebwt: "; logTime(cerr, true);
 	}
 	adjIdxBase = adjustEbwtBase(argv0, bt2indexBase, gVerbose);
-	HierEbwt<index_t, local_index_t> ebwt(
-		adjIdxBase,
-	    0,        // index is colorspace
-		-1,       // fw index
-	    true,     // index is for the forward direction
-	    /* overriding: */ offRate,
-		0, // amount to add to index offrate or <= 0 to do nothing
-	    useMm,    // whether to use memory-mapped files
-	    useShmem, // whether to use shared memory
-	    mmSweep,  // sweep memory-mapped files
-	    !noRefNames, // load names?
-		true,        // load SA sample?
-		true,        // load ftab?
-		true,        // load rstarts?
-	    gVerbose, // whether to be talkative
-	    startVerbose, // talkative during initialization
-	    false /*passMemExc*/,
-	    sanityCheck);
-	HierEbwt<index_t, local_index_t>* ebwtBw = NULL;
-#if 0
-	// We need the mirror index if mismatches are allowed
-	if(multiseedMms > 0 || do1mmUpFront) {
-		if(gVerbose || startVerbose) {
-			cerr << "About to initialize rev Ebwt: "; logTime(cerr, true);
-		}
-		ebwtBw = new HierEbwt<index_t, local_index_t>(
-			adjIdxBase + ".rev",
-			0,       // index is colorspace
-			1,       // TODO: maybe not
-		    false, // index is for the reverse direction
-		    /* overriding: */ offRate,
-			0, // amount to add to index offrate or <= 0 to do nothing
-		    useMm,    // whether to use memory-mapped files
-		    useShmem, // whether to use shared memory
-		    mmSweep,  // sweep memory-mapped files
-		    !noRefNames, // load names?
-			true,        // load SA sample?
-			true,        // load ftab?
-			true,        // load rstarts?
-		    gVerbose,    // whether to be talkative
-		    startVerbose, // talkative during initialization
-		    false /*passMemExc*/,
-		    sanityCheck);
-	}
-#endif
+	auto_ptr<HierEbwt<index_t, local_index_t> > ebwtp(newIndex());
+	HierEbwt<index_t, local_index_t>& ebwt = *ebwtp.get();
+	Ebwt<index_t>* ebwtBw = newMirrorIndex();
 	if(sanityCheck && !os.empty()) {
 		// Sanity check number of patterns and pattern lengths in Ebwt
 		// against original strings
@@ -3630,118 +4724,80 @@ static void driver(
 	}
 	OutputQueue oq(
 		*fout,                   // out file buffer
-		reorder && nthreads > 1, // whether to reorder when there's >1 thread
+		reorder && nthreads > 1 && !sortedBam, // whether to reorder when there's >1 thread
 		nthreads,                // # threads
 		nthreads > 1,            // whether to be thread-safe
 		skipReads);              // first read will have this rdid
 	{
 		Timer _t(cerr, "Time searching: ", timing);
-		// Set up penalities
-		if(bonusMatch > 0 && !localAlign) {
-			cerr << "Warning: Match bonus always = 0 in --end-to-end mode; ignoring user setting" << endl;
-			bonusMatch = 0;
-		}
-		Scoring sc(
-			bonusMatch,     // constant reward for match
-			penMmcType,     // how to penalize mismatches
-			penMmcMax,      // max mm pelanty
-			penMmcMin,      // min mm pelanty
-			scoreMin,       // min score as function of read len
-			nCeil,          // max # Ns as function of read len
-			penNType,       // how to penalize Ns in the read
-			penN,           // constant if N pelanty is a constant
-			penNCatPair,    // whether to concat mates before N filtering
-			penRdGapConst,  // constant coeff for read gap cost
-			penRfGapConst,  // constant coeff for ref gap cost
-			penRdGapLinear, // linear coeff for read gap cost
-			penRfGapLinear, // linear coeff for ref gap cost
-			gGapBarrier,    // # rows at top/bot only entered diagonally
-            penCanSplice,   // canonical splicing penalty
-            penNoncanSplice,// non-canonical splicing penalty
-            penConflictSplice, // conflicting splice site penalty
-            &penIntronLen);  // penalty as to intron length
+		auto_ptr<Scoring> scp(newScoring());
+		Scoring& sc = *scp.get();
 		EList<size_t> reflens;
 		for(size_t i = 0; i < ebwt.nPat(); i++) {
 			reflens.push_back(ebwt.plen()[i]);
 		}
 		EList<string> refnames;
 		readEbwtRefnames<index_t>(adjIdxBase, refnames);
-		SamConfig samc(
-			refnames,               // reference sequence names
-			reflens,                // reference sequence lengths
-			samTruncQname,          // whether to truncate QNAME to 255 chars
-			samOmitSecSeqQual,      // omit SEQ/QUAL for 2ndary alignments?
-			samNoUnal,              // omit unaligned-read records?
-			string("hisat"),      // program id
-			string("hisat"),      // program name
-			string(HISAT_VERSION), // program version
-			argstr,                 // command-line
-			rgs_optflag,            // read-group string
-            rna_strandness,
-			sam_print_as,
-			sam_print_xs,
-			sam_print_xss,
-			sam_print_yn,
-			sam_print_xn,
-			sam_print_cs,
-			sam_print_cq,
-			sam_print_x0,
-			sam_print_x1,
-			sam_print_xm,
-			sam_print_xo,
-			sam_print_xg,
-			sam_print_nm,
-			sam_print_md,
-			sam_print_yf,
-			sam_print_yi,
-			sam_print_ym,
-			sam_print_yp,
-			sam_print_yt,
-			sam_print_ys,
-			sam_print_zs,
-			sam_print_xr,
-			sam_print_xt,
-			sam_print_xd,
-			sam_print_xu,
-			sam_print_yl,
-			sam_print_ye,
-			sam_print_yu,
-			sam_print_xp,
-			sam_print_yr,
-			sam_print_zb,
-			sam_print_zr,
-			sam_print_zf,
-			sam_print_zm,
-			sam_print_zi,
-			sam_print_zp,
-			sam_print_zu,
-            sam_print_xs_a,
-            sam_print_nh);
+		auto_ptr<SamConfig> samcp(newSamConfig(refnames, reflens));
+		SamConfig& samc = *samcp.get();
 		// Set up hit sink; if sanityCheck && !os.empty() is true,
 		// then instruct the sink to "retain" hits in a vector in
 		// memory so that we can easily sanity check them later on
 		AlnSink<index_t> *mssink = NULL;
-        Timer *_tRef = new Timer(cerr, "Time loading reference: ", timing);
-        auto_ptr<BitPairReference> refs(
-                                        new BitPairReference(
-                                                             adjIdxBase,
-                                                             false,
-                                                             sanityCheck,
-                                                             NULL,
-                                                             NULL,
-                                                             false,
-                                                             useMm,
-                                                             useShmem,
-                                                             mmSweep,
-                                                             gVerbose,
-                                                             startVerbose)
-                                        );
-        delete _tRef;
-        if(!refs->loaded()) throw 1;
+		BamSorter *bamSorter = NULL;
+        auto_ptr<BitPairReference> refs(newReference());
+        
+        // Build the contaminant pre-filter, if any
+        auto_ptr<ContamFilter> contam(newContamFilter());
+        contamFilter = contam.get();
         
         init_junction_prob();
-        bool write = novelSpliceSiteOutfile != "" || useTempSpliceSite;
-        bool read = knownSpliceSiteInfile != "" || novelSpliceSiteInfile != "" || useTempSpliceSite;
+        // Splice signal track written by hisat-build --ss-track, if any
+        auto_ptr<SpliceTrack> ssTrack(newSpliceTrack(*(refs.get())));
+        string pass1Sites; // splice sites found in the first pass of --two-pass
+        if(twoPass) {
+            // First pass: align the reads (or the first --two-pass-reads of
+            // them) with output discarded, only to collect splice sites.
+            // The index and reference stay loaded for the second pass.
+            Timer _t(cerr, "Time for first pass: ", timing);
+            ssdb = new SpliceSiteDB(
+                                    *(refs.get()),
+                                    refnames,
+                                    nthreads > 1, // thread-safe
+                                    true,  // write?
+                                    true); // read?
+            ssdb->setTrack(ssTrack.get());
+            loadSpliceSites(*ssdb);
+            OutputQueue oq1(*fout, false, nthreads, nthreads > 1, skipReads);
+            oq1.setDiscard(true);
+            AlnSinkSam<index_t> sink1(oq1, samc, refnames, true, ssdb);
+            TReadId origQUpto = qUpto;
+            if(twoPassReads > 0) {
+                qUpto = min<TReadId>(qUpto, skipReads + twoPassReads);
+            }
+            // Only the second pass goes in the --trace-file timeline
+            multiseedSearch(sc, *patsrc, sink1, ebwt, *ebwtBw, refs.get(), NULL, NULL, false);
+            qUpto = origQUpto;
+            patsrc->reset();
+            metrics.reset();
+            // Keep the same sites --novel-splicesite-outfile would report
+            ostringstream os;
+            ssdb->print(os);
+            pass1Sites = os.str();
+            delete ssdb;
+            ssdb = NULL;
+            if(novelSpliceSiteOutfile != "") {
+                ofstream ssdb_file(novelSpliceSiteOutfile.c_str(), ios::out);
+                if(ssdb_file.is_open()) {
+                    ssdb_file << pass1Sites;
+                    ssdb_file.close();
+                }
+            }
+        }
+        // With --two-pass, the second pass aligns against the frozen set of
+        // sites from the first, so the DB is read-only and needs no locking
+        bool write = !twoPass && (novelSpliceSiteOutfile != "" || useTempSpliceSite);
+        bool read = twoPass || knownSpliceSiteInfile != "" || novelSpliceSiteInfile != "" || useTempSpliceSite;
         ssdb = new SpliceSiteDB(
                                 *(refs.get()),
                                 refnames,
@@ -3749,21 +4805,22 @@ static void driver(
                                 write, // write?
                                 read);  // read?
         if(ssdb != NULL) {
-            if(knownSpliceSiteInfile != "") {
-                ifstream ssdb_file(knownSpliceSiteInfile.c_str(), ios::in);
-                if(ssdb_file.is_open()) {
-                    ssdb->read(ssdb_file,
-                               true); // known splice sites
-                    ssdb_file.close();
+            ssdb->setTrack(ssTrack.get());
+            loadSpliceSites(*ssdb);
+            if(!ckptSites.empty()) {
+                ifstream is(ckptSites.c_str());
+                if(!is.is_open()) {
+                    cerr << "Error: could not open splice site snapshot \"" << ckptSites.c_str() << "\"" << endl;
+                    throw 1;
                 }
+                ssdb->load(is);
             }
-            if(novelSpliceSiteInfile != "") {
-                ifstream ssdb_file(novelSpliceSiteInfile.c_str(), ios::in);
-                if(ssdb_file.is_open()) {
-                    ssdb->read(ssdb_file,
-                               false); // novel splice sites
-                    ssdb_file.close();
-                }
+            if(twoPass) {
+                istringstream is(pass1Sites);
+                ssdb->read(is,
+                           false); // novel splice sites
+                // No new sites are learned, so threads needn't stay in step
+                useTempSpliceSite = false;
             }
         }
 		switch(outType) {
@@ -3774,10 +4831,27 @@ static void driver(
 					refnames,     // reference names
 					gQuiet,       // don't print alignment summary at end
                     ssdb);
-				if(!samNoHead) {
+				BTString buf;
+				if(!samNoHead && !resumed) {
 					bool printHd = true, printSq = true;
-					BTString buf;
-					samc.printHeader(buf, rgid, rgs, printHd, !samNoSQ, printSq);
+					samc.printHeader(buf, rgid, rgs, printHd, !samNoSQ, printSq,
+					                 sortedBam ? "coordinate" : "unsorted");
+				}
+				if(sortedBam) {
+					const char *tmpdir = getenv("TMPDIR");
+					string tmpPrefix = !outfile.empty() ? outfile :
+						string(tmpdir != NULL ? tmpdir : "/tmp") + "/hisat";
+					bamSorter = new BamSorter(
+						*fout,                     // BAM output
+						refnames,                  // reference names
+						reflens,                   // reference lengths
+						nthreads,                  // # threads
+						sortMemMB * 1024 * 1024,   // memory budget
+						tmpPrefix + ".sort",       // temp file prefix
+						-1);                       // zlib default compression
+					bamSorter->setHeader(buf);
+					oq.setBamSorter(bamSorter);
+				} else {
 					fout->writeString(buf);
 				}
 				break;
@@ -3786,6 +4860,17 @@ static void driver(
 				cerr << "Invalid output type: " << outType << endl;
 				throw 1;
 		}
+		// Open the --un/--al/--un-conc/--al-conc files, if any
+		ReadOutFiles readOut;
+		for(int i = 0; i < READ_OUT_NUM; i++) {
+			if(!readOutFns[i].empty()) {
+				readOut.open(i, readOutFns[i], readOutCompress[i]);
+			}
+		}
+		if(!readOut.empty()) {
+			readOut.init(nthreads); // thread ids start at 1
+			mssink->setReadOut(&readOut);
+		}
 		if(gVerbose || startVerbose) {
 			cerr << "Dispatching to search driver: "; logTime(cerr, true);
 		}
@@ -3794,6 +4879,18 @@ static void driver(
 		if(!metricsFile.empty() && metricsIval > 0) {
 			metricsOfb = new OutFileBuf(metricsFile);
 		}
+		OutFileBuf *stageOfb = NULL;
+		if(!stageTimesFile.empty()) {
+			stageOfb = new OutFileBuf(stageTimesFile);
+		}
+		if(resumed) {
+			mssink->mergeMetrics(ckptMet);
+		}
+		ckptOq = &oq;
+		ckptOut = fout;
+		ckptNext = skipReads;
+		ckptDue = ckptNext + ckptIval;
+		ckptBusy = 0;
 		// Do the search for all input reads
 		assert(patsrc != NULL);
 		assert(mssink != NULL);
@@ -3804,7 +4901,10 @@ static void driver(
 			ebwt,    // BWT
 			*ebwtBw, // BWT'
             refs.get(),
-			metricsOfb);
+			metricsOfb,
+			stageOfb,
+			true);
+		readOut.finish();
 		// Evict any loaded indexes from memory
 		if(ebwt.isInMemory()) {
 			ebwt.evictFromMemory();
@@ -3812,18 +4912,29 @@ static void driver(
 		if(ebwtBw != NULL) {
 			delete ebwtBw;
 		}
+		size_t repThresh = mhits;
+		if(repThresh == 0) {
+			repThresh = std::numeric_limits<size_t>::max();
+		}
+		if(!summaryFile.empty()) {
+			writeAlnSummary(summaryFile, mssink->metrics(), repThresh,
+			                gReportDiscordant, gReportMixed, shardIdx, nShards);
+		}
 		if(!gQuiet && !seedSumm) {
-			size_t repThresh = mhits;
-			if(repThresh == 0) {
-				repThresh = std::numeric_limits<size_t>::max();
-			}
 			mssink->finish(
 				repThresh,
 				gReportDiscordant,
 				gReportMixed,
 				hadoopOut);
+			uint64_t nbudget = metrics.him.budgetlf + metrics.him.budgetcells + metrics.him.budgettime;
+			if(nbudget > 0) {
+				cerr << nbudget << " reads hit the per-read work budget (LF: "
+				     << metrics.him.budgetlf << ", cells: " << metrics.him.budgetcells
+				     << ", time: " << metrics.him.budgettime << ")" << endl;
+			}
 		}
-        if(ssdb != NULL) {
+		contamFilter = NULL;
+        if(ssdb != NULL && !twoPass) {
             if(novelSpliceSiteOutfile != "") {
                 ofstream ssdb_file(novelSpliceSiteOutfile.c_str(), ios::out);
                 if(ssdb_file.is_open()) {
@@ -3835,13 +4946,91 @@ static void driver(
 		oq.flush(true);
 		assert_eq(oq.numStarted(), oq.numFinished());
 		assert_eq(oq.numStarted(), oq.numFlushed());
+		if(bamSorter != NULL) {
+			Timer _t(cerr, "Time merging sorted BAM: ", timing);
+			bamSorter->finish();
+			if(gVerbose) {
+				cerr << "Sorted BAM: spilled " << bamSorter->numSpills()
+				     << " run(s) to temporary files" << endl;
+			}
+			delete bamSorter;
+		}
 		delete patsrc;
 		delete mssink;
         delete ssdb;
 		delete metricsOfb;
+		delete stageOfb;
 		if(fout != NULL) {
 			delete fout;
 		}
+		// The run is complete, so there's nothing left to resume
+		if(!ckptFile.empty()) {
+			alnCkpt.discard();
+			if(!ckptSites.empty()) {
+				remove(ckptSites.c_str());
+			}
+		}
+	}
+}
+
+/**
+ * Parse the input reads once and store them in a HISAT binary read file
+ * (--hrb-out) for later runs to read with --hrb.  Qualities are stored as
+ * Phred+33 and -5/-3 trimming is applied; -s/-u select a range of reads.
+ */
+static void encodeReads(const string& outfn) {
+	PatternParams pp(
+		format,        // file format
+		false,         // records must come out in input order
+		seed,          // pseudo-random seed
+		useSpinlock,   // use spin locks instead of pthreads
+		solexaQuals,   // true -> qualities are on solexa64 scale
+		phred64Quals,  // true -> qualities are on phred64 scale
+		integerQuals,  // true -> qualities are space-separated numbers
+		fuzzy,         // true -> try to parse fuzzy fastq
+		fastaContLen,  // length of sampled reads for FastaContinuous...
+		fastaContFreq, // frequency of sampled reads for FastaContinuous...
+		skipReads,     // skip the first 'skip' patterns
+		shardIdx,      // dispense only this shard's reads/pairs...
+		nShards        // ...out of this many
+	);
+	PairedPatternSource *patsrc = PairedPatternSource::setupPatternSources(
+		queries,     // singles, from argv
+		mates1,      // mate1's, from -1 arg
+		mates2,      // mate2's, from -2 arg
+		mates12,     // both mates on each line, from --12 arg
+#ifdef USE_SRA
+        sra_accs,    // SRA accessions
+#endif
+		qualities,   // qualities associated with singles
+		qualities1,  // qualities associated with m1
+		qualities2,  // qualities associated with m2
+		pp,          // read read-in parameters
+		1,
+		gVerbose || startVerbose); // be talkative
+	HrbWriter w(outfn, hrbBinQuals);
+	Read ra, rb;
+	uint64_t npairs = 0;
+	while(true) {
+		TReadId rdid = 0, endid = 0;
+		bool success = false, done = false, paired = false;
+		ra.reset();
+		rb.reset();
+		patsrc->nextShardReadPair(ra, rb, rdid, endid, success, done, paired, false);
+		if(!success) {
+			if(done) break;
+			continue;
+		}
+		if(rdid < skipReads) continue;
+		if(rdid >= qUpto) break;
+		w.add(ra, paired ? &rb : NULL);
+		if(paired) npairs++;
+	}
+	w.finish();
+	delete patsrc;
+	if(!gQuiet) {
+		cerr << "Wrote " << w.numRecords() << " reads (" << npairs << " of them pairs) to "
+		     << outfn.c_str() << endl;
 	}
 }
 
@@ -3892,8 +5081,20 @@ int hisat(int argc, const char **argv) {
 				cerr << "Parsing index and read arguments: "; logTime(cerr, true);
 			}
 
-			// Get index basename (but only if it wasn't specified via --index)
-			if(bt2index.empty()) {
+			// --merge-*: combine the outputs of --shard runs; no index needed
+			if(!mergeSamFns.empty() || !mergeSummFns.empty() || !mergeSsFns.empty()) {
+				if(optind < argc) {
+					cerr << "Extra parameter(s) specified with --merge-shards/--merge-summaries/--merge-splicesites" << endl;
+					throw 1;
+				}
+				mergeShards(mergeSamFns, mergeSummFns, mergeSsFns,
+				            outfile, summaryFile, novelSpliceSiteOutfile, gQuiet);
+				return 0;
+			}
+
+			// Get index basename (but only if it wasn't specified via --index;
+			// --hrb-out doesn't need one)
+			if(bt2index.empty() && hrbOutfile.empty()) {
 				if(optind >= argc) {
 					cerr << "No index, query, or output file specified!" << endl;
 					printUsage(cerr);
@@ -3959,6 +5160,37 @@ int hisat(int argc, const char **argv) {
 				throw 1;
 			}
 
+			// --two-pass reads the input twice, so it can't come from stdin
+			if(twoPass) {
+				const EList<string>* ins[] = { &queries, &mates1, &mates2, &mates12 };
+				for(size_t i = 0; i < 4; i++) {
+					for(size_t j = 0; j < ins[i]->size(); j++) {
+						if((*ins[i])[j] == "-") {
+							cerr << "Error: --two-pass cannot read from standard in" << endl;
+							throw 1;
+						}
+					}
+				}
+			}
+
+			// --resume truncates the SAM output and appends to it, and
+			// can't take back what went to other outputs
+			if(!ckptFile.empty()) {
+				bool readOut = false;
+				for(int i = 0; i < READ_OUT_NUM; i++) {
+					readOut = readOut || !readOutFns[i].empty();
+				}
+				if(outfile.empty() || sortedBam || twoPass || readOut || !hrbOutfile.empty()) {
+					cerr << "Error: --checkpoint needs -S <sam> and can't be combined with --sorted-bam, "
+					     << "--two-pass, --hrb-out, --un, --al, --un-conc, --al-conc or --filtered" << endl;
+					throw 1;
+				}
+				ckptFingerprint = alignFingerprint(argc, argv);
+			} else if(resume) {
+				cerr << "Error: --resume needs --checkpoint <path>" << endl;
+				throw 1;
+			}
+
 			// Optionally summarize
 			if(gVerbose) {
 				cout << "Input bt2 file: \"" << bt2index.c_str() << "\"" << endl;
@@ -3983,7 +5215,11 @@ int hisat(int argc, const char **argv) {
 				cout << "Press key to continue..." << endl;
 				getchar();
 			}
-			driver<SString<char> >("DNA", bt2index, outfile);
+			if(!hrbOutfile.empty()) {
+				encodeReads(hrbOutfile);
+			} else {
+				driver<SString<char> >("DNA", bt2index, outfile);
+			}
 		}
 		return 0;
 	} catch(std::exception& e) {
@@ -4003,3 +5239,277 @@ int hisat(int argc, const char **argv) {
 	}
 } // bowtie()
 } // extern "C"
+
+/*
+ * Library interface; see hisat_lib.h.  Everything is loaded, and the
+ * workers started, once by hisat_open(), through the same routines
+ * driver() uses; hisat_align() then hands each batch to the waiting
+ * workers through a MemoryPatternSource and collects the alignments
+ * with an AlnSinkCallback.
+ */
+struct hisat_aligner {
+
+	hisat_aligner() :
+		ebwt(NULL), ebwtBw(NULL), refs(NULL), contam(NULL), ssTrack(NULL),
+		sc(NULL), samc(NULL), fout(NULL), oq(NULL), sink(NULL), src(NULL),
+		patsrc(NULL), tids(NULL) { }
+
+	HierEbwt<index_t, local_index_t>* ebwt;
+	Ebwt<index_t>*                    ebwtBw;
+	BitPairReference*                 refs;
+	ContamFilter*                     contam;
+	SpliceTrack*                      ssTrack;
+	Scoring*                          sc;
+	EList<string>                     refnames;
+	EList<size_t>                     reflens;
+	SamConfig*                        samc;
+	OutFileBuf*                       fout;    // never written to; oq discards
+	OutputQueue*                      oq;
+	AlnSinkCallback<index_t>*         sink;
+	MemoryPatternSource*              src;
+	PairedPatternSource*              patsrc;  // wraps src
+	EList<tthread::thread*>           threads;
+	int*                              tids;
+};
+
+/**
+ * Wait until every worker is done with the current batch, then collect
+ * the metrics they handed over.  Call holding poolMutex.
+ */
+static void waitForWorkers() {
+	while(poolIdle < nthreads) {
+		poolCond.wait(poolMutex);
+	}
+	drainMetricsMailboxes(true);
+}
+
+/**
+ * Return true iff a mate handed to hisat_align() can be parsed, so that
+ * bad input is turned away before the workers see it.
+ */
+static bool checkMate(const char *seq, const char *qual) {
+	size_t len = strlen(seq);
+	for(size_t i = 0; i < len; i++) {
+		if(!isalpha(seq[i]) && seq[i] != '.') return false;
+	}
+	if(qual == NULL) return true;
+	if(strlen(qual) != len) return false;
+	try {
+		for(size_t i = 0; i < len; i++) {
+			charToPhred33(qual[i], solexaQuals, phred64Quals);
+		}
+	} catch(int e) {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Stop the workers, if any were started, and free everything.
+ */
+static void freeAligner(hisat_aligner_t *h) {
+	if(!h->threads.empty()) {
+		{
+			tthread::lock_guard<tthread::mutex> guard(poolMutex);
+			waitForWorkers();
+			poolQuit = true;
+			poolCond.notify_all();
+		}
+		for(size_t i = 0; i < h->threads.size(); i++) {
+			h->threads[i]->join();
+			delete h->threads[i];
+		}
+	}
+	poolOn = false;
+	delete[] metricsBoxes;
+	metricsBoxes = NULL;
+	delete[] h->tids;
+	delete h->patsrc; // deletes src
+	delete h->sink;
+	delete h->oq;
+	delete h->fout;
+	delete h->samc;
+	delete h->sc;
+	delete ssdb;
+	ssdb = NULL;
+	delete h->ssTrack;
+	contamFilter = NULL;
+	delete h->contam;
+	delete h->refs;
+	delete h->ebwtBw;
+	delete h->ebwt;
+	delete h;
+}
+
+extern "C" {
+
+hisat_aligner_t *hisat_open(int argc, const char **argv) {
+	if(poolOn) {
+		cerr << "Error: only one aligner can be open at a time" << endl;
+		return NULL;
+	}
+	hisat_aligner_t *h = NULL;
+	try {
+		opterr = optind = 1;
+		resetOptions();
+		argstr.clear();
+		for(int i = 0; i < argc; i++) {
+			argstr += argv[i];
+			if(i < argc-1) argstr += " ";
+		}
+		parseOptions(argc, argv);
+		argv0 = argv[0];
+		if(bt2index.empty() && optind < argc) {
+			bt2index = argv[optind++];
+		}
+		if(bt2index.empty()) {
+			cerr << "Error: no index specified with -x" << endl;
+			throw 1;
+		}
+		bool files = optind < argc || !queries.empty() || !mates1.empty() ||
+		             !mates12.empty() || !outfile.empty() || !hrbOutfile.empty() ||
+		             !metricsFile.empty() || !stageTimesFile.empty() || !traceFile.empty() ||
+		             !mergeSamFns.empty() || !mergeSummFns.empty() || !mergeSsFns.empty();
+		for(int i = 0; i < READ_OUT_NUM; i++) {
+			files = files || !readOutFns[i].empty();
+		}
+		if(files || twoPass || sortedBam || !ckptFile.empty() || nShards > 1 ||
+		   skipReads > 0 || qUpto != QUPTO_NONE)
+		{
+			cerr << "Error: read inputs, output files, --two-pass, --sorted-bam, --checkpoint, "
+			     << "--shard, -s and -u can't be given to hisat_open()" << endl;
+			throw 1;
+		}
+		if(minIntronLen > maxIntronLen) {
+			cerr << "Error: --min-intronlen(" << minIntronLen << ") should not be greater than --max-intronlen("
+			     << maxIntronLen << ")" << endl;
+			throw 1;
+		}
+		h = new hisat_aligner_t();
+		initializeCntLut();
+		adjIdxBase = adjustEbwtBase(argv0, bt2index, gVerbose);
+		h->ebwt = newIndex();
+		h->ebwtBw = newMirrorIndex();
+		loadIndexes(*h->ebwt, *h->ebwtBw);
+		for(size_t i = 0; i < h->ebwt->nPat(); i++) {
+			h->reflens.push_back(h->ebwt->plen()[i]);
+		}
+		readEbwtRefnames<index_t>(adjIdxBase, h->refnames);
+		h->sc = newScoring();
+		h->samc = newSamConfig(h->refnames, h->reflens);
+		h->refs = newReference();
+		h->contam = newContamFilter();
+		contamFilter = h->contam;
+		init_junction_prob();
+		h->ssTrack = newSpliceTrack(*h->refs);
+		ssdb = new SpliceSiteDB(
+		                        *h->refs,
+		                        h->refnames,
+		                        nthreads > 1, // thread-safe
+		                        novelSpliceSiteOutfile != "" || useTempSpliceSite, // write?
+		                        knownSpliceSiteInfile != "" || novelSpliceSiteInfile != "" || useTempSpliceSite); // read?
+		ssdb->setTrack(h->ssTrack);
+		loadSpliceSites(*ssdb);
+		h->fout = new OutFileBuf();
+		h->oq = new OutputQueue(*h->fout, false, nthreads, nthreads > 1, 0);
+		h->oq->setDiscard(true);
+		h->sink = new AlnSinkCallback<index_t>(*h->oq, *h->samc, h->refnames, ssdb);
+		PatternParams pp = patternParams();
+		h->src = new MemoryPatternSource(pp);
+		EList<PatternSource*>* srcs = new EList<PatternSource*>();
+		srcs->push_back(h->src);
+		h->patsrc = new PairedSoloPatternSource(srcs, pp);
+		// Start the workers; they find the empty batch 0 and wait
+		multiseed_patsrc = h->patsrc;
+		multiseed_msink  = h->sink;
+		multiseed_ebwtFw = h->ebwt;
+		multiseed_ebwtBw = h->ebwtBw;
+		multiseed_sc     = h->sc;
+		multiseed_metricsOfb = NULL;
+		multiseed_stageOfb   = NULL;
+		multiseed_refs   = h->refs;
+		metricsBoxes = new MetricsMailbox[nthreads];
+		metricsThreadOn = false;
+		thread_rids.resize(nthreads);
+		thread_rids.fill(0);
+		thread_rids_mindist = (nthreads == 1 || !useTempSpliceSite ? 0 : 1000 * nthreads);
+		poolOn = true;
+		poolQuit = false;
+		poolBatch = 0;
+		poolIdle = 0;
+		poolError = false;
+		h->tids = new int[nthreads];
+		for(int i = 0; i < nthreads; i++) {
+			// Thread IDs start at 1
+			h->tids[i] = i+1;
+			h->threads.push_back(new tthread::thread(multiseedSearchPoolWorker_hisat, (void*)&h->tids[i]));
+		}
+		return h;
+	} catch(std::exception& e) {
+		cerr << "Error: Encountered exception: '" << e.what() << "'" << endl;
+	} catch(int e) {
+		if(e != 0) {
+			cerr << "Error: Encountered internal HISAT exception (#" << e << ")" << endl;
+		}
+	}
+	if(h != NULL) {
+		freeAligner(h);
+	}
+	return NULL;
+}
+
+int hisat_align(
+	hisat_aligner_t    *h,
+	const hisat_read_t *reads,
+	size_t              n,
+	hisat_aln_cb        cb,
+	void               *user)
+{
+	for(size_t i = 0; i < n; i++) {
+		const hisat_read_t& rd = reads[i];
+		if(rd.seq == NULL || !checkMate(rd.seq, rd.qual) ||
+		   (rd.seq2 != NULL && !checkMate(rd.seq2, rd.qual2)))
+		{
+			cerr << "Error: read " << i << " has no sequence, a character that isn't a base "
+			     << "or a quality string that doesn't match it" << endl;
+			return 1;
+		}
+	}
+	tthread::lock_guard<tthread::mutex> guard(poolMutex);
+	waitForWorkers();
+	TReadId first = h->src->setBatch(reads, n);
+	h->patsrc->reset();
+	h->sink->setCallback(cb, user, first);
+	thread_rids.fill(first);
+	poolIdle = 0;
+	poolError = false;
+	poolBatch++;
+	poolCond.notify_all();
+	waitForWorkers();
+	return poolError ? 1 : 0;
+}
+
+int32_t hisat_nrefs(const hisat_aligner_t *h) {
+	return (int32_t)h->refnames.size();
+}
+
+const char *hisat_refname(const hisat_aligner_t *h, int32_t refid) {
+	if(refid < 0 || (size_t)refid >= h->refnames.size()) return NULL;
+	return h->refnames[refid].c_str();
+}
+
+void hisat_close(hisat_aligner_t *h) {
+	if(h == NULL) return;
+	if(ssdb != NULL && novelSpliceSiteOutfile != "") {
+		tthread::lock_guard<tthread::mutex> guard(poolMutex);
+		waitForWorkers();
+		ofstream ssdb_file(novelSpliceSiteOutfile.c_str(), ios::out);
+		if(ssdb_file.is_open()) {
+			ssdb->print(ssdb_file);
+			ssdb_file.close();
+		}
+	}
+	freeAligner(h);
+}
+
+} // extern "C"
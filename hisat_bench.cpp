@@ -0,0 +1,991 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * hisat-bench: times the alignment hot paths (FM index stepping, global
+ * and local index search, offset resolution, the SSE dynamic programming
+ * kernels, splice site lookups, FASTQ parsing and SAM formatting) in
+ * isolation, and prints one JSON object per kernel so that results can be
+ * compared across commits.
+ */
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "assert_helpers.h"
+#include "ds.h"
+#include "hier_idx.h"
+#include "reference.h"
+#include "random_source.h"
+#include "formats.h"
+#include "pat.h"
+#include "read.h"
+#include "scoring.h"
+#include "simple_func.h"
+#include "dp_framer.h"
+#include "aligner_sw.h"
+#include "group_walk.h"
+#include "splice_site.h"
+#include "spliced_aligner.h"
+#include "sam.h"
+#include "aln_sink.h"
+#include "outq.h"
+#include "unique.h"
+
+using namespace std;
+
+typedef TIndexOffU index_t;
+typedef uint16_t local_index_t;
+
+// Globals normally defined by the hisat-align front end (search_globals.h)
+bool gColor           = false; // colorspace (not supported)
+int  gVerbose         = 0;     // be talkative
+int  gQuiet           = 0;     // print nothing but the alignments
+bool gReportOverhangs = false; // false -> filter out alignments that fall off the end of a reference sequence
+bool gNofw            = false; // don't align fw orientation of read
+bool gNorc            = false; // don't align rc orientation of read
+bool gMate1fw         = true;  // -1 mate aligns in fw orientation on fw strand
+bool gMate2fw         = false; // -2 mate aligns in rc orientation on fw strand
+int  gMinInsert       = 0;     // minimum insert size
+int  gMaxInsert       = 500;   // maximum insert size
+int  gTrim5           = 0;     // amount to trim from 5' end
+int  gTrim3           = 0;     // amount to trim from 3' end
+int  gGapBarrier      = 4;     // # diags on top/bot only to be entered diagonally
+static const char *argv0      = NULL;
+
+#define DMAX std::numeric_limits<double>::max()
+
+static string   bt2index;          // index basename
+static string   readsFile;         // FASTQ to parse/align; synthesized if empty
+static string   ssFile;            // splice sites; synthesized if empty
+static string   outfile;           // write JSON here instead of stdout
+static string   kernelList;        // comma-separated subset of kernels to run
+static size_t   nreads;            // # reads to synthesize or load
+static size_t   readLen;           // length of synthesized reads
+static size_t   nsites;            // # splice sites to synthesize
+static double   minTime;           // min seconds to spend per kernel
+static uint32_t seed;              // pseudo-random seed
+static bool     listOnly;          // just list the kernels and quit
+
+static const char *short_options = "x:U:o:n:t:s:lh";
+
+enum {
+	ARG_SS = 256,
+	ARG_READ_LEN,
+	ARG_NSITES,
+	ARG_KERNELS,
+	ARG_USAGE
+};
+
+static struct option long_options[] = {
+	{(char*)"index",     required_argument, 0, 'x'},
+	{(char*)"reads",     required_argument, 0, 'U'},
+	{(char*)"output",    required_argument, 0, 'o'},
+	{(char*)"nreads",    required_argument, 0, 'n'},
+	{(char*)"min-time",  required_argument, 0, 't'},
+	{(char*)"seed",      required_argument, 0, 's'},
+	{(char*)"list",      no_argument,       0, 'l'},
+	{(char*)"ss",        required_argument, 0, ARG_SS},
+	{(char*)"read-len",  required_argument, 0, ARG_READ_LEN},
+	{(char*)"nsites",    required_argument, 0, ARG_NSITES},
+	{(char*)"kernels",   required_argument, 0, ARG_KERNELS},
+	{(char*)"help",      no_argument,       0, 'h'},
+	{(char*)"usage",     no_argument,       0, ARG_USAGE},
+	{(char*)0, 0, 0, 0} // terminator
+};
+
+static void resetOptions() {
+	bt2index.clear();
+	readsFile.clear();
+	ssFile.clear();
+	outfile.clear();
+	kernelList.clear();
+	nreads   = 10000;
+	readLen  = 100;
+	nsites   = 10000;
+	minTime  = 1.0;
+	seed     = 0;
+	listOnly = false;
+}
+
+/**
+ * Print a summary usage message to the provided output stream.
+ */
+static void printUsage(ostream& out) {
+	out << "HISAT version " << string(HISAT_VERSION).c_str() << " by Daehwan Kim (infphilo@gmail.com, http://www.ccb.jhu.edu/people/infphilo)" << endl;
+	out << "Usage: hisat-bench [options]* -x <bt2_base>" << endl
+	    << "  <bt2_base>         index filename prefix (minus trailing .X." << gEbwt_ext << ")" << endl
+	    << endl
+	    << "  Times the alignment hot paths in isolation and prints one JSON object" << endl
+	    << "  per kernel with ns/op and throughput." << endl
+	    << endl
+	    << "Options:" << endl
+	    << "  -U <fq>            FASTQ reads to use (default: synthesize from the index)" << endl
+	    << "  --ss <file>        splice sites (default: synthesize from the index)" << endl
+	    << "  -n/--nreads <int>  # reads to synthesize or load (default: 10000)" << endl
+	    << "  --read-len <int>   length of synthesized reads (default: 100)" << endl
+	    << "  --nsites <int>     # splice sites to synthesize (default: 10000)" << endl
+	    << "  -t/--min-time <s>  minimum seconds spent timing each kernel (default: 1.0)" << endl
+	    << "  --kernels <list>   comma-separated kernels to run (default: all)" << endl
+	    << "  -s/--seed <int>    seed for pseudo-random generator (default: 0)" << endl
+	    << "  -o/--output <file> write JSON results to <file> (default: stdout)" << endl
+	    << "  -l/--list          list kernel names and quit" << endl
+	    << "  -h/--help          print this usage message" << endl;
+}
+
+/**
+ * Parse an int out of optarg and enforce that it be at least 'lower';
+ * if it is less than 'lower', than output the given error message and
+ * exit with an error and a usage message.
+ */
+static int parseInt(int lower, const char *errmsg) {
+	long l;
+	char *endPtr= NULL;
+	l = strtol(optarg, &endPtr, 10);
+	if (endPtr != NULL) {
+		if (l < lower) {
+			cerr << errmsg << endl;
+			printUsage(cerr);
+			throw 1;
+		}
+		return (int32_t)l;
+	}
+	cerr << errmsg << endl;
+	printUsage(cerr);
+	throw 1;
+	return -1;
+}
+
+/**
+ * Read command-line arguments
+ */
+static void parseOptions(int argc, char **argv) {
+	int option_index = 0;
+	int next_option;
+	do {
+		next_option = getopt_long(
+			argc, argv, short_options, long_options, &option_index);
+		switch (next_option) {
+			case 'x': bt2index = optarg; break;
+			case 'U': readsFile = optarg; break;
+			case 'o': outfile = optarg; break;
+			case 'n': nreads = parseInt(1, "-n/--nreads arg must be at least 1"); break;
+			case 's': seed = parseInt(0, "-s/--seed arg must be at least 0"); break;
+			case 'l': listOnly = true; break;
+			case 't': {
+				minTime = atof(optarg);
+				if(minTime <= 0.0) {
+					cerr << "-t/--min-time arg must be positive" << endl;
+					printUsage(cerr);
+					throw 1;
+				}
+				break;
+			}
+			case ARG_SS: ssFile = optarg; break;
+			case ARG_READ_LEN: readLen = parseInt(32, "--read-len arg must be at least 32"); break;
+			case ARG_NSITES: nsites = parseInt(1, "--nsites arg must be at least 1"); break;
+			case ARG_KERNELS: kernelList = optarg; break;
+			case 'h':
+			case ARG_USAGE:
+				printUsage(cout);
+				throw 0;
+				break;
+			case -1: break; /* Done with options. */
+			case 0:
+				if (long_options[option_index].flag != 0)
+					break;
+			default:
+				printUsage(cerr);
+				throw 1;
+		}
+	} while(next_option != -1);
+}
+
+static inline double benchNow() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
+}
+
+/**
+ * A read placed uniquely on the genome during setup; the inputs to the
+ * offset-free kernels (dynamic programming, SAM formatting).
+ */
+struct BenchAnchor {
+	size_t  rdi;   // index of read in BenchState::reads
+	bool    fw;    // orientation of the read
+	index_t tidx;  // reference sequence
+	index_t toff;  // offset of leftmost aligned read char
+	index_t tlen;  // length of reference sequence
+	index_t hitoff;// read offset from which the global search started
+	size_t  edi;   // first mismatch in BenchState::edits
+	size_t  edn;   // # mismatches
+};
+
+/**
+ * Everything the kernels share: the index, the reference, the reads and
+ * whatever was derived from them during setup.
+ */
+struct BenchState {
+	BenchState() :
+		ebwt(NULL), ref(NULL), ssdb(NULL), al(NULL),
+		sc(NULL), scLocal(NULL), mapq(NULL), samc(NULL), sink(NULL),
+		fastqBytes(0), sink64(0) { }
+
+	HierEbwt<index_t, local_index_t>*       ebwt;
+	BitPairReference*                       ref;
+	SpliceSiteDB*                           ssdb;
+	SplicedAligner<index_t, local_index_t>* al;
+	Scoring*                                sc;
+	Scoring*                                scLocal;
+	Mapq*                                   mapq;
+	SamConfig*                              samc;
+	AlnSinkSam<index_t>*                    sink;
+	EList<string>                           refnames;
+	EList<Read>                             reads;
+	EList<BenchAnchor>                      anchors;
+	EList<Edit>                             edits;
+	EList<index_t>                          rows;    // random BWT rows
+	EList<uint32_t>                         siteRef; // splice site query refs
+	EList<uint32_t>                         siteOff; // splice site query offs
+	string                                  fastqFile;
+	uint64_t                                fastqBytes;
+	RandomSource                            rnd;
+	SwAligner                               sw;
+	uint64_t                                sink64;  // defeats dead code elimination
+};
+
+typedef uint64_t (*BenchPass)(BenchState& st, uint64_t& bytes);
+
+/**
+ * LF-map 16 steps to the left starting from each sampled row.
+ */
+static uint64_t benchLF(BenchState& st, uint64_t& bytes) {
+	const Ebwt<index_t>& e = *st.ebwt;
+	SideLocus<index_t> l;
+	uint64_t ops = 0;
+	for(size_t i = 0; i < st.rows.size(); i++) {
+		index_t row = st.rows[i];
+		for(size_t j = 0; j < 16; j++) {
+			if(row == e.zOff()) break;
+			l.initFromRow(row, e.eh(), e.ebwt());
+			row = e.mapLF(l);
+			ops++;
+		}
+		st.sink64 += row;
+	}
+	return ops;
+}
+
+/**
+ * Tally A/C/G/T occurrences over 32-row ranges starting at each sampled row.
+ */
+static uint64_t benchSideRange(BenchState& st, uint64_t& bytes) {
+	const Ebwt<index_t>& e = *st.ebwt;
+	const index_t num = 32;
+	SideLocus<index_t> l;
+	EList<bool> masks[4];
+	index_t cntsUpto[4], cntsIn[4];
+	uint64_t ops = 0;
+	for(size_t i = 0; i < st.rows.size(); i++) {
+		index_t row = st.rows[i];
+		if(row + num > e.eh()._bwtLen) continue;
+		l.initFromRow(row, e.eh(), e.ebwt());
+		cntsUpto[0] = cntsUpto[1] = cntsUpto[2] = cntsUpto[3] = 0;
+		cntsIn[0] = cntsIn[1] = cntsIn[2] = cntsIn[3] = 0;
+		e.countBt2SideRange(l, num, cntsUpto, cntsIn, masks);
+		st.sink64 += cntsUpto[0] + cntsIn[3];
+		ops++;
+	}
+	return ops;
+}
+
+/**
+ * Search each read, both orientations, leftward from its 3' end in the
+ * global index.
+ */
+static uint64_t benchGlobalSearch(BenchState& st, uint64_t& bytes) {
+	uint64_t ops = 0;
+	for(size_t i = 0; i < st.reads.size(); i++) {
+		const Read& rd = st.reads[i];
+		for(int fwi = 0; fwi < 2; fwi++) {
+			index_t hitlen = 0, top = 0, bot = 0;
+			bool uniqueStop = false;
+			size_t nelt = st.al->globalEbwtSearch(
+				*st.ebwt, rd, *st.sc, fwi == 0, (index_t)(rd.length() - 1),
+				hitlen, top, bot, st.rnd, uniqueStop);
+			st.sink64 += nelt + hitlen;
+			ops++;
+		}
+	}
+	return ops;
+}
+
+/**
+ * Search each anchored read in the local index covering its placement.
+ */
+static uint64_t benchLocalSearch(BenchState& st, uint64_t& bytes) {
+	uint64_t ops = 0;
+	for(size_t i = 0; i < st.anchors.size(); i++) {
+		const BenchAnchor& a = st.anchors[i];
+		const Read& rd = st.reads[a.rdi];
+		const LocalEbwt<local_index_t, index_t>* lebwt =
+			st.ebwt->getLocalEbwt(a.tidx, a.toff);
+		if(lebwt == NULL || lebwt->empty()) continue;
+		index_t hitlen = 0;
+		local_index_t top = 0, bot = 0;
+		bool uniqueStop = false;
+		size_t nelt = st.al->localEbwtSearch(
+			lebwt, NULL, rd, *st.sc, a.fw, false, (index_t)(rd.length() - 1),
+			hitlen, top, bot, st.rnd, uniqueStop, 8);
+		st.sink64 += nelt + hitlen;
+		ops++;
+	}
+	return ops;
+}
+
+/**
+ * Resolve reference offsets for small SA ranges with GroupWalk.
+ */
+static uint64_t benchOffsetResolve(BenchState& st, uint64_t& bytes) {
+	const Ebwt<index_t>& e = *st.ebwt;
+	EList<index_t, 16> offs;
+	SARangeWithOffs<EListSlice<index_t, 16> > sa;
+	GroupWalk2S<index_t, EListSlice<index_t, 16>, 16> gw;
+	GroupWalkState<index_t> gwstate(GW_CAT);
+	WalkMetrics met;
+	PerReadMetrics prm;
+	uint64_t ops = 0;
+	for(size_t i = 0; i < st.rows.size(); i++) {
+		index_t top = st.rows[i];
+		index_t nelt = min<index_t>(4, e.eh()._bwtLen - top);
+		offs.resize(nelt);
+		offs.fill(std::numeric_limits<index_t>::max());
+		sa.init(top, 32, EListSlice<index_t, 16>(offs, 0, nelt));
+		gw.init(e, *st.ref, sa, st.rnd, met);
+		for(index_t j = 0; j < nelt; j++) {
+			WalkResult<index_t> wr;
+			gw.advanceElement(j, e, *st.ref, sa, gwstate, wr, met, prm);
+			st.sink64 += wr.toff;
+			ops++;
+		}
+	}
+	return ops;
+}
+
+/**
+ * Fill and align one DP rectangle per anchor with the given scheme.
+ */
+static uint64_t benchSw(BenchState& st, const Scoring& sc, bool enable8) {
+	DynProgFramer dpframe(true);
+	uint64_t ops = 0;
+	for(size_t i = 0; i < st.anchors.size(); i++) {
+		const BenchAnchor& a = st.anchors[i];
+		const Read& rd = st.reads[a.rdi];
+		size_t rdlen = rd.length();
+		TAlScore minsc = sc.scoreMin.f<TAlScore>((double)rdlen);
+		if(!sc.monotone && minsc < 0) minsc = 0;
+		size_t maxrdgap = min<size_t>(sc.maxReadGaps(minsc, rdlen), 15);
+		size_t maxrfgap = min<size_t>(sc.maxRefGaps(minsc, rdlen), 15);
+		DPRect rect;
+		if(!dpframe.frameSeedExtensionRect(
+			(int64_t)a.toff, rdlen, (int64_t)a.tlen,
+			maxrdgap, maxrfgap, (int64_t)rdlen, 15, rect))
+		{
+			continue;
+		}
+		size_t nsUpto = 0;
+		st.sw.initRead(rd.patFw, rd.patRc, rd.qual, rd.qualRev, 0, rdlen, sc);
+		st.sw.initRef(
+			a.fw, a.tidx, rect, *st.ref, a.tlen, sc, minsc, enable8,
+			std::numeric_limits<size_t>::max(), // never use checkpointing
+			0, false, true, 0, nsUpto);
+		TAlScore best = std::numeric_limits<TAlScore>::min();
+		st.sw.align(st.rnd, best);
+		st.sink64 += (uint64_t)best;
+		ops++;
+	}
+	return ops;
+}
+
+static uint64_t benchSwEEU8(BenchState& st, uint64_t& bytes) {
+	return benchSw(st, *st.sc, true);
+}
+
+static uint64_t benchSwEEI16(BenchState& st, uint64_t& bytes) {
+	return benchSw(st, *st.sc, false);
+}
+
+static uint64_t benchSwLocU8(BenchState& st, uint64_t& bytes) {
+	return benchSw(st, *st.scLocal, true);
+}
+
+static uint64_t benchSwLocI16(BenchState& st, uint64_t& bytes) {
+	return benchSw(st, *st.scLocal, false);
+}
+
+/**
+ * Look up splice sites around each query position and test a pair of
+ * windows for known sites.
+ */
+static uint64_t benchSsdb(BenchState& st, uint64_t& bytes) {
+	EList<SpliceSite> sites;
+	uint64_t ops = 0;
+	for(size_t i = 0; i < st.siteRef.size(); i++) {
+		uint32_t ref = st.siteRef[i], off = st.siteOff[i];
+		sites.clear();
+		st.ssdb->getLeftSpliceSites(ref, off, 100, sites);
+		st.ssdb->getRightSpliceSites(ref, off + 100, 100, sites);
+		st.sink64 += sites.size();
+		st.sink64 += st.ssdb->hasSpliceSites(ref, off, off + 50, off + 500, off + 550, true);
+		ops += 3;
+	}
+	return ops;
+}
+
+/**
+ * Parse the whole FASTQ input once.
+ */
+static uint64_t benchFastqParse(BenchState& st, uint64_t& bytes) {
+	PatternParams pp(
+		FASTQ, false, seed, false, false, false, false, false, -1, -1, 0);
+	EList<string> qs;
+	qs.push_back(st.fastqFile);
+	PatternSource *ps = PatternSource::patsrcFromStrings(pp, qs);
+	Read r;
+	TReadId rdid = 0, endid = 0;
+	bool success = true, done = false;
+	uint64_t ops = 0;
+	while(true) {
+		r.reset();
+		ps->nextRead(r, rdid, endid, success, done);
+		if(!success && done) break;
+		if(!success) continue;
+		st.sink64 += r.length();
+		ops++;
+		if(done) break;
+	}
+	delete ps;
+	bytes = st.fastqBytes;
+	return ops;
+}
+
+/**
+ * Format one SAM record per anchor.
+ */
+static uint64_t benchSamFormat(BenchState& st, uint64_t& bytes) {
+	LinkedEList<EList<Edit> > rawEdits;
+	AlnRes res;
+	StackedAln staln;
+	AlnSetSumm summ;
+	SeedAlSumm ssm;
+	PerReadMetrics prm;
+	BTString o;
+	AlnFlags flags(
+		ALN_FLAG_PAIR_UNPAIRED, false, false, false, false, false,
+		false, false, false, true, false, false);
+	uint64_t ops = 0;
+	bytes = 0;
+	for(size_t i = 0; i < st.anchors.size(); i++) {
+		const BenchAnchor& a = st.anchors[i];
+		const Read& rd = st.reads[a.rdi];
+		TAlScore score = -(TAlScore)(a.edn * st.sc->mmpMax);
+		res.reset();
+		res.init(
+			rd.length(), AlnScore(score, 0, 0), &st.edits, a.edi, a.edn,
+			NULL, 0, 0, Coord(a.tidx, a.toff, a.fw), a.tlen, &rawEdits);
+		res.setMateParams(ALN_RES_TYPE_UNPAIRED, NULL, flags);
+		summ.init(
+			res.score(), AlnScore(), AlnScore(), AlnScore(), AlnScore(),
+			AlnScore(), 0, 0, false, false, false, -1, -1, 1, 0, 0);
+		o.clear();
+		st.sink->append(
+			o, staln, 0, &rd, NULL, (TReadId)i, &res, NULL, summ, ssm, ssm,
+			&flags, NULL, prm, *st.mapq, *st.sc, false);
+		bytes += o.length();
+		ops++;
+	}
+	return ops;
+}
+
+struct BenchKernel {
+	const char* name;
+	BenchPass   pass;
+};
+
+static const BenchKernel kernels[] = {
+	{ "lf",             benchLF },
+	{ "side_range",     benchSideRange },
+	{ "global_search",  benchGlobalSearch },
+	{ "local_search",   benchLocalSearch },
+	{ "offset_resolve", benchOffsetResolve },
+	{ "sw_ee_u8",       benchSwEEU8 },
+	{ "sw_ee_i16",      benchSwEEI16 },
+	{ "sw_loc_u8",      benchSwLocU8 },
+	{ "sw_loc_i16",     benchSwLocI16 },
+	{ "ssdb_query",     benchSsdb },
+	{ "fastq_parse",    benchFastqParse },
+	{ "sam_format",     benchSamFormat },
+	{ NULL,             NULL }
+};
+
+/**
+ * Run one pass as a warm-up, then repeat passes until minTime seconds have
+ * elapsed, and print the result as a single JSON object.
+ */
+static void runKernel(BenchState& st, const BenchKernel& k, ostream& out) {
+	uint64_t bytes = 0;
+	if(k.pass(st, bytes) == 0) {
+		out << "{\"kernel\":\"" << k.name << "\",\"ops\":0,\"skipped\":true}" << endl;
+		return;
+	}
+	uint64_t ops = 0, totBytes = 0, passes = 0;
+	double start = benchNow(), elapsed = 0.0;
+	do {
+		bytes = 0;
+		ops += k.pass(st, bytes);
+		totBytes += bytes;
+		passes++;
+		elapsed = benchNow() - start;
+	} while(elapsed < minTime);
+	char buf[1024];
+	snprintf(buf, sizeof(buf),
+	         "{\"kernel\":\"%s\",\"passes\":%llu,\"ops\":%llu,\"seconds\":%.6f,"
+	         "\"ns_per_op\":%.3f,\"ops_per_sec\":%.1f",
+	         k.name, (unsigned long long)passes, (unsigned long long)ops, elapsed,
+	         elapsed * 1e9 / (double)ops, (double)ops / elapsed);
+	out << buf;
+	if(totBytes > 0) {
+		snprintf(buf, sizeof(buf), ",\"bytes\":%llu,\"mb_per_sec\":%.3f",
+		         (unsigned long long)totBytes, (double)totBytes / elapsed / 1e6);
+		out << buf;
+	}
+	out << "}" << endl;
+}
+
+/**
+ * Make a temporary file name next to the system temp directory.
+ */
+static string benchTempFile(const char *suffix) {
+	const char *tmpdir = getenv("TMPDIR");
+	string tmpl = string(tmpdir != NULL ? tmpdir : "/tmp") + "/hisat-bench.XXXXXX";
+	EList<char> buf;
+	buf.resize(tmpl.length() + 1);
+	memcpy(buf.ptr(), tmpl.c_str(), tmpl.length() + 1);
+	int fd = mkstemp(buf.ptr());
+	if(fd < 0) {
+		cerr << "Error: could not create temporary file " << tmpl << endl;
+		throw 1;
+	}
+	close(fd);
+	string name = buf.ptr();
+	if(suffix != NULL) {
+		string renamed = name + suffix;
+		rename(name.c_str(), renamed.c_str());
+		name = renamed;
+	}
+	return name;
+}
+
+/**
+ * Simulate reads from random unambiguous stretches of the reference, with
+ * random orientation and roughly one mismatch per 100 bases, and write
+ * them as FASTQ.
+ */
+static void synthesizeReads(BenchState& st, const string& fname) {
+	ofstream fout(fname.c_str());
+	if(!fout.good()) {
+		cerr << "Error: could not open " << fname << " for writing" << endl;
+		throw 1;
+	}
+	const BitPairReference& ref = *st.ref;
+	EList<uint32_t> buf;
+	buf.resize((readLen + 128) / 4);
+	ASSERT_ONLY(SStringExpandable<uint32_t> destU32);
+	string seq, qual(readLen, 'I');
+	size_t made = 0, tries = 0;
+	while(made < nreads) {
+		if(++tries > nreads * 100) {
+			cerr << "Error: could not simulate reads from the reference; "
+			     << "are the sequences shorter than --read-len?" << endl;
+			throw 1;
+		}
+		size_t tidx = st.rnd.nextU32() % ref.numRefs();
+		size_t tlen = ref.approxLen(tidx);
+		if(tlen < readLen) continue;
+		size_t toff = st.rnd.nextU32() % (tlen - readLen + 1);
+		int off = ref.getStretch(buf.ptr(), tidx, toff, readLen ASSERT_ONLY(, destU32));
+		const uint8_t *cb = ((const uint8_t*)buf.ptr()) + off;
+		bool hasN = false;
+		seq.clear();
+		for(size_t j = 0; j < readLen; j++) {
+			if(cb[j] > 3) { hasN = true; break; }
+			int c = cb[j];
+			if(st.rnd.nextU32() % 100 == 0) c = (c + 1 + st.rnd.nextU32() % 3) & 3;
+			seq.push_back("ACGT"[c]);
+		}
+		if(hasN) continue;
+		if(st.rnd.nextU32() & 1) {
+			reverse(seq.begin(), seq.end());
+			for(size_t j = 0; j < seq.length(); j++) {
+				seq[j] = "TGCA"[asc2dna[(int)seq[j]]];
+			}
+		}
+		fout << "@sim" << made << "\n" << seq << "\n+\n" << qual << "\n";
+		made++;
+	}
+	fout.close();
+}
+
+/**
+ * Write random canonical-looking splice sites (one every few kb) in the
+ * format read by SpliceSiteDB::read.
+ */
+static void synthesizeSpliceSites(BenchState& st, const string& fname) {
+	ofstream fout(fname.c_str());
+	if(!fout.good()) {
+		cerr << "Error: could not open " << fname << " for writing" << endl;
+		throw 1;
+	}
+	const BitPairReference& ref = *st.ref;
+	for(size_t i = 0; i < nsites; i++) {
+		size_t tidx = st.rnd.nextU32() % ref.numRefs();
+		size_t tlen = ref.approxLen(tidx);
+		if(tlen < 20000) continue;
+		uint32_t left = st.rnd.nextU32() % (uint32_t)(tlen - 20000);
+		uint32_t right = left + 50 + st.rnd.nextU32() % 15000;
+		fout << st.refnames[tidx] << "\t" << left << "\t" << right << "\t"
+		     << ((st.rnd.nextU32() & 1) ? '+' : '-') << "\n";
+	}
+	fout.close();
+}
+
+/**
+ * Load all reads from the FASTQ input into memory.
+ */
+static void loadReads(BenchState& st) {
+	PatternParams pp(
+		FASTQ, false, seed, false, false, false, false, false, -1, -1, 0);
+	EList<string> qs;
+	qs.push_back(st.fastqFile);
+	PatternSource *ps = PatternSource::patsrcFromStrings(pp, qs);
+	TReadId rdid = 0, endid = 0;
+	while(st.reads.size() < nreads) {
+		bool success = true, done = false;
+		st.reads.expand();
+		st.reads.back().reset();
+		ps->nextRead(st.reads.back(), rdid, endid, success, done);
+		if(!success || st.reads.back().length() == 0) {
+			st.reads.pop_back();
+		}
+		if(done) break;
+	}
+	delete ps;
+	struct stat s;
+	if(stat(st.fastqFile.c_str(), &s) == 0) {
+		st.fastqBytes = (uint64_t)s.st_size;
+	}
+}
+
+/**
+ * Place each read uniquely (if possible) with an exact global search from
+ * its 3' end and record the mismatches of the implied ungapped alignment.
+ */
+static void findAnchors(BenchState& st) {
+	const BitPairReference& ref = *st.ref;
+	EList<Coord> coords;
+	WalkMetrics wlm;
+	PerReadMetrics prm;
+	HIMetrics him;
+	EList<uint32_t> buf;
+	ASSERT_ONLY(SStringExpandable<uint32_t> destU32);
+	for(size_t i = 0; i < st.reads.size(); i++) {
+		const Read& rd = st.reads[i];
+		index_t rdlen = (index_t)rd.length();
+		for(int fwi = 0; fwi < 2; fwi++) {
+			bool fw = (fwi == 0);
+			index_t hitoff = rdlen - 1, hitlen = 0, top = 0, bot = 0;
+			bool uniqueStop = false;
+			size_t nelt = st.al->globalEbwtSearch(
+				*st.ebwt, rd, *st.sc, fw, hitoff, hitlen, top, bot,
+				st.rnd, uniqueStop);
+			if(nelt != 1 || hitlen < 20) continue;
+			bool straddled = false;
+			index_t rdoff = hitoff - hitlen + 1;
+			if(!st.al->getGenomeCoords(
+				*st.ebwt, ref, st.rnd, top, bot, fw, 1, rdoff, rdlen,
+				coords, wlm, prm, him, true, straddled) || coords.empty())
+			{
+				continue;
+			}
+			index_t tidx = (index_t)coords[0].ref();
+			index_t toff = (index_t)coords[0].off() - rdoff;
+			index_t tlen = st.ebwt->plen()[tidx];
+			if(toff + rdlen > tlen) continue;
+			BenchAnchor a;
+			a.rdi = i; a.fw = fw; a.tidx = tidx; a.toff = toff; a.tlen = tlen;
+			a.hitoff = hitoff; a.edi = st.edits.size(); a.edn = 0;
+			buf.resize((rdlen + 128) / 4);
+			int off = ref.getStretch(buf.ptr(), tidx, toff, rdlen ASSERT_ONLY(, destU32));
+			const uint8_t *cb = ((const uint8_t*)buf.ptr()) + off;
+			const BTDnaString& seq = fw ? rd.patFw : rd.patRc;
+			EList<Edit> ned;
+			for(index_t j = 0; j < rdlen; j++) {
+				int rdc = seq[j], rfc = cb[j];
+				if(rdc == rfc) continue;
+				ned.push_back(Edit(j, "ACGTN"[rfc], "ACGTN"[rdc], EDIT_TYPE_MM));
+			}
+			if(!fw) Edit::invertPoss(ned, rdlen, false);
+			for(size_t j = 0; j < ned.size(); j++) st.edits.push_back(ned[j]);
+			a.edn = ned.size();
+			st.anchors.push_back(a);
+			break;
+		}
+	}
+}
+
+static void driver() {
+	BenchState st;
+	st.rnd.init(seed);
+	EList<string> tempFiles;
+	string adjIdxBase = adjustEbwtBase(argv0, bt2index, false);
+	st.ebwt = new HierEbwt<index_t, local_index_t>(
+		adjIdxBase,
+		0,     // index is colorspace
+		-1,    // fw index
+		true,  // index is for the forward direction
+		-1,    // offRate
+		0,     // offRatePlus
+		false, // use memory-mapped files
+		false, // use shared memory
+		false, // sweep memory-mapped files
+		true,  // load names?
+		true,  // load SA sample?
+		true,  // load ftab?
+		true,  // load rstarts?
+		false, // verbose
+		false, // startVerbose
+		false, // passMemExc
+		false);// sanity
+	st.ebwt->loadIntoMemory(
+		0,     // colorspace?
+		-1,    // not the reverse index
+		true,  // load SA sample
+		true,  // load ftab
+		true,  // load rstarts
+		true,  // load names
+		false);// startVerbose
+	st.ref = new BitPairReference(
+		adjIdxBase, false, false, NULL, NULL, false, false, false, false,
+		false, false);
+	if(!st.ref->loaded()) throw 1;
+	EList<string> fullnames;
+	readEbwtRefnames<index_t>(adjIdxBase, fullnames);
+	for(size_t i = 0; i < fullnames.size(); i++) {
+		string name = fullnames[i];
+		size_t ws = name.find_first_of(" \t");
+		if(ws != string::npos) name = name.substr(0, ws);
+		st.refnames.push_back(name);
+	}
+	try {
+		// Inputs
+		if(readsFile.empty()) {
+			st.fastqFile = benchTempFile(".fq");
+			tempFiles.push_back(st.fastqFile);
+			synthesizeReads(st, st.fastqFile);
+		} else {
+			st.fastqFile = readsFile;
+		}
+		loadReads(st);
+		string ssdbFile = ssFile;
+		if(ssdbFile.empty()) {
+			ssdbFile = benchTempFile(".ss");
+			tempFiles.push_back(ssdbFile);
+			synthesizeSpliceSites(st, ssdbFile);
+		}
+		init_junction_prob();
+		st.ssdb = new SpliceSiteDB(*st.ref, st.refnames, false, false, true);
+		{
+			ifstream ssin(ssdbFile.c_str(), ios::in);
+			if(!ssin.is_open()) {
+				cerr << "Error: could not open splice site file " << ssdbFile << endl;
+				throw 1;
+			}
+			st.ssdb->read(ssin, true);
+		}
+		// Scoring schemes matching hisat-align's defaults
+		SimpleFunc scoreMin, scoreMinLocal, nCeil, penIntronLen;
+		scoreMin.init(SIMPLE_FUNC_CONST, -18, 0);
+		scoreMinLocal.init(SIMPLE_FUNC_LOG, DEFAULT_MIN_CONST_LOCAL, DEFAULT_MIN_LINEAR_LOCAL);
+		nCeil.init(SIMPLE_FUNC_LINEAR, 0.0f, DMAX, 2.0f, 0.1f);
+		penIntronLen.init(SIMPLE_FUNC_LOG, -8, 1);
+		st.sc = new Scoring(
+			DEFAULT_MATCH_BONUS, DEFAULT_MM_PENALTY_TYPE,
+			DEFAULT_MM_PENALTY_MAX, DEFAULT_MM_PENALTY_MIN,
+			scoreMin, nCeil, DEFAULT_N_PENALTY_TYPE, DEFAULT_N_PENALTY,
+			DEFAULT_N_CAT_PAIR, DEFAULT_READ_GAP_CONST, DEFAULT_REF_GAP_CONST,
+			DEFAULT_READ_GAP_LINEAR, DEFAULT_REF_GAP_LINEAR, gGapBarrier,
+			0, 12, 1000000, &penIntronLen);
+		st.scLocal = new Scoring(
+			DEFAULT_MATCH_BONUS_LOCAL, DEFAULT_MM_PENALTY_TYPE,
+			DEFAULT_MM_PENALTY_MAX, DEFAULT_MM_PENALTY_MIN,
+			scoreMinLocal, nCeil, DEFAULT_N_PENALTY_TYPE, DEFAULT_N_PENALTY,
+			DEFAULT_N_CAT_PAIR, DEFAULT_READ_GAP_CONST, DEFAULT_REF_GAP_CONST,
+			DEFAULT_READ_GAP_LINEAR, DEFAULT_REF_GAP_LINEAR, gGapBarrier,
+			0, 12, 1000000, &penIntronLen);
+		st.al = new SplicedAligner<index_t, local_index_t>(*st.ebwt, 20, 500000);
+		findAnchors(st);
+		// Random rows and splice site query positions
+		index_t bwtLen = st.ebwt->eh()._bwtLen;
+		for(size_t i = 0; i < 4096; i++) {
+			st.rows.push_back((index_t)(st.rnd.nextU32() % bwtLen));
+			size_t tidx = st.rnd.nextU32() % st.ref->numRefs();
+			st.siteRef.push_back((uint32_t)tidx);
+			st.siteOff.push_back(st.rnd.nextU32() % (uint32_t)max<size_t>(st.ref->approxLen(tidx), 1));
+		}
+		// SAM formatting
+		EList<size_t> reflens;
+		for(size_t i = 0; i < st.ebwt->nPat(); i++) {
+			reflens.push_back(st.ebwt->plen()[i]);
+		}
+		st.samc = new SamConfig(
+			fullnames, reflens, false, false, false,
+			string("hisat"), string("hisat"), string(HISAT_VERSION),
+			string(""), string(""), RNA_STRANDNESS_UNKNOWN,
+			true,   // AS
+			true,   // XS
+			false,  // XSS
+			false,  // YN
+			true,   // XN
+			false,  // CS
+			false,  // CQ
+			true,   // X0
+			true,   // X1
+			true,   // XM
+			true,   // XO
+			true,   // XG
+			true,   // NM
+			true,   // MD
+			true,   // YF
+			false,  // YI
+			false,  // YM
+			false,  // YP
+			true,   // YT
+			true,   // YS
+			false,  // ZS
+			false,  // XR
+			false,  // XT
+			false,  // XD
+			false,  // XU
+			false,  // YL
+			false,  // YE
+			false,  // YU
+			false,  // XP
+			false,  // YR
+			false,  // ZB
+			false,  // ZR
+			false,  // ZF
+			false,  // ZM
+			false,  // ZI
+			false,  // ZP
+			false,  // ZU
+			true,   // XS:A
+			true);  // NH
+		OutFileBuf devnull("/dev/null");
+		OutputQueue oq(devnull, false, 1, false, 0);
+		st.sink = new AlnSinkSam<index_t>(oq, *st.samc, fullnames, true, NULL);
+		st.mapq = new_mapq(2, scoreMin, *st.sc);
+
+		cerr << "hisat-bench: " << st.reads.size() << " reads, "
+		     << st.anchors.size() << " anchored" << endl;
+		ostream *out = &cout;
+		ofstream fout;
+		if(!outfile.empty()) {
+			fout.open(outfile.c_str());
+			if(!fout.good()) {
+				cerr << "Error: could not open " << outfile << " for writing" << endl;
+				throw 1;
+			}
+			out = &fout;
+		}
+		for(size_t i = 0; kernels[i].name != NULL; i++) {
+			if(!kernelList.empty()) {
+				string padded = "," + kernelList + ",";
+				if(padded.find("," + string(kernels[i].name) + ",") == string::npos) continue;
+			}
+			runKernel(st, kernels[i], *out);
+		}
+		delete st.sink; st.sink = NULL;
+		devnull.close();
+	} catch(...) {
+		for(size_t i = 0; i < tempFiles.size(); i++) remove(tempFiles[i].c_str());
+		throw;
+	}
+	for(size_t i = 0; i < tempFiles.size(); i++) remove(tempFiles[i].c_str());
+	delete st.mapq;
+	delete st.samc;
+	delete st.al;
+	delete st.scLocal;
+	delete st.sc;
+	delete st.ssdb;
+	delete st.ref;
+	delete st.ebwt;
+}
+
+int main(int argc, char **argv) {
+	try {
+		argv0 = argv[0];
+		resetOptions();
+		parseOptions(argc, argv);
+		if(listOnly) {
+			for(size_t i = 0; kernels[i].name != NULL; i++) {
+				cout << kernels[i].name << endl;
+			}
+			return 0;
+		}
+		if(bt2index.empty()) {
+			cerr << "No index name given!" << endl;
+			printUsage(cerr);
+			return 1;
+		}
+		driver();
+		return 0;
+	} catch(std::exception& e) {
+		cerr << "Error: Encountered exception: '" << e.what() << "'" << endl;
+		cerr << "Command: ";
+		for(int i = 0; i < argc; i++) cerr << argv[i] << " ";
+		cerr << endl;
+		return 1;
+	} catch(int e) {
+		if(e != 0) {
+			cerr << "Error: Encountered internal HISAT exception (#" << e << ")" << endl;
+			cerr << "Command: ";
+			for(int i = 0; i < argc; i++) cerr << argv[i] << " ";
+			cerr << endl;
+		}
+		return e;
+	}
+}
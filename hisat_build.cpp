@@ -33,6 +33,9 @@
 #include "ref_read.h"
 #include "filebuf.h"
 #include "reference.h"
+#include "splice_site.h"
+#include "splice_track.h"
+#include "build_checkpoint.h"
 #include "ds.h"
 
 /**
@@ -66,6 +69,10 @@ static bool writeRef;
 static bool justRef;
 static bool reverseEach;
 static string wrapper;
+static string incremental; // basename of an existing index to extend
+static bool ssTrack;       // also write a splice signal track (.ss.bt2)
+static int nthreads;       // threads for parsing the input FASTA
+static bool resume;        // pick up where an interrupted run left off
 
 static void resetOptions() {
 	verbose        = true;  // be talkative (default)
@@ -94,6 +101,10 @@ static void resetOptions() {
 	justRef        = false; // *just* write compact reference, don't index
 	reverseEach    = false;
     wrapper.clear();
+	incremental.clear();
+	ssTrack        = false;
+	nthreads       = 1;
+	resume         = false;
 }
 
 // Argument constants for getopts
@@ -111,7 +122,11 @@ enum {
     ARG_SA,
 	ARG_WRAPPER,
     ARG_LOCAL_OFFRATE,
-    ARG_LOCAL_FTABCHARS
+    ARG_LOCAL_FTABCHARS,
+	ARG_INCREMENTAL,
+	ARG_SS_TRACK,
+	ARG_THREADS,
+	ARG_RESUME
 };
 
 /**
@@ -151,6 +166,11 @@ static void printUsage(ostream& out) {
 	    << "    -t/--ftabchars <int>    # of chars consumed in initial lookup (default: 10)" << endl
         << "    --localoffrate <int>    SA (local) is sampled every 2^offRate BWT chars (default: 3)" << endl
         << "    --localftabchars <int>  # of chars consumed in initial lookup in a local index (default: 6)" << endl
+	    << "    --incremental <idx>     add <reference_in> sequences to existing index <idx>;" << endl
+	    << "                            local indexes of <idx> are reused as-is" << endl
+	    << "    --ss-track              also write splice signal track (.ss." << gEbwt_ext << ")" << endl
+	    << "    --threads <int>         # of threads parsing the reference (default: 1)" << endl
+	    << "    --resume                continue an interrupted run with the same arguments" << endl
 	    << "    --seed <int>            seed for random number generator" << endl
 	    << "    -q/--quiet              verbose output (for debugging)" << endl
 	    << "    -h/--help               print detailed description of tool and its options" << endl
@@ -200,6 +220,10 @@ static struct option long_options[] = {
 	{(char*)"reverse-each",   no_argument,       0,            ARG_REVERSE_EACH},
 	{(char*)"usage",          no_argument,       0,            ARG_USAGE},
     {(char*)"wrapper",        required_argument, 0,            ARG_WRAPPER},
+	{(char*)"incremental",    required_argument, 0,            ARG_INCREMENTAL},
+	{(char*)"ss-track",       no_argument,       0,            ARG_SS_TRACK},
+	{(char*)"threads",        required_argument, 0,            ARG_THREADS},
+	{(char*)"resume",         no_argument,       0,            ARG_RESUME},
 	{(char*)0, 0, 0, 0} // terminator
 };
 
@@ -301,6 +325,14 @@ static void parseOptions(int argc, const char **argv) {
 			case ARG_REVERSE_EACH:
 				reverseEach = true;
 				break;
+			case ARG_INCREMENTAL:
+				incremental = optarg;
+				break;
+			case ARG_SS_TRACK: ssTrack = true; break;
+			case ARG_THREADS:
+				nthreads = parseNumber<int>(1, "--threads arg must be at least 1");
+				break;
+			case ARG_RESUME: resume = true; break;
 			case ARG_NTOA: nsToAs = true; break;
 			case 'a': autoMem = false; break;
 			case 'q': verbose = false; break;
@@ -325,17 +357,24 @@ static void parseOptions(int argc, const char **argv) {
 }
 
 EList<string> filesWritten;
+static BuildCheckpoint checkpoint; // progress, in <outfile>.ckpt
 
 /**
  * Delete all the index files that we tried to create.  For when we had to
- * abort the index-building process due to an error.
+ * abort the index-building process due to an error.  Files that a checkpoint
+ * refers to are kept so that the run can be resumed.
  */
 static void deleteIdxFiles(
 	const string& outfile,
 	bool doRef,
 	bool justRef)
 {
-	
+	if(checkpoint.progress()) {
+		cerr << "Keeping the files written so far; run again with --resume to continue "
+		     << "(progress is in \"" << checkpoint.file().c_str() << "\")" << endl;
+		return;
+	}
+	checkpoint.discard();
 	for(size_t i = 0; i < filesWritten.size(); i++) {
 		cerr << "Deleting \"" << filesWritten[i].c_str()
 		     << "\" file written during aborted indexing attempt." << endl;
@@ -343,6 +382,17 @@ static void deleteIdxFiles(
 	}
 }
 
+/**
+ * Removes a temporary file when it goes out of scope, however the scope is
+ * left.
+ */
+struct TempFile {
+	~TempFile() {
+		if(!fn.empty()) remove(fn.c_str());
+	}
+	string fn;
+};
+
 extern void initializeCntLut();
 
 /**
@@ -355,14 +405,18 @@ static void driver(
 	EList<string>& infiles,
 	const string& outfile,
 	bool packed,
-	int reverse)
+	int reverse,
+	const RefIngest* ingest)
 {
     initializeCntLut();
 	EList<FileBuf*> is(MISC_CAT);
 	bool bisulfite = false;
 	RefReadInParams refparams(false, reverse, nsToAs, bisulfite);
+	refparams.ingest = ingest;
 	assert_gt(infiles.size(), 0);
-	if(format == CMDLINE) {
+	if(ingest != NULL) {
+		// Already parsed; no need to open the files again
+	} else if(format == CMDLINE) {
 		// Adapt sequence strings to stringstreams open for input
 		stringstream *ss = new stringstream();
 		for(size_t i = 0; i < infiles.size(); i++) {
@@ -396,7 +450,7 @@ static void driver(
 			is.push_back(fb);
 		}
 	}
-	if(is.empty()) {
+	if(is.empty() && ingest == NULL) {
 		cerr << "Warning: All fasta inputs were empty" << endl;
 		throw 1;
 	}
@@ -411,11 +465,43 @@ static void driver(
 		if(!reverse && (writeRef || justRef)) {
 			filesWritten.push_back(outfile + ".3." + gEbwt_ext);
 			filesWritten.push_back(outfile + ".4." + gEbwt_ext);
-			sztot = BitPairReference::szsFromFasta(is, outfile, bigEndian, refparams, szs, sanityCheck);
+			EList<string> refFiles(MISC_CAT);
+			refFiles.push_back(outfile + ".3." + gEbwt_ext);
+			refFiles.push_back(outfile + ".4." + gEbwt_ext);
+			if(checkpoint.done("ref", refFiles)) {
+				if(verbose) cout << "  Reusing packed reference from previous run" << endl;
+				sztot = BitPairReference::szsFromFasta(is, string(), bigEndian, refparams, szs, sanityCheck);
+			} else {
+				sztot = BitPairReference::szsFromFasta(is, outfile, bigEndian, refparams, szs, sanityCheck);
+				checkpoint.finish("ref", refFiles);
+			}
 		} else {
 			sztot = BitPairReference::szsFromFasta(is, string(), bigEndian, refparams, szs, sanityCheck);
 		}
 	}
+	EList<string> trackFiles(MISC_CAT);
+	trackFiles.push_back(outfile + ".ss." + gEbwt_ext);
+	if(!reverse && ssTrack && checkpoint.done("ss", trackFiles)) {
+		filesWritten.push_back(trackFiles[0]);
+		if(verbose) cout << "Reusing splice signal track from previous run" << endl;
+	} else if(!reverse && ssTrack) {
+		// Computed from the packed reference so that its coordinates are
+		// those the aligner uses
+		if(verbose) cout << "Building splice signal track" << endl;
+		Timer _t(cout, "  Time building splice signal track: ", verbose);
+		BitPairReference ref(outfile, false);
+		if(!ref.loaded()) {
+			cerr << "Error: --ss-track needs the .3/.4." << gEbwt_ext << " files" << endl;
+			throw 1;
+		}
+		init_junction_prob();
+		SpliceTrack track;
+		track.build(ref, verbose);
+		string trackfn = outfile + ".ss." + gEbwt_ext;
+		filesWritten.push_back(trackfn);
+		track.write(trackfn);
+		checkpoint.finish("ss", trackFiles);
+	}
 	if(justRef) return;
 	assert_gt(sztot.first, 0);
 	assert_gt(sztot.second, 0);
@@ -423,6 +509,16 @@ static void driver(
 	// Construct index from input strings and parameters
 	filesWritten.push_back(outfile + ".1." + gEbwt_ext);
 	filesWritten.push_back(outfile + ".2." + gEbwt_ext);
+	EList<string> idxFiles(MISC_CAT);
+	idxFiles.push_back(outfile + ".1." + gEbwt_ext);
+	idxFiles.push_back(outfile + ".2." + gEbwt_ext);
+	idxFiles.push_back(outfile + ".5." + gEbwt_ext);
+	idxFiles.push_back(outfile + ".6." + gEbwt_ext);
+	string passKey = reverse ? "rev" : "fw";
+	if(checkpoint.done(passKey, idxFiles)) {
+		if(verbose) cout << "Reusing " << (reverse ? "mirror" : "forward") << " index from previous run" << endl;
+		return;
+	}
 	TStr s;
 	HierEbwt<TIndexOffU> hierEbwt(
                                   s,
@@ -449,7 +545,11 @@ static void driver(
                                   -1,           // override offRate
                                   verbose,      // be talkative
                                   autoMem,      // pass exceptions up to the toplevel so that we can adjust memory settings automatically
-                                  sanityCheck); // verify results and internal consistency
+                                  sanityCheck,  // verify results and internal consistency
+                                  incremental.empty() ? string() :
+                                  (reverse ? incremental + ".rev" : incremental), // index whose local indexes are reused
+                                  &checkpoint); // record progress
+	checkpoint.finish(passKey, idxFiles);
 	// Note that the Ebwt is *not* resident in memory at this time.  To
 	// load it into memory, call ebwt.loadIntoMemory()
 	if(verbose) {
@@ -494,6 +594,37 @@ static void driver(
 	}
 }
 
+/**
+ * Identify the input and the options that affect what is written, so that
+ * --resume only reuses files written for the same index.
+ */
+static uint64_t buildFingerprint(const EList<string>& infiles, const RefIngest* ingest) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int32_t opts[] = {
+		lineRate, offRate, ftabChars, localOffRate, localFtabChars,
+		bigEndian, nsToAs, reverseEach, seed, writeRef, justRef, ssTrack,
+		noDc, dcv, (int32_t)sizeof(TIndexOffU)
+	};
+	fnvHash(h, opts, sizeof(opts));
+	fnvHash(h, incremental.c_str(), incremental.length() + 1);
+	if(ingest != NULL) {
+		const EList<RefRecord>& recs = ingest->recs();
+		for(size_t i = 0; i < recs.size(); i++) {
+			uint64_t rec[] = { (uint64_t)recs[i].off, (uint64_t)recs[i].len, (uint64_t)recs[i].first };
+			fnvHash(h, rec, sizeof(rec));
+		}
+		for(size_t i = 0; i < ingest->names().size(); i++) {
+			fnvHash(h, ingest->names()[i].c_str(), ingest->names()[i].length() + 1);
+		}
+		fnvHash(h, ingest->packed(), (ingest->numBases() + 3) >> 2);
+	} else {
+		for(size_t i = 0; i < infiles.size(); i++) {
+			fnvHash(h, infiles[i].c_str(), infiles[i].length() + 1);
+		}
+	}
+	return h;
+}
+
 static const char *argv0 = NULL;
 
 extern "C" {
@@ -556,6 +687,39 @@ int hisat_build(int argc, const char **argv) {
 			return 1;
 		}
 
+		// Sequences of the index being extended are decoded from its
+		// packed reference and placed ahead of the new ones, so that the
+		// existing reference ids and local indexes stay valid
+		TempFile incrementalFa;
+		if(!incremental.empty()) {
+			if(format == CMDLINE) {
+				cerr << "Error: --incremental cannot be combined with -c" << endl;
+				throw 1;
+			}
+			if(incremental == outfile) {
+				cerr << "Error: --incremental index must differ from the output index" << endl;
+				throw 1;
+			}
+			EList<string> refnames;
+			readEbwtRefnames<TIndexOffU>(incremental, refnames);
+			incrementalFa.fn = outfile + ".incremental.fa";
+			ofstream fout(incrementalFa.fn.c_str(), ios::binary);
+			if(!fout.good()) {
+				cerr << "Could not open file for writing: \"" << incrementalFa.fn.c_str() << "\"" << endl;
+				throw 1;
+			}
+			TIndexOffU nrefs = BitPairReference::fastaFromIndex(incremental, refnames, fout);
+			fout.close();
+			if(fout.fail()) {
+				cerr << "An error occurred writing \"" << incrementalFa.fn.c_str() << "\".  Please check if the disk is full." << endl;
+				throw 1;
+			}
+			infiles.insert(incrementalFa.fn, 0);
+			if(verbose) {
+				cout << "Extending index " << incremental.c_str() << " (" << nrefs << " reference sequences)" << endl;
+			}
+		}
+
 		// Optionally summarize
 		if(verbose) {
 			cout << "Settings:" << endl
@@ -601,13 +765,25 @@ int hisat_build(int argc, const char **argv) {
 				cout << "  " << infiles[i].c_str() << endl;
 			}
 		}
+		// Parse the input once, for both the forward and the mirror index
+		RefIngest ingest;
+		const RefIngest* ingestp = NULL;
+		if(format == FASTA) {
+			if(verbose) cout << "Parsing reference" << endl;
+			Timer _t(cout, "  Time parsing reference: ", verbose);
+			ingest.parse(infiles, RefReadInParams(false, 0, nsToAs, false), nthreads, verbose);
+			ingestp = &ingest;
+		}
+		if(checkpoint.init(outfile + ".ckpt", buildFingerprint(infiles, ingestp), resume) && verbose) {
+			cout << "Resuming from " << checkpoint.file().c_str() << endl;
+		}
 		// Seed random number generator
 		srand(seed);
 		{
 			Timer timer(cout, "Total time for call to driver() for forward index: ", verbose);
 			if(!packed) {
 				try {
-					driver<SString<char> >(infile, infiles, outfile, false, REF_READ_FORWARD);
+					driver<SString<char> >(infile, infiles, outfile, false, REF_READ_FORWARD, ingestp);
 				} catch(bad_alloc& e) {
 					if(autoMem) {
 						cerr << "Switching to a packed string representation." << endl;
@@ -618,7 +794,7 @@ int hisat_build(int argc, const char **argv) {
 				}
 			}
 			if(packed) {
-				driver<S2bDnaString>(infile, infiles, outfile, true, REF_READ_FORWARD);
+				driver<S2bDnaString>(infile, infiles, outfile, true, REF_READ_FORWARD, ingestp);
 			}
 		}
 		int reverseType = reverseEach ? REF_READ_REVERSE_EACH : REF_READ_REVERSE;
@@ -626,7 +802,7 @@ int hisat_build(int argc, const char **argv) {
 		Timer timer(cout, "Total time for backward call to driver() for mirror index: ", verbose);
 		if(!packed) {
 			try {
-				driver<SString<char> >(infile, infiles, outfile + ".rev", false, reverseType);
+				driver<SString<char> >(infile, infiles, outfile + ".rev", false, reverseType, ingestp);
 			} catch(bad_alloc& e) {
 				if(autoMem) {
 					cerr << "Switching to a packed string representation." << endl;
@@ -637,8 +813,9 @@ int hisat_build(int argc, const char **argv) {
 			}
 		}
 		if(packed) {
-			driver<S2bDnaString>(infile, infiles, outfile + ".rev", true, reverseType);
+			driver<S2bDnaString>(infile, infiles, outfile + ".rev", true, reverseType, ingestp);
 		}
+		checkpoint.discard();
 		return 0;
 	} catch(std::exception& e) {
 		cerr << "Error: Encountered exception: '" << e.what() << "'" << endl;
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HISAT_LIB_H_
+#define HISAT_LIB_H_
+
+/*
+ * C interface to the aligner, built as libhisat.so ("make libhisat").
+ * It lets a program load an index once and align batches of reads held
+ * in memory, getting each alignment back as a hisat_aln_t rather than
+ * as SAM text:
+ *
+ *   const char *args[] = { "myprog", "-x", "genome", "-p", "8" };
+ *   hisat_aligner_t *h = hisat_open(5, args);
+ *   hisat_align(h, reads, nreads, on_aln, &state);
+ *   ...
+ *   hisat_close(h);
+ *
+ * hisat_open() takes the same options as hisat-align, except those
+ * naming read inputs or output files (-U/-1/-2/--12, -S, --un etc.,
+ * --two-pass, --sorted-bam, --checkpoint, --shard, --hrb-out, metrics
+ * files).  The options are process-wide, so only one aligner can be open
+ * at a time.  The -p worker threads are started by hisat_open() and are
+ * kept, with their per-thread state, until hisat_close().
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * An unpaired read, or a pair if seq2 is given.  Bases are ASCII
+ * (IUPAC codes other than ACGT become N); qualities are encoded as
+ * selected by the --phred33/--phred64/--solexa-quals options and must be
+ * as long as the bases, or NULL for "all high".  A NULL name is replaced
+ * by the read's index in the batch.
+ */
+typedef struct hisat_read {
+	const char *name;
+	const char *seq;
+	const char *qual;
+	const char *seq2;
+	const char *qual2;
+} hisat_read_t;
+
+/*
+ * One alignment, carrying the fields of the SAM record hisat-align would
+ * have printed for it.  Positions are 0-based; refid indexes the names
+ * returned by hisat_refname().  An unaligned mate has flag 0x4 set, an
+ * empty cigar ("*") and the position of its aligned mate, if any, else
+ * refid and pos -1.  The strings are only valid during the callback.
+ */
+typedef struct hisat_aln {
+	size_t      read;       /* index of the read in the batch */
+	int         mate;       /* 0 if unpaired, else 1 or 2 */
+	int         flag;       /* SAM FLAG */
+	int32_t     refid;      /* RNAME */
+	int64_t     pos;        /* POS */
+	int         mapq;       /* MAPQ */
+	const char *cigar;      /* CIGAR */
+	int32_t     mate_refid; /* RNEXT */
+	int64_t     mate_pos;   /* PNEXT */
+	int64_t     tlen;       /* TLEN */
+	int64_t     score;      /* alignment score (AS:i) */
+	int         nm;         /* edit distance (NM:i) */
+	int         nh;         /* # alignments reported for the read (NH:i) */
+	const char *tags;       /* optional fields, tab-separated, as in SAM */
+} hisat_aln_t;
+
+/*
+ * Called once per alignment, or once per mate for an unaligned read
+ * unless --no-unal was given.  The records of a read arrive together, but
+ * the worker threads call it concurrently, so it must be thread-safe.
+ */
+typedef void (*hisat_aln_cb)(const hisat_aln_t *aln, void *user);
+
+typedef struct hisat_aligner hisat_aligner_t;
+
+/*
+ * Parse argv-style options (argv[0] is the program name), load the
+ * index named with -x and start the worker threads.  Returns NULL, having
+ * printed the reason to stderr, on error.
+ */
+hisat_aligner_t *hisat_open(int argc, const char **argv);
+
+/*
+ * Align 'n' reads and return once every record has been passed to 'cb'.
+ * Batches are aligned one at a time; don't call this concurrently for the
+ * same aligner.  Returns 0 on success and nonzero, having printed the
+ * reason to stderr, if a read was rejected (no records are reported) or
+ * failed to align (the other reads' records are still reported).
+ */
+int hisat_align(
+	hisat_aligner_t    *h,
+	const hisat_read_t *reads,
+	size_t              n,
+	hisat_aln_cb        cb,
+	void               *user);
+
+/*
+ * Return the number of reference sequences and the name of reference
+ * 'refid'.
+ */
+int32_t hisat_nrefs(const hisat_aligner_t *h);
+const char *hisat_refname(const hisat_aligner_t *h, int32_t refid);
+
+/*
+ * Stop the worker threads and free the index.  Writes the splice sites
+ * found to --novel-splicesite-outfile, if given.
+ */
+void hisat_close(hisat_aligner_t *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*ndef HISAT_LIB_H_*/
@@ -0,0 +1,167 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_COUNTERS_H_
+#define HW_COUNTERS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/**
+ * Hardware events counted for --hw-counters.
+ */
+enum {
+	HWC_CYCLES = 0,
+	HWC_INSTRUCTIONS,
+	HWC_LLC_MISSES,    // last-level cache read misses
+	HWC_DTLB_MISSES,   // data TLB read misses
+	HWC_BRANCH_MISSES, // mispredicted branches
+	HWC_NUM
+};
+
+static const char * const hwc_names[HWC_NUM] = {
+	"cycles",
+	"instructions",
+	"llc_misses",
+	"dtlb_misses",
+	"branch_misses"
+};
+
+/**
+ * The calling thread's hardware event counters, opened with
+ * perf_event_open(2) as one group so that a single read() returns all of
+ * them.  Only user-space events are counted, which the default
+ * perf_event_paranoid setting allows.  Events the CPU (or hypervisor)
+ * doesn't provide are left out of the group and read as 0.  Only
+ * available on Linux; elsewhere open() always fails.
+ */
+class HwCounters {
+
+public:
+
+	HwCounters() : nopen_(0), err_(0) {
+		for(int i = 0; i < HWC_NUM; i++) {
+			fds_[i] = -1;
+			idx_[i] = -1;
+		}
+	}
+
+	~HwCounters() { close(); }
+
+	/**
+	 * Start counting for the calling thread.  Return the number of events
+	 * that could be opened; if 0, error() says why.
+	 */
+	int open() {
+		close();
+#ifdef __linux__
+		static const uint32_t types[HWC_NUM] = {
+			PERF_TYPE_HARDWARE,
+			PERF_TYPE_HARDWARE,
+			PERF_TYPE_HW_CACHE,
+			PERF_TYPE_HW_CACHE,
+			PERF_TYPE_HARDWARE
+		};
+		static const uint64_t configs[HWC_NUM] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_LL |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			PERF_COUNT_HW_CACHE_DTLB |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			PERF_COUNT_HW_BRANCH_MISSES
+		};
+		for(int i = 0; i < HWC_NUM; i++) {
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = types[i];
+			attr.config = configs[i];
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP |
+			                   PERF_FORMAT_TOTAL_TIME_ENABLED |
+			                   PERF_FORMAT_TOTAL_TIME_RUNNING;
+			int leader = (nopen_ > 0) ? fds_[0] : -1;
+			int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+			if(fd < 0) {
+				err_ = errno;
+				continue;
+			}
+			fds_[nopen_] = fd;
+			idx_[i] = nopen_++;
+		}
+#else
+		err_ = ENOSYS;
+#endif
+		return nopen_;
+	}
+
+	void close() {
+		for(int i = 0; i < nopen_; i++) {
+			::close(fds_[i]);
+			fds_[i] = -1;
+		}
+		for(int i = 0; i < HWC_NUM; i++) idx_[i] = -1;
+		nopen_ = 0;
+	}
+
+	/**
+	 * Return true iff event 'c' is being counted.
+	 */
+	bool has(int c) const { return idx_[c] >= 0; }
+
+	/**
+	 * Return the errno of the last event that couldn't be opened.
+	 */
+	int error() const { return err_; }
+
+	/**
+	 * Put the current counts in 'vals'.  'multiplexed' is set if the
+	 * kernel hasn't been able to keep the group on the PMU all the time,
+	 * e.g. because other programs are counting too, in which case the
+	 * counts are too low.  Returns false if the counters can't be read.
+	 */
+	bool read(uint64_t* vals, bool& multiplexed) const {
+		if(nopen_ == 0) return false;
+		uint64_t buf[3 + HWC_NUM];
+		ssize_t want = (ssize_t)((3 + nopen_) * sizeof(uint64_t));
+		if(::read(fds_[0], buf, sizeof(buf)) < want) return false;
+		multiplexed = buf[2] < buf[1];
+		for(int i = 0; i < HWC_NUM; i++) {
+			vals[i] = idx_[i] >= 0 ? buf[3 + idx_[i]] : 0;
+		}
+		return true;
+	}
+
+protected:
+
+	int fds_[HWC_NUM]; // group leader first
+	int idx_[HWC_NUM]; // position of each event in the group, or -1
+	int nopen_;
+	int err_;
+};
+
+#endif /*ndef HW_COUNTERS_H_*/
@@ -31,6 +31,11 @@ enum {
 	ARG_METRIC_FILE,            // --met-file
 	ARG_METRIC_STDERR,          // --met-stderr
 	ARG_METRIC_PER_READ,        // --met-per-read
+	ARG_STAGE_TIMES_FILE,       // --stage-times-file
+	ARG_TRACE_FILE,             // --trace-file
+	ARG_TRACE_START,            // --trace-start
+	ARG_TRACE_SECS,             // --trace-secs
+	ARG_HW_COUNTERS,            // --hw-counters
 	ARG_REFIDX,                 // --refidx
 	ARG_SANITY,                 // --sanity
 	ARG_PARTITION,              // --partition
@@ -135,6 +140,42 @@ enum {
 	ARG_MAPQ_EX,                // --mapq-extra
 	ARG_NO_EXTEND,              // --no-extend
 	ARG_REORDER,                // --reorder
+	ARG_SORTED_BAM,             // --sorted-bam
+	ARG_SORT_MEM,               // --sort-mem
+	ARG_TWO_PASS,               // --two-pass
+	ARG_TWO_PASS_READS,         // --two-pass-reads
+	ARG_HRB,                    // --hrb
+	ARG_HRB_OUT,                // --hrb-out
+	ARG_HRB_BIN_QUALS,          // --hrb-bin-quals
+	ARG_SHARD,                  // --shard
+	ARG_SUMMARY_FILE,           // --summary-file
+	ARG_MERGE_SHARDS,           // --merge-shards
+	ARG_MERGE_SUMMARIES,        // --merge-summaries
+	ARG_MERGE_SPLICESITES,      // --merge-splicesites
+	ARG_CHECKPOINT,             // --checkpoint
+	ARG_CHECKPOINT_IVAL,        // --checkpoint-ival
+	ARG_RESUME,                 // --resume
+	ARG_UN,                     // --un
+	ARG_UN_GZ,                  // --un-gz
+	ARG_UN_BZ2,                 // --un-bz2
+	ARG_AL,                     // --al
+	ARG_AL_GZ,                  // --al-gz
+	ARG_AL_BZ2,                 // --al-bz2
+	ARG_UN_CONC,                // --un-conc
+	ARG_UN_CONC_GZ,             // --un-conc-gz
+	ARG_UN_CONC_BZ2,            // --un-conc-bz2
+	ARG_AL_CONC,                // --al-conc
+	ARG_AL_CONC_GZ,             // --al-conc-gz
+	ARG_AL_CONC_BZ2,            // --al-conc-bz2
+	ARG_FILTERED,               // --filtered
+	ARG_FILTERED_CONC,          // --filtered-conc
+	ARG_FILTER_FA,              // --filter-fa
+	ARG_FILTER_K,               // --filter-k
+	ARG_FILTER_FRAC,            // --filter-frac
+	ARG_BUDGET_LF,              // --budget-lf
+	ARG_BUDGET_CELLS,           // --budget-cells
+	ARG_BUDGET_MS,              // --budget-ms
+	ARG_BIDIR,                  // --bidir
 	ARG_SHOW_RAND_SEED,         // --show-rand-seed
 	ARG_READ_PASSTHRU,          // --passthrough
 	ARG_SAMPLE,                 // --sample
@@ -162,6 +203,7 @@ enum {
     ARG_NOVEL_SPLICESITE_OUTFILE,
     ARG_SECONDARY,
     ARG_NO_SPLICED_ALIGNMENT,
+    ARG_NO_SS_TRACK,
     ARG_RNA_STRANDNESS,
     ARG_SPLICESITE_DB_ONLY,
 #ifdef USE_SRA
@@ -49,7 +49,21 @@ void OutputQueue::beginRead(TReadId rdid, size_t threadId) {
  * Writer is finished writing to 
  */
 void OutputQueue::finishRead(const BTString& rec, TReadId rdid, size_t threadId) {
+	if(bam_ != NULL) {
+		// Sorted BAM: the sorter keeps a bucket per thread, so encoding
+		// happens outside the lock
+		bam_->add(rec, rdid, threadId);
+		ThreadSafe t(&mutex_m, threadSafe_);
+		nfinished_++;
+		nflushed_++;
+		return;
+	}
 	ThreadSafe t(&mutex_m, threadSafe_);
+	if(discard_) {
+		nfinished_++;
+		nflushed_++;
+		return;
+	}
 	if(reorder_) {
 		assert_geq(rdid, cur_);
 		assert_eq(lines_.size(), finished_.size());
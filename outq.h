@@ -26,6 +26,7 @@
 #include "read.h"
 #include "threading.h"
 #include "mem_ids.h"
+#include "bam.h"
 
 /**
  * Encapsulates a list of lines of output.  If the earliest as-yet-unreported
@@ -56,11 +57,32 @@ public:
 		finished_(RES_CAT),
 		reorder_(reorder),
 		threadSafe_(threadSafe),
+		bam_(NULL),
+		discard_(false),
         mutex_m()
 	{
 		assert(nthreads <= 1 || threadSafe);
 	}
 
+	/**
+	 * Divert finished records to the given BamSorter instead of writing
+	 * them to obuf_.  Records are then neither reordered nor written until
+	 * the caller calls BamSorter::finish().
+	 */
+	void setBamSorter(BamSorter *bam) {
+		assert(!reorder_);
+		bam_ = bam;
+	}
+
+	/**
+	 * Count finished records but don't write them anywhere; used when
+	 * records are only formatted for their side effects.
+	 */
+	void setDiscard(bool discard) {
+		assert(!reorder_);
+		discard_ = discard;
+	}
+
 	/**
 	 * Caller is telling us that they're about to write output record(s) for
 	 * the read with the given id.
@@ -117,33 +139,65 @@ protected:
 	EList<bool>     finished_;
 	bool            reorder_;
 	bool            threadSafe_;
+	BamSorter      *bam_;
+	bool            discard_;
 	MUTEX_T         mutex_m;
 };
 
+/**
+ * Brackets the formatting of one read's output records: beginRead() on
+ * construction and finishRead() on destruction.  If 'stages' is non-NULL,
+ * time spent inside the two queue calls (mostly waiting for the queue's
+ * lock) is recorded as STAGE_OUTPUT_WAIT, and traced as two events,
+ * one per call.
+ */
 class OutputQueueMark {
 public:
 	OutputQueueMark(
 		OutputQueue& q,
 		const BTString& rec,
 		TReadId rdid,
-		size_t threadId) :
+		size_t threadId,
+		StageMetrics* stages = NULL) :
 		q_(q),
 		rec_(rec),
 		rdid_(rdid),
-		threadId_(threadId)
+		threadId_(threadId),
+		stages_(stages),
+		waitNs_(0)
 	{
+		uint64_t beg = (stages_ != NULL) ? stageNanos() : 0;
 		q_.beginRead(rdid, threadId);
+		if(stages_ != NULL) {
+			uint64_t end = stageNanos();
+			waitNs_ = end - beg;
+			trace(beg, end);
+		}
 	}
 	
 	~OutputQueueMark() {
+		uint64_t beg = (stages_ != NULL) ? stageNanos() : 0;
 		q_.finishRead(rec_, rdid_, threadId_);
+		if(stages_ != NULL) {
+			uint64_t end = stageNanos();
+			stages_->add(STAGE_OUTPUT_WAIT, waitNs_ + end - beg);
+			trace(beg, end);
+		}
 	}
 	
 protected:
+
+	static void trace(uint64_t beg, uint64_t end) {
+		StageTrace* tr = curStageTrace();
+		if(tr != NULL) tr->add(STAGE_OUTPUT_WAIT, beg, end);
+	}
+
 	OutputQueue& q_;
 	const BTString& rec_;
 	TReadId rdid_;
 	size_t threadId_;
+	StageMetrics* stages_;
+	uint64_t waitNs_;
 };
 
 #endif
@@ -23,6 +23,7 @@
 #include <stdexcept>
 #include "sstring.h"
 
+#include <emmintrin.h>
 #include "pat.h"
 #include "filebuf.h"
 #include "formats.h"
@@ -59,6 +60,7 @@ PatternSource* PatternSource::patsrcFromStrings(
 		case TAB_MATE6:   return new TabbedPatternSource(qs, p, true);
 		case CMDLINE:     return new VectorPatternSource(qs, p);
 		case QSEQ:        return new QseqPatternSource(qs, p);
+		case HRB:         return new HrbPatternSource(qs, p);
 #ifdef USE_SRA
         case SRA_FASTA:
         case SRA_FASTQ: return new SRAPatternSource(qs, p, nthreads);
@@ -145,11 +147,45 @@ bool WrappedPatternSourcePerThread::nextReadPair(
 	ASSERT_ONLY(TReadId lastRdId = rdid_);
 	buf1_.reset();
 	buf2_.reset();
-	patsrc_.nextReadPair(buf1_, buf2_, rdid_, endid_, success, done, paired, fixName);
+	patsrc_.nextShardReadPair(buf1_, buf2_, rdid_, endid_, success, done, paired, fixName);
 	assert(!success || rdid_ != lastRdId);
 	return success;
 }
 
+/**
+ * Get the next read/pair of this shard; see pat.h.
+ */
+bool PairedPatternSource::nextShardReadPair(
+	Read& ra,
+	Read& rb,
+	TReadId& rdid,
+	TReadId& endid,
+	bool& success,
+	bool& done,
+	bool& paired,
+	bool fixName)
+{
+	nextReadPair(ra, rb, rdid, endid, success, done, paired, fixName);
+	if(nshards_ == 1) {
+		return success;
+	}
+	while(success && rdid % nshards_ != shard_) {
+		ra.reset();
+		rb.reset();
+		do {
+			nextReadPair(ra, rb, rdid, endid, success, done, paired, fixName);
+		} while(!success && !done);
+	}
+	if(success) {
+		rdid /= nshards_;
+		ra.rdid = rdid;
+		if(!rb.empty()) {
+			rb.rdid = rdid;
+		}
+	}
+	return success;
+}
+
 /**
  * The main member function for dispensing pairs of reads or
  * singleton reads.  Returns true iff ra and rb contain a new
@@ -207,6 +243,28 @@ bool PairedSoloPatternSource::nextReadPair(
 	return false;
 }
 
+/**
+ * Position is the current source followed by the positions of all the
+ * sources.
+ */
+bool PairedSoloPatternSource::tell(ostream& os) {
+	os << cur_ << ' ';
+	for(size_t i = 0; i < src_->size(); i++) {
+		if(!(*src_)[i]->tell(os)) return false;
+	}
+	return true;
+}
+
+bool PairedSoloPatternSource::seek(istream& is) {
+	uint32_t cur = 0;
+	if((is >> cur).fail() || cur > src_->size()) return false;
+	for(size_t i = 0; i < src_->size(); i++) {
+		if(!(*src_)[i]->seek(is)) return false;
+	}
+	cur_ = cur;
+	return true;
+}
+
 /**
  * The main member function for dispensing pairs of reads or
  * singleton reads.  Returns true iff ra and rb contain a new
@@ -321,6 +379,30 @@ pair<TReadId, TReadId> PairedDualPatternSource::readCnt() const {
 	return make_pair(rets, retp);
 }
 
+/**
+ * Position is the current pair of sources followed by the positions of all
+ * the sources, mate 1 before mate 2.
+ */
+bool PairedDualPatternSource::tell(ostream& os) {
+	os << cur_ << ' ';
+	for(size_t i = 0; i < srca_->size(); i++) {
+		if(!(*srca_)[i]->tell(os)) return false;
+		if((*srcb_)[i] != NULL && !(*srcb_)[i]->tell(os)) return false;
+	}
+	return true;
+}
+
+bool PairedDualPatternSource::seek(istream& is) {
+	uint32_t cur = 0;
+	if((is >> cur).fail() || cur > srca_->size()) return false;
+	for(size_t i = 0; i < srca_->size(); i++) {
+		if(!(*srca_)[i]->seek(is)) return false;
+		if((*srcb_)[i] != NULL && !(*srcb_)[i]->seek(is)) return false;
+	}
+	cur_ = cur;
+	return true;
+}
+
 /**
  * Given the values for all of the various arguments used to specify
  * the read and quality input, create a list of pattern sources to
@@ -721,6 +803,256 @@ int parseQuals(
 	return (int)r.qual.length();
 }
 
+/**
+ * Append the nucleotides in one sequence line to dst.  Runs of A, C, G, T
+ * and N (either case) are converted 16 characters at a time; from the
+ * first other character on, the line is converted one character at a time
+ * following the same rules as the character-at-a-time parsers: FASTQ keeps
+ * any letter and treats '.' as N, FASTA keeps any IUPAC character.
+ */
+static void appendSeqLine(BTDnaString& dst, const char *s, size_t len, bool fasta) {
+	size_t off = dst.length();
+	dst.resize(off + len);
+	char *d = dst.wbuf() + off;
+	const __m128i vcase = _mm_set1_epi8((char)0xDF);
+	const __m128i vA = _mm_set1_epi8('A'), vC = _mm_set1_epi8('C');
+	const __m128i vG = _mm_set1_epi8('G'), vT = _mm_set1_epi8('T');
+	const __m128i vN = _mm_set1_epi8('N');
+	const __m128i v1 = _mm_set1_epi8(1), v2 = _mm_set1_epi8(2);
+	const __m128i v3 = _mm_set1_epi8(3), v4 = _mm_set1_epi8(4);
+	size_t i = 0;
+	for(; i + 16 <= len; i += 16) {
+		__m128i v = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i)), vcase);
+		__m128i isC = _mm_cmpeq_epi8(v, vC), isG = _mm_cmpeq_epi8(v, vG);
+		__m128i isT = _mm_cmpeq_epi8(v, vT), isN = _mm_cmpeq_epi8(v, vN);
+		__m128i ok = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, vA), isC),
+		                          _mm_or_si128(_mm_or_si128(isG, isT), isN));
+		if(_mm_movemask_epi8(ok) != 0xffff) break;
+		__m128i r = _mm_or_si128(_mm_and_si128(isC, v1), _mm_and_si128(isG, v2));
+		r = _mm_or_si128(r, _mm_or_si128(_mm_and_si128(isT, v3), _mm_and_si128(isN, v4)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), r);
+	}
+	size_t j = i;
+	for(; i < len; i++) {
+		int c = (unsigned char)s[i];
+		if(fasta) {
+			if(asc2dnacat[c] > 0) d[j++] = asc2dna[c];
+		} else {
+			if(c == '.') c = 'N';
+			if(isalpha(c)) d[j++] = asc2dna[c];
+		}
+	}
+	dst.resize(off + j);
+}
+
+/**
+ * Append one line of ASCII-encoded qualities to dst, converted to Phred+33.
+ * Phred+33 and Phred+64 qualities are checked and converted 16 at a time;
+ * anything the vector pass can't vouch for goes through charToPhred33(),
+ * which reports the error.
+ */
+static void appendQualLine(
+	BTString& dst,
+	const char *s,
+	size_t len,
+	bool solQuals,
+	bool phred64Quals,
+	const BTString& name)
+{
+	size_t off = dst.length();
+	dst.resize(off + len);
+	char *d = dst.wbuf() + off;
+	size_t i = 0;
+	if(!solQuals) {
+		const __m128i vmin = _mm_set1_epi8(phred64Quals ? 63 : 32);
+		const __m128i vsub = _mm_set1_epi8(phred64Quals ? 64 - 33 : 0);
+		for(; i + 16 <= len; i += 16) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+			if(_mm_movemask_epi8(_mm_cmpgt_epi8(v, vmin)) != 0xffff) break;
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_sub_epi8(v, vsub));
+		}
+	}
+	for(; i < len; i++) {
+		if(s[i] == ' ') wrongQualityFormat(name);
+		d[i] = charToPhred33(s[i], solQuals, phred64Quals);
+		assert_geq(d[i], 33);
+	}
+}
+
+/**
+ * Parse one mate handed over by the library interface into r; 'idx' is
+ * the read's index in the batch.
+ */
+void MemoryPatternSource::parse(
+	Read& r,
+	const char *name,
+	const char *seq,
+	const char *qual,
+	size_t idx)
+{
+	r.color = gColor;
+	if(name != NULL) {
+		r.name.install(name);
+	} else {
+		char cbuf[20];
+		itoa10<size_t>(idx, cbuf);
+		r.name.install(cbuf);
+	}
+	size_t len = strlen(seq);
+	appendSeqLine(r.patFw, seq, len, false);
+	size_t seqlen = r.patFw.length();
+	if(seqlen == 0) return;
+	r.patFw.trimBegin(min<size_t>((size_t)gTrim5, seqlen));
+	r.patFw.trimEnd(gTrim3);
+	if(qual != NULL) {
+		size_t qlen = strlen(qual);
+		size_t qtrim5 = min<size_t>((size_t)gTrim5, qlen);
+		appendQualLine(r.qual, qual + qtrim5, qlen - qtrim5, solQuals_, phred64Quals_, r.name);
+		r.qual.trimEnd(gTrim3);
+		if(r.qual.length() < r.patFw.length()) {
+			tooFewQualities(r.name);
+		} else if(r.qual.length() > r.patFw.length()) {
+			tooManyQualities(r.name);
+		}
+	} else {
+		r.qual.resize(r.patFw.length());
+		r.qual.fill('I');
+	}
+	r.trimmed3 = gTrim3;
+	r.trimmed5 = gTrim5;
+}
+
+/**
+ * Dispense mate 1 of the next read; for completeness, since pairs are
+ * dispensed by nextReadPairImpl().
+ */
+bool MemoryPatternSource::nextReadImpl(
+	Read& r,
+	TReadId& rdid,
+	TReadId& endid,
+	bool& success,
+	bool& done)
+{
+	r.reset();
+	lock();
+	if(cur_ >= n_) {
+		unlock();
+		success = false;
+		done = true;
+		return false;
+	}
+	size_t idx = cur_++;
+	done = cur_ == n_;
+	rdid = endid = readCnt_;
+	readCnt_++;
+	unlock();
+	const hisat_read_t& rd = reads_[idx];
+	parse(r, rd.name, rd.seq, rd.qual, idx);
+	success = true;
+	return true;
+}
+
+/**
+ * Dispense the next read, or pair if it has a second sequence.
+ */
+bool MemoryPatternSource::nextReadPairImpl(
+	Read& ra,
+	Read& rb,
+	TReadId& rdid,
+	TReadId& endid,
+	bool& success,
+	bool& done,
+	bool& paired)
+{
+	ra.reset();
+	rb.reset();
+	lock();
+	if(cur_ >= n_) {
+		unlock();
+		success = false;
+		done = true;
+		return false;
+	}
+	size_t idx = cur_++;
+	done = cur_ == n_;
+	rdid = endid = readCnt_;
+	readCnt_++;
+	unlock();
+	const hisat_read_t& rd = reads_[idx];
+	parse(ra, rd.name, rd.seq, rd.qual, idx);
+	paired = rd.seq2 != NULL;
+	if(paired) {
+		parse(rb, rd.name, rd.seq2, rd.qual2, idx);
+	}
+	success = true;
+	return true;
+}
+
+/**
+ * Read another pattern from a FASTA input file, a line at a time.
+ */
+bool FastaPatternSource::readBlock(
+	Read& r,
+	TReadId& rdid,
+	TReadId& endid,
+	bool& success,
+	bool& done)
+{
+	const char *p;
+	size_t len;
+	int c;
+	success = true;
+	done = false;
+	r.reset();
+	r.color = gColor;
+	// Skip comments and blank lines
+	while((c = bb_.peek()) == '#' || c == ';' || c == '\r' || c == '\n') {
+		bb_.nextLine(p, len);
+	}
+	if(c < 0) {
+		r.reset(); success = false; done = true; return success;
+	}
+	if(c != '>') {
+		cerr << "Error: reads file does not look like a FASTA file" << endl;
+		throw 1;
+	}
+	first_ = false;
+	bb_.mark();
+	bb_.nextLine(p, len);
+	r.name.install(p + 1, len - 1);
+	if((c = bb_.peek()) < 0) {
+		r.reset(); success = false; done = true; return success;
+	}
+	if(c == '>') {
+		// Empty sequences!
+		cerr << "Warning: skipping empty FASTA read with name '" << r.name << "'" << endl;
+		rdid = endid = readCnt_;
+		readCnt_++;
+		success = true; done = false; return success;
+	}
+	while((c = bb_.peek()) >= 0 && c != '>') {
+		bb_.nextLine(p, len);
+		appendSeqLine(r.patFw, p, len, true);
+	}
+	r.patFw.trimBegin(min<size_t>((size_t)gTrim5, r.patFw.length()));
+	r.patFw.trimEnd(gTrim3);
+	r.qual.resize(r.patFw.length());
+	r.qual.fill('I');
+	r.trimmed3 = gTrim3;
+	r.trimmed5 = gTrim5;
+	// Set up a default name if one hasn't been set
+	if(r.name.empty()) {
+		char cbuf[20];
+		itoa10<TReadId>(readCnt_, cbuf);
+		r.name.install(cbuf);
+	}
+	assert_gt(r.name.length(), 0);
+	r.readOrigBuf.install(bb_.markedText(), bb_.markedLen());
+	rdid = endid = readCnt_;
+	readCnt_++;
+	return success;
+}
+
 /// Read another pattern from a FASTA input file
 bool FastaPatternSource::read(
 	Read& r,
@@ -729,6 +1061,7 @@ bool FastaPatternSource::read(
 	bool& success,
 	bool& done)
 {
+	if(blocks_) return readBlock(r, rdid, endid, success, done);
 	int c, qc = 0;
 	success = true;
 	done = false;
@@ -848,6 +1181,88 @@ bool FastaPatternSource::read(
 	return success;
 }
 
+/**
+ * Read another pattern from a FASTQ input file, a line at a time.  Used
+ * when there are no colors, alternate base calls or integer qualities.
+ */
+bool FastqPatternSource::readBlock(
+	Read& r,
+	TReadId& rdid,
+	TReadId& endid,
+	bool& success,
+	bool& done)
+{
+	const char *p;
+	size_t len;
+	int c;
+	success = true;
+	done = false;
+	r.reset();
+	r.color = gColor;
+	r.fuzzy = fuzzy_;
+	while((c = bb_.peek()) == '\r' || c == '\n') {
+		bb_.nextLine(p, len);
+	}
+	if(c < 0) {
+		r.reset(); success = false; done = true; return success;
+	}
+	if(c != '@') {
+		cerr << "Error: reads file does not look like a FASTQ file" << endl;
+		throw 1;
+	}
+	first_ = false;
+	bb_.mark();
+	bb_.nextLine(p, len);
+	r.name.install(p + 1, len - 1);
+	// Sequence line(s), up to the '+' line
+	while(true) {
+		if(!bb_.nextLine(p, len)) {
+			r.reset(); success = false; done = true; return success;
+		}
+		if(len > 0 && p[0] == '+') break;
+		appendSeqLine(r.patFw, p, len, false);
+	}
+	size_t seqlen = r.patFw.length();
+	if(seqlen == 0) {
+		// No sequence and so no quality line either
+		r.readOrigBuf.install(bb_.markedText(), bb_.markedLen());
+		rdid = endid = readCnt_;
+		readCnt_++;
+		return success;
+	}
+	r.patFw.trimBegin(min<size_t>((size_t)gTrim5, seqlen));
+	r.patFw.trimEnd(gTrim3);
+	
+	// Quality line; the file may end without a final newline
+	if(!bb_.nextLine(p, len)) {
+		p = NULL; len = 0;
+	}
+	size_t qtrim5 = min<size_t>((size_t)gTrim5, len);
+	appendQualLine(r.qual, p + qtrim5, len - qtrim5, solQuals_, phred64Quals_, r.name);
+	r.qual.trimEnd(gTrim3);
+	if(r.qual.length() < r.patFw.length()) {
+		tooFewQualities(r.name);
+	} else if(r.qual.length() > r.patFw.length()+1) {
+		tooManyQualities(r.name);
+	}
+	if(r.qual.length() > r.patFw.length()) {
+		r.qual.resize(r.patFw.length());
+	}
+	r.readOrigBuf.install(bb_.markedText(), bb_.markedLen());
+	
+	// Set up a default name if one hasn't been set
+	if(r.name.empty()) {
+		char cbuf[20];
+		itoa10<TReadId>(readCnt_, cbuf);
+		r.name.install(cbuf);
+	}
+	r.trimmed3 = gTrim3;
+	r.trimmed5 = gTrim5;
+	rdid = endid = readCnt_;
+	readCnt_++;
+	return success;
+}
+
 /// Read another pattern from a FASTQ input file
 bool FastqPatternSource::read(
 	Read& r,
@@ -856,6 +1271,7 @@ bool FastqPatternSource::read(
 	bool& success,
 	bool& done)
 {
+	if(blocks_) return readBlock(r, rdid, endid, success, done);
 	int c;
 	int dstLen = 0;
 	success = true;
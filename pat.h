@@ -34,12 +34,15 @@
 #include "random_source.h"
 #include "threading.h"
 #include "filebuf.h"
+#include "blockbuf.h"
 #include "qual.h"
 #include "search_globals.h"
 #include "sstring.h"
 #include "ds.h"
 #include "read.h"
 #include "util.h"
+#include "read_bin.h"
+#include "hisat_lib.h"
 
 /**
  * Classes and routines for reading reads from various input sources.
@@ -105,7 +108,9 @@ struct PatternParams {
 		bool fuzzy_,
 		int sampleLen_,
 		int sampleFreq_,
-		uint32_t skip_) :
+		TReadId skip_,
+		uint32_t shard_ = 0,
+		uint32_t nshards_ = 1) :
 		format(format_),
 		fileParallel(fileParallel_),
 		seed(seed_),
@@ -116,7 +121,9 @@ struct PatternParams {
 		fuzzy(fuzzy_),
 		sampleLen(sampleLen_),
 		sampleFreq(sampleFreq_),
-		skip(skip_) { }
+		skip(skip_),
+		shard(shard_),
+		nshards(nshards_) { }
 
 	int format;           // file format
 	bool fileParallel;    // true -> wrap files with separate PairedPatternSources
@@ -128,7 +135,9 @@ struct PatternParams {
 	bool fuzzy;           // true -> try to parse fuzzy fastq
 	int sampleLen;        // length of sampled reads for FastaContinuous...
 	int sampleFreq;       // frequency of sampled reads for FastaContinuous...
-	uint32_t skip;        // skip the first 'skip' patterns
+	TReadId skip;         // skip the first 'skip' patterns
+	uint32_t shard;       // with --shard, dispense only this shard's patterns
+	uint32_t nshards;     // # shards; 1 = no sharding
 };
 
 /**
@@ -223,13 +232,29 @@ public:
 	/// Reset state to start over again with the first read
 	virtual void reset() { readCnt_ = 0; }
 
+	/**
+	 * Write where the next read will be parsed from to 'os', for
+	 * --checkpoint.  Returns false if seek() couldn't get back there in a
+	 * later run, e.g. for stdin and pipes.  Only call while no other
+	 * thread is reading from this source.
+	 */
+	virtual bool tell(ostream& os) { return false; }
+
+	/**
+	 * Continue from a position written by tell(); the next read gets the
+	 * rdid it would have had then.  Returns false if that's not possible,
+	 * in which case the source must be reset() before it's used.  Only
+	 * call before any reads are dispensed.
+	 */
+	virtual bool seek(istream& is) { return false; }
+
 	/**
 	 * Concrete subclasses call lock() to enter a critical region.
 	 * What constitutes a critical region depends on the subclass.
 	 */
 	void lock() {
 		if(!doLocking_) return; // no contention
-        mutex.lock();
+		lockTraced(mutex, TRACE_INPUT_WAIT);
 	}
 
 	/**
@@ -278,7 +303,15 @@ protected:
  */
 class PairedPatternSource {
 public:
-	PairedPatternSource(const PatternParams& p) : mutex_m(), seed_(p.seed) {}
+	PairedPatternSource(const PatternParams& p) :
+		mutex_m(),
+		seed_(p.seed),
+		shard_(p.shard),
+		nshards_(p.nshards)
+	{
+		assert_gt(nshards_, 0);
+		assert_lt(shard_, nshards_);
+	}
 	virtual ~PairedPatternSource() { }
 
 	virtual void addWrapper() = 0;
@@ -296,12 +329,43 @@ public:
 	
 	virtual pair<TReadId, TReadId> readCnt() const = 0;
 
+	/**
+	 * Write where the next read/pair will come from to 'os', for
+	 * --checkpoint; see PatternSource::tell().  Returns false if the
+	 * position can't be returned to.
+	 */
+	virtual bool tell(ostream& os) = 0;
+
+	/**
+	 * Continue from a position written by tell(); see
+	 * PatternSource::seek().  Returns false if that's not possible, in
+	 * which case the source must be reset() before it's used.
+	 */
+	virtual bool seek(istream& is) = 0;
+
+	/**
+	 * Like nextReadPair(), but with --shard, pass over the reads/pairs
+	 * that belong to other shards.  Read/pair k of the input belongs to
+	 * shard k % nshards, and is read/pair k / nshards of that shard; rdid
+	 * is set to the latter, so a shard's reads are numbered from 0 with no
+	 * gaps.
+	 */
+	bool nextShardReadPair(
+		Read& ra,
+		Read& rb,
+		TReadId& rdid,
+		TReadId& endid,
+		bool& success,
+		bool& done,
+		bool& paired,
+		bool fixName);
+
 	/**
 	 * Lock this PairedPatternSource, usually because one of its shared
 	 * fields is being updated.
 	 */
 	void lock() {
-		mutex_m.lock();
+		lockTraced(mutex_m, TRACE_INPUT_WAIT);
 	}
 
 	/**
@@ -335,6 +399,8 @@ protected:
 
 	MUTEX_T mutex_m; /// mutex for syncing over critical regions
 	uint32_t seed_;
+	uint32_t shard_;   /// shard dispensed by nextShardReadPair()
+	uint32_t nshards_; /// # shards the input is divided into
 };
 
 /**
@@ -406,6 +472,9 @@ public:
 		return make_pair(ret, 0llu);
 	}
 
+	virtual bool tell(ostream& os);
+	virtual bool seek(istream& is);
+
 protected:
 
 	volatile uint32_t cur_; // current element in parallel srca_, srcb_ vectors
@@ -494,6 +563,9 @@ public:
 	 */
 	virtual pair<TReadId, TReadId> readCnt() const;
 
+	virtual bool tell(ostream& os);
+	virtual bool seek(istream& is);
+
 protected:
 
 	volatile uint32_t cur_; // current element in parallel srca_, srcb_ vectors
@@ -742,7 +814,7 @@ public:
 private:
 
 	size_t cur_;
-	uint32_t skip_;
+	TReadId skip_;
 	bool paired_;
 	EList<BTDnaString> v_;  // forward sequences
 	EList<BTString> quals_; // forward qualities
@@ -751,6 +823,81 @@ private:
 	EList<int> trimmed5_;   // names
 };
 
+/**
+ * Encapsulates a source of patterns handed over in memory by a caller of
+ * the library interface (hisat_lib.h).  Each hisat_read_t is an unpaired
+ * read or, if it has a second sequence, a pair; the bases and qualities
+ * are parsed following the FASTQ rules.  setBatch() replaces the reads,
+ * which the caller keeps alive until they have all been dispensed.
+ */
+class MemoryPatternSource : public PatternSource {
+
+public:
+
+	MemoryPatternSource(const PatternParams& p) :
+		PatternSource(p),
+		reads_(NULL),
+		n_(0),
+		cur_(0),
+		first_(0),
+		solQuals_(p.solexa64),
+		phred64Quals_(p.phred64)
+	{ }
+
+	virtual ~MemoryPatternSource() { }
+
+	/**
+	 * Dispense reads[0..n) next; call reset() afterwards.  Read ids keep
+	 * counting from one batch to the next, so that the splice site DB
+	 * sees the reads in the order they were aligned; returns the id of
+	 * reads[0].
+	 */
+	TReadId setBatch(const hisat_read_t* reads, size_t n) {
+		reads_ = reads;
+		n_ = n;
+		first_ += cur_;
+		return first_;
+	}
+
+	virtual bool nextReadImpl(
+		Read& r,
+		TReadId& rdid,
+		TReadId& endid,
+		bool& success,
+		bool& done);
+
+	virtual bool nextReadPairImpl(
+		Read& ra,
+		Read& rb,
+		TReadId& rdid,
+		TReadId& endid,
+		bool& success,
+		bool& done,
+		bool& paired);
+
+	/**
+	 * Start over with the first read of the batch.
+	 */
+	virtual void reset() {
+		readCnt_ = first_;
+		cur_ = 0;
+	}
+
+private:
+
+	/**
+	 * Parse one mate into r; 'idx' is the read's index in the batch.
+	 */
+	void parse(Read& r, const char *name, const char *seq, const char *qual, size_t idx);
+
+	const hisat_read_t* reads_;
+	size_t n_;
+	size_t cur_;
+	TReadId first_; // id of reads_[0]
+	bool solQuals_;
+	bool phred64Quals_;
+};
+
 /**
  *
  */
@@ -758,11 +905,14 @@ class BufferedFilePatternSource : public PatternSource {
 public:
 	BufferedFilePatternSource(
 		const EList<string>& infiles,
-		const PatternParams& p) :
+		const PatternParams& p,
+		bool blocks = false) :
 		PatternSource(p),
 		infiles_(infiles),
 		filecur_(0),
 		fb_(),
+		bb_(),
+		blocks_(blocks),
 		skip_(p.skip),
 		first_(true)
 	{
@@ -855,6 +1005,36 @@ public:
 		filecur_++;
 	}
 
+	/**
+	 * Position is the index of the current file, the offset in it of the
+	 * next record, the file's size and the rdid of the next read.  Only
+	 * whole-block parsing stops between records, so the other parsers
+	 * can't seek.
+	 */
+	virtual bool tell(ostream& os) {
+		if(!blocks_ || !bb_.isOpen() || !bb_.seekable()) return false;
+		os << (filecur_ - 1) << ' ' << bb_.offset() << ' ' << bb_.fileSize() << ' ' << readCnt_ << ' ';
+		return true;
+	}
+
+	virtual bool seek(istream& is) {
+		size_t file = 0;
+		uint64_t off = 0;
+		int64_t size = 0;
+		TReadId rdid = 0;
+		if((is >> file >> off >> size >> rdid).fail() || !blocks_ || file >= infiles_.size()) {
+			return false;
+		}
+		filecur_ = file;
+		open();
+		if(filecur_ != file || !bb_.seekable() || bb_.fileSize() != size || !bb_.seek(off)) {
+			return false;
+		}
+		filecur_++;
+		readCnt_ = rdid;
+		return true;
+	}
+
 protected:
 
 	/// Read another pattern from the input file; this is overridden
@@ -895,7 +1075,8 @@ protected:
 				filecur_++;
 				continue;
 			}
-			fb_.newFile(in);
+			if(blocks_) bb_.newFile(in);
+			else        fb_.newFile(in);
 			return;
 		}
 		cerr << "Error: No input read files were valid" << endl;
@@ -907,6 +1088,8 @@ protected:
 	EList<bool> errs_;       // whether we've already printed an error for each file
 	size_t filecur_;         // index into infiles_ of next file to read
 	FileBuf fb_;             // read file currently being read from
+	BlockBuf bb_;            // same, when parsing whole blocks (blocks_)
+	bool blocks_;            // true -> read through bb_ instead of fb_
 	TReadId skip_;           // number of reads to skip
 	bool first_;
 };
@@ -937,7 +1120,7 @@ class FastaPatternSource : public BufferedFilePatternSource {
 public:
 	FastaPatternSource(const EList<string>& infiles,
 	                   const PatternParams& p) :
-		BufferedFilePatternSource(infiles, p),
+		BufferedFilePatternSource(infiles, p, !gColor),
 		first_(true), solexa64_(p.solexa64), phred64_(p.phred64), intQuals_(p.intQuals)
 	{ }
 	virtual void reset() {
@@ -971,6 +1154,14 @@ protected:
 		bool& success,
 		bool& done);
 	
+	/// Same as read(), but parsing whole lines out of bb_
+	bool readBlock(
+		Read& r,
+		TReadId& rdid,
+		TReadId& endid,
+		bool& success,
+		bool& done);
+	
 	/// Read another pair of patterns from a FASTA input file
 	virtual bool readPair(
 		Read& ra,
@@ -1362,7 +1553,7 @@ class FastqPatternSource : public BufferedFilePatternSource {
 public:
 
 	FastqPatternSource(const EList<string>& infiles, const PatternParams& p) :
-		BufferedFilePatternSource(infiles, p),
+		BufferedFilePatternSource(infiles, p, !gColor && !p.fuzzy && !p.intQuals),
 		first_(true),
 		solQuals_(p.solexa64),
 		phred64Quals_(p.phred64),
@@ -1430,6 +1621,14 @@ protected:
 		bool& success,
 		bool& done);
 	
+	/// Same as read(), but parsing whole lines out of bb_
+	bool readBlock(
+		Read& r,
+		TReadId& rdid,
+		TReadId& endid,
+		bool& success,
+		bool& done);
+	
 	/// Read another read pair from a FASTQ input file
 	virtual bool readPair(
 		Read& ra,
@@ -1619,6 +1818,71 @@ private:
 	bool first_;
 };
 
+/**
+ * Synchronized concrete pattern source for HISAT binary read files (see
+ * read_bin.h).  All the files are mapped up front; a thread claims the next
+ * record while holding the lock and decodes it after letting go.  Skipped
+ * reads (-s) are found through each file's record index rather than by
+ * decoding them, so a run can start anywhere in the read-ID range.
+ */
+class HrbPatternSource : public PatternSource {
+
+public:
+
+	HrbPatternSource(
+		const EList<string>& infiles,
+		const PatternParams& p);
+
+	virtual ~HrbPatternSource();
+
+	/// Dispense the next unpaired read; a paired record is an error
+	virtual bool nextReadImpl(
+		Read& r,
+		TReadId& rdid,
+		TReadId& endid,
+		bool& success,
+		bool& done);
+
+	/// Dispense the next read or pair
+	virtual bool nextReadPairImpl(
+		Read& ra,
+		Read& rb,
+		TReadId& rdid,
+		TReadId& endid,
+		bool& success,
+		bool& done,
+		bool& paired);
+
+	virtual void reset() {
+		PatternSource::reset();
+		rewind();
+	}
+
+protected:
+
+	/**
+	 * Position at the first record not skipped with -s.
+	 */
+	void rewind();
+
+	/**
+	 * Claim the next record.  Returns NULL when there are none left;
+	 * otherwise sets f to the file it's in and rdid to its read ID.
+	 */
+	const uint8_t *claim(const HrbFile*& f, TReadId& rdid);
+
+	/**
+	 * Apply -5/-3 trimming to a freshly decoded mate.
+	 */
+	static void trim(Read& r);
+
+	EList<HrbFile*> files_;
+	TReadId skip_;        // number of reads to skip
+	size_t filecur_;      // file holding cur_
+	const uint8_t *cur_;  // next record to hand out
+	uint64_t left_;       // records left in files_[filecur_]
+};
+
 #ifdef USE_SRA
 
 namespace ngs {
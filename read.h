@@ -26,6 +26,7 @@
 #include "sstring.h"
 #include "filebuf.h"
 #include "util.h"
+#include "stage_metrics.h"
 
 enum rna_strandness_format {
     RNA_STRANDNESS_UNKNOWN = 0,
@@ -424,6 +425,16 @@ struct FmString {
 	EList<FmStringOp> ops; // op string
 };
 
+/**
+ * Which per-read work budget, if any, cut the search for a read short.
+ */
+enum {
+	WORK_BUDGET_NONE = 0,
+	WORK_BUDGET_LF,    // LF operations (--budget-lf)
+	WORK_BUDGET_CELLS, // DP cells (--budget-cells)
+	WORK_BUDGET_TIME   // wall-clock time (--budget-ms)
+};
+
 /**
  * Key per-read metrics.  These are used for thresholds, allowing us to bail
  * for unproductive reads.  They also the basis of what's printed when the user
@@ -431,7 +442,7 @@ struct FmString {
  */
 struct PerReadMetrics {
 
-	PerReadMetrics() { reset(); }
+	PerReadMetrics() : stages(NULL) { reset(); }
 
 	void reset() {
 		nExIters =
@@ -450,6 +461,7 @@ struct PerReadMetrics {
 		nRedSkip = 0;
 		nRedFail = 0;
 		nRedIns = 0;
+		budgetHit = WORK_BUDGET_NONE;
 		doFmString = false;
 		nSeedRanges = nSeedElts = 0;
 		nSeedRangesFw = nSeedEltsFw = 0;
@@ -521,6 +533,8 @@ struct PerReadMetrics {
 	uint64_t nEeLastSucc;   // index of last ungap attempt that succeeded
 	
 	uint64_t nFilt;         // # mates filtered
+
+	int      budgetHit;     // WORK_BUDGET_* that stopped the search early
 	
 	TAlScore bestLtMinscMate1; // best invalid score observed for mate 1
 	TAlScore bestLtMinscMate2; // best invalid score observed for mate 2
@@ -528,6 +542,10 @@ struct PerReadMetrics {
 	// For collecting information to go into an FM string
 	bool doFmString;
 	FmString fmString;
+
+	// Per-thread stage latency histograms; NULL unless stage timing is on.
+	// Not touched by reset().
+	StageMetrics* stages;
 };
 
 #endif /*READ_H_*/
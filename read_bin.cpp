@@ -0,0 +1,531 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef BOWTIE_MM
+#include <sys/mman.h>
+#endif
+#include <iostream>
+#include "endian_swap.h"
+#include "mem_ids.h"
+#include "pat.h"
+#include "read_bin.h"
+
+using namespace std;
+
+/**
+ * The four bases packed into each possible byte, ready to be copied into a
+ * read with a single 4-byte move.
+ */
+static struct HrbUnpackTable {
+	uint8_t t[256][4];
+	HrbUnpackTable() {
+		for(int b = 0; b < 256; b++) {
+			for(int i = 0; i < 4; i++) {
+				t[b][i] = (uint8_t)((b >> (i << 1)) & 3);
+			}
+		}
+	}
+} hrb_unpack;
+
+HrbWriter::HrbWriter(const string& fn, bool binQuals) :
+	fn_(fn),
+	fh_(NULL),
+	binQuals_(binQuals),
+	flags_(binQuals ? HRB_BINNED_QUALS : 0),
+	nrecs_(0),
+	off_(sizeof(HrbHeader)),
+	index_(MISC_CAT),
+	buf_(MISC_CAT)
+{
+	if(currentlyBigEndian()) {
+		cerr << "Error: binary read files can only be written on little-endian machines" << endl;
+		throw 1;
+	}
+	if(fn_ == "-" || (fh_ = fopen(fn_.c_str(), "wb")) == NULL) {
+		cerr << "Error: Could not open binary read file \"" << fn_.c_str() << "\" for writing" << endl;
+		throw 1;
+	}
+	// Placeholder; finish() writes the real header
+	HrbHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	if(fwrite(&hdr, sizeof(hdr), 1, fh_) != 1) {
+		cerr << "Error: Could not write to binary read file \"" << fn_.c_str() << "\"" << endl;
+		throw 1;
+	}
+}
+
+HrbWriter::~HrbWriter() {
+	// A file that was never finished keeps its zeroed header, so it
+	// won't be mistaken for a good one
+	if(fh_ != NULL) fclose(fh_);
+}
+
+/**
+ * Append the encoding of one mate to buf_.
+ */
+void HrbWriter::putMate(const Read& r) {
+	size_t nlen = min<size_t>(r.name.length(), 0xffff);
+	uint32_t len = (uint32_t)r.length();
+	size_t packed = (len + 3) >> 2;
+	size_t masklen = (len + 7) >> 3;
+	size_t qlen = binQuals_ ? ((len + 1) >> 1) : len;
+	size_t start = buf_.size();
+	buf_.resize(start + 2 + nlen + 4 + 1 + packed + masklen + qlen);
+	uint8_t *p = buf_.ptr() + start;
+	uint16_t nlen16 = (uint16_t)nlen;
+	memcpy(p, &nlen16, 2); p += 2;
+	memcpy(p, r.name.buf(), nlen); p += nlen;
+	memcpy(p, &len, 4); p += 4;
+	uint8_t *flags = p++;
+	*flags = 0;
+	// Bases; Ns go in as A and are restored from the mask
+	memset(p, 0, packed);
+	for(size_t i = 0; i < len; i++) {
+		int c = (int)r.patFw[i];
+		if(c > 3) *flags = HRB_MATE_NS;
+		p[i >> 2] |= (uint8_t)((c & 3) << ((i & 3) << 1));
+	}
+	p += packed;
+	if(*flags & HRB_MATE_NS) {
+		memset(p, 0, masklen);
+		for(size_t i = 0; i < len; i++) {
+			if((int)r.patFw[i] > 3) p[i >> 3] |= (uint8_t)(1 << (i & 7));
+		}
+		p += masklen;
+	}
+	if(binQuals_) {
+		memset(p, 0, qlen);
+		for(size_t i = 0; i < len; i++) {
+			p[i >> 1] |= (uint8_t)(hrbQualBin((int)r.qual[i] - 33) << ((i & 1) << 2));
+		}
+	} else {
+		memcpy(p, r.qual.buf(), len);
+	}
+	p += qlen;
+	buf_.resize((size_t)(p - buf_.ptr()));
+}
+
+/**
+ * Append an unpaired read (rb == NULL) or a pair.
+ */
+void HrbWriter::add(const Read& ra, const Read* rb) {
+	assert(fh_ != NULL);
+	buf_.clear();
+	buf_.push_back(rb == NULL ? 1 : 2);
+	putMate(ra);
+	if(rb != NULL) {
+		putMate(*rb);
+		flags_ |= HRB_PAIRED;
+	}
+	if((nrecs_ % HRB_INDEX_IVAL) == 0) {
+		index_.push_back(off_);
+	}
+	if(fwrite(buf_.ptr(), 1, buf_.size(), fh_) != buf_.size()) {
+		cerr << "Error: Could not write to binary read file \"" << fn_.c_str() << "\"" << endl;
+		throw 1;
+	}
+	off_ += buf_.size();
+	nrecs_++;
+}
+
+/**
+ * Write the index and header and close the file.
+ */
+void HrbWriter::finish() {
+	if(fh_ == NULL) return;
+	HrbHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HRB_MAGIC, sizeof(hdr.magic));
+	hdr.version = HRB_VERSION;
+	hdr.flags = flags_;
+	hdr.nrecs = nrecs_;
+	hdr.indexOff = off_;
+	hdr.ival = HRB_INDEX_IVAL;
+	if((!index_.empty() &&
+	    fwrite(index_.ptr(), sizeof(uint64_t), index_.size(), fh_) != index_.size()) ||
+	   fseek(fh_, 0, SEEK_SET) != 0 ||
+	   fwrite(&hdr, sizeof(hdr), 1, fh_) != 1 ||
+	   fclose(fh_) != 0)
+	{
+		fh_ = NULL;
+		cerr << "Error: Could not write to binary read file \"" << fn_.c_str() << "\"" << endl;
+		throw 1;
+	}
+	fh_ = NULL;
+}
+
+/**
+ * Map the given file and check its header.  Throws on error.
+ */
+void HrbFile::open(const string& fn) {
+	close();
+	fn_ = fn;
+	FILE *f = fopen(fn.c_str(), "rb");
+	if(f == NULL) {
+		cerr << "Error: Could not open binary read file \"" << fn.c_str() << "\" for reading" << endl;
+		throw 1;
+	}
+	struct stat st;
+	if(fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) {
+		fclose(f);
+		cerr << "Error: Binary read file \"" << fn.c_str() << "\" is not a regular file" << endl;
+		throw 1;
+	}
+	len_ = (size_t)st.st_size;
+	if(len_ < sizeof(HrbHeader)) {
+		fclose(f);
+		cerr << "Error: \"" << fn.c_str() << "\" is not a HISAT binary read file" << endl;
+		throw 1;
+	}
+#ifdef BOWTIE_MM
+	void *p = mmap(NULL, len_, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if(p != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+		madvise(p, len_, MADV_SEQUENTIAL);
+#endif
+		buf_ = (uint8_t *)p;
+		mapped_ = true;
+	}
+#endif
+	if(buf_ == NULL) {
+		buf_ = new uint8_t[len_];
+		if(fread(buf_, 1, len_, f) != len_) {
+			fclose(f);
+			close();
+			cerr << "Error: Could not read binary read file \"" << fn.c_str() << "\"" << endl;
+			throw 1;
+		}
+	}
+	fclose(f);
+	memcpy(&hdr_, buf_, sizeof(hdr_));
+	if(memcmp(hdr_.magic, HRB_MAGIC, sizeof(hdr_.magic)) != 0 || currentlyBigEndian()) {
+		cerr << "Error: \"" << fn.c_str() << "\" is not a HISAT binary read file" << endl;
+		close();
+		throw 1;
+	}
+	if(hdr_.version != HRB_VERSION) {
+		cerr << "Error: Binary read file \"" << fn.c_str() << "\" has version " << hdr_.version
+		     << ", but this HISAT reads version " << HRB_VERSION << endl;
+		close();
+		throw 1;
+	}
+	uint64_t nidx = (hdr_.ival == 0) ? 0 : (hdr_.nrecs + hdr_.ival - 1) / hdr_.ival;
+	if(hdr_.ival == 0 ||
+	   hdr_.indexOff < sizeof(HrbHeader) ||
+	   hdr_.indexOff > len_ ||
+	   nidx > (len_ - hdr_.indexOff) / sizeof(uint64_t))
+	{
+		cerr << "Error: Binary read file \"" << fn.c_str() << "\" is truncated or corrupt" << endl;
+		close();
+		throw 1;
+	}
+}
+
+void HrbFile::close() {
+	if(buf_ != NULL) {
+#ifdef BOWTIE_MM
+		if(mapped_) munmap(buf_, len_);
+		else
+#endif
+		delete[] buf_;
+	}
+	buf_ = NULL;
+	len_ = 0;
+	mapped_ = false;
+}
+
+/**
+ * Return a pointer to record i, found through the index.
+ */
+const uint8_t *HrbFile::record(uint64_t i) const {
+	assert_lt(i, hdr_.nrecs);
+	uint64_t off;
+	memcpy(&off, buf_ + hdr_.indexOff + (i / hdr_.ival) * sizeof(uint64_t), sizeof(off));
+	if(off < sizeof(HrbHeader) || off >= hdr_.indexOff) {
+		cerr << "Error: Binary read file \"" << fn_.c_str() << "\" is truncated or corrupt" << endl;
+		throw 1;
+	}
+	const uint8_t *p = buf_ + off;
+	for(uint64_t j = i % hdr_.ival; j > 0; j--) {
+		p = skipRecord(p);
+	}
+	return p;
+}
+
+/**
+ * Return a pointer to the record following the one at p.
+ */
+const uint8_t *HrbFile::skipRecord(const uint8_t *p) const {
+	const uint8_t *end = buf_ + hdr_.indexOff;
+	bool binned = binnedQuals();
+	int nmates = *p++;
+	for(int m = 0; m < nmates && p + 7 <= end; m++) {
+		uint16_t nlen;
+		memcpy(&nlen, p, 2);
+		p += 2 + nlen;
+		if(p + 5 > end) break;
+		uint32_t len;
+		memcpy(&len, p, 4);
+		p += 4;
+		uint8_t flags = *p++;
+		p += (len + 3) >> 2;
+		if(flags & HRB_MATE_NS) p += (len + 7) >> 3;
+		p += binned ? ((len + 1) >> 1) : len;
+	}
+	if(p > end || nmates < 1 || nmates > 2) {
+		cerr << "Error: Binary read file \"" << fn_.c_str() << "\" is truncated or corrupt" << endl;
+		throw 1;
+	}
+	return p;
+}
+
+/**
+ * Decode the mate at p into r and return a pointer just past it.
+ * r.readOrigBuf gets the mate as a FASTQ record.  The caller has already
+ * checked the record's extent with skipRecord().
+ */
+const uint8_t *HrbFile::decodeMate(const uint8_t *p, Read& r) const {
+	uint16_t nlen;
+	memcpy(&nlen, p, 2);
+	p += 2;
+	r.name.install((const char *)p, nlen);
+	p += nlen;
+	uint32_t len;
+	memcpy(&len, p, 4);
+	p += 4;
+	uint8_t flags = *p++;
+	// Bases, four at a time
+	r.patFw.resize(len);
+	char *s = r.patFw.wbuf();
+	size_t full = len >> 2;
+	for(size_t i = 0; i < full; i++) {
+		memcpy(s + (i << 2), hrb_unpack.t[p[i]], 4);
+	}
+	for(size_t i = full << 2; i < len; i++) {
+		s[i] = (char)hrb_unpack.t[p[i >> 2]][i & 3];
+	}
+	p += (len + 3) >> 2;
+	if(flags & HRB_MATE_NS) {
+		size_t masklen = (len + 7) >> 3;
+		for(size_t i = 0; i < masklen; i++) {
+			for(uint8_t b = p[i]; b != 0; b &= (uint8_t)(b - 1)) {
+				s[(i << 3) + __builtin_ctz(b)] = 4;
+			}
+		}
+		p += masklen;
+	}
+	// Qualities
+	r.qual.resize(len);
+	char *q = r.qual.wbuf();
+	if(binnedQuals()) {
+		for(size_t i = 0; i < len; i++) {
+			q[i] = (char)(hrb_qual_bins[(p[i >> 1] >> ((i & 1) << 2)) & 7] + 33);
+		}
+		p += (len + 1) >> 1;
+	} else {
+		memcpy(q, p, len);
+		p += len;
+	}
+	// Original text for --un/--al and friends
+	r.readOrigBuf.resize(nlen + 2 * (size_t)len + 6);
+	char *o = r.readOrigBuf.wbuf();
+	*o++ = '@';
+	memcpy(o, r.name.buf(), nlen); o += nlen;
+	*o++ = '\n';
+	for(size_t i = 0; i < len; i++) {
+		*o++ = "ACGTN"[(int)s[i]];
+	}
+	*o++ = '\n';
+	*o++ = '+';
+	*o++ = '\n';
+	memcpy(o, q, len); o += len;
+	*o++ = '\n';
+	return p;
+}
+
+HrbPatternSource::HrbPatternSource(
+	const EList<string>& infiles,
+	const PatternParams& p) :
+	PatternSource(p),
+	skip_(p.skip),
+	filecur_(0),
+	cur_(NULL),
+	left_(0)
+{
+	assert_gt(infiles.size(), 0);
+	try {
+		for(size_t i = 0; i < infiles.size(); i++) {
+			if(infiles[i] == "-") {
+				cerr << "Error: binary read files can't be read from standard in" << endl;
+				throw 1;
+			}
+			files_.push_back(new HrbFile());
+			files_.back()->open(infiles[i]);
+		}
+	} catch(...) {
+		// the destructor won't run, so release the files opened so far
+		for(size_t i = 0; i < files_.size(); i++) {
+			delete files_[i];
+		}
+		throw;
+	}
+	rewind();
+}
+
+HrbPatternSource::~HrbPatternSource() {
+	for(size_t i = 0; i < files_.size(); i++) {
+		delete files_[i];
+	}
+}
+
+/**
+ * Position at the first record not skipped with -s.  The skipped records
+ * still count toward read IDs, so IDs match a run over the text input.
+ */
+void HrbPatternSource::rewind() {
+	TReadId skip = skip_;
+	readCnt_ = 0;
+	cur_ = NULL;
+	left_ = 0;
+	for(filecur_ = 0; filecur_ < files_.size(); filecur_++) {
+		uint64_t n = files_[filecur_]->numRecords();
+		if(skip < n) {
+			cur_ = files_[filecur_]->record(skip);
+			left_ = n - skip;
+			readCnt_ += skip;
+			return;
+		}
+		skip -= n;
+		readCnt_ += n;
+	}
+}
+
+/**
+ * Claim the next record.  Returns NULL when there are none left;
+ * otherwise sets f to the file it's in and rdid to its read ID.
+ */
+const uint8_t *HrbPatternSource::claim(const HrbFile*& f, TReadId& rdid) {
+	lock();
+	while(left_ == 0 && filecur_ + 1 < files_.size()) {
+		filecur_++;
+		left_ = files_[filecur_]->numRecords();
+		cur_ = (left_ > 0) ? files_[filecur_]->record(0) : NULL;
+	}
+	if(left_ == 0) {
+		unlock();
+		return NULL;
+	}
+	const uint8_t *p = cur_;
+	f = files_[filecur_];
+	cur_ = f->skipRecord(p);
+	left_--;
+	rdid = readCnt_;
+	readCnt_++;
+	unlock();
+	return p;
+}
+
+/**
+ * Apply -5/-3 trimming to a freshly decoded mate.  readOrigBuf keeps the
+ * untrimmed mate, as it does for the text formats.
+ */
+void HrbPatternSource::trim(Read& r) {
+	size_t len = r.patFw.length();
+	size_t t5 = min<size_t>((size_t)gTrim5, len);
+	size_t t3 = min<size_t>((size_t)gTrim3, len - t5);
+	if(t5 > 0) {
+		r.patFw.trimBegin(t5);
+		r.qual.trimBegin(t5);
+	}
+	if(t3 > 0) {
+		r.patFw.trimEnd(t3);
+		r.qual.trimEnd(t3);
+	}
+	r.trimmed5 = (int)t5;
+	r.trimmed3 = (int)t3;
+}
+
+/**
+ * Dispense the next read or pair.  Only claiming the record happens under
+ * the lock; decoding is done straight from the mapped file.
+ */
+bool HrbPatternSource::nextReadPairImpl(
+	Read& ra,
+	Read& rb,
+	TReadId& rdid,
+	TReadId& endid,
+	bool& success,
+	bool& done,
+	bool& paired)
+{
+	const HrbFile *f = NULL;
+	const uint8_t *p = claim(f, rdid);
+	if(p == NULL) {
+		success = false;
+		done = true;
+		return false;
+	}
+	endid = rdid;
+	int nmates = *p++;
+	p = f->decodeMate(p, ra);
+	trim(ra);
+	paired = (nmates == 2);
+	if(paired) {
+		f->decodeMate(p, rb);
+		trim(rb);
+	}
+	success = true;
+	done = false;
+	return true;
+}
+
+/**
+ * Dispense the next unpaired read.  Binary read files are always given with
+ * --hrb, which reads them a pair at a time, so a paired record here is an
+ * error.
+ */
+bool HrbPatternSource::nextReadImpl(
+	Read& r,
+	TReadId& rdid,
+	TReadId& endid,
+	bool& success,
+	bool& done)
+{
+	const HrbFile *f = NULL;
+	const uint8_t *p = claim(f, rdid);
+	if(p == NULL) {
+		success = false;
+		done = true;
+		return false;
+	}
+	endid = rdid;
+	if(*p != 1) {
+		cerr << "Error: paired binary read files must be given with --hrb" << endl;
+		throw 1;
+	}
+	f->decodeMate(p + 1, r);
+	trim(r);
+	success = true;
+	done = false;
+	return true;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef READ_BIN_H_
+#define READ_BIN_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include "assert_helpers.h"
+#include "ds.h"
+#include "read.h"
+
+/**
+ * HISAT binary read files (.hrb).  Reads are parsed, converted to Phred+33
+ * and (optionally) trimmed once when the file is written; reading them back
+ * is then just a matter of unpacking bytes.  Layout:
+ *
+ *   header   64 bytes, see HrbHeader
+ *   records  one per read or pair, in read-ID order
+ *   index    file offset of every hdr.ival'th record, as uint64s
+ *
+ * A record is a byte giving the number of mates (1 or 2), then per mate:
+ *
+ *   uint16   name length, followed by the name
+ *   uint32   sequence length
+ *   uint8    flags; HRB_MATE_NS means an N mask follows the bases
+ *   bases    2 bits each, 4 per byte, first base in the low bits
+ *   N mask   1 bit per base (Ns are stored as A in the bases)
+ *   quals    Phred+33 bytes, or 4-bit bin codes if HRB_BINNED_QUALS
+ *
+ * Integers are little-endian and unaligned.
+ */
+
+static const char     HRB_MAGIC[8]     = { 'H', 'I', 'S', 'A', 'T', 'R', 'B', '\0' };
+static const uint32_t HRB_VERSION      = 1;
+static const uint32_t HRB_INDEX_IVAL   = 1024;
+
+// Header flags
+static const uint32_t HRB_PAIRED       = 1; // some records have two mates
+static const uint32_t HRB_BINNED_QUALS = 2; // qualities are 4-bit bin codes
+
+// Per-mate flags
+static const uint8_t  HRB_MATE_NS      = 1; // N mask follows the bases
+
+struct HrbHeader {
+	char     magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t nrecs;     // number of reads/pairs
+	uint64_t indexOff;  // file offset of the record index
+	uint32_t ival;      // records between index entries
+	uint8_t  pad[28];
+};
+
+/**
+ * Illumina's 8-level quality binning.  Returns the bin code for Phred
+ * quality q; hrb_qual_bins[code] is the quality the bin decodes to.
+ */
+static const uint8_t hrb_qual_bins[8] = { 2, 6, 15, 22, 27, 33, 37, 40 };
+
+static inline uint8_t hrbQualBin(int q) {
+	if(q < 2)  return 0;
+	if(q < 10) return 1;
+	if(q < 20) return 2;
+	if(q < 25) return 3;
+	if(q < 30) return 4;
+	if(q < 35) return 5;
+	if(q < 40) return 6;
+	return 7;
+}
+
+/**
+ * Writes reads to a .hrb file.  The output must be a regular file, since
+ * the header is filled in at the end.
+ */
+class HrbWriter {
+
+public:
+
+	HrbWriter(const std::string& fn, bool binQuals);
+
+	~HrbWriter();
+
+	/**
+	 * Append an unpaired read (rb == NULL) or a pair.
+	 */
+	void add(const Read& ra, const Read* rb);
+
+	/**
+	 * Write the index and header and close the file.
+	 */
+	void finish();
+
+	uint64_t numRecords() const { return nrecs_; }
+
+protected:
+
+	void putMate(const Read& r);
+
+	std::string   fn_;
+	FILE         *fh_;
+	bool          binQuals_;
+	uint32_t      flags_;
+	uint64_t      nrecs_;
+	uint64_t      off_;    // file offset of the next record
+	EList<uint64_t> index_;
+	EList<uint8_t>  buf_;  // record being built
+};
+
+/**
+ * A .hrb file mapped into memory (or read whole, without BOWTIE_MM).
+ * Records are decoded straight out of the mapping.
+ */
+class HrbFile {
+
+public:
+
+	HrbFile() : buf_(NULL), len_(0), mapped_(false) { }
+
+	~HrbFile() { close(); }
+
+	/**
+	 * Map the given file and check its header.  Throws on error.
+	 */
+	void open(const std::string& fn);
+
+	void close();
+
+	uint64_t numRecords() const { return hdr_.nrecs; }
+
+	bool binnedQuals() const { return (hdr_.flags & HRB_BINNED_QUALS) != 0; }
+
+	/**
+	 * Return a pointer to record i, found through the index.
+	 */
+	const uint8_t *record(uint64_t i) const;
+
+	/**
+	 * Return a pointer to the record following the one at p.
+	 */
+	const uint8_t *skipRecord(const uint8_t *p) const;
+
+	/**
+	 * Decode the mate at p into r and return a pointer just past it.
+	 * r.readOrigBuf gets the mate as a FASTQ record.
+	 */
+	const uint8_t *decodeMate(const uint8_t *p, Read& r) const;
+
+protected:
+
+	std::string    fn_;
+	uint8_t       *buf_;
+	size_t         len_;
+	bool           mapped_;
+	HrbHeader      hdr_;
+};
+
+#endif /*ndef READ_BIN_H_*/
@@ -0,0 +1,255 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <sys/stat.h>
+#include <iostream>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_BZ2
+#include <bzlib.h>
+#endif
+#include "read_out.h"
+
+using namespace std;
+
+static const char *read_out_names[READ_OUT_NUM] = {
+	"un", "al", "un-conc", "al-conc", "filtered", "filtered-conc"
+};
+
+/**
+ * Close anything still open without flushing; finish() does the flushing
+ * on the normal path.
+ */
+ReadOutFiles::~ReadOutFiles() {
+	for(int k = 0; k < READ_OUT_NUM; k++) {
+		for(int m = 0; m < 2; m++) {
+			if(fhs_[k][m] == NULL) continue;
+			if(piped_[k]) pclose(fhs_[k][m]);
+			else fclose(fhs_[k][m]);
+		}
+	}
+	delete[] bufs_;
+}
+
+/**
+ * Open the file(s) for the given kind, naming them the way the hisat
+ * wrapper did.
+ */
+void ReadOutFiles::open(int kind, const string& path, int compress) {
+	assert_range(0, READ_OUT_NUM - 1, kind);
+	if(fhs_[kind][0] != NULL) {
+		cerr << "Error: --" << read_out_names[kind] << " specified more than once" << endl;
+		throw 1;
+	}
+	// Split into directory (with trailing slash) and file name
+	string dir, base;
+	struct stat st;
+	if(stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+		dir = path;
+		if(!dir.empty() && dir[dir.length()-1] != '/') dir += '/';
+	} else {
+		size_t slash = path.find_last_of('/');
+		if(slash == string::npos) {
+			base = path;
+		} else {
+			dir = path.substr(0, slash + 1);
+			base = path.substr(slash + 1);
+		}
+	}
+	compress_[kind] = compress;
+	if(kind == READ_OUT_UN_CONC || kind == READ_OUT_AL_CONC || kind == READ_OUT_FILT_CONC) {
+		if(base.empty()) {
+			base = string(read_out_names[kind]) + "-mate";
+		}
+		string fn[2];
+		if(base.find('%') != string::npos) {
+			for(int m = 0; m < 2; m++) {
+				fn[m] = base;
+				for(size_t i = 0; i < fn[m].length(); i++) {
+					if(fn[m][i] == '%') fn[m][i] = (char)('1' + m);
+				}
+			}
+		} else if(base.find('.') != string::npos) {
+			size_t dot = base.find_last_of('.');
+			fn[0] = base.substr(0, dot) + ".1" + base.substr(dot);
+			fn[1] = base.substr(0, dot) + ".2" + base.substr(dot);
+		} else {
+			fn[0] = base + ".1";
+			fn[1] = base + ".2";
+		}
+		openOne(kind, 0, dir + fn[0], compress);
+		openOne(kind, 1, dir + fn[1], compress);
+	} else {
+		if(base.empty()) {
+			base = string(read_out_names[kind]) + "-seqs";
+		}
+		openOne(kind, 0, dir + base, compress);
+	}
+}
+
+/**
+ * Open one output file.  Without libbz2 (or zlib), bzip2 (gzip) output goes
+ * through an external bzip2 (gzip) process, as it did when the wrapper
+ * wrote these files.
+ */
+void ReadOutFiles::openOne(int kind, int mate, const string& fn, int compress) {
+	names_[kind][mate] = fn;
+	const char *prog = NULL;
+#ifndef USE_BZ2
+	if(compress == READ_OUT_BZIP2) prog = "bzip2";
+#endif
+#ifndef USE_ZLIB
+	if(compress == READ_OUT_GZIP) prog = "gzip";
+#endif
+	if(prog != NULL) {
+		string cmd = string(prog) + " -c > '";
+		for(size_t i = 0; i < fn.length(); i++) {
+			if(fn[i] == '\'') cmd += "'\\''";
+			else cmd += fn[i];
+		}
+		cmd += "'";
+		fhs_[kind][mate] = popen(cmd.c_str(), "w");
+		piped_[kind] = true;
+		compress_[kind] = READ_OUT_PLAIN;
+	} else {
+		fhs_[kind][mate] = fopen(fn.c_str(), "wb");
+	}
+	if(fhs_[kind][mate] == NULL) {
+		cerr << "Error: Could not open --" << read_out_names[kind]
+		     << " output file " << fn.c_str() << endl;
+		throw 1;
+	}
+}
+
+/**
+ * Allocate per-thread buffers.
+ */
+void ReadOutFiles::init(size_t maxThreadId) {
+	delete[] bufs_;
+	nbufs_ = maxThreadId + 1;
+	bufs_ = new ThreadBufs[nbufs_];
+}
+
+/**
+ * Compress one buffer into a self-contained gzip member or bzip2 stream.
+ * Concatenations of either are valid files for the usual tools.
+ */
+void ReadOutFiles::compressBlock(int kind, const BTString& in, EList<char>& out) {
+#ifdef USE_ZLIB
+	if(compress_[kind] == READ_OUT_GZIP) {
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			cerr << "Error: could not initialize compression for --" << read_out_names[kind] << "-gz" << endl;
+			throw 1;
+		}
+		out.resize(deflateBound(&zs, (uLong)in.length()));
+		zs.next_in = (Bytef *)in.buf();
+		zs.avail_in = (uInt)in.length();
+		zs.next_out = (Bytef *)out.ptr();
+		zs.avail_out = (uInt)out.size();
+		int ret = deflate(&zs, Z_FINISH);
+		out.resize(zs.total_out);
+		deflateEnd(&zs);
+		if(ret != Z_STREAM_END) {
+			cerr << "Error: could not compress output for --" << read_out_names[kind] << "-gz" << endl;
+			throw 1;
+		}
+	}
+#endif
+#ifdef USE_BZ2
+	if(compress_[kind] == READ_OUT_BZIP2) {
+		// bzip2 never expands by more than 1% plus 600 bytes
+		unsigned int clen = (unsigned int)(in.length() + in.length() / 100 + 600);
+		out.resize(clen);
+		if(BZ2_bzBuffToBuffCompress(out.ptr(), &clen, (char *)in.buf(),
+		                            (unsigned int)in.length(), 9, 0, 0) != BZ_OK)
+		{
+			cerr << "Error: could not compress output for --" << read_out_names[kind] << "-bz2" << endl;
+			throw 1;
+		}
+		out.resize(clen);
+	}
+#endif
+}
+
+void ReadOutFiles::writeBlock(FILE *fh, const char *p, size_t len) {
+	if(len > 0 && fwrite(p, 1, len, fh) != len) {
+		cerr << "Error: could not write read output file" << endl;
+		throw 1;
+	}
+}
+
+/**
+ * Compress (if requested) and write the given thread's buffers for the
+ * given kind.  Only the write happens under the lock.
+ */
+void ReadOutFiles::flush(int kind, size_t threadId) {
+	ThreadBufs& tb = bufs_[threadId];
+	BTString *b = tb.buf[kind];
+	int nmates = (fhs_[kind][1] != NULL) ? 2 : 1;
+	bool compress = compress_[kind] != READ_OUT_PLAIN;
+	if(compress) {
+		for(int m = 0; m < nmates; m++) {
+			compressBlock(kind, b[m], tb.cbuf[m]);
+		}
+	}
+	{
+		ThreadSafe t(&mutex_m[kind], true);
+		for(int m = 0; m < nmates; m++) {
+			if(compress) {
+				writeBlock(fhs_[kind][m], tb.cbuf[m].ptr(), tb.cbuf[m].size());
+			} else {
+				writeBlock(fhs_[kind][m], b[m].buf(), b[m].length());
+			}
+		}
+	}
+	for(int m = 0; m < nmates; m++) {
+		b[m].clear();
+		tb.cbuf[m].clear();
+	}
+}
+
+/**
+ * Flush everything that's left and close the files.
+ */
+void ReadOutFiles::finish() {
+	if(finished_) return;
+	finished_ = true;
+	for(int k = 0; k < READ_OUT_NUM; k++) {
+		if(fhs_[k][0] == NULL) continue;
+		for(size_t t = 0; t < nbufs_; t++) {
+			if(!bufs_[t].buf[k][0].empty() || !bufs_[t].buf[k][1].empty()) {
+				flush(k, t);
+			}
+		}
+		for(int m = 0; m < 2; m++) {
+			if(fhs_[k][m] == NULL) continue;
+			int ret = piped_[k] ? pclose(fhs_[k][m]) : fclose(fhs_[k][m]);
+			if(ret != 0) {
+				cerr << "Error: could not close --" << read_out_names[k]
+				     << " output file " << names_[k][m].c_str() << endl;
+				throw 1;
+			}
+			fhs_[k][m] = NULL;
+		}
+	}
+}
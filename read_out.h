@@ -0,0 +1,185 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef READ_OUT_H_
+#define READ_OUT_H_
+
+#include <stdio.h>
+#include <string>
+#include "assert_helpers.h"
+#include "ds.h"
+#include "sstring.h"
+#include "read.h"
+#include "threading.h"
+#include "mem_ids.h"
+
+/**
+ * Kinds of read files requested with --un, --al, --un-conc, --al-conc,
+ * --filtered and --filtered-conc.
+ */
+enum {
+	READ_OUT_UN = 0,  // unpaired reads that failed to align
+	READ_OUT_AL,      // unpaired reads that aligned at least once
+	READ_OUT_UN_CONC, // pairs that didn't align concordantly
+	READ_OUT_AL_CONC, // pairs that aligned concordantly at least once
+	READ_OUT_FILT,    // unpaired reads that matched --filter-fa
+	READ_OUT_FILT_CONC, // pairs that matched --filter-fa
+	READ_OUT_NUM
+};
+
+/**
+ * Compression applied to a read file.
+ */
+enum {
+	READ_OUT_PLAIN = 0,
+	READ_OUT_GZIP,
+	READ_OUT_BZIP2
+};
+
+/**
+ * Writes the original text of reads to the files requested with --un, --al,
+ * --un-conc and --al-conc (and their -gz and -bz2 variants), and with
+ * --filtered and --filtered-conc.
+ *
+ * Each thread appends reads to its own buffers without locking.  When a
+ * buffer fills, the thread compresses it into a self-contained gzip member
+ * (or bzip2 stream) and only then takes the file's lock to write it, so
+ * compression runs in parallel across threads.  Both mates of a pair are
+ * flushed under the same lock, which keeps the _1 and _2 files in step.
+ */
+class ReadOutFiles {
+
+	static const size_t FLUSH_THRESH = 256 * 1024;
+
+public:
+
+	ReadOutFiles() :
+		bufs_(NULL),
+		nbufs_(0),
+		finished_(false)
+	{
+		for(int i = 0; i < READ_OUT_NUM; i++) {
+			compress_[i] = READ_OUT_PLAIN;
+			fhs_[i][0] = fhs_[i][1] = NULL;
+			piped_[i] = false;
+		}
+	}
+
+	~ReadOutFiles();
+
+	/**
+	 * Open the file (or, for the -conc kinds, the pair of files) for the
+	 * given kind.  path is interpreted the way the hisat wrapper always
+	 * has: a directory gets a default file name, and for the -conc kinds
+	 * the mate number replaces any % in the name or is inserted before
+	 * the final extension.
+	 */
+	void open(int kind, const std::string& path, int compress);
+
+	/**
+	 * Allocate per-thread buffers for thread ids 0 through maxThreadId.
+	 */
+	void init(size_t maxThreadId);
+
+	/**
+	 * Return true iff no read files were requested.
+	 */
+	bool empty() const {
+		for(int i = 0; i < READ_OUT_NUM; i++) {
+			if(!names_[i][0].empty()) return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Record the outcome for the read or pair just finished by the given
+	 * thread.  For an unpaired read, rd2 is NULL and aligned says whether
+	 * it aligned at all; for a pair, aligned says whether it aligned
+	 * concordantly.
+	 */
+	void add(const Read *rd1, const Read *rd2, bool aligned, size_t threadId) {
+		int kind = (rd2 == NULL) ?
+			(aligned ? READ_OUT_AL : READ_OUT_UN) :
+			(aligned ? READ_OUT_AL_CONC : READ_OUT_UN_CONC);
+		append(kind, rd1, rd2, threadId);
+	}
+
+	/**
+	 * Record a read or pair that matched the contaminant filter and so was
+	 * never aligned.
+	 */
+	void addFiltered(const Read *rd1, const Read *rd2, size_t threadId) {
+		append(rd2 == NULL ? READ_OUT_FILT : READ_OUT_FILT_CONC, rd1, rd2, threadId);
+	}
+
+	/**
+	 * Flush all per-thread buffers and close the files.  Call once, after
+	 * all threads are done calling add().
+	 */
+	void finish();
+
+protected:
+
+	/**
+	 * Per-thread buffers, one (or two, for mates) per kind.  Padded so
+	 * that neighboring threads don't share cache lines.
+	 */
+	struct ThreadBufs {
+		BTString    buf[READ_OUT_NUM][2];
+		EList<char> cbuf[2]; // compressed blocks awaiting write
+		char        pad[64];
+	};
+
+	/**
+	 * Append the read or pair to the given thread's buffer for the given
+	 * kind, flushing the buffer if it's full.
+	 */
+	void append(int kind, const Read *rd1, const Read *rd2, size_t threadId) {
+		if(fhs_[kind][0] == NULL) return;
+		assert(rd1 != NULL);
+		assert_lt(threadId, nbufs_);
+		BTString *b = bufs_[threadId].buf[kind];
+		b[0].append(rd1->readOrigBuf.buf(), rd1->readOrigBuf.length());
+		if(rd2 != NULL) {
+			b[1].append(rd2->readOrigBuf.buf(), rd2->readOrigBuf.length());
+		}
+		if(b[0].length() >= FLUSH_THRESH || b[1].length() >= FLUSH_THRESH) {
+			flush(kind, threadId);
+		}
+	}
+
+	void flush(int kind, size_t threadId);
+
+	void compressBlock(int kind, const BTString& in, EList<char>& out);
+
+	void openOne(int kind, int mate, const std::string& fn, int compress);
+
+	static void writeBlock(FILE *fh, const char *p, size_t len);
+
+	int          compress_[READ_OUT_NUM];
+	FILE        *fhs_[READ_OUT_NUM][2];
+	bool         piped_[READ_OUT_NUM]; // files are pipes to an external compressor
+	std::string  names_[READ_OUT_NUM][2];
+	ThreadBufs  *bufs_;
+	size_t       nbufs_;
+	bool         finished_;
+	MUTEX_T      mutex_m[READ_OUT_NUM]; // guards fhs_[kind]
+};
+
+#endif /*ndef READ_OUT_H_*/
@@ -17,22 +17,45 @@
  * along with Bowtie 2.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/stat.h>
 #include "ref_read.h"
+#include "threading.h"
+
+/**
+ * Skip past the rest of a name line and the newlines after it, like
+ * FileBuf::getPastNewline(), appending the name to 'name' if it is set.
+ */
+template<typename TIn>
+static int getPastName(TIn& in, std::string* name) {
+	if(name == NULL) {
+		return in.getPastNewline();
+	}
+	int c = in.get();
+	while(c != -1 && c != '\n' && c != '\r') {
+		name->push_back((char)c);
+		c = in.get();
+	}
+	while(c == '\n' || c == '\r') c = in.get();
+	return c;
+}
 
 /**
  * Reads past the next ambiguous or unambiguous stretch of sequence
- * from the given FASTA file and returns its length.  Does not do
- * anything with the sequence characters themselves; this is purely for
- * measuring lengths.
+ * from the given FASTA input and returns its length.  Unambiguous
+ * characters are written to bpout if it is set, and the name of a
+ * sequence whose name line is read is put in 'name' if it is set.
+ * 'lastc' is the last character seen by the previous call.
  */
-RefRecord fastaRefReadSize(
-	FileBuf& in,
+template<typename TIn, typename TOut>
+static RefRecord fastaRefReadSize(
+	TIn& in,
 	const RefReadInParams& rparms,
 	bool first,
-	BitpairOutFileBuf* bpout)
+	TOut* bpout,
+	int& lastc,
+	std::string* name)
 {
 	int c;
-	static int lastc = '>'; // last character seen
 
 	// RefRecord params
 	TIndexOffU len = 0; // 'len' counts toward total length
@@ -60,7 +83,8 @@ RefRecord fastaRefReadSize(
 	if(lastc == '>') {
 		// Skip to the end of the name line
 		do {
-			if((c = in.getPastNewline()) == -1) {
+			if(name != NULL) name->clear();
+			if((c = getPastName(in, name)) == -1) {
 				// No more input
 				cerr << "Warning: Encountered empty reference sequence" << endl;
 				lastc = -1;
@@ -191,6 +215,22 @@ RefRecord fastaRefReadSize(
 	return RefRecord((TIndexOffU)off, (TIndexOffU)len, first);
 }
 
+/**
+ * Reads past the next ambiguous or unambiguous stretch of sequence
+ * from the given FASTA file and returns its length.  Does not do
+ * anything with the sequence characters themselves; this is purely for
+ * measuring lengths.
+ */
+RefRecord fastaRefReadSize(
+	FileBuf& in,
+	const RefReadInParams& rparms,
+	bool first,
+	BitpairOutFileBuf* bpout)
+{
+	static int lastc = '>'; // last character seen
+	return fastaRefReadSize(in, rparms, first, bpout, lastc, (std::string*)NULL);
+}
+
 #if 0
 static void
 printRecords(ostream& os, const EList<RefRecord>& l) {
@@ -325,3 +365,363 @@ fastaRefReadSizes(
 		unambigTot, // total number of unambiguous DNA characters read
 		bothTot); // total number of DNA characters read, incl. ambiguous ones
 }
+
+/**
+ * FASTA input held in memory, read with the FileBuf calls the parser
+ * uses.
+ */
+class MemFastaBuf {
+public:
+	MemFastaBuf(const char *beg, const char *end) : cur_(beg), end_(end) { }
+
+	int get() {
+		return cur_ < end_ ? (int)(uint8_t)*cur_++ : -1;
+	}
+
+	bool eof() const {
+		return cur_ == end_;
+	}
+
+	int getPastWhitespace() {
+		int c;
+		while(isspace(c = get()) && c != -1);
+		return c;
+	}
+
+	int getPastNewline() {
+		int c = get();
+		while(c != -1 && c != '\n' && c != '\r') c = get();
+		while(c == '\n' || c == '\r') c = get();
+		return c;
+	}
+
+private:
+	const char *cur_;
+	const char *end_;
+};
+
+/**
+ * Bitpairs packed four to a byte in memory, as BitpairOutFileBuf writes
+ * them.
+ */
+class BitpairMemBuf {
+public:
+	BitpairMemBuf() : bytes(MISC_CAT), n(0) { }
+
+	void write(int bp) {
+		assert_lt(bp, 4);
+		if((n & 3) == 0) bytes.push_back(0);
+		bytes.back() |= (uint8_t)(bp << ((n & 3) << 1));
+		n++;
+	}
+
+	EList<uint8_t> bytes;
+	size_t n;
+};
+
+/**
+ * One piece of an input file and what parsing it produced.
+ */
+struct RefIngestChunk {
+	RefIngestChunk() :
+		beg(NULL), end(NULL), recs(MISC_CAT), names(MISC_CAT),
+		unambigTot(0), bothTot(0), numSeqs(0), tooLong(false) { }
+
+	void reset(const char *b, const char *e) {
+		beg = b;
+		end = e;
+		recs.clear();
+		names.clear();
+		bases.bytes.clear();
+		bases.n = 0;
+		unambigTot = bothTot = 0;
+		numSeqs = 0;
+		tooLong = false;
+	}
+
+	const char *beg;
+	const char *end;
+	EList<RefRecord> recs;
+	EList<std::string> names;
+	BitpairMemBuf bases;
+	size_t unambigTot;
+	size_t bothTot;
+	TIndexOff numSeqs;
+	bool tooLong;   // a sequence overflowed TIndexOffU
+};
+
+/**
+ * Parse one chunk the way fastaRefReadSizes() parses a file.
+ */
+static void parseChunk(RefIngestChunk& ch, const RefReadInParams& rparms) {
+	MemFastaBuf in(ch.beg, ch.end);
+	bool first = true;
+	int lastc = '>';
+	std::string name;
+	while(!in.eof()) {
+		RefRecord rec;
+		try {
+			rec = fastaRefReadSize(in, rparms, first, &ch.bases, lastc, &name);
+		} catch(RefTooLongException& e) {
+			ch.tooLong = true;
+			return;
+		}
+		if(rec.first) ch.numSeqs++;
+		ch.unambigTot += rec.len;
+		ch.bothTot += rec.len;
+		ch.bothTot += rec.off;
+		first = false;
+		if(rec.len == 0 && rec.off == 0 && !rec.first) continue;
+		ch.recs.push_back(rec);
+		if(rec.first) ch.names.push_back(name);
+	}
+}
+
+struct RefIngestWorker {
+	EList<RefIngestChunk>* chunks;
+	const RefReadInParams* rparms;
+	size_t tid;
+	size_t nthreads;
+};
+
+static void refIngestWorker(void *vp) {
+	RefIngestWorker& w = *(RefIngestWorker*)vp;
+	for(size_t i = w.tid; i < w.chunks->size(); i += w.nthreads) {
+		parseChunk((*w.chunks)[i], *w.rparms);
+	}
+}
+
+/**
+ * Return true iff buf can be cut at i: a '>' at the start of a line whose
+ * last non-blank line before it is a sequence line, not a name line.
+ */
+static bool isCut(const char *buf, size_t i) {
+	if(i == 0 || buf[i] != '>' || buf[i-1] != '\n') return false;
+	size_t r = i - 1;
+	while(r > 0 && isspace((uint8_t)buf[r])) r--;
+	size_t l = r;
+	while(l > 0 && buf[l-1] != '\n') l--;
+	return memchr(buf + l, '>', r - l + 1) == NULL;
+}
+
+/**
+ * Return the offset of the first place at or after 'from' where buf can
+ * be cut.  Return len if there is none.
+ */
+static size_t nextCut(const char *buf, size_t len, size_t from) {
+	for(size_t i = max<size_t>(from, 1); i < len; i++) {
+		if(isCut(buf, i)) return i;
+	}
+	return len;
+}
+
+/**
+ * Return the offset of the last place in buf, other than its start, where
+ * it can be cut.  Return 0 if there is none.
+ */
+static size_t lastCut(const char *buf, size_t len) {
+	for(size_t i = len; i > 1; i--) {
+		if(isCut(buf, i-1)) return i-1;
+	}
+	return 0;
+}
+
+/**
+ * Parse one batch of loaded files.
+ */
+static void parseBatch(
+	EList<EList<char> >& files,
+	const RefReadInParams& rparms,
+	int nthreads,
+	EList<RefIngestChunk>& chunks)
+{
+	size_t tot = 0;
+	for(size_t i = 0; i < files.size(); i++) tot += files[i].size();
+	// Several chunks per thread, but none so small that cutting costs
+	// more than it saves
+	size_t target = (nthreads > 1) ?
+		max<size_t>(tot / (nthreads * 4), 1024 * 1024) : tot + 1;
+	chunks.clear();
+	for(size_t i = 0; i < files.size(); i++) {
+		const char *buf = files[i].ptr();
+		size_t len = files[i].size();
+		size_t beg = 0;
+		while(beg < len) {
+			size_t end = (len - beg > target) ? nextCut(buf, len, beg + target) : len;
+			chunks.expand();
+			chunks.back().reset(buf + beg, buf + end);
+			beg = end;
+		}
+	}
+	size_t nt = min<size_t>((size_t)nthreads, chunks.size());
+	if(nt <= 1) {
+		for(size_t i = 0; i < chunks.size(); i++) {
+			parseChunk(chunks[i], rparms);
+		}
+		return;
+	}
+	EList<RefIngestWorker> ws(MISC_CAT);
+	EList<tthread::thread*> threads(MISC_CAT);
+	ws.resizeExact(nt);
+	for(size_t t = 0; t < nt; t++) {
+		ws[t].chunks = &chunks;
+		ws[t].rparms = &rparms;
+		ws[t].tid = t;
+		ws[t].nthreads = nt;
+		threads.push_back(new tthread::thread(refIngestWorker, (void*)&ws[t]));
+	}
+	for(size_t t = 0; t < nt; t++) {
+		threads[t]->join();
+		delete threads[t];
+	}
+}
+
+/**
+ * Read the part of the file, which is 'sz' bytes long, that starts at
+ * 'off' into buf and return its length.  If what's left is more than
+ * 'max' bytes, only read up to the last record boundary within the first
+ * 'max' bytes (or, if a single record is longer than that, the first
+ * boundary after them).  Throws if the file cannot be read or is not
+ * FASTA.
+ */
+static size_t loadFasta(
+	const std::string& fn,
+	size_t sz,
+	size_t off,
+	size_t max,
+	EList<char>& buf)
+{
+	FILE *f = fopen(fn.c_str(), "rb");
+	if(f == NULL) {
+		cerr << "Error: could not open " << fn.c_str() << endl;
+		throw 1;
+	}
+	if(off > 0 && fseeko(f, (off_t)off, SEEK_SET) != 0) {
+		fclose(f);
+		cerr << "Error: could not read " << fn.c_str() << endl;
+		throw 1;
+	}
+	size_t len = 0, want = min<size_t>(sz - off, max), cut = 0;
+	while(true) {
+		buf.resizeExact(want);
+		size_t nread = fread(buf.ptr() + len, 1, want - len, f);
+		if(nread != want - len) {
+			fclose(f);
+			cerr << "Error: could not read " << fn.c_str() << endl;
+			throw 1;
+		}
+		len = want;
+		if(off + len == sz) {
+			cut = len;
+			break;
+		}
+		cut = lastCut(buf.ptr(), len);
+		if(cut > 0) break;
+		want = min<size_t>(sz - off, want * 2);
+	}
+	fclose(f);
+	buf.resize(cut);
+	if(off == 0) {
+		size_t i = 0;
+		while(i < cut && isspace((uint8_t)buf[i])) i++;
+		if(i == cut || buf[i] != '>') {
+			cerr << "Reference file does not seem to be a FASTA file" << endl;
+			throw 1;
+		}
+	}
+	return cut;
+}
+
+void RefIngest::parse(
+	const EList<std::string>& infiles,
+	const RefReadInParams& rparms,
+	int nthreads,
+	bool verbose)
+{
+	assert(!rparms.color);
+	recs_.clear();
+	names_.clear();
+	bases_.clear();
+	nbases_ = unambigTot_ = bothTot_ = 0;
+	numSeqs_ = 0;
+	EList<size_t> sizes(MISC_CAT);
+	size_t nonempty = 0;
+	for(size_t i = 0; i < infiles.size(); i++) {
+		struct stat st;
+		if(stat(infiles[i].c_str(), &st) != 0) {
+			cerr << "Error: could not open "<< infiles[i].c_str() << endl;
+			throw 1;
+		}
+		sizes.push_back((size_t)st.st_size);
+		if(st.st_size == 0) {
+			cerr << "Warning: Empty fasta file: '" << infiles[i].c_str() << "'" << endl;
+		} else {
+			nonempty++;
+		}
+	}
+	if(nonempty == 0) {
+		cerr << "Warning: All fasta inputs were empty" << endl;
+		throw 1;
+	}
+	EList<EList<char> > files(MISC_CAT);
+	EList<RefIngestChunk> chunks(MISC_CAT);
+	size_t i = 0, off = 0; // next file, and where to resume within it
+	while(i < infiles.size()) {
+		// Load files until the batch is full; a file that doesn't fit in
+		// a batch of its own is loaded a batch's worth of records at a time
+		files.clear();
+		size_t batch = 0;
+		while(i < infiles.size()) {
+			if(sizes[i] == 0) {
+				i++;
+				continue;
+			}
+			if(batch > 0 && batch + sizes[i] - off > INGEST_BATCH) break;
+			files.expand();
+			size_t len = loadFasta(infiles[i], sizes[i], off, INGEST_BATCH, files.back());
+			batch += len;
+			off += len;
+			if(off < sizes[i]) break;
+			i++;
+			off = 0;
+		}
+		if(files.empty()) continue;
+		parseBatch(files, rparms, nthreads, chunks);
+		// Append the chunks' results in input order
+		for(size_t j = 0; j < chunks.size(); j++) {
+			RefIngestChunk& ch = chunks[j];
+			if(ch.tooLong ||
+			   unambigTot_ + ch.unambigTot > (size_t)std::numeric_limits<TIndexOffU>::max())
+			{
+				cerr << RefTooLongException().what() << endl;
+				throw 1;
+			}
+			for(size_t k = 0; k < ch.recs.size(); k++) recs_.push_back(ch.recs[k]);
+			for(size_t k = 0; k < ch.names.size(); k++) names_.push_back(ch.names[k]);
+			const EList<uint8_t>& b = ch.bases.bytes;
+			int sh = (int)((nbases_ & 3) << 1);
+			if(sh == 0) {
+				size_t at = bases_.size();
+				bases_.resize(at + b.size());
+				if(b.size() > 0) memcpy(bases_.ptr() + at, b.ptr(), b.size());
+			} else {
+				// Shift the chunk's bases in behind the last partial byte
+				for(size_t k = 0; k < b.size(); k++) {
+					bases_.back() |= (uint8_t)(b[k] << sh);
+					bases_.push_back((uint8_t)(b[k] >> (8 - sh)));
+				}
+			}
+			nbases_ += ch.bases.n;
+			bases_.resize((nbases_ + 3) >> 2);
+			unambigTot_ += ch.unambigTot;
+			bothTot_ += ch.bothTot;
+			numSeqs_ += ch.numSeqs;
+		}
+		chunks.clear();
+	}
+	assert_eq(nbases_, unambigTot_);
+	if(verbose) {
+		cout << "  Parsed " << numSeqs_ << " sequences, " << recs_.size()
+		     << " records, " << nbases_ << " unambiguous bases" << endl;
+	}
+}
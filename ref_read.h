@@ -31,6 +31,7 @@
 #include "filebuf.h"
 #include "word_io.h"
 #include "ds.h"
+#include "mem_ids.h"
 #include "endian_swap.h"
 
 using namespace std;
@@ -108,12 +109,14 @@ enum {
 	REF_READ_REVERSE_EACH // reverse each unambiguous stretch of reference
 };
 
+class RefIngest;
+
 /**
  * Parameters governing treatment of references as they're read in.
  */
 struct RefReadInParams {
 	RefReadInParams(bool col, int r, bool nsToA, bool bisulf) :
-		color(col), reverse(r), nsToAs(nsToA), bisulfite(bisulf) { }
+		color(col), reverse(r), nsToAs(nsToA), bisulfite(bisulf), ingest(NULL) { }
 	// extract colors from reference
 	bool color;
 	// reverse each reference sequence before passing it along
@@ -122,6 +125,8 @@ struct RefReadInParams {
 	bool nsToAs;
 	// bisulfite-convert the reference
 	bool bisulfite;
+	// if set, the input already parsed; the input streams are not read
+	const RefIngest* ingest;
 };
 
 extern RefRecord
@@ -139,6 +144,111 @@ fastaRefReadSizes(
 	BitpairOutFileBuf* bpout,
 	TIndexOff& numSeqs);
 
+/**
+ * The input FASTA files read and parsed once, up front, into the same
+ * records fastaRefReadSizes() would produce, the name of each sequence
+ * and all the unambiguous bases packed four to a byte like the .4 file.
+ * Files are loaded in batches of about INGEST_BATCH bytes; a larger file
+ * is loaded a batch at a time, cut at record boundaries.  What is loaded
+ * is cut into chunks that start at a '>' following a sequence line, so that
+ * every chunk parses as if it were a file of its own, and the chunks are
+ * parsed by up to 'nthreads' threads at once.
+ *
+ * Pass one to the index builder through RefReadInParams::ingest so that
+ * szsFromFasta(), joinToDisk() and join() use it instead of re-reading
+ * the files.  Nucleotide references only.
+ */
+class RefIngest {
+
+public:
+
+	static const size_t INGEST_BATCH = 1024 * 1024 * 1024;
+
+	RefIngest() :
+		recs_(MISC_CAT),
+		names_(MISC_CAT),
+		bases_(MISC_CAT),
+		nbases_(0),
+		unambigTot_(0),
+		bothTot_(0),
+		numSeqs_(0)
+	{ }
+
+	/**
+	 * Read and parse the given FASTA files.  Empty files are skipped with
+	 * a warning.  Throws if none are left or a file cannot be read.
+	 */
+	void parse(
+		const EList<std::string>& infiles,
+		const RefReadInParams& rparms,
+		int nthreads,
+		bool verbose);
+
+	/**
+	 * Records, as fastaRefReadSizes() returns them.
+	 */
+	const EList<RefRecord>& recs() const { return recs_; }
+
+	/**
+	 * The name line of each record that starts a sequence, in order.
+	 */
+	const EList<std::string>& names() const { return names_; }
+
+	/**
+	 * Total unambiguous characters and total characters, as
+	 * fastaRefReadSizes() returns them.
+	 */
+	std::pair<size_t, size_t> sizes() const {
+		return std::make_pair(unambigTot_, bothTot_);
+	}
+
+	TIndexOff numSeqs() const { return numSeqs_; }
+
+	size_t numBases() const { return nbases_; }
+
+	const uint8_t* packed() const { return bases_.ptr(); }
+
+	/**
+	 * Return the i-th unambiguous base.
+	 */
+	int base(size_t i) const {
+		assert_lt(i, nbases_);
+		return (bases_[i >> 2] >> ((i & 3) << 1)) & 3;
+	}
+
+	/**
+	 * Append the bases of record 'rec', starting at base 'basei', to dst
+	 * the way fastaRefReadAppend() would, and advance basei past them.
+	 */
+	template <typename TStr, typename TOff>
+	void append(
+		const RefRecord& rec,
+		size_t& basei,
+		TStr& dst,
+		TOff& dstoff,
+		int reverse) const
+	{
+		size_t ilen = dstoff;
+		for(TIndexOffU j = 0; j < rec.len; j++) {
+			dst.set(base(basei++), dstoff++);
+		}
+		if(reverse == REF_READ_REVERSE_EACH) {
+			size_t nlen = dstoff;
+			dst.reverseWindow(ilen, nlen);
+		}
+	}
+
+protected:
+
+	EList<RefRecord>   recs_;
+	EList<std::string> names_;
+	EList<uint8_t>     bases_;   // 2 bits per base, lowest bits first
+	size_t             nbases_;
+	size_t             unambigTot_;
+	size_t             bothTot_;
+	TIndexOff          numSeqs_;
+};
+
 extern void
 reverseRefRecords(
 	const EList<RefRecord>& src,
@@ -21,6 +21,9 @@
 #include <string.h>
 #include "reference.h"
 #include "mem_ids.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -43,7 +46,7 @@ BitPairReference::BitPairReference(
 	sanityBuf_(NULL),
 	loaded_(true),
 	sanity_(sanity),
-	useMm_(useMm),
+	useMm_(useMm || useShmem),
 	useShmem_(useShmem),
 	verbose_(verbose)
 {
@@ -66,7 +69,10 @@ BitPairReference::BitPairReference(
 	}
 #ifdef BOWTIE_MM
     char *mmFile = NULL;
-	if(useMm_) {
+	if(useShmem_) {
+		size_t len = 0;
+		mmFile = ATTACH_SHARED(s4, len, (verbose_ || startVerbose));
+	} else if(useMm_) {
 		if(verbose_ || startVerbose) {
 			cerr << "  Memory-mapping reference index file " << s4.c_str() << ": ";
 			logTime(cerr);
@@ -196,53 +202,37 @@ BitPairReference::BitPairReference(
 		throw 1;
 #endif
 	} else {
-		bool shmemLeader = true;
-		if(!useShmem_) {
-			// Allocate a buffer to hold the reference string
-			try {
-				buf_ = new uint8_t[cumsz >> 2];
-				if(buf_ == NULL) throw std::bad_alloc();
-			} catch(std::bad_alloc& e) {
-				cerr << "Error: Ran out of memory allocating space for the bitpacked reference.  Please" << endl
-				<< "re-run on a computer with more memory." << endl;
-				throw 1;
-			}
-		} else {
-			shmemLeader = ALLOC_SHARED_U8(
-										  (s4 + "[ref]"), (cumsz >> 2), &buf_,
-										  "ref", (verbose_ || startVerbose));
+		// Allocate a buffer to hold the reference string
+		try {
+			buf_ = new uint8_t[cumsz >> 2];
+			if(buf_ == NULL) throw std::bad_alloc();
+		} catch(std::bad_alloc& e) {
+			cerr << "Error: Ran out of memory allocating space for the bitpacked reference.  Please" << endl
+			<< "re-run on a computer with more memory." << endl;
+			throw 1;
 		}
-		if(shmemLeader) {
-			// Open the bitpair-encoded reference file
-			FILE *f4 = fopen(s4.c_str(), "rb");
-			if(f4 == NULL) {
-				cerr << "Could not open reference-string index file " << s4.c_str() << " for reading." << endl;
-				cerr << "This is most likely because your index was built with an older version" << endl
-				<< "(<= 0.9.8.1) of bowtie-build.  Please re-run bowtie-build to generate a new" << endl
-				<< "index (or download one from the Bowtie website) and try again." << endl;
-				loaded_ = false;
-				return;
-			}
-			// Read the whole thing in
-			size_t ret = fread(buf_, 1, cumsz >> 2, f4);
-			// Didn't read all of it?
-			if(ret != (cumsz >> 2)) {
-				cerr << "Only read " << ret << " bytes (out of " << (cumsz >> 2) << ") from reference index file " << s4.c_str() << endl;
-				throw 1;
-			}
-			// Make sure there's no more
-			char c;
-			ret = fread(&c, 1, 1, f4);
-			assert_eq(0, ret); // should have failed
-			fclose(f4);
-#ifdef BOWTIE_SHARED_MEM
-			if(useShmem_) NOTIFY_SHARED(buf_, (cumsz >> 2));
-#endif
-		} else {
-#ifdef BOWTIE_SHARED_MEM
-			if(useShmem_) WAIT_SHARED(buf_, (cumsz >> 2));
-#endif
+		// Open the bitpair-encoded reference file
+		FILE *f4 = fopen(s4.c_str(), "rb");
+		if(f4 == NULL) {
+			cerr << "Could not open reference-string index file " << s4.c_str() << " for reading." << endl;
+			cerr << "This is most likely because your index was built with an older version" << endl
+			<< "(<= 0.9.8.1) of bowtie-build.  Please re-run bowtie-build to generate a new" << endl
+			<< "index (or download one from the Bowtie website) and try again." << endl;
+			loaded_ = false;
+			return;
+		}
+		// Read the whole thing in
+		size_t ret = fread(buf_, 1, cumsz >> 2, f4);
+		// Didn't read all of it?
+		if(ret != (cumsz >> 2)) {
+			cerr << "Only read " << ret << " bytes (out of " << (cumsz >> 2) << ") from reference index file " << s4.c_str() << endl;
+			throw 1;
 		}
+		// Make sure there's no more
+		char c;
+		ret = fread(&c, 1, 1, f4);
+		assert_eq(0, ret); // should have failed
+		fclose(f4);
 	}
 	
 	// Populate byteToU32_
@@ -314,7 +304,8 @@ BitPairReference::BitPairReference(
 }
 
 BitPairReference::~BitPairReference() {
-	if(buf_ != NULL && !useMm_ && !useShmem_) delete[] buf_;
+	if(useShmem_) DETACH_SHARED((char*)buf_);
+	else if(buf_ != NULL && !useMm_) delete[] buf_;
 	if(sanityBuf_ != NULL) delete[] sanityBuf_;
 }
 
@@ -417,6 +408,30 @@ int BitPairReference::getStretchNaive(
 /**
  * Load a stretch of the reference string into memory at 'dest'.
  */
+#ifdef __SSE2__
+/**
+ * Unpack the 64 bases in 16 bytes of buf_ to one byte each, like 16
+ * lookups in byteToU32_ on a little-endian machine: split out the four
+ * bit pairs of every byte, then interleave them with byte and word
+ * unpacks.
+ */
+static inline void unpack16(const uint8_t *src, uint32_t *dst) {
+	const __m128i mask = _mm_set1_epi8(3);
+	__m128i v = _mm_loadu_si128((const __m128i*)src);
+	__m128i b0 = _mm_and_si128(v, mask);
+	__m128i b1 = _mm_and_si128(_mm_srli_epi16(v, 2), mask);
+	__m128i b2 = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+	__m128i b3 = _mm_and_si128(_mm_srli_epi16(v, 6), mask);
+	__m128i lo01 = _mm_unpacklo_epi8(b0, b1), hi01 = _mm_unpackhi_epi8(b0, b1);
+	__m128i lo23 = _mm_unpacklo_epi8(b2, b3), hi23 = _mm_unpackhi_epi8(b2, b3);
+	__m128i *d = (__m128i*)dst;
+	_mm_storeu_si128(d + 0, _mm_unpacklo_epi16(lo01, lo23));
+	_mm_storeu_si128(d + 1, _mm_unpackhi_epi16(lo01, lo23));
+	_mm_storeu_si128(d + 2, _mm_unpacklo_epi16(hi01, hi23));
+	_mm_storeu_si128(d + 3, _mm_unpackhi_epi16(hi01, hi23));
+}
+#endif
+
 int BitPairReference::getStretch(
 	uint32_t *destU32,
 	size_t tidx,
@@ -522,19 +537,29 @@ int BitPairReference::getStretch(
 					uint64_t offLim = ((off - (toff + 4)) >> 2);
 					uint64_t lim = min(countLim, offLim);
 					// Do the fast thing for as far as possible
-					for(uint64_t j = 0; j < lim; j++) {
+					uint64_t j = 0;
+#ifdef __SSE2__
+					// 16 bytes (64 bases) at a time
+					for(; j + 16 <= lim; j += 16) {
+						unpack16(buf_ + bufOffU32, destU32 + curU32);
+						bufOffU32 += 16;
+						curU32 += 16;
+					}
+#endif
+					for(; j < lim; j++) {
 						// Lots of cache misses on the following line
-						destU32[curU32] = byteToU32_[buf_[bufOffU32++]];
+						destU32[curU32++] = byteToU32_[buf_[bufOffU32++]];
+					}
 #ifndef NDEBUG
-						if(dest_2 != NULL) {
-							assert_eq(dest[(curU32 << 2) + 0], dest_2[(curU32 << 2) - offset + 0]);
-							assert_eq(dest[(curU32 << 2) + 1], dest_2[(curU32 << 2) - offset + 1]);
-							assert_eq(dest[(curU32 << 2) + 2], dest_2[(curU32 << 2) - offset + 2]);
-							assert_eq(dest[(curU32 << 2) + 3], dest_2[(curU32 << 2) - offset + 3]);
+					if(dest_2 != NULL) {
+						for(uint64_t k = curU32 - lim; k < curU32; k++) {
+							assert_eq(dest[(k << 2) + 0], dest_2[(k << 2) - offset + 0]);
+							assert_eq(dest[(k << 2) + 1], dest_2[(k << 2) - offset + 1]);
+							assert_eq(dest[(k << 2) + 2], dest_2[(k << 2) - offset + 2]);
+							assert_eq(dest[(k << 2) + 3], dest_2[(k << 2) - offset + 3]);
 						}
-#endif
-						curU32++;
 					}
+#endif
 					toff += (lim << 2);
 					assert_leq(toff, off);
 					assert_leq((lim << 2), count);
@@ -578,6 +603,79 @@ int BitPairReference::getStretch(
 	return (int)offset;
 }
 
+int BitPairReference::getStretch(
+	uint32_t *destU32,
+	size_t tidx,
+	size_t toff,
+	size_t count,
+	RefWindowCache& cache
+	ASSERT_ONLY(, SStringExpandable<uint32_t>& destU32_2)) const
+{
+	const size_t W = RefWindowCache::RWC_WINDOW;
+	size_t win = toff / W;
+	size_t skip = toff - win * W;
+	if(count == 0 || skip + count > 2 * W || toff + count > refLens_[tidx]) {
+		return getStretch(destU32, tidx, toff, count ASSERT_ONLY(, destU32_2));
+	}
+	uint8_t *dest = (uint8_t*)destU32;
+	destU32[0] = 0x04040404; // same cushion of Ns as getStretch()
+	size_t cur = 4;
+	while(count > 0) {
+		const uint8_t *w = cache.window(*this, tidx, win);
+		size_t cpycnt = min(W - skip, count);
+		memcpy(dest + cur, w + skip, cpycnt);
+		cur += cpycnt;
+		count -= cpycnt;
+		skip = 0;
+		win++;
+	}
+#ifndef NDEBUG
+	if((rand() % 10) == 0) {
+		size_t origCount = cur - 4;
+		destU32_2.clear();
+		destU32_2.resize((origCount >> 2) + 2);
+		int off2 = getStretchNaive(destU32_2.wbuf(), tidx, toff, origCount);
+		const uint8_t *dest_2 = ((const uint8_t*)destU32_2.wbuf()) + off2;
+		for(size_t i = 0; i < origCount; i++) {
+			assert_eq(dest[4 + i], dest_2[i]);
+		}
+	}
+#endif
+	return 4;
+}
+
+const uint8_t* RefWindowCache::window(
+	const BitPairReference& ref,
+	size_t tidx,
+	size_t win)
+{
+	if(ref_ != &ref) {
+		clear();
+		ref_ = &ref;
+	}
+	clock_++;
+	size_t lru = 0;
+	for(size_t i = 0; i < RWC_SLOTS; i++) {
+		if(used_[i] != 0 && tidx_[i] == tidx && win_[i] == win) {
+			used_[i] = clock_;
+			hits_++;
+			return (const uint8_t*)bufs_[i] + off_[i];
+		}
+		if(used_[i] < used_[lru]) lru = i;
+	}
+	misses_++;
+	size_t toff = win * RWC_WINDOW;
+	size_t len = ref.approxLen(tidx);
+	assert_lt(toff, len);
+	size_t count = min((size_t)RWC_WINDOW, len - toff);
+	off_[lru] = ref.getStretch(bufs_[lru], tidx, toff, count ASSERT_ONLY(, destU32_));
+	assert_lt(off_[lru], 16);
+	tidx_[lru] = tidx;
+	win_[lru] = win;
+	used_[lru] = clock_;
+	return (const uint8_t*)bufs_[lru] + off_[lru];
+}
+
 
 /**
  * Parse the input fasta files, populating the szs list and writing the
@@ -633,7 +731,14 @@ BitPairReference::szsFromFasta(
 			assert_eq(sztot2.second, sztot.second + numSeqs);
 		} else {
 			TIndexOff numSeqs = 0;
-			sztot = fastaRefReadSizes(is, szs, parms, &bpout, numSeqs);
+			if(parms.ingest != NULL) {
+				// Already parsed; just write it out
+				szs = parms.ingest->recs();
+				sztot = parms.ingest->sizes();
+				bpout.write(parms.ingest->packed(), parms.ingest->numBases());
+			} else {
+				sztot = fastaRefReadSizes(is, szs, parms, &bpout, numSeqs);
+			}
 			writeIndex<TIndexOffU>(fout3, (TIndexOffU)szs.size(), bigEndian); // write # records
 			for(size_t i = 0; i < szs.size(); i++) szs[i].write(fout3, bigEndian);
 		}
@@ -649,6 +754,11 @@ BitPairReference::szsFromFasta(
 		// Read in the sizes of all the unambiguous stretches of the
 		// genome into a vector of RefRecords
 		TIndexOff numSeqs = 0;
+		if(parms.ingest != NULL && !parms.color) {
+			szs = parms.ingest->recs();
+			sztot = parms.ingest->sizes();
+			return sztot;
+		}
 		sztot = fastaRefReadSizes(is, szs, parms, NULL, numSeqs);
 #ifndef NDEBUG
 		if(parms.color) {
@@ -666,3 +776,93 @@ BitPairReference::szsFromFasta(
 	}
 	return sztot;
 }
+
+/**
+ * Decode the .3.gEbwt_ext and .4.gEbwt_ext portions of the index with
+ * basename 'in' back into FASTA.  Records are replayed in order, so
+ * szsFromFasta run over the output reproduces the original records.
+ */
+TIndexOffU
+BitPairReference::fastaFromIndex(
+	const string& in,
+	const EList<string>& refnames,
+	std::ostream& out)
+{
+	string s3 = in + ".3." + gEbwt_ext;
+	string s4 = in + ".4." + gEbwt_ext;
+	FILE *f3, *f4;
+	if((f3 = fopen(s3.c_str(), "rb")) == NULL) {
+		cerr << "Could not open reference-string index file " << s3.c_str() << " for reading." << endl;
+		throw 1;
+	}
+	if((f4 = fopen(s4.c_str(), "rb")) == NULL) {
+		cerr << "Could not open reference-string index file " << s4.c_str() << " for reading." << endl;
+		fclose(f3);
+		throw 1;
+	}
+	bool swap = false;
+	uint32_t one = readIndex<int32_t>(f3, swap);
+	if(one != 1) {
+		assert_eq(0x1000000, one);
+		swap = true;
+	}
+	TIndexOffU sz = readIndex<TIndexOffU>(f3, swap);
+	const size_t lineLen = 60;
+	size_t col = 0;
+	TIndexOffU nrefs = 0, nnamed = 0;
+	int byte = 0, bp = 8;
+	for(TIndexOffU i = 0; i < sz; i++) {
+		RefRecord rec(f3, swap);
+		if(rec.first) {
+			if(nrefs > 0 && col > 0) {
+				out << '\n';
+			}
+			col = 0;
+			out << '>';
+			if(rec.len > 0) {
+				// Only sequences with unambiguous characters were named
+				if(nnamed >= refnames.size()) {
+					cerr << "Error: index " << in.c_str() << " has more reference sequences than names" << endl;
+					fclose(f3); fclose(f4);
+					throw 1;
+				}
+				out << refnames[nnamed++].c_str();
+			} else {
+				out << nrefs;
+			}
+			out << '\n';
+			nrefs++;
+		} else if(i == 0) {
+			cerr << "First record in reference index file was not marked as "
+			     << "'first'" << endl;
+			fclose(f3); fclose(f4);
+			throw 1;
+		}
+		for(TIndexOffU j = 0; j < rec.off + rec.len; j++) {
+			char c = 'N';
+			if(j >= rec.off) {
+				if(bp == 8) {
+					if((byte = fgetc(f4)) == EOF) {
+						cerr << "Error: reference-string index file " << s4.c_str() << " is truncated" << endl;
+						fclose(f3); fclose(f4);
+						throw 1;
+					}
+					bp = 0;
+				}
+				c = "ACGT"[(byte >> bp) & 3];
+				bp += 2;
+			}
+			out << c;
+			if(++col == lineLen) {
+				out << '\n';
+				col = 0;
+			}
+		}
+	}
+	if(col > 0) {
+		out << '\n';
+	}
+	fclose(f3);
+	fclose(f4);
+	return nrefs;
+}
@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <utility>
+#include <limits>
 #ifdef BOWTIE_MM
 #include <sys/mman.h>
 #include <sys/shm.h>
@@ -37,6 +38,8 @@
 #include "sstring.h"
 #include "btypes.h"
 
+class RefWindowCache;
+
 
 /**
  * Concrete reference representation that bulk-loads the reference from
@@ -115,6 +118,19 @@ public:
 		size_t count
 		ASSERT_ONLY(, SStringExpandable<uint32_t>& destU32_2)) const;
 
+	/**
+	 * Like getStretch(), but serve the stretch from the given per-thread
+	 * cache of decoded windows when it lies within one or two of them,
+	 * decoding the missing windows into the cache first.
+	 */
+	int getStretch(
+		uint32_t *destU32,
+		size_t tidx,
+		size_t toff,
+		size_t count,
+		RefWindowCache& cache
+		ASSERT_ONLY(, SStringExpandable<uint32_t>& destU32_2)) const;
+
 	/**
 	 * Return the number of reference sequences.
 	 */
@@ -161,7 +177,19 @@ public:
 		const RefReadInParams& refparams,
 		EList<RefRecord>& szs,
 		bool sanity);
-	
+
+	/**
+	 * Decode the .3.ebwt and .4.ebwt portions of the index with basename
+	 * 'in' back into FASTA, writing to 'out'.  Ambiguous stretches are
+	 * written as Ns so that re-parsing the output yields the same
+	 * records.  Returns the number of reference sequences written.
+	 */
+	static TIndexOffU
+	fastaFromIndex(
+		const string& in,
+		const EList<string>& refnames,
+		std::ostream& out);
+
 protected:
 
 	uint32_t byteToU32_[256];
@@ -186,4 +214,57 @@ protected:
 	ASSERT_ONLY(SStringExpandable<uint32_t> tmp_destU32_);
 };
 
+/**
+ * A handful of recently used windows of the reference, decoded one byte
+ * per base.  Windows are RWC_WINDOW bases long and aligned to multiples of
+ * RWC_WINDOW within their sequence, and are replaced least recently used
+ * first.  Not thread-safe; each thread keeps its own.
+ */
+class RefWindowCache {
+
+	friend class BitPairReference;
+
+	static const size_t RWC_WINDOW = 1024; // bases per window
+	static const size_t RWC_SLOTS  = 16;
+
+public:
+
+	RefWindowCache() : ref_(NULL), clock_(0), hits_(0), misses_(0) {
+		clear();
+	}
+
+	/**
+	 * Forget all windows.
+	 */
+	void clear() {
+		for(size_t i = 0; i < RWC_SLOTS; i++) {
+			tidx_[i] = std::numeric_limits<size_t>::max();
+			win_[i] = 0;
+			used_[i] = 0;
+		}
+	}
+
+	uint64_t hits() const   { return hits_; }
+	uint64_t misses() const { return misses_; }
+
+protected:
+
+	/**
+	 * Return the decoded bases of window 'win' of sequence 'tidx',
+	 * decoding it into the least recently used slot if it is not cached.
+	 */
+	const uint8_t* window(const BitPairReference& ref, size_t tidx, size_t win);
+
+	const BitPairReference* ref_;  // windows belong to this reference
+	uint64_t clock_;
+	uint64_t hits_;
+	uint64_t misses_;
+	size_t   tidx_[RWC_SLOTS];
+	size_t   win_[RWC_SLOTS];
+	uint64_t used_[RWC_SLOTS];     // clock_ when last used; 0 = empty
+	int      off_[RWC_SLOTS];      // offset of the first base in bufs_[i]
+	uint32_t bufs_[RWC_SLOTS][(RWC_WINDOW >> 2) + 4];
+	ASSERT_ONLY(SStringExpandable<uint32_t> destU32_);
+};
+
 #endif
@@ -57,9 +57,10 @@ void SamConfig::printHeader(
 	const string& rgs,
 	bool printHd,
 	bool printSq,
-	bool printPg) const
+	bool printPg,
+	const char *sortOrder) const
 {
-	if(printHd) printHdLine(o, "1.0");
+	if(printHd) printHdLine(o, "1.0", sortOrder);
 	if(printSq) printSqLines(o);
 	if(!rgid.empty()) {
 		o.append("@RG");
@@ -73,10 +74,16 @@ void SamConfig::printHeader(
 /**
  * Print the @HD header line to the given string.
  */
-void SamConfig::printHdLine(BTString& o, const char *samver) const {
+void SamConfig::printHdLine(
+	BTString& o,
+	const char *samver,
+	const char *sortOrder) const
+{
 	o.append("@HD\tVN:");
 	o.append(samver);
-	o.append("\tSO:unsorted\n");
+	o.append("\tSO:");
+	o.append(sortOrder);
+	o.append('\n');
 }
 
 /**
@@ -498,6 +505,13 @@ void SamConfig::printAlignedOptFlags(
 		o.append("ZI:i:");
 		o.append(buf);
 	}
+	if(prm.budgetHit != WORK_BUDGET_NONE) {
+		// ZW:Z: Per-read work budget that cut the search short
+		WRITE_SEP();
+		o.append("ZW:Z:");
+		o.append(prm.budgetHit == WORK_BUDGET_LF ? "lf" :
+		         (prm.budgetHit == WORK_BUDGET_CELLS ? "cells" : "time"));
+	}
     if(print_xs_a_) {
         if(rna_strandness_ == RNA_STRANDNESS_UNKNOWN) {
             uint8_t whichsense = res.spliced_whichsense_transcript();
@@ -762,6 +776,13 @@ void SamConfig::printEmptyOptFlags(
 		o.append("ZI:i:");
 		o.append(buf);
 	}
+	if(prm.budgetHit != WORK_BUDGET_NONE) {
+		// ZW:Z: Per-read work budget that cut the search short
+		WRITE_SEP();
+		o.append("ZW:Z:");
+		o.append(prm.budgetHit == WORK_BUDGET_LF ? "lf" :
+		         (prm.budgetHit == WORK_BUDGET_CELLS ? "cells" : "time"));
+	}
 	if(print_xr_) {
 		// Original read string
 		o.append("\n");
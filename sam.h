@@ -264,13 +264,17 @@ public:
 		const std::string& rgs,
 		bool printHd,
 		bool printSq,
-		bool printPg)
+		bool printPg,
+		const char *sortOrder = "unsorted")
 		const;
 
 	/**
 	 * Print the @HD header line to the given string.
 	 */
-	void printHdLine(BTString& o, const char *samver) const;
+	void printHdLine(
+		BTString& o,
+		const char *samver,
+		const char *sortOrder = "unsorted") const;
 
 	/**
 	 * Print the @SQ header lines to the given string.
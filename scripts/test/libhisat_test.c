@@ -0,0 +1,192 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Aligns paired FASTQ files through libhisat, in batches, and checks
+ * that the records it gets back are those of a SAM file hisat-align wrote
+ * for the same reads and options (all fields but SEQ and QUAL, in any
+ * order).  Run by simple_tests.pl:
+ *
+ *   libhisat_test <SAM> <mate 1 FASTQ> <mate 2 FASTQ> <batch size> <options>
+ *
+ * where <options> are passed to hisat_open().  Exits 0 if the records
+ * match.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hisat_lib.h"
+
+#define MAX_LINE 4096
+
+typedef struct {
+	char  **v;
+	size_t  n, cap;
+} lines_t;
+
+static hisat_aligner_t *aligner;
+static hisat_read_t    *batch;
+static pthread_mutex_t  mutex = PTHREAD_MUTEX_INITIALIZER;
+static lines_t          got;
+
+static void die(const char *msg, const char *arg) {
+	fprintf(stderr, "libhisat_test: %s%s\n", msg, arg);
+	exit(1);
+}
+
+static char *copy(const char *s) {
+	char *c = malloc(strlen(s) + 1);
+	if(c == NULL) die("out of memory", "");
+	return strcpy(c, s);
+}
+
+static void push(lines_t *ls, char *l) {
+	if(ls->n == ls->cap) {
+		ls->cap = ls->cap == 0 ? 1024 : ls->cap * 2;
+		ls->v = realloc(ls->v, ls->cap * sizeof(char*));
+		if(ls->v == NULL) die("out of memory", "");
+	}
+	ls->v[ls->n++] = l;
+}
+
+static int cmp(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Print a record as hisat-align would, without SEQ and QUAL.
+ */
+static void onAln(const hisat_aln_t *a, void *user) {
+	char l[MAX_LINE];
+	const char *rname = a->refid < 0 ? "*" : hisat_refname(aligner, a->refid);
+	const char *rnext = a->mate_refid < 0 ? "*" :
+		(a->mate_refid == a->refid ? "=" : hisat_refname(aligner, a->mate_refid));
+	(void)user;
+	snprintf(l, sizeof(l), "%s\t%d\t%s\t%lld\t%d\t%s\t%s\t%lld\t%lld\t%s",
+	         batch[a->read].name, a->flag, rname, (long long)a->pos + 1, a->mapq,
+	         a->cigar, rnext, (long long)a->mate_pos + 1, (long long)a->tlen, a->tags);
+	pthread_mutex_lock(&mutex);
+	push(&got, copy(l));
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * Read one FASTQ record into r's name, seq and qual (mate 1) or seq2 and
+ * qual2 (mate 2).  Returns 0 at the end of the file.
+ */
+static int readMate(FILE *fq, hisat_read_t *r, int mate) {
+	char l[4][MAX_LINE];
+	int i;
+	for(i = 0; i < 4; i++) {
+		if(fgets(l[i], MAX_LINE, fq) == NULL) {
+			if(i == 0) return 0;
+			die("truncated FASTQ record", "");
+		}
+		l[i][strcspn(l[i], "\r\n")] = '\0';
+	}
+	if(mate == 1) {
+		size_t len;
+		l[0][strcspn(l[0], " \t")] = '\0';
+		len = strlen(l[0]);
+		if(len > 2 && l[0][len-2] == '/') l[0][len-2] = '\0';
+		r->name = copy(l[0] + 1);
+		r->seq  = copy(l[1]);
+		r->qual = copy(l[3]);
+	} else {
+		r->seq2  = copy(l[1]);
+		r->qual2 = copy(l[3]);
+	}
+	return 1;
+}
+
+static void freeBatch(size_t n) {
+	size_t i;
+	for(i = 0; i < n; i++) {
+		free((char*)batch[i].name);
+		free((char*)batch[i].seq);
+		free((char*)batch[i].qual);
+		free((char*)batch[i].seq2);
+		free((char*)batch[i].qual2);
+	}
+}
+
+int main(int argc, const char **argv) {
+	FILE *sam, *fq1, *fq2;
+	size_t bsz, n, i;
+	lines_t want = { NULL, 0, 0 };
+	char l[MAX_LINE];
+	if(argc < 6) {
+		die("usage: libhisat_test <SAM> <mate 1 FASTQ> <mate 2 FASTQ> <batch size> <options>", "");
+	}
+	if((sam = fopen(argv[1], "r")) == NULL) die("could not open ", argv[1]);
+	if((fq1 = fopen(argv[2], "r")) == NULL) die("could not open ", argv[2]);
+	if((fq2 = fopen(argv[3], "r")) == NULL) die("could not open ", argv[3]);
+	bsz = (size_t)atol(argv[4]);
+	if(bsz == 0) die("bad batch size ", argv[4]);
+
+	/* hisat_open() takes argv[0] as the program name */
+	argv[4] = "libhisat_test";
+	if((aligner = hisat_open(argc - 4, argv + 4)) == NULL) die("hisat_open() failed", "");
+	batch = calloc(bsz, sizeof(hisat_read_t));
+	if(batch == NULL) die("out of memory", "");
+	do {
+		memset(batch, 0, bsz * sizeof(hisat_read_t));
+		for(n = 0; n < bsz && readMate(fq1, &batch[n], 1); n++) {
+			if(!readMate(fq2, &batch[n], 2)) die("fewer mate 2s than mate 1s", "");
+		}
+		if(n > 0 && hisat_align(aligner, batch, n, onAln, NULL) != 0) {
+			die("hisat_align() failed", "");
+		}
+		freeBatch(n);
+	} while(n == bsz);
+	hisat_close(aligner);
+
+	/* Drop SEQ and QUAL (fields 10 and 11) from the expected records */
+	while(fgets(l, MAX_LINE, sam) != NULL) {
+		char rec[MAX_LINE], *f;
+		size_t len = 0;
+		l[strcspn(l, "\r\n")] = '\0';
+		if(l[0] == '@') continue;
+		for(i = 1, f = strtok(l, "\t"); f != NULL; i++, f = strtok(NULL, "\t")) {
+			if(i == 10 || i == 11) continue;
+			len += snprintf(rec + len, sizeof(rec) - len, "%s%s", len > 0 ? "\t" : "", f);
+		}
+		if(i <= 11) die("SAM record with too few fields in ", argv[1]);
+		push(&want, copy(rec));
+	}
+
+	if(want.n == 0) die("no records in ", argv[1]);
+	if(got.n != want.n) {
+		fprintf(stderr, "libhisat_test: got %lu records, expected %lu\n",
+		        (unsigned long)got.n, (unsigned long)want.n);
+		return 1;
+	}
+	qsort(got.v, got.n, sizeof(char*), cmp);
+	qsort(want.v, want.n, sizeof(char*), cmp);
+	for(i = 0; i < got.n; i++) {
+		if(strcmp(got.v[i], want.v[i]) != 0) {
+			fprintf(stderr, "libhisat_test: got record\n%s\nexpected\n%s\n", got.v[i], want.v[i]);
+			return 1;
+		}
+	}
+	printf("%lu records match\n", (unsigned long)got.n);
+	return 0;
+}
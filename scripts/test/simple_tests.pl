@@ -29,6 +29,9 @@ use Getopt::Long;
 use FindBin qw($Bin); 
 use lib $Bin;
 use List::Util qw(max min);
+use POSIX qw(:sys_wait_h);
+use File::Spec;
+use IO::Uncompress::Gunzip qw(gunzip $GunzipError);
 use Data::Dumper;
 use DNA;
 use Clone qw(clone);
@@ -37,11 +40,15 @@ use Test::Deep;
 my $bowtie2 = "";
 my $bowtie2_build = "";
 my $skipColor = 1;
+my $runsOnly = 0;
+my $libhisat = "";
 
 GetOptions(
 	"bowtie2=s"       => \$bowtie2,
 	"bowtie2-build=s" => \$bowtie2_build,
-	"skip-color"      => \$skipColor) || die "Bad options";
+	"skip-color"      => \$skipColor,
+	"runs-only"       => \$runsOnly,
+	"libhisat=s"      => \$libhisat) || die "Bad options";
 
 if(! -x $bowtie2 || ! -x $bowtie2_build) {
 	my $bowtie2_dir = `dirname $bowtie2`;
@@ -4245,6 +4252,489 @@ sub matchSamOptionalFlags($$) {
 	return 1;
 }
 
+##
+# Whole runs over the example index and reads whose output must match that
+# of another run (or runs) of the same input.
+#
+my $exIdx = "$Bin/../../example/index/22_20-21M_hisat";
+my $exReads = "-1 $Bin/../../example/reads/reads_1.fq -2 $Bin/../../example/reads/reads_2.fq";
+
+my @runCases = (
+
+	{ name   => "Shards merged",
+	  args   => "--no-temp-splicesite --reorder",
+	  shards => 3 },
+
+	{ name   => "Shards merged, with -s/-u",
+	  args   => "--no-temp-splicesite --reorder -s 100 -u 700",
+	  shards => 3 },
+
+	{ name   => "Killed and resumed",
+	  args   => "",
+	  resume => 1 },
+
+	{ name   => "Killed and resumed, with -s/-u",
+	  args   => "-s 1500 -u 40000",
+	  resume => 1 },
+
+	{ name   => "Index build killed and resumed",
+	  args   => "",
+	  build  => 1 },
+
+	{ name   => "Sorted BAM, spilled and merged",
+	  args   => "",
+	  bam    => "-p 1" },
+
+	{ name   => "Sorted BAM, spilled and merged, 3 threads",
+	  args   => "--no-temp-splicesite",
+	  bam    => "-p 3" },
+
+	{ name   => "Contaminant filter, pairs",
+	  args   => "--no-temp-splicesite",
+	  filter => "paired" },
+
+	{ name   => "Contaminant filter, unpaired",
+	  args   => "--no-temp-splicesite",
+	  filter => "unpaired" },
+
+	{ name   => "Large index packed to 40 bits",
+	  args   => "",
+	  large  => 1 },
+
+	{ name   => "Library, in batches",
+	  args   => "",
+	  lib    => 300 },
+
+	{ name   => "Library, in batches, 3 threads",
+	  args   => "-p 3 --no-temp-splicesite",
+	  lib    => 333 },
+);
+
+##
+# Return the contents of a file.
+#
+sub slurp($) {
+	my $fn = shift;
+	open(my $fh, "<", $fn) || die "Could not open '$fn' for reading";
+	local $/ = undef;
+	my $str = <$fh>;
+	close($fh);
+	return $str;
+}
+
+##
+# Return the header lines of a SAM file and, sorted, its records.  The
+# sort puts the records of --merge-shards output in the order of a single
+# run.
+#
+sub samParts($) {
+	my @ls = split(/\n/, slurp(shift));
+	return (join("\n", grep { /^@/ } @ls), join("\n", sort grep { !/^@/ } @ls));
+}
+
+##
+# Run a command, dying if it fails.
+#
+sub run($) {
+	my $cmd = shift;
+	print "$cmd\n";
+	system($cmd) == 0 || die "Bad exitlevel from '$cmd': $?";
+}
+
+##
+# Align the example reads in one run and as shards 0..N-1 of N, then
+# merge the shards' SAM output and summaries.  Both must be the same as
+# the single run's.
+#
+sub checkShards($) {
+	my $c = shift;
+	my $n = $c->{shards};
+	my $cmd = "$bowtie2 -p 1 -x $exIdx $exReads $c->{args}";
+	run("$cmd -S .simple_tests.full.sam --summary-file .simple_tests.full.sum 2> .simple_tests.full.err");
+	my (@sams, @sums);
+	for(my $i = 0; $i < $n; $i++) {
+		push @sams, ".simple_tests.shard$i.sam";
+		push @sums, ".simple_tests.shard$i.sum";
+		run("$cmd --shard $i/$n -S $sams[-1] --summary-file $sums[-1] 2> /dev/null");
+	}
+	run("$bowtie2 --merge-shards ".join(",", @sams)." -S .simple_tests.merged.sam");
+	run("$bowtie2 --merge-summaries ".join(",", @sums).
+	    " --summary-file .simple_tests.merged.sum 2> .simple_tests.merged.err");
+	my ($fullHdr, $fullRecs) = samParts(".simple_tests.full.sam");
+	my ($mergedHdr, $mergedRecs) = samParts(".simple_tests.merged.sam");
+	$fullRecs ne "" || die "No SAM records from '$cmd'";
+	$mergedHdr eq $fullHdr || die "Merged SAM header differs from that of a single run";
+	$mergedRecs eq $fullRecs || die "Merged SAM records differ from those of a single run";
+	slurp(".simple_tests.merged.sum") eq slurp(".simple_tests.full.sum") ||
+		die "Merged --summary-file differs from that of a single run";
+	slurp(".simple_tests.merged.err") eq slurp(".simple_tests.full.err") ||
+		die "Merged alignment summary differs from that of a single run";
+	unlink(".simple_tests.full.sam", ".simple_tests.full.sum", ".simple_tests.full.err",
+	       ".simple_tests.merged.sam", ".simple_tests.merged.sum", ".simple_tests.merged.err",
+	       @sams, @sums);
+}
+
+##
+# Write 'n' copies of the example reads to <prefix>.1.fq and <prefix>.2.fq
+# and return the two file names.
+#
+sub copyReads($$) {
+	my ($n, $prefix) = @_;
+	my @fqs;
+	for my $m (1, 2) {
+		my $reads = slurp("$Bin/../../example/reads/reads_$m.fq");
+		push @fqs, "$prefix.$m.fq";
+		open(my $fh, ">", $fqs[-1]) || die "Could not open '$fqs[-1]' for writing";
+		print $fh $reads x $n;
+		close($fh);
+	}
+	return @fqs;
+}
+
+##
+# Align 50 copies of the example reads in one run, and again in a run
+# that saves --checkpoints, is killed after the first one and then
+# continued with --resume.  The output and the summaries must be the same.
+#
+sub checkResume($) {
+	my $c = shift;
+	my @fqs = copyReads(50, ".simple_tests.resume");
+	my $cmd = "$bowtie2 -p 1 -x $exIdx -1 $fqs[0] -2 $fqs[1] $c->{args}";
+	run("$cmd -S .simple_tests.full.sam --summary-file .simple_tests.full.sum 2> .simple_tests.full.err");
+	my $ckpt = ".simple_tests.ckpt";
+	unlink($ckpt);
+	$cmd .= " -S .simple_tests.resumed.sam --summary-file .simple_tests.resumed.sum".
+	        " --checkpoint $ckpt --checkpoint-ival 1000";
+	print "$cmd (killed)\n";
+	my $pid = fork();
+	defined($pid) || die "Could not fork";
+	if($pid == 0) {
+		# No shell in between, so that the kill reaches the aligner
+		open(STDERR, ">", "/dev/null") || die;
+		exec(split(" ", $cmd)) || die "Could not run '$cmd'";
+	}
+	while(!-e $ckpt) {
+		waitpid($pid, WNOHANG) == 0 || die "'$cmd' finished before saving a checkpoint";
+		select(undef, undef, undef, 0.02);
+	}
+	kill(9, $pid);
+	waitpid($pid, 0);
+	-e $ckpt || die "'$cmd' finished before it could be killed";
+	run("$cmd --resume 2> .simple_tests.resumed.err");
+	!-e $ckpt || die "Checkpoint left behind after the resumed run completed";
+	slurp(".simple_tests.resumed.sam") eq slurp(".simple_tests.full.sam") ||
+		die "Resumed SAM output differs from that of an uninterrupted run";
+	slurp(".simple_tests.resumed.sum") eq slurp(".simple_tests.full.sum") ||
+		die "Resumed --summary-file differs from that of an uninterrupted run";
+	my $err = slurp(".simple_tests.resumed.err");
+	$err =~ s/^Resuming from read \d+ .*\n//m || die "Run wasn't resumed";
+	$err eq slurp(".simple_tests.full.err") ||
+		die "Resumed alignment summary differs from that of an uninterrupted run";
+	unlink(@fqs, ".simple_tests.full.sam", ".simple_tests.full.sum", ".simple_tests.full.err",
+	       ".simple_tests.resumed.sam", ".simple_tests.resumed.sum", ".simple_tests.resumed.err");
+}
+
+##
+# Build an index of the example reference, kill a second build of it once
+# it has saved <out>.ckpt, then finish that build with --resume.  The index
+# files must be those of the uninterrupted build.
+#
+sub checkBuildResume($) {
+	my $c = shift;
+	my $fa = "$Bin/../../example/reference/22_20-21M.fa";
+	my @exts = map { "$_.bt2" } (1..6, "rev.1", "rev.2", "rev.5", "rev.6");
+	run("$bowtie2_build -q $c->{args} $fa .simple_tests.build.full > /dev/null");
+	my $ckpt = ".simple_tests.build.ckpt";
+	unlink($ckpt);
+	my $cmd = "$bowtie2_build $c->{args} $fa .simple_tests.build";
+	print "$cmd (killed)\n";
+	my $pid = fork();
+	defined($pid) || die "Could not fork";
+	if($pid == 0) {
+		# No shell in between, so that the kill reaches hisat-build
+		open(STDOUT, ">", "/dev/null") || die;
+		open(STDERR, ">", "/dev/null") || die;
+		exec(split(" ", $cmd)) || die "Could not run '$cmd'";
+	}
+	while(!-e $ckpt) {
+		waitpid($pid, WNOHANG) == 0 || die "'$cmd' finished before saving a checkpoint";
+		select(undef, undef, undef, 0.005);
+	}
+	kill(9, $pid);
+	waitpid($pid, 0);
+	-e $ckpt || die "'$cmd' finished before it could be killed";
+	run("$cmd --resume > .simple_tests.build.out");
+	!-e $ckpt || die "Checkpoint left behind after the resumed build completed";
+	slurp(".simple_tests.build.out") =~ /^Resuming from /m || die "Build wasn't resumed";
+	for my $ext (@exts) {
+		system("cmp .simple_tests.build.$ext .simple_tests.build.full.$ext") == 0 ||
+			die "Resumed build's .$ext differs from that of an uninterrupted build";
+	}
+	unlink(".simple_tests.build.out", map { (".simple_tests.build.$_", ".simple_tests.build.full.$_") } @exts);
+}
+
+##
+# Decode a BAM file.  Return its header text and its records as SAM
+# lines, with integer tags typed "i" as hisat-align prints them.
+#
+sub readBam($) {
+	my $fn = shift;
+	my $bam;
+	gunzip($fn => \$bam, MultiStream => 1) || die "Could not decompress '$fn': $GunzipError";
+	my $p = 0;
+	my $take = sub { my $n = shift; my $s = substr($bam, $p, $n); $p += $n; return $s; };
+	$take->(4) eq "BAM\1" || die "'$fn' is not a BAM file";
+	my $hdr = $take->(unpack("V", $take->(4)));
+	my @refs;
+	for(1..unpack("V", $take->(4))) {
+		push @refs, unpack("Z*", $take->(unpack("V", $take->(4))));
+		$take->(4);
+	}
+	my @recs;
+	while($p < length($bam)) {
+		my $end = $p + 4 + unpack("V", $take->(4));
+		my ($rid, $pos, $lname, $mapq, $bin, $ncig, $flag, $lseq, $nrid, $npos, $tlen) =
+			unpack("l< l< C C v v v V l< l< l<", $take->(32));
+		my $name = unpack("Z*", $take->($lname));
+		my $cigar = join("", map { ($_ >> 4).substr("MIDNSHP=X", $_ & 15, 1) }
+		                     unpack("V*", $take->(4 * $ncig)));
+		my $seq = join("", map { substr("=ACMGRSVTWYHKDBN", $_, 1) }
+		                   map { ($_ >> 4, $_ & 15) } unpack("C*", $take->(($lseq + 1) >> 1)));
+		$seq = substr($seq, 0, $lseq);
+		my $qual = $take->($lseq);
+		$qual = ($lseq == 0 || substr($qual, 0, 1) eq "\xff") ? "*" : join("", map { chr($_ + 33) } unpack("C*", $qual));
+		my @f = ($name, $flag, $rid < 0 ? "*" : $refs[$rid], $pos + 1, $mapq,
+		         $cigar eq "" ? "*" : $cigar,
+		         $nrid < 0 ? "*" : ($nrid == $rid ? "=" : $refs[$nrid]), $npos + 1, $tlen,
+		         $seq eq "" ? "*" : $seq, $qual);
+		my %ints = (c => "c", C => "C", s => "s<", S => "v", i => "l<", I => "V");
+		my %lens = (c => 1, C => 1, s => 2, S => 2, i => 4, I => 4);
+		while($p < $end) {
+			my ($tag, $ty) = unpack("A2 A1", $take->(3));
+			if(defined($ints{$ty})) {
+				push @f, "$tag:i:".unpack($ints{$ty}, $take->($lens{$ty}));
+			} elsif($ty eq "A") {
+				push @f, "$tag:A:".$take->(1);
+			} elsif($ty eq "f") {
+				push @f, "$tag:f:".unpack("f<", $take->(4));
+			} elsif($ty eq "Z" || $ty eq "H") {
+				my $v = unpack("Z*", substr($bam, $p));
+				$p += length($v) + 1;
+				push @f, "$tag:$ty:$v";
+			} else {
+				die "Unexpected tag type '$ty' in '$fn'";
+			}
+		}
+		$p == $end || die "Bad record length in '$fn'";
+		push @recs, join("\t", @f);
+	}
+	return ($hdr, @recs);
+}
+
+##
+# Align 40 copies of the example reads to SAM with one thread and to
+# --sorted-bam with the options $c->{bam}, using a small --sort-mem so
+# that more runs are spilled than are merged at once.  The BAM must have
+# the SAM header, marked sorted, and the SAM records in coordinate order:
+# by reference (unaligned last) and position, ties in the order they were
+# printed in.
+#
+sub checkBam($) {
+	my $c = shift;
+	my @fqs = copyReads(40, ".simple_tests.bam");
+	my $cmd = "$bowtie2 -x $exIdx -1 $fqs[0] -2 $fqs[1] $c->{args}";
+	run("$cmd -p 1 -S .simple_tests.full.sam 2> /dev/null");
+	run("$cmd --sorted-bam --sort-mem 1 $c->{bam} -S .simple_tests.sorted.bam 2> /dev/null");
+	my @sam = split(/\n/, slurp(".simple_tests.full.sam"));
+	my @refs = map { /^\@SQ\tSN:([^\t]+)/ ? ($1) : () } @sam;
+	my %refid = map { ($refs[$_] => $_) } 0..$#refs;
+	my @samRecs = grep { !/^@/ } @sam;
+	my @keys = map { my @f = split(/\t/); [ $f[2] eq "*" ? scalar(@refs) : $refid{$f[2]}, $f[3] ] } @samRecs;
+	my @order = sort { $keys[$a][0] <=> $keys[$b][0] || $keys[$a][1] <=> $keys[$b][1] || $a <=> $b } 0..$#samRecs;
+	my ($bamHdr, @bamRecs) = readBam(".simple_tests.sorted.bam");
+	my $samHdr = join("", map { "$_\n" } grep { /^@/ && !/^\@PG/ } @sam);
+	$samHdr =~ s/\tSO:unsorted/\tSO:coordinate/ || die "No SO:unsorted in the SAM header";
+	$bamHdr =~ s/^\@PG.*\n//mg;
+	$bamHdr eq $samHdr || die "BAM header differs from the SAM header";
+	scalar(@bamRecs) == scalar(@samRecs) ||
+		die "BAM has ".scalar(@bamRecs)." records, SAM has ".scalar(@samRecs);
+	for my $i (0..$#order) {
+		$bamRecs[$i] eq $samRecs[$order[$i]] ||
+			die "BAM record $i differs from the sorted SAM:\n$bamRecs[$i]\n$samRecs[$order[$i]]";
+	}
+	unlink(@fqs, ".simple_tests.full.sam", ".simple_tests.sorted.bam");
+}
+
+##
+# Return the FASTQ records of a file as [ name, sequence, record text ],
+# the name without /1 or /2.
+#
+sub readFastq($) {
+	my @ls = split(/\n/, slurp(shift));
+	my @recs;
+	for(my $i = 0; $i + 3 < scalar(@ls); $i += 4) {
+		my $name = substr($ls[$i], 1);
+		$name =~ s/\s.*//;
+		$name =~ s/\/[12]$//;
+		push @recs, [ $name, $ls[$i+1], join("\n", @ls[$i..$i+3])."\n" ];
+	}
+	return @recs;
+}
+
+##
+# Return the canonical 25-mers (the --filter-k default) of a sequence,
+# skipping those with an N.
+#
+sub kmers($) {
+	my $seq = shift;
+	my @ks;
+	for(my $i = 0; $i + 25 <= length($seq); $i++) {
+		my $k = substr($seq, $i, 25);
+		next if $k =~ /[^ACGT]/;
+		my $rc = reverse($k);
+		$rc =~ tr/ACGT/TGCA/;
+		push @ks, ($k lt $rc ? $k : $rc);
+	}
+	return @ks;
+}
+
+##
+# Filter the example reads, as pairs or mate 1s alone, with --filter-fa
+# given the sequences of a few example pairs.  The example reads overlap
+# a lot, so the reads expected to match, those with at least half
+# (--filter-frac) of their k-mers in the contaminants, are worked out
+# here.  Exactly those must be written, unchanged, to --filtered or
+# --filtered-conc, get no SAM records and be counted as contaminants in
+# the summaries; the other reads' records must be those of an unfiltered
+# run (with --no-temp-splicesite, as the filtered reads can't add splice
+# sites).
+#
+sub checkFilter($) {
+	my $c = shift;
+	my $paired = $c->{filter} eq "paired";
+	my @mates = ([ readFastq("$Bin/../../example/reads/reads_1.fq") ]);
+	push @mates, [ readFastq("$Bin/../../example/reads/reads_2.fq") ] if $paired;
+	my $nreads = scalar(@{$mates[0]});
+	my %contam;
+	open(my $fh, ">", ".simple_tests.contam.fa") || die;
+	for(my $i = 0; $i < $nreads; $i += 250) {
+		for my $m (0..$#mates) {
+			print $fh ">contam${i}_$m\n$mates[$m][$i][1]\n";
+			$contam{$_} = 1 for kmers($mates[$m][$i][1]);
+		}
+	}
+	close($fh);
+	my %expect;
+	my @expectRecs = map { "" } @mates;
+	for my $i (0..$nreads-1) {
+		my @ks = map { kmers($_->[$i][1]) } @mates;
+		my $nhit = scalar(grep { $contam{$_} } @ks);
+		next unless $nhit >= 0.5 * scalar(@ks);
+		$expect{$mates[0][$i][0]} = 1;
+		$expectRecs[$_] .= $mates[$_][$i][2] for 0..$#mates;
+	}
+	my $nexpect = scalar(keys %expect);
+	($nexpect > 0 && $nexpect < $nreads) || die "Expected $nexpect of $nreads reads to match";
+
+	my $reads = $paired ? $exReads : "-U $Bin/../../example/reads/reads_1.fq";
+	my $cmd = "$bowtie2 -p 1 -x $exIdx $reads $c->{args}";
+	run("$cmd -S .simple_tests.full.sam 2> /dev/null");
+	my $out = $paired ? "--filtered-conc .simple_tests.filtered.%.fq" : "--filtered .simple_tests.filtered.fq";
+	run("$cmd --filter-fa .simple_tests.contam.fa $out -S .simple_tests.filt.sam".
+	    " --summary-file .simple_tests.filt.sum 2> .simple_tests.filt.err");
+	my @filtered = $paired ? (".simple_tests.filtered.1.fq", ".simple_tests.filtered.2.fq")
+	                       : (".simple_tests.filtered.fq");
+	for my $m (0..$#mates) {
+		slurp($filtered[$m]) eq $expectRecs[$m] ||
+			die "$filtered[$m] doesn't hold exactly the $nexpect reads expected to match";
+	}
+	my (undef, $full) = samParts(".simple_tests.full.sam");
+	my (undef, $filt) = samParts(".simple_tests.filt.sam");
+	my @kept = grep { my ($n) = split(/\t/); !$expect{$n} } split(/\n/, $full);
+	$filt eq join("\n", @kept) ||
+		die "SAM records with --filter-fa aren't those of the reads that didn't match";
+	my $err = slurp(".simple_tests.filt.err");
+	$err =~ /^$nexpect reads\/pairs matched the contaminant filter and were not aligned\n/ ||
+		die "Alignment summary doesn't report $nexpect matching reads/pairs";
+	my $nleft = $nreads - $nexpect;
+	$err =~ /^$nleft reads; of these:$/m || die "Alignment summary doesn't count $nleft reads";
+	my $sum = slurp(".simple_tests.filt.sum");
+	($sum =~ /^contaminant\t$nexpect$/m && $sum =~ /^reads\t$nleft$/m) ||
+		die "--summary-file doesn't count $nexpect contaminants and $nleft reads";
+	unlink(".simple_tests.contam.fa", @filtered, ".simple_tests.full.sam", ".simple_tests.filt.sam",
+	       ".simple_tests.filt.sum", ".simple_tests.filt.err");
+}
+
+##
+# Build a large (64-bit) index of the example reference with the -l
+# hisat-build next to $bowtie2_build, and align the example reads to it
+# with the -l aligner: once read into memory, where its SA sample and
+# ftab are packed to 40 bits, and once with --mm, where they aren't.
+# Both must give the records of the small example index.
+#
+sub checkLarge($) {
+	my $c = shift;
+	my ($alignL, $buildL) = ($bowtie2, $bowtie2_build);
+	s/-s((-debug)?)$/-l$1/ for ($alignL, $buildL);
+	(-x $alignL && -x $buildL) || die "Cannot run '$alignL' and '$buildL'";
+	my $idx = ".simple_tests.large";
+	run("$buildL -q $Bin/../../example/reference/22_20-21M.fa $idx > /dev/null");
+	run("$bowtie2 -p 1 -x $exIdx $exReads $c->{args} -S .simple_tests.full.sam 2> /dev/null");
+	run("$alignL --verbose -p 1 -x $idx $exReads $c->{args} -S .simple_tests.packed.sam".
+	    " > /dev/null 2> .simple_tests.packed.err");
+	run("$alignL --mm -p 1 -x $idx $exReads $c->{args} -S .simple_tests.mm.sam 2> /dev/null");
+	slurp(".simple_tests.packed.err") =~ /packing to 40 bits/ || die "'$alignL' didn't pack the index";
+	my (undef, $full) = samParts(".simple_tests.full.sam");
+	my (undef, $packed) = samParts(".simple_tests.packed.sam");
+	my (undef, $mm) = samParts(".simple_tests.mm.sam");
+	$full ne "" || die "No SAM records from '$bowtie2'";
+	$packed eq $full || die "SAM records with the packed large index differ from the small index's";
+	$mm eq $full || die "SAM records with the large index and --mm differ from the small index's";
+	unlink(glob("$idx.*"), ".simple_tests.full.sam", ".simple_tests.packed.sam",
+	       ".simple_tests.packed.err", ".simple_tests.mm.sam");
+}
+
+##
+# Align the example reads with hisat-align, and again in batches of
+# $c->{lib} reads with libhisat_test.c, which links libhisat.so and checks
+# that it reports the same records.
+#
+sub checkLib($) {
+	my $c = shift;
+	# libhisat.so is next to the aligner unless given; build it if needed
+	if($libhisat eq "") {
+		my $bowtie2_dir = `dirname $bowtie2`;
+		chomp($bowtie2_dir);
+		$libhisat = "$bowtie2_dir/libhisat.so";
+		if(! -f $libhisat) {
+			system("make -C $bowtie2_dir libhisat.so") == 0 ||
+				die "Could not build '$libhisat'; give it with --libhisat";
+		}
+	}
+	(-f $libhisat) || die "Cannot find '$libhisat'";
+	$libhisat = File::Spec->rel2abs($libhisat);
+	run("cc -Wall -I$Bin/../.. -o .simple_tests.libhisat_test $Bin/libhisat_test.c $libhisat -lpthread");
+	run("$bowtie2 -x $exIdx $exReads $c->{args} -S .simple_tests.full.sam 2> /dev/null");
+	my @mates = ("$Bin/../../example/reads/reads_1.fq", "$Bin/../../example/reads/reads_2.fq");
+	run("./.simple_tests.libhisat_test .simple_tests.full.sam @mates $c->{lib} -x $exIdx $c->{args}");
+	unlink(".simple_tests.libhisat_test", ".simple_tests.full.sam");
+}
+
+for my $c (@runCases) {
+	print "$c->{name}\n";
+	checkShards($c) if defined($c->{shards});
+	checkResume($c) if defined($c->{resume});
+	checkBam($c) if defined($c->{bam});
+	checkBuildResume($c) if defined($c->{build});
+	checkFilter($c) if defined($c->{filter});
+	checkLarge($c) if defined($c->{large});
+	checkLib($c) if defined($c->{lib});
+}
+if($runsOnly) {
+	print "PASSED\n";
+	exit 0;
+}
+
 my $tmpfafn = ".simple_tests.pl.fa";
 my $last_ref = undef;
 for (my $ci = 0; $ci < scalar(@cases); $ci++) {
@@ -0,0 +1,400 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "aln_sink.h"
+#include "limit.h"
+#include "shard.h"
+
+using namespace std;
+
+/**
+ * The counters of a ReportingMetrics, by their names in summary files.
+ */
+static const struct {
+	const char *name;
+	uint64_t ReportingMetrics::*field;
+} summFields[] = {
+	{ "reads",              &ReportingMetrics::nread },
+	{ "contaminant",        &ReportingMetrics::ncontam },
+	{ "paired",             &ReportingMetrics::npaired },
+	{ "unpaired",           &ReportingMetrics::nunpaired },
+	{ "concord-uni",        &ReportingMetrics::nconcord_uni },
+	{ "concord-uni1",       &ReportingMetrics::nconcord_uni1 },
+	{ "concord-uni2",       &ReportingMetrics::nconcord_uni2 },
+	{ "concord-rep",        &ReportingMetrics::nconcord_rep },
+	{ "concord-0",          &ReportingMetrics::nconcord_0 },
+	{ "discord",            &ReportingMetrics::ndiscord },
+	{ "unp-0-uni",          &ReportingMetrics::nunp_0_uni },
+	{ "unp-0-uni1",         &ReportingMetrics::nunp_0_uni1 },
+	{ "unp-0-uni2",         &ReportingMetrics::nunp_0_uni2 },
+	{ "unp-0-rep",          &ReportingMetrics::nunp_0_rep },
+	{ "unp-0-0",            &ReportingMetrics::nunp_0_0 },
+	{ "unp-rep-uni",        &ReportingMetrics::nunp_rep_uni },
+	{ "unp-rep-uni1",       &ReportingMetrics::nunp_rep_uni1 },
+	{ "unp-rep-uni2",       &ReportingMetrics::nunp_rep_uni2 },
+	{ "unp-rep-rep",        &ReportingMetrics::nunp_rep_rep },
+	{ "unp-rep-0",          &ReportingMetrics::nunp_rep_0 },
+	{ "unp-uni",            &ReportingMetrics::nunp_uni },
+	{ "unp-uni1",           &ReportingMetrics::nunp_uni1 },
+	{ "unp-uni2",           &ReportingMetrics::nunp_uni2 },
+	{ "unp-rep",            &ReportingMetrics::nunp_rep },
+	{ "unp-0",              &ReportingMetrics::nunp_0 },
+	{ "sum-best1",          &ReportingMetrics::sum_best1 },
+	{ "sum-best2",          &ReportingMetrics::sum_best2 },
+	{ "sum-best",           &ReportingMetrics::sum_best }
+};
+
+static const size_t numSummFields = sizeof(summFields) / sizeof(summFields[0]);
+
+/**
+ * Reporting settings and shard of a summary file.
+ */
+struct SummarySettings {
+	SummarySettings() :
+		repThresh(MAX_SIZE_T), discord(false), mixed(false), shard(0), nshards(1), sharded(false) { }
+
+	size_t   repThresh;
+	bool     discord;
+	bool     mixed;
+	uint32_t shard;
+	uint32_t nshards;
+	bool     sharded;  // had a "shard" line
+};
+
+static void writeSummary(
+	ostream& os,
+	const ReportingMetrics& met,
+	const SummarySettings& set)
+{
+	os << "# HISAT alignment summary" << endl;
+	if(set.sharded) {
+		os << "shard\t" << set.shard << "/" << set.nshards << endl;
+	}
+	os << "rep-thresh\t" << (uint64_t)set.repThresh << endl;
+	os << "report-discord\t" << (set.discord ? 1 : 0) << endl;
+	os << "report-mixed\t" << (set.mixed ? 1 : 0) << endl;
+	for(size_t i = 0; i < numSummFields; i++) {
+		os << summFields[i].name << "\t" << met.*(summFields[i].field) << endl;
+	}
+}
+
+void writeAlnSummary(
+	const string& fn,
+	const ReportingMetrics& met,
+	size_t repThresh,
+	bool discord,
+	bool mixed,
+	uint32_t shard,
+	uint32_t nshards)
+{
+	ofstream os(fn.c_str());
+	if(!os.is_open()) {
+		cerr << "Error: could not open summary file \"" << fn.c_str() << "\" for writing" << endl;
+		throw 1;
+	}
+	SummarySettings set;
+	set.repThresh = repThresh;
+	set.discord = discord;
+	set.mixed = mixed;
+	set.shard = shard;
+	set.nshards = nshards;
+	set.sharded = nshards > 1;
+	writeSummary(os, met, set);
+	os.close();
+	if(os.fail()) {
+		cerr << "Error: could not write summary file \"" << fn.c_str() << "\"" << endl;
+		throw 1;
+	}
+}
+
+string alnCountersToString(const ReportingMetrics& met) {
+	ostringstream os;
+	for(size_t i = 0; i < numSummFields; i++) {
+		if(i > 0) os << ' ';
+		os << summFields[i].name << '=' << met.*(summFields[i].field);
+	}
+	return os.str();
+}
+
+bool alnCountersFromString(const string& s, ReportingMetrics& met) {
+	istringstream is(s);
+	string tok;
+	while(is >> tok) {
+		size_t eq = tok.find('=');
+		if(eq == string::npos) return false;
+		size_t i = 0;
+		for(; i < numSummFields && tok.compare(0, eq, summFields[i].name) != 0; i++);
+		uint64_t v = 0;
+		istringstream vs(tok.substr(eq + 1));
+		if(i == numSummFields || (vs >> v).fail()) return false;
+		met.*(summFields[i].field) += v;
+	}
+	return true;
+}
+
+/**
+ * Read summary file 'fn', adding its counters to 'met'.  Throws on error.
+ */
+static void readSummary(
+	const string& fn,
+	ReportingMetrics& met,
+	SummarySettings& set)
+{
+	ifstream is(fn.c_str());
+	if(!is.is_open()) {
+		cerr << "Error: could not open summary file \"" << fn.c_str() << "\"" << endl;
+		throw 1;
+	}
+	string line;
+	while(getline(is, line)) {
+		if(line.empty() || line[0] == '#') continue;
+		size_t tab = line.find('\t');
+		string name = line.substr(0, tab);
+		string val = tab == string::npos ? string() : line.substr(tab + 1);
+		istringstream vs(val);
+		bool ok = true;
+		if(name == "shard") {
+			char slash = 0;
+			ok = !(vs >> set.shard >> slash >> set.nshards).fail() && slash == '/' &&
+			     set.nshards > 0 && set.shard < set.nshards;
+			set.sharded = true;
+		} else if(name == "rep-thresh") {
+			uint64_t t = 0;
+			ok = !(vs >> t).fail();
+			set.repThresh = (size_t)t;
+		} else if(name == "report-discord" || name == "report-mixed") {
+			int b = 0;
+			ok = !(vs >> b).fail();
+			(name == "report-discord" ? set.discord : set.mixed) = (b != 0);
+		} else {
+			size_t i = 0;
+			for(; i < numSummFields && name != summFields[i].name; i++);
+			uint64_t v = 0;
+			ok = i < numSummFields && !(vs >> v).fail();
+			if(ok) met.*(summFields[i].field) += v;
+		}
+		if(!ok) {
+			cerr << "Error: bad line in summary file \"" << fn.c_str() << "\": " << line.c_str() << endl;
+			throw 1;
+		}
+	}
+}
+
+static void mergeSummaries(
+	const EList<string>& fns,
+	const string& outfn,
+	bool quiet)
+{
+	ReportingMetrics met;
+	SummarySettings first;
+	EList<bool> seen(MISC_CAT);
+	for(size_t i = 0; i < fns.size(); i++) {
+		SummarySettings set;
+		readSummary(fns[i], met, set);
+		if(i == 0) {
+			first = set;
+			seen.resize(set.nshards);
+			seen.fill(false);
+		} else if(set.sharded != first.sharded || set.nshards != first.nshards) {
+			cerr << "Error: \"" << fns[i].c_str() << "\" is from a run with a different --shard count than \""
+			     << fns[0].c_str() << "\"" << endl;
+			throw 1;
+		} else if(set.repThresh != first.repThresh || set.discord != first.discord || set.mixed != first.mixed) {
+			cerr << "Warning: \"" << fns[i].c_str() << "\" is from a run with different reporting options than \""
+			     << fns[0].c_str() << "\"" << endl;
+		}
+		if(set.sharded) {
+			if(seen[set.shard]) {
+				cerr << "Error: shard " << set.shard << "/" << set.nshards << " is given more than once" << endl;
+				throw 1;
+			}
+			seen[set.shard] = true;
+		}
+	}
+	if(first.sharded) {
+		for(size_t i = 0; i < seen.size(); i++) {
+			if(!seen[i]) {
+				cerr << "Error: the summary of shard " << i << "/" << first.nshards << " is missing" << endl;
+				throw 1;
+			}
+		}
+	}
+	first.sharded = false;
+	if(!outfn.empty()) {
+		ofstream os(outfn.c_str());
+		if(!os.is_open()) {
+			cerr << "Error: could not open summary file \"" << outfn.c_str() << "\" for writing" << endl;
+			throw 1;
+		}
+		writeSummary(os, met, first);
+	}
+	if(!quiet) {
+		AlnSink<TIndexOffU>::printAlSumm(met, first.repThresh, first.discord, first.mixed, false);
+	}
+}
+
+/**
+ * Read the header lines at the start of 'in' into 'hdr'.
+ */
+static void readSamHeader(istream& in, EList<string>& hdr) {
+	string line;
+	while(in.peek() == '@' && getline(in, line)) {
+		hdr.push_back(line);
+	}
+}
+
+static void mergeSams(const EList<string>& fns, const string& outfn) {
+	ofstream fout;
+	if(!outfn.empty()) {
+		fout.open(outfn.c_str(), ios::binary);
+		if(!fout.is_open()) {
+			cerr << "Error: could not open \"" << outfn.c_str() << "\" for writing" << endl;
+			throw 1;
+		}
+	}
+	ostream& out = outfn.empty() ? cout : fout;
+	EList<string> sqs(MISC_CAT);
+	for(size_t i = 0; i < fns.size(); i++) {
+		ifstream in(fns[i].c_str(), ios::binary);
+		if(!in.is_open()) {
+			cerr << "Error: could not open SAM file \"" << fns[i].c_str() << "\"" << endl;
+			throw 1;
+		}
+		if(in.peek() == 0x1f) {
+			cerr << "Error: \"" << fns[i].c_str() << "\" is compressed (BAM?); only SAM shards can be merged"
+			     << endl;
+			throw 1;
+		}
+		EList<string> hdr(MISC_CAT), mysqs(MISC_CAT);
+		readSamHeader(in, hdr);
+		for(size_t j = 0; j < hdr.size(); j++) {
+			if(hdr[j].compare(0, 3, "@SQ") == 0) {
+				mysqs.push_back(hdr[j]);
+			}
+			if(i == 0) {
+				out << hdr[j] << '\n';
+			}
+		}
+		if(i == 0) {
+			sqs = mysqs;
+		} else if(!mysqs.empty() && !(mysqs == sqs)) {
+			cerr << "Error: \"" << fns[i].c_str() << "\" was aligned against different references than \""
+			     << fns[0].c_str() << "\"" << endl;
+			throw 1;
+		}
+		if(in.peek() != EOF) {
+			out << in.rdbuf();
+		}
+	}
+	out.flush();
+	if(out.fail()) {
+		cerr << "Error: could not write merged SAM output" << endl;
+		throw 1;
+	}
+}
+
+/**
+ * A splice site as listed by --novel-splicesite-outfile.
+ */
+struct ListedSpliceSite {
+	uint64_t left;
+	uint64_t right;
+	char     strand;
+
+	bool operator<(const ListedSpliceSite& o) const {
+		return left != o.left ? left < o.left : right < o.right;
+	}
+};
+
+static void mergeSpliceSites(const EList<string>& fns, const string& outfn) {
+	if(outfn.empty()) {
+		cerr << "Error: --merge-splicesites needs --novel-splicesite-outfile for the merged list" << endl;
+		throw 1;
+	}
+	// References in the order the files list them in
+	EList<string> refs(MISC_CAT);
+	EList<EList<ListedSpliceSite> > sites(MISC_CAT);
+	for(size_t i = 0; i < fns.size(); i++) {
+		ifstream in(fns[i].c_str());
+		if(!in.is_open()) {
+			cerr << "Error: could not open splice site file \"" << fns[i].c_str() << "\"" << endl;
+			throw 1;
+		}
+		size_t prev = refs.size();
+		string line;
+		while(getline(in, line)) {
+			if(line.empty()) continue;
+			istringstream ls(line);
+			string ref;
+			ListedSpliceSite ss;
+			if(!(ls >> ref >> ss.left >> ss.right >> ss.strand)) {
+				cerr << "Error: bad line in splice site file \"" << fns[i].c_str() << "\": "
+				     << line.c_str() << endl;
+				throw 1;
+			}
+			size_t r = 0;
+			for(; r < refs.size() && refs[r] != ref; r++);
+			if(r == refs.size()) {
+				// New reference: put it after the one this file listed last
+				r = (prev < refs.size()) ? prev + 1 : refs.size();
+				refs.insert(ref, r);
+				sites.insert(EList<ListedSpliceSite>(MISC_CAT), r);
+			}
+			prev = r;
+			sites[r].push_back(ss);
+		}
+	}
+	ofstream out(outfn.c_str());
+	if(!out.is_open()) {
+		cerr << "Error: could not open \"" << outfn.c_str() << "\" for writing" << endl;
+		throw 1;
+	}
+	for(size_t r = 0; r < refs.size(); r++) {
+		EList<ListedSpliceSite>& rs = sites[r];
+		rs.sort();
+		for(size_t j = 0; j < rs.size(); j++) {
+			if(j > 0 && rs[j].left == rs[j-1].left && rs[j].right == rs[j-1].right) continue;
+			out << refs[r] << "\t" << rs[j].left << "\t" << rs[j].right << "\t" << rs[j].strand << endl;
+		}
+	}
+}
+
+void mergeShards(
+	const EList<string>& sams,
+	const EList<string>& summaries,
+	const EList<string>& spliceSites,
+	const string& samOut,
+	const string& summaryOut,
+	const string& spliceSiteOut,
+	bool quiet)
+{
+	if(!sams.empty()) {
+		mergeSams(sams, samOut);
+	}
+	if(!spliceSites.empty()) {
+		mergeSpliceSites(spliceSites, spliceSiteOut);
+	}
+	if(!summaries.empty()) {
+		mergeSummaries(summaries, summaryOut, quiet);
+	}
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include <stdint.h>
+#include <string>
+#include "ds.h"
+
+struct ReportingMetrics;
+
+/**
+ * Support for aligning one input in several independent runs, e.g. on
+ * several nodes, with --shard <i>/<N>, and for combining what the runs
+ * wrote with --merge-shards.
+ *
+ * Each run writes its SAM output, and optionally its alignment summary
+ * (--summary-file) and novel splice sites (--novel-splicesite-outfile).
+ * The summary file is a machine-readable version of the summary printed
+ * at the end of a run: one "name<TAB>value" line per counter, plus the
+ * shard and the reporting settings that printing it depends on.
+ */
+
+/**
+ * Write the counters in 'met' to summary file 'fn'.  'nshards' is 1 for
+ * a run that was not sharded.  Throws on error.
+ */
+void writeAlnSummary(
+	const std::string& fn,
+	const ReportingMetrics& met,
+	size_t repThresh,
+	bool discord,
+	bool mixed,
+	uint32_t shard,
+	uint32_t nshards);
+
+/**
+ * Return the counters in 'met' as one line of space-separated
+ * "name=value" pairs, with the names used in summary files; for
+ * --checkpoint.
+ */
+std::string alnCountersToString(const ReportingMetrics& met);
+
+/**
+ * Add the counters in a line written by alnCountersToString() to 'met'.
+ * Returns false if the line is malformed.
+ */
+bool alnCountersFromString(const std::string& s, ReportingMetrics& met);
+
+/**
+ * Combine the outputs of the shards of a run:
+ *
+ *  - concatenate the SAM files in 'sams' into 'samOut' (stdout if empty),
+ *    keeping the header of the first one; the others must have been
+ *    aligned against the same references;
+ *  - add up the summary files in 'summaries', print the total the way a
+ *    single run would (unless 'quiet') and write it to 'summaryOut', if
+ *    given; if the summaries are from --shard runs, every shard must be
+ *    there exactly once;
+ *  - write the union of the splice sites in 'spliceSites' to
+ *    'spliceSiteOut'.
+ *
+ * Any of the lists may be empty.  Throws on error.
+ */
+void mergeShards(
+	const EList<std::string>& sams,
+	const EList<std::string>& summaries,
+	const EList<std::string>& spliceSites,
+	const std::string& samOut,
+	const std::string& summaryOut,
+	const std::string& spliceSiteOut,
+	bool quiet);
+
+#endif /*ndef SHARD_H_*/
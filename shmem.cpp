@@ -21,29 +21,293 @@
 
 #include <iostream>
 #include <string>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
-#include <sys/shm.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <map>
+#include "threading.h"
 #include "shmem.h"
 
 using namespace std;
 
 /**
- * Notify other users of a shared-memory chunk that the leader has
- * finished initializing it.
+ * Lives in the first page of every shared-memory object.
  */
-void notifySharedMem(void *mem, size_t len) {
-	((volatile uint32_t*)((char*)mem + len))[0] = SHMEM_INIT;
+struct SharedFileHdr {
+	volatile uint32_t state;  // SHMEM_INIT once the file has been read in
+	uint64_t          len;    // size of the file
+	char              name[64];
+};
+
+static size_t hdrSize() {
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * How long to wait for another process to finish loading a file before
+ * giving up.
+ */
+static const int SHMEM_WAIT_SECS = 30 * 60;
+
+/**
+ * Name the object after the identity of the file: its device, inode, size
+ * and modification time, hashed with 64-bit FNV-1a.  The user is part of
+ * the name too, since objects are only accessible to their owner.
+ */
+static string sharedFileName(const struct stat& st) {
+	uint64_t id[] = {
+		(uint64_t)st.st_dev, (uint64_t)st.st_ino,
+		(uint64_t)st.st_size, (uint64_t)st.st_mtime,
+		(uint64_t)getuid()
+	};
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const uint8_t *b = (const uint8_t*)id;
+	for(size_t i = 0; i < sizeof(id); i++) {
+		h = (h ^ b[i]) * 0x100000001b3ULL;
+	}
+	char buf[32];
+	snprintf(buf, sizeof(buf), "/hisat.%016llx", (unsigned long long)h);
+	return string(buf);
+}
+
+/**
+ * Return the directory the lock files go in: $XDG_RUNTIME_DIR, or else
+ * /tmp/hisat-<uid>, created if need be.  Either must be a directory owned
+ * by the user that nobody else can write to, so that other users can't
+ * plant files or symlinks in it.  Throws if it isn't.
+ */
+static string lockDir() {
+	uid_t uid = getuid();
+	const char *xdg = getenv("XDG_RUNTIME_DIR");
+	string dir;
+	if(xdg != NULL && xdg[0] == '/') {
+		dir = xdg;
+	} else {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "/tmp/hisat-%lu", (unsigned long)uid);
+		dir = buf;
+		if(mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+			cerr << "Error: Could not create lock directory " << dir.c_str() << ": " << strerror(errno) << endl;
+			throw 1;
+		}
+	}
+	struct stat st;
+	if(lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+	   st.st_uid != uid || (st.st_mode & 022) != 0)
+	{
+		cerr << "Error: Lock directory " << dir.c_str() << " is missing, not a directory, "
+		     << "not owned by the user or writable by others" << endl;
+		throw 1;
+	}
+	return dir;
+}
+
+/**
+ * Open (creating if need be) the lock file <lockDir()><name>.<suffix>.
+ * Throws on error, or if it isn't a regular file owned by the user.
+ */
+static int openLockFile(const string& name, const char *suffix) {
+	string fn = lockDir() + name + "." + suffix;
+	int fd = open(fn.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if(fd < 0) {
+		cerr << "Error: Could not open lock file " << fn.c_str() << ": " << strerror(errno) << endl;
+		throw 1;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid()) {
+		cerr << "Error: Lock file " << fn.c_str() << " is not a regular file owned by the user" << endl;
+		close(fd);
+		throw 1;
+	}
+	return fd;
 }
 
 /**
- * Wait until the leader of a shared-memory chunk has finished
- * initializing it.
+ * Take an exclusive lock on fd, waiting at most SHMEM_WAIT_SECS for
+ * whoever holds it.  Return false if it couldn't be had in that time.
  */
-void waitSharedMem(void *mem, size_t len) {
-	while(((volatile uint32_t*)((char*)mem + len))[0] != SHMEM_INIT) {
-		sleep(1);
+static bool lockWithTimeout(int fd, const string& fname, bool verbose) {
+	for(int i = 0; i < SHMEM_WAIT_SECS * 10; i++) {
+		if(flock(fd, LOCK_EX | LOCK_NB) == 0) return true;
+		if(errno != EWOULDBLOCK && errno != EINTR) return false;
+		if(i == 0 && verbose) {
+			cerr << "  Waiting for another process to load " << fname.c_str()
+			     << " into shared memory" << endl;
+		}
+		usleep(100000);
+	}
+	return false;
+}
+
+/**
+ * Read all of 'fname' into 'dst'.  Return false on error.
+ */
+static bool readWhole(const string& fname, char *dst, size_t len) {
+	FILE *f = fopen(fname.c_str(), "rb");
+	if(f == NULL) return false;
+	size_t done = 0;
+	while(done < len) {
+		size_t r = fread(dst + done, 1, len - done, f);
+		if(r == 0) break;
+		done += r;
+	}
+	fclose(f);
+	return done == len;
+}
+
+/**
+ * The ".users" lock file of every object this process has attached, by
+ * the address of the copy.
+ */
+static map<char*, int> usersFds;
+static MUTEX_T usersFdsMutex;
+
+char* attachSharedFile(const string& fname, size_t& len, bool verbose) {
+	struct stat st;
+	if(stat(fname.c_str(), &st) != 0) {
+		cerr << "Error: Could not stat index file " << fname.c_str() << " prior to loading it into shared memory" << endl;
+		throw 1;
+	}
+	len = (size_t)st.st_size;
+	string name = sharedFileName(st);
+	size_t hsz = hdrSize();
+	size_t segLen = hsz + len;
+	// Creating, attaching and removing the object all happen under an
+	// exclusive lock on ".lock"; every process using the object holds a
+	// shared lock on ".users".  The kernel drops both when a process dies,
+	// so an object nobody holds ".users" for is left over from processes
+	// that are gone, however they ended.
+	int lockFd = openLockFile(name, "lock");
+	int usersFd = -1;
+	if(!lockWithTimeout(lockFd, fname, verbose)) {
+		cerr << "Error: Timed out waiting for another process to load " << fname.c_str()
+		     << " into shared memory" << endl;
+		close(lockFd);
+		throw 1;
+	}
+	char *base = (char*)MAP_FAILED;
+	try {
+		usersFd = openLockFile(name, "users");
+		bool inUse = flock(usersFd, LOCK_EX | LOCK_NB) != 0;
+		int fd = -1;
+		if(inUse) {
+			fd = shm_open(name.c_str(), O_RDWR, 0);
+		} else {
+			// Replace anything left behind
+			shm_unlink(name.c_str());
+			fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		}
+		if(fd < 0) {
+			cerr << "Error: shm_open() failed for " << name.c_str() << " (" << fname.c_str()
+			     << "): " << strerror(errno) << endl;
+			throw 1;
+		}
+		struct stat fst;
+		if(fstat(fd, &fst) != 0 || fst.st_uid != getuid()) {
+			cerr << "Error: Shared-memory object " << name.c_str() << " for " << fname.c_str()
+			     << " is not owned by the user" << endl;
+			close(fd);
+			throw 1;
+		}
+		if(!inUse && ftruncate(fd, (off_t)segLen) != 0) {
+			cerr << "Error: Could not make a shared-memory object of " << segLen
+			     << " bytes for " << fname.c_str() << ": " << strerror(errno) << endl;
+			close(fd);
+			shm_unlink(name.c_str());
+			throw 1;
+		}
+		base = (char*)mmap(NULL, segLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if(base == (char*)MAP_FAILED) {
+			cerr << "Error: Could not map shared-memory object " << name.c_str() << " for "
+			     << fname.c_str() << ": " << strerror(errno) << endl;
+			if(!inUse) shm_unlink(name.c_str());
+			throw 1;
+		}
+		SharedFileHdr *hdr = (SharedFileHdr*)base;
+		if(!inUse) {
+			if(verbose) {
+				cerr << "  Reading " << len << " bytes of " << fname.c_str()
+				     << " into shared memory " << name.c_str() << endl;
+			}
+			hdr->len = len;
+			strncpy(hdr->name, name.c_str(), sizeof(hdr->name) - 1);
+			if(!readWhole(fname, base + hsz, len)) {
+				cerr << "Error: Could not read " << fname.c_str() << " into shared memory" << endl;
+				shm_unlink(name.c_str());
+				throw 1;
+			}
+			hdr->state = SHMEM_INIT;
+		} else {
+			if(hdr->state != SHMEM_INIT || hdr->len != len) {
+				cerr << "Error: Shared-memory object " << name.c_str() << " for " << fname.c_str()
+				     << " is in use but incomplete" << endl;
+				throw 1;
+			}
+			if(verbose) {
+				cerr << "  Mapped " << fname.c_str() << " from shared memory " << name.c_str() << endl;
+			}
+		}
+		// A shared lock from here on marks the object as in use
+		if(flock(usersFd, LOCK_SH) != 0) {
+			cerr << "Error: Could not lock " << name.c_str() << ".users: " << strerror(errno) << endl;
+			if(!inUse) shm_unlink(name.c_str());
+			throw 1;
+		}
+	} catch(...) {
+		if(base != (char*)MAP_FAILED) munmap(base, segLen);
+		if(usersFd >= 0) close(usersFd);
+		close(lockFd); // also unlocks it
+		throw;
+	}
+	close(lockFd);
+	// Nothing but the loader ever writes to it
+	if(len > 0) {
+		mprotect(base + hsz, len, PROT_READ);
+	}
+	{
+		ThreadSafe _ts(&usersFdsMutex);
+		usersFds[base + hsz] = usersFd;
+	}
+	return base + hsz;
+}
+
+void detachSharedFile(char* data) {
+	if(data == NULL) return;
+	char *base = data - hdrSize();
+	SharedFileHdr *hdr = (SharedFileHdr*)base;
+	size_t segLen = hdrSize() + (size_t)hdr->len;
+	string name = hdr->name;
+	int usersFd = -1;
+	{
+		ThreadSafe _ts(&usersFdsMutex);
+		map<char*, int>::iterator it = usersFds.find(data);
+		if(it == usersFds.end()) return;
+		usersFd = it->second;
+		usersFds.erase(it);
+	}
+	munmap(base, segLen);
+	int lockFd = -1;
+	try {
+		lockFd = openLockFile(name, "lock");
+	} catch(int) {
+		// Leave the object for the next process to find unused
+		close(usersFd);
+		return;
+	}
+	flock(lockFd, LOCK_EX);
+	// The last user removes it; nobody can attach while we hold ".lock"
+	if(flock(usersFd, LOCK_EX | LOCK_NB) == 0) {
+		shm_unlink(name.c_str());
 	}
+	close(usersFd);
+	close(lockFd);
 }
 
 #endif
@@ -22,139 +22,59 @@
 
 #ifdef BOWTIE_SHARED_MEM
 
+#ifndef BOWTIE_MM
+#error "BOWTIE_SHARED_MEM needs BOWTIE_MM"
+#endif
+
 #include <string>
-#include <sys/shm.h>
-#include <unistd.h>
-#include <sys/shm.h>
-#include <errno.h>
 #include <stdint.h>
-#include <stdexcept>
-#include "str_util.h"
-#include "btypes.h"
-
-extern void notifySharedMem(void *mem, size_t len);
 
-extern void waitSharedMem(void *mem, size_t len);
-
-#define ALLOC_SHARED_U allocSharedMem<TIndexOffU>
-#define ALLOC_SHARED_U8 allocSharedMem<uint8_t>
-#define ALLOC_SHARED_U32 allocSharedMem<uint32_t>
-#define FREE_SHARED shmdt
-#define NOTIFY_SHARED notifySharedMem
-#define WAIT_SHARED waitSharedMem
+/**
+ * Index files held in POSIX shared memory (shm_open), for --shmem.  Every
+ * index file the aligner can memory-map -- .1/.2, .5/.6 and .3/.4 --
+ * gets one shared-memory object holding a verbatim copy of
+ * the file after a one-page header, so that the memory-mapped code paths
+ * can use the copy exactly as they would use an mmap of the file.
+ *
+ * The object is named after the file's device, inode, size and mtime and
+ * the user, so all of a user's processes on a host that open the same file
+ * find the same object, and rebuilding the index gives it a new one.
+ * Objects are created with mode 0600; other users get their own.
+ *
+ * Liveness is tracked with flock(2) on two lock files named after the
+ * object, in $XDG_RUNTIME_DIR or else a private /tmp/hisat-<uid>
+ * directory, which the kernel releases however a process ends.  Every process
+ * using an object holds a shared lock on its ".users" file, and creating,
+ * attaching and removing an object happen under an exclusive lock on its
+ * ".lock" file.  The first process to ask for an object, or the first one
+ * after everyone using it has gone, (re)creates it and reads the file in
+ * while the others wait on ".lock" (for up to 30 minutes); the last one to let go removes it.  If
+ * a process is killed, the object stays until the next process to use the
+ * index replaces it.  The lock files are left in place.
+ */
 
-#define SHMEM_UNINIT  0xafba4242
-#define SHMEM_INIT    0xffaa6161
+/**
+ * Map the shared copy of 'fname', creating and filling it if need be,
+ * and take a reference to it.  Return a pointer to the copy of the first
+ * byte of the file; it is page-aligned and read-only.  Set 'len' to the
+ * size of the file.  Throws on error.
+ */
+extern char* attachSharedFile(const std::string& fname, size_t& len, bool verbose);
 
 /**
- * Tries to allocate a shared-memory chunk for a given file of a given size.
+ * Drop the reference taken by attachSharedFile() and unmap the copy.
  */
-template <typename T>
-bool allocSharedMem(std::string fname,
-                    size_t len,
-                    T ** dst,
-                    const char *memName,
-                    bool verbose)
-{
-	using namespace std;
-	int shmid = -1;
-	// Calculate key given string
-	key_t key = (key_t)hash_string(fname);
-	shmid_ds ds;
-	int ret;
-	// Reserve 4 bytes at the end for silly synchronization
-	size_t shmemLen = len + 4;
-	if(verbose) {
-		cerr << "Reading " << len << "+4 bytes into shared memory for " << memName << endl;
-	}
-	T *ptr = NULL;
-	while(true) {
-		// Create the shrared-memory block
-		if((shmid = shmget(key, shmemLen, IPC_CREAT | 0666)) < 0) {
-			if(errno == ENOMEM) {
-				cerr << "Out of memory allocating shared area " << memName << endl;
-			} else if(errno == EACCES) {
-				cerr << "EACCES" << endl;
-			} else if(errno == EEXIST) {
-				cerr << "EEXIST" << endl;
-			} else if(errno == EINVAL) {
-				cerr << "Warning: shared-memory chunk's segment size doesn't match expected size (" << (shmemLen) << ")" << endl
-					 << "Deleteing old shared memory block and trying again." << endl;
-				shmid = shmget(key, 0, 0);
-				if((ret = shmctl(shmid, IPC_RMID, &ds)) < 0) {
-					cerr << "shmctl returned " << ret
-						 << " for IPC_RMID, errno is " << errno
-						 << ", shmid is " << shmid << endl;
-					throw 1;
-				} else {
-					cerr << "Deleted shared mem chunk with shmid " << shmid << endl;
-				}
-				continue;
-			} else if(errno == ENOENT) {
-				cerr << "ENOENT" << endl;
-			} else if(errno == ENOSPC) {
-				cerr << "ENOSPC" << endl;
-			} else {
-				cerr << "shmget returned " << shmid << " for and errno is " << errno << endl;
-			}
-			throw 1;
-		}
-		ptr = (T*)shmat(shmid, 0, 0);
-		if(ptr == (void*)-1) {
-			cerr << "Failed to attach " << memName << " to shared memory with shmat()." << endl;
-			throw 1;
-		}
-		if(ptr == NULL) {
-			cerr << memName << " pointer returned by shmat() was NULL." << endl;
-			throw 1;
-		}
-		// Did I create it, or did I just attach to one created by
-		// another process?
-		if((ret = shmctl(shmid, IPC_STAT, &ds)) < 0) {
-			cerr << "shmctl returned " << ret << " for IPC_STAT and errno is " << errno << endl;
-			throw 1;
-		}
-		if(ds.shm_segsz != shmemLen) {
-			cerr << "Warning: shared-memory chunk's segment size (" << ds.shm_segsz
-				 << ") doesn't match expected size (" << shmemLen << ")" << endl
-				 << "Deleteing old shared memory block and trying again." << endl;
-			if((ret = shmctl(shmid, IPC_RMID, &ds)) < 0) {
-				cerr << "shmctl returned " << ret << " for IPC_RMID and errno is " << errno << endl;
-				throw 1;
-			}
-		} else {
-			break;
-		}
-	} // while(true)
-	*dst = ptr;
-	bool initid = (((volatile uint32_t*)((char*)ptr + len))[0] == SHMEM_INIT);
-	if(ds.shm_cpid == getpid() && !initid) {
-		if(verbose) {
-			cerr << "  I (pid = " << getpid() << ") created the "
-			     << "shared memory for " << memName << endl;
-		}
-		// Set this value just off the end of the chunk to
-		// indicate that the data hasn't been read yet.
-		((volatile uint32_t*)((char*)ptr + len))[0] = SHMEM_UNINIT;
-		return true;
-	} else {
-		if(verbose) {
-			cerr << "  I (pid = " << getpid()
-			     << ") did not create the shared memory for "
-			     << memName << ".  Pid " << ds.shm_cpid << " did." << endl;
-		}
-		return false;
-	}
-}
+extern void detachSharedFile(char* data);
+
+#define ATTACH_SHARED attachSharedFile
+#define DETACH_SHARED detachSharedFile
+
+#define SHMEM_INIT    0xffaa6161
 
 #else
 
-#define ALLOC_SHARED_U(...) 0
-#define ALLOC_SHARED_U8(...) 0
-#define ALLOC_SHARED_U32(...) 0
-#define FREE_SHARED(...)
-#define NOTIFY_SHARED(...)
-#define WAIT_SHARED(...)
+#define ATTACH_SHARED(...) NULL
+#define DETACH_SHARED(...)
 
 #endif /*BOWTIE_SHARED_MEM*/
 
@@ -354,6 +354,7 @@ public:
 std::ostream& operator<<(std::ostream& out, const SpliceSite& c);
 
 class AlnRes;
+class SpliceTrack;
 
 class SpliceSiteDB {
 public:
@@ -377,6 +378,24 @@ public:
                            int64_t donor_seq,
                            int64_t acceptor_seq);
     
+#if !defined(NEW_PROB_MODEL)
+    /**
+     * Log-odds scores of a donor or an acceptor site alone;
+     * probscore(d, a) == combinescore(donorscore(d), acceptorscore(a))
+     */
+    static float donorscore(int64_t donor_seq);
+    static float acceptorscore(int64_t acceptor_seq);
+    static float combinescore(
+                              float donor_score,
+                              float acceptor_score);
+#endif
+    
+    /**
+     * Precomputed splice signals of the reference (<idx>.ss.bt2), if any
+     */
+    const SpliceTrack* track() const { return _track; }
+    void setTrack(const SpliceTrack* track) { _track = track; }
+    
     size_t size(uint64_t ref) const;
     bool empty(uint64_t ref) const;
     
@@ -390,8 +409,20 @@ public:
     void getRightSpliceSites(uint32_t ref, uint32_t right, uint32_t range, EList<SpliceSite>& spliceSites) const;
     bool hasSpliceSites(uint32_t ref, uint32_t left1, uint32_t right1, uint32_t left2, uint32_t right2, bool includeNovel = false) const;
     
-    void print(ofstream& out);
-    void read(ifstream& in, bool known = false);
+    void print(ostream& out);
+    void read(istream& in, bool known = false);
+    
+    /**
+     * Write every site with all of its fields, unlike print(), so that
+     * load() can restore the DB as it is now; for --checkpoint.
+     */
+    void save(ostream& out) const;
+    
+    /**
+     * Restore the sites written by save().  Sites already in the DB, e.g.
+     * from --known-splicesite-infile, take on the saved fields.
+     */
+    void load(istream& in);
     
 private:
     void getSpliceSites_recur(
@@ -410,7 +441,7 @@ private:
     
     void print_recur(
                      const RedBlackNode<SpliceSitePos, uint32_t> *node,
-                     ofstream& out,
+                     ostream& out,
                      const uint32_t numreads_cutoff,
                      const uint32_t numreads_cutoff2,
                      EList<SpliceSite>& ss_list);
@@ -418,7 +449,7 @@ private:
     Pool& pool(uint64_t ref);
     
     void print_impl(
-                    ofstream& out,
+                    ostream& out,
                     EList<SpliceSite>& ss_list,
                     const SpliceSite* ss = NULL);
     
@@ -445,6 +476,8 @@ private:
     BTDnaString                         acceptorstr;
     
     bool                                _empty;
+    
+    const SpliceTrack*                  _track;
 };
 
 #endif /*ifndef SPLICE_SITE_H_*/
@@ -0,0 +1,194 @@
+/*
+ * Copyright 2013, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of Bowtie 2.
+ *
+ * Bowtie 2 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bowtie 2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bowtie 2.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include "splice_site.h"
+
+#if defined(NEW_PROB_MODEL)
+
+#include "splice_site_mem.h"
+
+#else
+
+float donor_prob[4][donor_len] = {
+    {0.340f, 0.604f, 0.092f, 0.001f, 0.001f, 0.526f, 0.713f, 0.071f, 0.160f},
+    {0.363f, 0.129f, 0.033f, 0.001f, 0.001f, 0.028f, 0.076f, 0.055f, 0.165f},
+    {0.183f, 0.125f, 0.803f, 1.000f, 0.001f, 0.419f, 0.118f, 0.814f, 0.209f},
+    {0.114f, 0.142f, 0.073f, 0.001f, 1.000f, 0.025f, 0.093f, 0.059f, 0.462f}
+};
+
+float acceptor_prob[4][acceptor_len] = {
+    {0.090f, 0.084f, 0.075f, 0.068f, 0.076f, 0.080f, 0.097f, 0.092f, 0.076f, 0.078f, 0.237f, 0.042f, 1.000f, 0.001f, 0.239f},
+    {0.310f, 0.310f, 0.307f, 0.293f, 0.326f, 0.330f, 0.373f, 0.385f, 0.410f, 0.352f, 0.309f, 0.708f, 0.001f, 0.001f, 0.138f},
+    {0.125f, 0.115f, 0.106f, 0.104f, 0.110f, 0.113f, 0.113f, 0.085f, 0.066f, 0.064f, 0.212f, 0.003f, 0.001f, 1.000f, 0.520f},
+    {0.463f, 0.440f, 0.470f, 0.494f, 0.471f, 0.463f, 0.408f, 0.429f, 0.445f, 0.504f, 0.240f, 0.246f, 0.001f, 0.001f, 0.104f}
+};
+
+float donor_prob_sum[1 << (donor_len << 1)];
+float acceptor_prob_sum1[1 << (acceptor_len1 << 1)];
+float acceptor_prob_sum2[1 << (acceptor_len2 << 1)];
+
+#endif
+
+void init_junction_prob()
+{
+#if !defined(NEW_PROB_MODEL)
+    // The tables are converted in place, so only do it once
+    static bool inited = false;
+    if(inited) return;
+    inited = true;
+    for(size_t i = 0; i < donor_len; i++) {
+        ASSERT_ONLY(float sum = 0.0f);
+        for(size_t j = 0; j < 4; j++) {
+            float prob = donor_prob[j][i];
+            assert_gt(prob, 0.0f);
+            ASSERT_ONLY(sum += prob);
+            donor_prob[j][i] = log(prob / background_prob[j]);
+        }
+        assert_range(0.9f, 1.05f, sum);
+    }
+    for(size_t i = 0; i < acceptor_len; i++) {
+        ASSERT_ONLY(float sum = 0.0f);
+        for(size_t j = 0; j < 4; j++) {
+            float prob = acceptor_prob[j][i];
+            assert_gt(prob, 0.0f);
+            ASSERT_ONLY(sum += prob);
+            acceptor_prob[j][i] = log(prob / background_prob[j]);
+        }
+        assert_range(0.9f, 1.05f, sum);
+    }
+    
+    const size_t donor_elms = 1 << (donor_len << 1);
+    for(size_t i = 0; i < donor_elms; i++) {
+        float sum = 0.0f;
+        for(size_t j = 0; j < donor_len; j++) {
+            int base = (i >> (j << 1)) & 0x3;
+            sum += donor_prob[base][donor_len - j - 1];
+        }
+        donor_prob_sum[i] = exp(-sum);
+    }
+    
+    const size_t acceptor_elms1 = 1 << (acceptor_len1 << 1);
+    for(size_t i = 0; i < acceptor_elms1; i++) {
+        float sum = 0.0f;
+        for(size_t j = 0; j < acceptor_len1; j++) {
+            int base = (i >> (j << 1)) & 0x3;
+            sum += acceptor_prob[base][acceptor_len1 - j - 1];
+        }
+        acceptor_prob_sum1[i] = exp(-sum);
+    }
+    
+    const size_t acceptor_elms2 = 1 << (acceptor_len2 << 1);
+    for(size_t i = 0; i < acceptor_elms2; i++) {
+        float sum = 0.0f;
+        for(size_t j = 0; j < acceptor_len2; j++) {
+            int base = (i >> (j << 1)) & 0x3;
+            sum += acceptor_prob[base][acceptor_len - j - 1];
+        }
+        acceptor_prob_sum2[i] = exp(-sum);
+    }
+#endif
+}
+
+float SpliceSiteDB::probscore(
+                              int64_t donor_seq,
+                              int64_t acceptor_seq)
+{
+    float probscore = 0.0f;
+#if defined(NEW_PROB_MODEL)
+    float donor_probscore = 0.0f;
+    assert_leq(donor_seq, 0x3ffff);
+    int64_t donor_exonic_seq = (donor_seq >> 4) & (~0xff);
+    int64_t donor_intronic_seq = donor_seq & 0xff;
+    int64_t donor_rest_seq = donor_exonic_seq | donor_intronic_seq;
+    int donor_seq3 = (donor_seq >> 10) & 0x3;
+    int donor_seq4 = (donor_seq >> 8) & 0x3;
+    donor_probscore = donor_cons1[donor_seq3] * donor_cons2[donor_seq4] / (background_bp_prob[donor_seq3] * background_bp_prob[donor_seq4]) * donor_me2x5[donor_rest_seq];
+    
+    float acceptor_probscore = 0.0f;
+    assert_leq(acceptor_seq, 0x3fffffffffff);
+    int64_t acceptor_intronic_seq = (acceptor_seq >> 4) & (~0x3f);
+    int64_t acceptor_exonic_seq = acceptor_seq & 0x3f;
+    int64_t acceptor_rest_seq = acceptor_intronic_seq | acceptor_exonic_seq;
+    int acceptor_seq18 = (acceptor_seq >> 8) & 0x3;
+    int acceptor_seq19 = (acceptor_seq >> 6) & 0x3;
+    acceptor_probscore = acceptor_cons1[acceptor_seq18] * acceptor_cons2[acceptor_seq19] / (background_bp_prob[acceptor_seq18] * background_bp_prob[acceptor_seq19]);
+    
+    int64_t acceptor_seq1 = acceptor_rest_seq >> 28 & 0x3fff; // [0, 7]
+    acceptor_probscore *= acceptor_me2x3acc1[acceptor_seq1];
+    int64_t acceptor_seq2 = (acceptor_rest_seq >> 14) & 0x3fff; // [7, 7]
+    acceptor_probscore *= acceptor_me2x3acc2[acceptor_seq2];
+    int64_t acceptor_seq3 = acceptor_rest_seq & 0x3fff; // [14, 7]
+    acceptor_probscore *= acceptor_me2x3acc3[acceptor_seq3];
+    int64_t acceptor_seq4 = (acceptor_rest_seq >> 20) & 0x3fff; // [4, 7]
+    acceptor_probscore *= acceptor_me2x3acc4[acceptor_seq4];
+    int64_t acceptor_seq5 = (acceptor_rest_seq >> 6) & 0x3fff; // [11, 7]
+    acceptor_probscore *= acceptor_me2x3acc5[acceptor_seq5];
+    int64_t acceptor_seq6 = acceptor_seq1 & 0x3f; // [4, 3]
+    acceptor_probscore /= acceptor_me2x3acc6[acceptor_seq6];
+    int64_t acceptor_seq7 = acceptor_seq4 & 0xff; // [7, 4]
+    acceptor_probscore /= acceptor_me2x3acc7[acceptor_seq7];
+    int64_t acceptor_seq8 = acceptor_seq2 & 0x3f; // [11, 3]
+    acceptor_probscore /= acceptor_me2x3acc8[acceptor_seq8];
+    int64_t acceptor_seq9 = acceptor_seq5 & 0xff; // [14, 4]
+    acceptor_probscore /= acceptor_me2x3acc9[acceptor_seq9];
+
+    donor_probscore /= (1.0f + donor_probscore);
+    acceptor_probscore /= (1.0f + acceptor_probscore);
+    probscore = (donor_probscore + acceptor_probscore) / 2.0;
+    
+#else
+    assert_lt(donor_seq, (int)(1 << (donor_len << 1)));
+    probscore = donor_prob_sum[donor_seq];
+    
+    int acceptor_seq1 = acceptor_seq >> (acceptor_len2 << 1);
+    assert_lt(acceptor_seq1, (int)(1 << (acceptor_len1 << 1)));
+    probscore *= acceptor_prob_sum1[acceptor_seq1];
+    
+    int acceptor_seq2 = acceptor_seq % (1 << (acceptor_len2 << 1));
+    probscore *= acceptor_prob_sum2[acceptor_seq2];
+    
+    probscore = 1.0 / (1.0 + probscore);
+#endif
+    return probscore;
+}
+
+
+#if !defined(NEW_PROB_MODEL)
+float SpliceSiteDB::donorscore(int64_t donor_seq)
+{
+    assert_lt(donor_seq, (int)(1 << (donor_len << 1)));
+    return -log(donor_prob_sum[donor_seq]);
+}
+
+float SpliceSiteDB::acceptorscore(int64_t acceptor_seq)
+{
+    int acceptor_seq1 = acceptor_seq >> (acceptor_len2 << 1);
+    assert_lt(acceptor_seq1, (int)(1 << (acceptor_len1 << 1)));
+    int acceptor_seq2 = acceptor_seq % (1 << (acceptor_len2 << 1));
+    return -log(acceptor_prob_sum1[acceptor_seq1] * acceptor_prob_sum2[acceptor_seq2]);
+}
+
+float SpliceSiteDB::combinescore(
+                                 float donor_score,
+                                 float acceptor_score)
+{
+    return 1.0 / (1.0 + exp(-(donor_score + acceptor_score)));
+}
+#endif
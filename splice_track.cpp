@@ -0,0 +1,233 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <iostream>
+#include "splice_site.h"
+#include "splice_track.h"
+
+using namespace std;
+
+#if !defined(NEW_PROB_MODEL)
+
+/**
+ * Pack the bases from..to of s, two bits each, the way
+ * GenomeHit::combineWith() does; Ns count as A.  If from > to, the bases
+ * are taken from 'from' down to 'to' and complemented.
+ */
+static int64_t packSeq(const uint8_t *s, int64_t from, int64_t to) {
+	int64_t seq = 0;
+	if(from <= to) {
+		for(int64_t j = from; j <= to; j++) {
+			int base = s[j];
+			if(base > 3) base = 0;
+			seq = seq << 2 | base;
+		}
+	} else {
+		for(int64_t j = from; j >= to; j--) {
+			int base = s[j];
+			if(base > 3) base = 0;
+			seq = seq << 2 | (base ^ 0x3);
+		}
+	}
+	return seq;
+}
+
+/**
+ * Quantize a site score to 1/8 units.
+ */
+static int8_t quantize(float score) {
+	float q = floor(score * 8.0f + 0.5f);
+	if(q < -128.0f) q = -128.0f;
+	if(q > 127.0f) q = 127.0f;
+	return (int8_t)q;
+}
+
+#endif
+
+/**
+ * Read each sequence in full, set a bit where a GT, AG, CT or AC starts
+ * and score the donor or acceptor site there.  A site whose flanks run
+ * off either end of the sequence is scored as if they were all As, as
+ * GenomeHit::combineWith() does when they run off its reference buffers.
+ */
+void SpliceTrack::build(const BitPairReference& ref, bool verbose) {
+#if defined(NEW_PROB_MODEL)
+	cerr << "Error: --ss-track is not supported with NEW_PROB_MODEL" << endl;
+	throw 1;
+#else
+	nrefs_ = ref.numRefs();
+	refoffs_.resizeExact(nrefs_);
+	reflens_.resizeExact(nrefs_);
+	total_ = 0;
+	for(size_t i = 0; i < nrefs_; i++) {
+		refoffs_[i] = total_;
+		reflens_[i] = ref.approxLen(i);
+		total_ += reflens_[i];
+	}
+	bits_.resizeExact((size_t)((total_ + 63) >> 6) + 1);
+	bits_.fillZero();
+	scores_.clear();
+	EList<uint32_t> buf(MISC_CAT);
+	ASSERT_ONLY(SStringExpandable<uint32_t> destU32);
+	for(size_t tidx = 0; tidx < nrefs_; tidx++) {
+		int64_t len = (int64_t)reflens_[tidx];
+		if(len < 2) continue;
+		buf.resizeExact((size_t)((len + 16) >> 2) + 1);
+		int off = ref.getStretch(buf.ptr(), tidx, 0, (size_t)len ASSERT_ONLY(, destU32));
+		const uint8_t *s = (const uint8_t*)buf.ptr() + off;
+		for(int64_t p = 0; p + 1 < len; p++) {
+			int c1 = s[p], c2 = s[p + 1];
+			float score;
+			if(c1 == 2 && c2 == 3) {
+				// GT: donor on the forward strand
+				int64_t from = p - (int64_t)donor_exonic_len;
+				int64_t to = p + (int64_t)donor_intronic_len - 1;
+				score = SpliceSiteDB::donorscore((from >= 0 && to < len) ? packSeq(s, from, to) : 0);
+			} else if(c1 == 0 && c2 == 2) {
+				// AG: acceptor on the forward strand
+				int64_t from = p + 2 - (int64_t)acceptor_intronic_len;
+				int64_t to = p + 1 + (int64_t)acceptor_exonic_len;
+				score = SpliceSiteDB::acceptorscore((from >= 0 && to < len) ? packSeq(s, from, to) : 0);
+			} else if(c1 == 1 && c2 == 3) {
+				// CT: acceptor on the reverse strand
+				int64_t from = p - (int64_t)acceptor_exonic_len;
+				int64_t to = p - 1 + (int64_t)acceptor_intronic_len;
+				score = SpliceSiteDB::acceptorscore((from >= 0 && to < len) ? packSeq(s, to, from) : 0);
+			} else if(c1 == 0 && c2 == 1) {
+				// AC: donor on the reverse strand
+				int64_t from = p + 2 - (int64_t)donor_intronic_len;
+				int64_t to = p + 1 + (int64_t)donor_exonic_len;
+				score = SpliceSiteDB::donorscore((from >= 0 && to < len) ? packSeq(s, to, from) : 0);
+			} else {
+				continue;
+			}
+			uint64_t g = refoffs_[tidx] + (uint64_t)p;
+			bits_[(size_t)(g >> 6)] |= ((uint64_t)1 << (g & 63));
+			scores_.push_back(quantize(score));
+		}
+	}
+	ASSERT_ONLY(uint64_t nset =) rank();
+	assert_eq(nset, scores_.size());
+	if(verbose) {
+		cout << "Splice signal track: " << scores_.size() << " motifs in "
+		     << total_ << " positions, " << bytes() << " bytes" << endl;
+	}
+#endif
+}
+
+uint64_t SpliceTrack::rank() {
+	size_t nblks = (bits_.size() + SS_BLOCK_WDS - 1) / SS_BLOCK_WDS;
+	ranks_.resizeExact(nblks);
+	uint64_t r = 0;
+	for(size_t i = 0; i < bits_.size(); i++) {
+		if(i % SS_BLOCK_WDS == 0) {
+			ranks_[i / SS_BLOCK_WDS] = r;
+		}
+		r += __builtin_popcountll(bits_[i]);
+	}
+	return r;
+}
+
+/**
+ * File layout, in the byte order of the machine that wrote it: int32 1,
+ * uint32 version, uint64 number of sequences and each of their lengths,
+ * then the bit words and the scores, each preceded by a uint64 count.
+ * The rank blocks are recomputed on reading.
+ */
+void SpliceTrack::write(const string& fn) const {
+	FILE *f = fopen(fn.c_str(), "wb");
+	if(f == NULL) {
+		cerr << "Could not open file for writing: \"" << fn.c_str() << "\"" << endl;
+		throw 1;
+	}
+	int32_t one = 1;
+	uint32_t version = SS_VERSION;
+	uint64_t n = nrefs_, nbits = bits_.size(), nscores = scores_.size();
+	bool ok = fwrite(&one, 4, 1, f) == 1 &&
+	          fwrite(&version, 4, 1, f) == 1 &&
+	          fwrite(&n, 8, 1, f) == 1 &&
+	          fwrite(reflens_.ptr(), 8, nrefs_, f) == nrefs_ &&
+	          fwrite(&nbits, 8, 1, f) == 1 &&
+	          fwrite(bits_.ptr(), 8, bits_.size(), f) == bits_.size() &&
+	          fwrite(&nscores, 8, 1, f) == 1 &&
+	          fwrite(scores_.ptr(), 1, scores_.size(), f) == scores_.size();
+	if(fclose(f) != 0) ok = false;
+	if(!ok) {
+		cerr << "An error occurred writing \"" << fn.c_str() << "\".  Please check if the disk is full." << endl;
+		throw 1;
+	}
+}
+
+bool SpliceTrack::read(const string& fn, const BitPairReference& ref, bool verbose) {
+	nrefs_ = 0;
+	FILE *f = fopen(fn.c_str(), "rb");
+	if(f == NULL) {
+		return false;
+	}
+	int32_t one = 0;
+	uint32_t version = 0;
+	uint64_t n = 0;
+	bool ok = fread(&one, 4, 1, f) == 1 && one == 1 &&
+	          fread(&version, 4, 1, f) == 1 && version == SS_VERSION &&
+	          fread(&n, 8, 1, f) == 1 && n == ref.numRefs();
+	if(ok) {
+		reflens_.resizeExact((size_t)n);
+		refoffs_.resizeExact((size_t)n);
+		ok = fread(reflens_.ptr(), 8, (size_t)n, f) == n;
+	}
+	total_ = 0;
+	for(size_t i = 0; ok && i < n; i++) {
+		ok = reflens_[i] == ref.approxLen(i);
+		refoffs_[i] = total_;
+		total_ += reflens_[i];
+	}
+	uint64_t nbits = 0, nscores = 0;
+	if(ok) {
+		ok = fread(&nbits, 8, 1, f) == 1 && nbits == ((total_ + 63) >> 6) + 1;
+	}
+	if(ok) {
+		bits_.resizeExact((size_t)nbits);
+		ok = fread(bits_.ptr(), 8, (size_t)nbits, f) == nbits &&
+		     fread(&nscores, 8, 1, f) == 1;
+	}
+	if(ok) {
+		scores_.resizeExact((size_t)nscores);
+		ok = fread(scores_.ptr(), 1, (size_t)nscores, f) == nscores;
+	}
+	fclose(f);
+	if(ok) {
+		ok = rank() == nscores;
+	}
+	if(!ok) {
+		cerr << "Warning: ignoring splice signal track \"" << fn.c_str()
+		     << "\", which does not match the index" << endl;
+		bits_.clear();
+		ranks_.clear();
+		scores_.clear();
+		return false;
+	}
+	nrefs_ = (size_t)n;
+	if(verbose) {
+		cerr << "Splice signal track: " << scores_.size() << " motifs, "
+		     << bytes() << " bytes" << endl;
+	}
+	return true;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPLICE_TRACK_H_
+#define SPLICE_TRACK_H_
+
+#include <stdint.h>
+#include <string>
+#include "assert_helpers.h"
+#include "ds.h"
+#include "mem_ids.h"
+#include "reference.h"
+
+/**
+ * Genome-wide splice signals, written by hisat-build --ss-track to
+ * <idx>.ss.bt2 (or .ss.bt2l).  There is one bit per reference position,
+ * set where a GT, AG, CT or AC dinucleotide starts, i.e. where a donor or
+ * an acceptor of a canonical intron on either strand may be.  Every set bit
+ * has a score: the log-odds of the site (SpliceSiteDB::donorscore() for GT
+ * and AC, SpliceSiteDB::acceptorscore() for AG and CT) in 1/8 units,
+ * clamped to a byte.  Scores are found by rank, using a count of the set
+ * bits before every 512-bit block.
+ *
+ * GenomeHit::combineWith() ANDs the bits of the two sides of a gap to find
+ * the breakpoints that may be canonical splice sites, and scores them
+ * from the track instead of packing and looking up their flanks.
+ */
+class SpliceTrack {
+
+	static const size_t   SS_BLOCK_WDS = 8;  // 64-bit words per rank block
+	static const uint32_t SS_VERSION = 1;
+
+public:
+
+	SpliceTrack() :
+		nrefs_(0),
+		total_(0),
+		refoffs_(MISC_CAT),
+		reflens_(MISC_CAT),
+		bits_(MISC_CAT),
+		ranks_(MISC_CAT),
+		scores_(MISC_CAT)
+	{ }
+
+	/**
+	 * Compute the track for all the sequences of the given reference.
+	 */
+	void build(const BitPairReference& ref, bool verbose);
+
+	/**
+	 * Write the track to the given file.  Throws on error.
+	 */
+	void write(const std::string& fn) const;
+
+	/**
+	 * Read the track from the given file.  Return false, leaving the track
+	 * empty, if there is no such file or it does not match the reference.
+	 */
+	bool read(const std::string& fn, const BitPairReference& ref, bool verbose);
+
+	bool empty() const { return nrefs_ == 0; }
+
+	/**
+	 * Return the size of the track in bytes.
+	 */
+	size_t bytes() const {
+		return (bits_.size() + ranks_.size()) * sizeof(uint64_t) + scores_.size();
+	}
+
+	/**
+	 * Return the 64 bits of the track that start at offset toff of
+	 * sequence tidx; bit j is set iff a motif starts at toff + j.  Bits
+	 * past the end of the sequence are clear.
+	 */
+	uint64_t motifs(size_t tidx, uint64_t toff) const {
+		assert_lt(tidx, nrefs_);
+		uint64_t len = reflens_[tidx];
+		if(toff >= len) return 0;
+		uint64_t g = refoffs_[tidx] + toff;
+		size_t w = (size_t)(g >> 6);
+		int sh = (int)(g & 63);
+		uint64_t m = bits_[w] >> sh;
+		if(sh > 0) {
+			m |= bits_[w + 1] << (64 - sh);
+		}
+		if(len - toff < 64) {
+			m &= ((uint64_t)1 << (len - toff)) - 1;
+		}
+		return m;
+	}
+
+	/**
+	 * Return the score of the motif at offset toff of sequence tidx.
+	 */
+	float score(size_t tidx, uint64_t toff) const {
+		assert_lt(tidx, nrefs_);
+		assert_lt(toff, reflens_[tidx]);
+		uint64_t g = refoffs_[tidx] + toff;
+		assert(((bits_[(size_t)(g >> 6)] >> (g & 63)) & 1) != 0);
+		size_t w = (size_t)(g >> 6);
+		size_t blk = w / SS_BLOCK_WDS;
+		uint64_t r = ranks_[blk];
+		for(size_t i = blk * SS_BLOCK_WDS; i < w; i++) {
+			r += __builtin_popcountll(bits_[i]);
+		}
+		r += __builtin_popcountll(bits_[w] & (((uint64_t)1 << (g & 63)) - 1));
+		assert_lt(r, scores_.size());
+		return (float)scores_[(size_t)r] / 8.0f;
+	}
+
+protected:
+
+	/**
+	 * Fill in ranks_ from bits_; return the number of set bits.
+	 */
+	uint64_t rank();
+
+	size_t          nrefs_;
+	uint64_t        total_;   // sum of the sequence lengths
+	EList<uint64_t> refoffs_; // offset of each sequence in the track
+	EList<uint64_t> reflens_;
+	EList<uint64_t> bits_;    // one spare word at the end
+	EList<uint64_t> ranks_;   // set bits before each block
+	EList<int8_t>   scores_;  // one per set bit
+};
+
+#endif /*ndef SPLICE_TRACK_H_*/
@@ -304,7 +304,9 @@ int64_t SplicedAligner<index_t, local_index_t>::hybridSearch_recur(
                                      this->_sharedVars);
                         if(!tempHit.compatibleWith(hit, this->_minIntronLen, this->_maxIntronLen, this->_no_spliced_alignment)) continue;
                         int64_t minsc = max<int64_t>(this->_minsc[rdi], best_score);
+                        StageTimer _stSplice(prm.stages, STAGE_SPLICE_SCAN);
                         bool combined = tempHit.combineWith(hit, rd, ref, ssdb, swa, swm, sc, minsc, rnd, this->_minK_local, this->_minIntronLen, this->_maxIntronLen, 1, 1, &ss);
+                        _stSplice.stop();
                         if(rdi == 0) minsc = max(minsc, sink.bestUnp1());
                         else         minsc = max(minsc, sink.bestUnp2());
                         index_t leftAnchorLen = 0, nedits = 0;
@@ -357,7 +359,9 @@ int64_t SplicedAligner<index_t, local_index_t>::hybridSearch_recur(
                             if(!canHit.compatibleWith(tempHit, this->_minIntronLen, this->_maxIntronLen, this->_no_spliced_alignment)) continue;
                             GenomeHit<index_t> combinedHit = canHit;
                             int64_t minsc = max<int64_t>(this->_minsc[rdi], best_score);
+                            StageTimer _stSplice(prm.stages, STAGE_SPLICE_SCAN);
                             bool combined = combinedHit.combineWith(tempHit, rd, ref, ssdb, swa, swm, sc, minsc, rnd, this->_minK_local, this->_minIntronLen, this->_maxIntronLen, 1, 1, &ss);
+                            _stSplice.stop();
                             if(rdi == 0) minsc = max(minsc, sink.bestUnp1());
                             else         minsc = max(minsc, sink.bestUnp2());
                             index_t rightAnchorLen = 0, nedits = 0;
@@ -429,7 +433,9 @@ int64_t SplicedAligner<index_t, local_index_t>::hybridSearch_recur(
                                  this->_sharedVars);
                     if(!tempHit.compatibleWith(hit, this->_minIntronLen, this->_maxIntronLen, this->_no_spliced_alignment)) continue;
                     int64_t minsc = this->_minsc[rdi];
+                    StageTimer _stSplice(prm.stages, STAGE_SPLICE_SCAN);
                     bool combined = tempHit.combineWith(hit, rd, ref, ssdb, swa, swm, sc, minsc, rnd, this->_minK_local, this->_minIntronLen, this->_maxIntronLen, 1, 1, &ss);
+                    _stSplice.stop();
                     if(!this->_secondary) {
                         if(rdi == 0) minsc = max(minsc, sink.bestUnp1());
                         else         minsc = max(minsc, sink.bestUnp2());
@@ -581,7 +587,9 @@ int64_t SplicedAligner<index_t, local_index_t>::hybridSearch_recur(
                     }
                     // combine the partial alignment and the new alignment
                     int64_t minsc = this->_minsc[rdi];
+                    StageTimer _stSplice(prm.stages, STAGE_SPLICE_SCAN);
                     bool combined = tempHit.combineWith(hit, rd, ref, ssdb, swa, swm, sc, minsc, rnd, this->_minK_local, this->_minIntronLen, this->_maxIntronLen);
+                    _stSplice.stop();
                     if(!this->_secondary) {
                         if(rdi == 0) minsc = max(minsc, sink.bestUnp1());
                         else         minsc = max(minsc, sink.bestUnp2());
@@ -710,7 +718,9 @@ int64_t SplicedAligner<index_t, local_index_t>::hybridSearch_recur(
                             tempHit.extend(rd, ref, ssdb, swa, swm, prm, sc, this->_minsc[rdi], rnd, this->_minK_local, this->_minIntronLen, this->_maxIntronLen, leftext, rightext);
                         }
                         int64_t minsc = this->_minsc[rdi];
+                        StageTimer _stSplice(prm.stages, STAGE_SPLICE_SCAN);
                         bool combined = tempHit.combineWith(hit, rd, ref, ssdb, swa, swm, sc, minsc, rnd, this->_minK_local, this->_minIntronLen, this->_maxIntronLen);
+                        _stSplice.stop();
                         if(!this->_secondary) {
                             if(rdi == 0) minsc = max(minsc, sink.bestUnp1());
                             else         minsc = max(minsc, sink.bestUnp2());
@@ -868,7 +878,9 @@ int64_t SplicedAligner<index_t, local_index_t>::hybridSearch_recur(
                     if(!hit.compatibleWith(tempHit, this->_minIntronLen, this->_maxIntronLen, this->_no_spliced_alignment)) continue;
                     GenomeHit<index_t> combinedHit = hit;
                     int64_t minsc = this->_minsc[rdi];
+                    StageTimer _stSplice(prm.stages, STAGE_SPLICE_SCAN);
                     bool combined = combinedHit.combineWith(tempHit, rd, ref, ssdb, swa, swm, sc, minsc, rnd, this->_minK_local, this->_minIntronLen, this->_maxIntronLen, 1, 1, &ss);
+                    _stSplice.stop();
                     if(!this->_secondary) {
                         if(rdi == 0) minsc = max(minsc, sink.bestUnp1());
                         else         minsc = max(minsc, sink.bestUnp2());
@@ -1024,7 +1036,9 @@ int64_t SplicedAligner<index_t, local_index_t>::hybridSearch_recur(
                     GenomeHit<index_t> combinedHit = hit;
                     int64_t minsc = this->_minsc[rdi];
                     // combine the partial alignment and the new alignment
+                    StageTimer _stSplice(prm.stages, STAGE_SPLICE_SCAN);
                     bool combined = combinedHit.combineWith(tempHit, rd, ref, ssdb, swa, swm, sc, minsc, rnd, this->_minK_local, this->_minIntronLen, this->_maxIntronLen);
+                    _stSplice.stop();
                     if(!this->_secondary) {
                         if(rdi == 0) minsc = max(minsc, sink.bestUnp1());
                         else         minsc = max(minsc, sink.bestUnp2());
@@ -1150,7 +1164,9 @@ int64_t SplicedAligner<index_t, local_index_t>::hybridSearch_recur(
                         tempHit.extend(rd, ref, ssdb, swa, swm, prm, sc, this->_minsc[rdi], rnd, this->_minK_local, this->_minIntronLen, this->_maxIntronLen, leftext, rightext);
                         GenomeHit<index_t> combinedHit = hit;
                         int64_t minsc = this->_minsc[rdi];
+                        StageTimer _stSplice(prm.stages, STAGE_SPLICE_SCAN);
                         bool combined = combinedHit.combineWith(tempHit, rd, ref, ssdb, swa, swm, sc, minsc, rnd, this->_minK_local, this->_minIntronLen, this->_maxIntronLen);
+                        _stSplice.stop();
                         if(!this->_secondary) {
                             if(rdi == 0) minsc = max(minsc, sink.bestUnp1());
                             else         minsc = max(minsc, sink.bestUnp2());
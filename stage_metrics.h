@@ -0,0 +1,484 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STAGE_METRICS_H_
+#define STAGE_METRICS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <ostream>
+#include "assert_helpers.h"
+#include "threading.h"
+#include "hw_counters.h"
+
+/**
+ * Pipeline stages whose latencies are recorded when --stage-times-file is
+ * given.  Stages nest (e.g. genome_coords runs inside global_search), so
+ * each histogram measures the inclusive latency of one call.
+ */
+enum {
+	STAGE_PARSE = 0,     // reading and parsing the next read/pair
+	STAGE_GLOBAL_SEARCH, // HI_Aligner::nextBWT
+	STAGE_LOCAL_SEARCH,  // local FM index search
+	STAGE_GENOME_COORDS, // resolving BW rows to genome coordinates
+	STAGE_SW_EXTEND,     // GenomeHit::extend
+	STAGE_SPLICE_SCAN,   // GenomeHit::combineWith, looking for the splice site
+	STAGE_PAIR,          // HI_Aligner::pairReads
+	STAGE_SINK,          // AlnSinkWrap::finishRead, incl. SAM formatting
+	STAGE_OUTPUT_WAIT,   // waiting on the shared output queue
+	STAGE_NUM
+};
+
+static const char * const stage_names[STAGE_NUM] = {
+	"parse",
+	"global_search",
+	"local_search",
+	"genome_coords",
+	"sw_extend",
+	"splice_scan",
+	"pair",
+	"sink",
+	"output_wait"
+};
+
+/**
+ * Return a monotonic timestamp in nanoseconds.
+ */
+static inline uint64_t stageNanos() {
+#if defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000ull + (uint64_t)tv.tv_usec * 1000ull;
+#endif
+}
+
+/**
+ * Log-linear latency histogram: values below 8 ns get a bucket each; above
+ * that, each power of two is split into 8 sub-buckets, so any reported
+ * quantile is within 12.5% of the true value.
+ */
+struct StageHist {
+
+	static const int SUB_BITS = 3;
+	static const int SUB = 1 << SUB_BITS;
+	static const int MAX_EXP = 47; // ~39 hours; larger values are clamped
+	static const int NBUCKETS = SUB + (MAX_EXP - SUB_BITS + 1) * SUB;
+
+	StageHist() { reset(); }
+
+	void reset() {
+		memset(counts, 0, sizeof(counts));
+		n = totNs = maxNs = 0;
+	}
+
+	static inline int bucket(uint64_t v) {
+		if(v < (uint64_t)SUB) return (int)v;
+		int e = 63 - __builtin_clzll(v);
+		if(e > MAX_EXP) return NBUCKETS - 1;
+		int sub = (int)((v >> (e - SUB_BITS)) & (SUB - 1));
+		return SUB + (e - SUB_BITS) * SUB + sub;
+	}
+
+	/**
+	 * Return the midpoint of the range of values that fall in bucket b.
+	 */
+	static inline uint64_t bucketValue(int b) {
+		if(b < SUB) return (uint64_t)b;
+		int e = (b - SUB) / SUB + SUB_BITS;
+		uint64_t sub = (uint64_t)((b - SUB) % SUB);
+		uint64_t lo = (1ull << e) + (sub << (e - SUB_BITS));
+		return lo + ((1ull << (e - SUB_BITS)) >> 1);
+	}
+
+	inline void add(uint64_t ns) {
+		counts[bucket(ns)]++;
+		n++;
+		totNs += ns;
+		if(ns > maxNs) maxNs = ns;
+	}
+
+	void merge(const StageHist& o) {
+		if(o.n == 0) return;
+		for(int i = 0; i < NBUCKETS; i++) counts[i] += o.counts[i];
+		n += o.n;
+		totNs += o.totNs;
+		if(o.maxNs > maxNs) maxNs = o.maxNs;
+	}
+
+	/**
+	 * Return the approximate q-quantile (0 < q <= 1) in nanoseconds.
+	 */
+	uint64_t quantile(double q) const {
+		if(n == 0) return 0;
+		uint64_t rank = (uint64_t)(q * (double)n + 0.999999);
+		if(rank == 0) rank = 1;
+		uint64_t cum = 0;
+		for(int i = 0; i < NBUCKETS; i++) {
+			cum += counts[i];
+			if(cum >= rank) {
+				uint64_t v = bucketValue(i);
+				return v < maxNs ? v : maxNs;
+			}
+		}
+		return maxNs;
+	}
+
+	uint64_t counts[NBUCKETS];
+	uint64_t n;      // # calls
+	uint64_t totNs;  // total time
+	uint64_t maxNs;  // slowest call
+};
+
+/**
+ * One latency histogram per pipeline stage.  Each worker thread records into
+ * its own StageMetrics without locking and periodically merges it into the
+ * global one along with the other per-thread metrics.
+ *
+ * With --hw-counters, the hardware events counted while a stage is the
+ * innermost one running are charged to it, so unlike the latencies these
+ * counts are exclusive and add up to the thread's total; hwc[STAGE_NUM]
+ * gets what's counted outside any stage.
+ */
+struct StageMetrics {
+
+	StageMetrics() { reset(); }
+
+	void reset() {
+		for(int i = 0; i < STAGE_NUM; i++) stages[i].reset();
+		memset(hwc, 0, sizeof(hwc));
+		hwMultiplexed = false;
+	}
+
+	inline void add(int stage, uint64_t ns) {
+		assert_range(0, STAGE_NUM - 1, stage);
+		stages[stage].add(ns);
+	}
+
+	void merge(const StageMetrics& o) {
+		for(int i = 0; i < STAGE_NUM; i++) stages[i].merge(o.stages[i]);
+		for(int i = 0; i <= STAGE_NUM; i++) {
+			for(int j = 0; j < HWC_NUM; j++) hwc[i][j] += o.hwc[i][j];
+		}
+		hwMultiplexed = hwMultiplexed || o.hwMultiplexed;
+	}
+
+	/**
+	 * Write a single-line JSON object with count, total, mean, p50, p99,
+	 * p99.9 and max latency for each stage and, if 'hw' is set, the
+	 * hardware events charged to it.
+	 */
+	void printJson(std::ostream& os, time_t curtime, uint64_t nreads, bool hw) const {
+		os << "{\"time\":" << curtime << ",\"reads\":" << nreads << ",\"stages\":{";
+		for(int i = 0; i < STAGE_NUM; i++) {
+			const StageHist& h = stages[i];
+			if(i > 0) os << ",";
+			os << "\"" << stage_names[i] << "\":{"
+			   << "\"count\":" << h.n
+			   << ",\"total_ns\":" << h.totNs
+			   << ",\"mean_ns\":" << (h.n > 0 ? h.totNs / h.n : 0)
+			   << ",\"p50_ns\":" << h.quantile(0.5)
+			   << ",\"p99_ns\":" << h.quantile(0.99)
+			   << ",\"p999_ns\":" << h.quantile(0.999)
+			   << ",\"max_ns\":" << h.maxNs;
+			if(hw) {
+				os << ",\"hw\":";
+				printHw(os, i);
+			}
+			os << "}";
+		}
+		os << "}";
+		if(hw) {
+			os << ",\"hw_other\":";
+			printHw(os, STAGE_NUM);
+			os << ",\"hw_multiplexed\":" << (hwMultiplexed ? "true" : "false");
+		}
+		os << "}";
+	}
+
+	void printHw(std::ostream& os, int stage) const {
+		os << "{";
+		for(int j = 0; j < HWC_NUM; j++) {
+			if(j > 0) os << ",";
+			os << "\"" << hwc_names[j] << "\":" << hwc[stage][j];
+		}
+		os << "}";
+	}
+
+	StageHist stages[STAGE_NUM];
+	uint64_t  hwc[STAGE_NUM + 1][HWC_NUM]; // hardware events, by stage
+	bool      hwMultiplexed; // some counts were too low; see HwCounters::read
+};
+
+/**
+ * Events recorded by --trace-file in addition to the pipeline stages:
+ * time spent waiting for the shared locks.  Only waits are recorded; a
+ * lock that is taken without contention leaves no event.
+ */
+enum {
+	TRACE_INPUT_WAIT = STAGE_NUM, // PatternSource/PairedPatternSource lock
+	TRACE_THROTTLE_WAIT,          // thread_rids throttle (temp. splice sites)
+	TRACE_SPLICE_DB_WAIT,         // SpliceSiteDB per-reference locks
+	TRACE_NUM
+};
+
+static const char * const trace_wait_names[TRACE_NUM - STAGE_NUM] = {
+	"input_wait",
+	"throttle_wait",
+	"splice_db_wait"
+};
+
+/**
+ * A timeline of one worker thread's stages and lock waits.  Events that
+ * overlap the sampled window are kept in a fixed-size ring buffer, so if
+ * the window holds more events than fit, the latest ones are kept.
+ * Only the owning thread adds events; they are written out once the
+ * threads have finished.
+ */
+class StageTrace {
+
+public:
+
+	struct Event {
+		uint64_t beg;
+		uint32_t dur;  // ns, clamped to ~4 s
+		uint32_t what;
+	};
+
+	StageTrace() : evs_(NULL), cap_(0), n_(0), winBeg_(0), winEnd_(0) { }
+
+	~StageTrace() { delete[] evs_; }
+
+	/**
+	 * Keep up to 'cap' events overlapping [winBeg, winEnd), in
+	 * stageNanos() time.
+	 */
+	void init(size_t cap, uint64_t winBeg, uint64_t winEnd) {
+		delete[] evs_;
+		evs_ = new Event[cap];
+		cap_ = cap;
+		n_ = 0;
+		winBeg_ = winBeg;
+		winEnd_ = winEnd;
+	}
+
+	inline void add(int what, uint64_t beg, uint64_t end) {
+		if(end < winBeg_ || beg >= winEnd_) return;
+		Event& e = evs_[n_ % cap_];
+		e.beg = beg;
+		e.dur = (end - beg > 0xffffffffull) ? 0xffffffffu : (uint32_t)(end - beg);
+		e.what = (uint32_t)what;
+		n_++;
+	}
+
+	/**
+	 * Return the number of events that were dropped because the ring
+	 * buffer was full.
+	 */
+	uint64_t dropped() const { return n_ > cap_ ? n_ - cap_ : 0; }
+
+	/**
+	 * Write the retained events as Chrome trace "complete" events for
+	 * thread 'tid', with timestamps in microseconds since 'origin'.  Each
+	 * event is preceded by a comma.
+	 */
+	void printJson(std::ostream& os, int tid, uint64_t origin) const {
+		size_t nev = n_ < cap_ ? (size_t)n_ : cap_;
+		size_t first = n_ < cap_ ? 0 : (size_t)(n_ % cap_);
+		for(size_t i = 0; i < nev; i++) {
+			const Event& e = evs_[(first + i) % cap_];
+			int what = (int)e.what;
+			bool wait = what >= STAGE_NUM || what == STAGE_OUTPUT_WAIT;
+			const char *name = what < STAGE_NUM ?
+				stage_names[what] : trace_wait_names[what - STAGE_NUM];
+			uint64_t ts = e.beg > origin ? e.beg - origin : 0;
+			os << ",\n{\"name\":\"" << name << "\",\"cat\":\"" << (wait ? "wait" : "stage")
+			   << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid << ",\"ts\":";
+			printMicros(os, ts);
+			os << ",\"dur\":";
+			printMicros(os, e.dur);
+			os << "}";
+		}
+	}
+
+protected:
+
+	static void printMicros(std::ostream& os, uint64_t ns) {
+		uint64_t frac = ns % 1000;
+		os << ns / 1000 << '.' << (char)('0' + frac / 100)
+		   << (char)('0' + frac / 10 % 10) << (char)('0' + frac % 10);
+	}
+
+	Event*   evs_;
+	size_t   cap_;
+	uint64_t n_;      // # events added, incl. overwritten ones
+	uint64_t winBeg_;
+	uint64_t winEnd_;
+};
+
+/**
+ * The calling thread's trace, or NULL if it isn't being traced.  Lets
+ * code far from the worker loop (pattern sources, the splice site
+ * database) record lock waits without threading a pointer through.
+ */
+inline StageTrace*& curStageTrace() {
+	static thread_local StageTrace* trace = NULL;
+	return trace;
+}
+
+/**
+ * Lock 'm', recording the time spent waiting for it as event 'what' if
+ * the calling thread is being traced and the lock was contended.
+ */
+template<typename T>
+static inline void lockTraced(T& m, int what) {
+	StageTrace* tr = curStageTrace();
+	if(tr == NULL) {
+		m.lock();
+		return;
+	}
+	if(m.try_lock()) return;
+	uint64_t beg = stageNanos();
+	m.lock();
+	tr->add(what, beg, stageNanos());
+}
+
+/**
+ * Like ThreadSafe, but records contended waits as event 'what'.
+ */
+class TracedThreadSafe {
+public:
+	TracedThreadSafe(MUTEX_T* ptr_mutex, bool locked, int what) {
+		ptr_mutex_ = locked ? ptr_mutex : NULL;
+		if(ptr_mutex_ != NULL) lockTraced(*ptr_mutex_, what);
+	}
+
+	~TracedThreadSafe() {
+		if(ptr_mutex_ != NULL) ptr_mutex_->unlock();
+	}
+
+private:
+	MUTEX_T *ptr_mutex_;
+};
+
+/**
+ * Charges a worker thread's hardware event counts to the stages it runs,
+ * for --hw-counters.  The counters are read whenever a stage begins or
+ * ends, and what was counted since the last reading is charged to the
+ * innermost stage running at the time.
+ */
+class StageCounters {
+
+public:
+
+	explicit StageCounters(const HwCounters& hw) : hw_(hw), depth_(0) {
+		bool mux = false;
+		if(!hw_.read(last_, mux)) memset(last_, 0, sizeof(last_));
+	}
+
+	inline void enter(StageMetrics& met, int stage) {
+		charge(met);
+		if(depth_ < MAX_DEPTH) stack_[depth_] = stage;
+		depth_++;
+	}
+
+	inline void leave(StageMetrics& met) {
+		charge(met);
+		if(depth_ > 0) depth_--;
+	}
+
+	/**
+	 * Charge the events counted since the last reading to the innermost
+	 * running stage, or to "other" if there is none.
+	 */
+	void charge(StageMetrics& met) {
+		uint64_t now[HWC_NUM];
+		bool mux = false;
+		if(!hw_.read(now, mux)) return;
+		int stage = STAGE_NUM;
+		if(depth_ > 0) stage = stack_[(depth_ < MAX_DEPTH ? depth_ : MAX_DEPTH) - 1];
+		for(int i = 0; i < HWC_NUM; i++) {
+			met.hwc[stage][i] += now[i] - last_[i];
+			last_[i] = now[i];
+		}
+		if(mux) met.hwMultiplexed = true;
+	}
+
+protected:
+
+	static const int MAX_DEPTH = 16; // deeper stages are charged to the 16th
+
+	const HwCounters& hw_;
+	uint64_t last_[HWC_NUM];
+	int      stack_[MAX_DEPTH];
+	int      depth_;
+};
+
+/**
+ * The calling thread's StageCounters, or NULL unless --hw-counters.
+ */
+inline StageCounters*& curStageCounters() {
+	static thread_local StageCounters* counters = NULL;
+	return counters;
+}
+
+/**
+ * Records the time between construction and destruction into the given
+ * stage, into the thread's trace if it has one, and charges the hardware
+ * events counted meanwhile to the stage with --hw-counters; does nothing
+ * if the StageMetrics pointer is NULL, which is the case unless stage
+ * timing, tracing or counting was requested.
+ */
+class StageTimer {
+public:
+	StageTimer(StageMetrics* met, int stage) : met_(met), stage_(stage), beg_(0) {
+		if(met_ == NULL) return;
+		StageCounters* hc = curStageCounters();
+		if(hc != NULL) hc->enter(*met_, stage_);
+		beg_ = stageNanos();
+	}
+
+	~StageTimer() { stop(); }
+
+	/**
+	 * Record the elapsed time now rather than at destruction.
+	 */
+	void stop() {
+		if(met_ == NULL) return;
+		uint64_t end = stageNanos();
+		met_->add(stage_, end - beg_);
+		StageTrace* tr = curStageTrace();
+		if(tr != NULL) tr->add(stage_, beg_, end);
+		StageCounters* hc = curStageCounters();
+		if(hc != NULL) hc->leave(*met_);
+		met_ = NULL;
+	}
+
+private:
+	StageMetrics* met_;
+	int           stage_;
+	uint64_t      beg_;
+};
+
+#endif /*ndef STAGE_METRICS_H_*/